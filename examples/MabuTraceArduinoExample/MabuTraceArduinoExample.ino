@@ -45,7 +45,7 @@ hw_timer_t *timer = NULL;
 QueueHandle_t Queue1, Queue2;
 typedef struct {
   char line[256];
-  uint16_t link;
+  uint32_t link;
 } message_t;
 
 void setup() {
@@ -95,7 +95,7 @@ void setup() {
   }
 
   //Initialize MabuTrace and start server on port 81
-  ESP_ERROR_CHECK(mabutrace_init());
+  ESP_ERROR_CHECK(mabutrace_init(NULL));
   ESP_ERROR_CHECK(mabutrace_start_server(81));
 
   Serial.print("MabuTrace server started. Go to ");
@@ -111,8 +111,8 @@ void ARDUINO_ISR_ATTR onTimer() {
   randomFill(message.line, sizeof(message.line));
 
   //To trace application flow accross thread boundaries TRACE_FLOW_OUT and TRACE_FLOW_IN can be used.
-  //First an outbound flow trace is created by passing a pointer to a uint16_t that's set to 0 as link_out argument:
-  uint16_t link_idx = 0;
+  //First an outbound flow trace is created by passing a pointer to a uint32_t that's set to 0 as link_out argument:
+  uint32_t link_idx = 0;
   TRACE_FLOW_OUT(&link_idx);
   //link_idx now contains a value that needs to be used as link_in argument when tracing the corresponding inbound flow trace.
   message.link = link_idx;
@@ -163,7 +163,7 @@ void workerTask(void *pvParameters) {
 
     if(findLongestPalindrome(message.line, sizeof(message.line))) {
       //Create another outbound flow trace
-      uint16_t link_idx = 0;
+      uint32_t link_idx = 0;
       TRACE_FLOW_OUT(&link_idx);
       //link_idx now contains a value that needs to be used as link_in argument when tracing the corresponding inbound linked trace.
       message.link = link_idx;
@@ -62,7 +62,7 @@ gptimer_handle_t gptimer = NULL;
 QueueHandle_t Queue1, Queue2;
 typedef struct {
   char line[256];
-  uint16_t link;
+  uint32_t link;
 } message_t;
 
 // Semaphore to signal Wi-Fi connection
@@ -132,8 +132,8 @@ static bool IRAM_ATTR onTimer(gptimer_handle_t timer,
 
   // To trace application flow accross thread boundaries TRACE_FLOW_OUT and
   // TRACE_FLOW_IN can be used. First an outbound flow trace is created by
-  // passing a pointer to a uint16_t that's set to 0 as link_out argument:
-  uint16_t link_idx = 0;
+  // passing a pointer to a uint32_t that's set to 0 as link_out argument:
+  uint32_t link_idx = 0;
   TRACE_FLOW_OUT(&link_idx);
   // link_idx now contains a value that needs to be used as link_in argument
   // when tracing the corresponding inbound flow trace.
@@ -217,7 +217,7 @@ void workerTask(void *pvParameters) {
 
     if (findLongestPalindrome(message.line, sizeof(message.line))) {
       // Create another outbound flow trace
-      uint16_t link_idx = 0;
+      uint32_t link_idx = 0;
       TRACE_FLOW_OUT(&link_idx);
       // link_idx now contains a value that needs to be used as link_in argument
       // when tracing the corresponding inbound linked trace.
@@ -294,7 +294,7 @@ extern "C" void app_main(void) {
   }
 
   // Initialize MabuTrace and start server on port 81
-  ESP_ERROR_CHECK(mabutrace_init());
+  ESP_ERROR_CHECK(mabutrace_init(NULL));
   ESP_ERROR_CHECK(mabutrace_start_server(81));
 
   // Get IP Address
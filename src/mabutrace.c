@@ -19,244 +19,838 @@
 
 #include "mabutrace.h"
 
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include "esp_log.h"
-#include "esp_timer.h"
-#include "freertos/semphr.h"
-
 static const char *TAG = "MABUTRACE";
 
-static void* profiler_entries = NULL;
-static volatile size_t entries_start_index = 0;
-static volatile size_t entries_next_index = 0;
-static volatile portMUX_TYPE profiler_index_mutex = portMUX_INITIALIZER_UNLOCKED;
-static volatile uint16_t link_index = 0;
-static volatile portMUX_TYPE link_index_mutex = portMUX_INITIALIZER_UNLOCKED;
-static volatile TaskHandle_t task_handles[16];
-static volatile uint8_t type_sizes[8];
-static volatile bool tracing_enabled = false;
+/*
+* Every CPU writes into its own ring, so reserving an entry only has to be protected against the tasks and
+* interrupts of the same CPU. This is done by masking interrupts on the local CPU for the reservation (and the
+* few stores that fill in the entry), instead of serializing all CPUs on one spinlock.
+*/
+typedef struct {
+  char* entries;  // ring_size bytes, followed by the overflow area.
+  uint16_t current_task_id;  // Task of the last entry written.
+  uint16_t start_task_id;  // Task of the entries before the first task context entry still in the ring.
+  // Total number of bytes of entries ever written to and evicted from the ring. The oldest entry is stored at
+  // evicted_bytes & ring_mask, the next one is written at written_bytes & ring_mask. They wrap around, compare
+  // them by their signed difference.
+  volatile uint32_t written_bytes;
+  volatile uint32_t evicted_bytes;
+  uint32_t reset_bytes;  // written_bytes when the ring was last reset.
+  uint32_t next_anchor_bytes;  // written_bytes from which on the next entry is preceded by a time anchor.
+  uint64_t last_time_stamp;  // Time of the last entry written, the base of the time delta of the next entry.
+} profiler_ring_t;
+
+// Largest entry, the size of the overflow area behind each ring. An entry that crosses the end of the ring is
+// written in one piece into the overflow area, so writers and the exporter never have to split one.
+typedef union {
+  time_anchor_entry_t time_anchor;
+  duration_long_long_entry_t duration_long_long;
+  counter_long_entry_t counter_long;
+  uint8_t args[sizeof(args_entry_t) + MABUTRACE_MAX_ARGS_LENGTH];
+} largest_entry_t;
+#define MAX_ENTRY_SIZE (sizeof(largest_entry_t) + MABUTRACE_MAX_DELTA_LENGTH)
+#define MIN_RING_SIZE 1024
+#define MAX_RING_SIZE (1u << 30)  // Keeps the signed differences of the byte counters unambiguous.
+
+static uint32_t ring_size;  // Size of each ring, a power of two.
+static uint32_t ring_mask;
+
+/*
+* The rings of all CPUs. With the spare buffer there are two of them: writers use the active one, and a
+* capture makes the other one active and exports the old one while tracing continues.
+*/
+typedef struct {
+  void* entries;
+  profiler_ring_t rings[MABUTRACE_NUM_CPUS];
+} profiler_buffer_t;
+
+#define PROFILER_NUM_BUFFERS 2
+
+static profiler_buffer_t profiler_buffers[PROFILER_NUM_BUFFERS];
+static atomic_uchar active_buffer = 0;
+static atomic_bool capture_in_progress = false;
+static bool capture_swapped = false;  // The capture in progress swapped buffers instead of suspending tracing.
+static atomic_bool capture_frozen = false;  // The capture in progress was started by a trigger and waits for export.
+// A trigger fired, and the trace is frozen once the clock reaches trigger_freeze_ticks.
+#define TRIGGER_IDLE 0
+#define TRIGGER_FIRING 1  // trigger_freeze_ticks is being set.
+#define TRIGGER_PENDING 2
+static atomic_uchar trigger_state = TRIGGER_IDLE;
+static uint64_t trigger_freeze_ticks;
+static uint64_t post_trigger_ticks;
+static atomic_uint link_index = 0;  // Last flow link or async slice ID handed out.
+static uintptr_t task_table_generation = 0;
+static uint8_t type_sizes[32];  // Only written by mabutrace_init, before tracing is enabled.
+static atomic_bool tracing_enabled = false;
 static volatile bool trace_interrupts_within_interrupted_tasks = false;
-static SemaphoreHandle_t active_writers_semaphore; // Tracks in-flight writers
+static volatile bool trace_task_switches = true;
+static volatile bool scope_begin_records = false;
+static volatile bool scope_events = true;
+static volatile bool scope_histograms = false;
+// Changes whenever counter values recorded before may be gone from the trace: when the buffers are swapped, and
+// every half lap of a ring. Deadband counters record their next value regardless once it has changed. Never 0.
+static atomic_uint counter_epoch = 1;
+// Number of tracing calls in flight per buffer, counted on the CPU they started on. A writer that migrates
+// decrements the same counter it incremented, so only the sum over all CPUs of a buffer is meaningful. Writer
+// slot buffer * MABUTRACE_NUM_CPUS + cpu belongs to the given buffer and CPU.
+static atomic_uint active_writers[PROFILER_NUM_BUFFERS * MABUTRACE_NUM_CPUS];
+
+/*
+* Task registry. The ID of a task is the index of its slot, found by open addressing on the task handle, so
+* looking up a known task needs no lock. Slots are only claimed and released under task_slots_mutex. When a task
+* is deleted, its slot keeps the name snapshot until every event of the task has been evicted from the rings, and
+* only then is the ID handed out again.
+*/
+#define TASK_SLOT_EMPTY 0  // Never used, ends a probe sequence.
+#define TASK_SLOT_LIVE 1
+#define TASK_SLOT_DELETED 2  // Task is gone, but its events may still be in the rings.
+#define TASK_SLOT_FREE 3  // Can be reused, but doesn't end a probe sequence.
+
+typedef struct {
+  TaskHandle_t handle;
+  atomic_uchar state;
+  bool written_on_cpu[MABUTRACE_NUM_CPUS];  // A task context entry for this ID was written to the ring of the CPU.
+  mabutrace_rings_mark_t deleted_at;  // Where the rings were when the task was deleted.
+  uint64_t blocked_since;  // Time at which the task started to block on a queue, 0 if it isn't blocked.
+  char name[MABUTRACE_TASK_NAME_LENGTH];
+} task_slot_t;
+
+static task_slot_t task_slots[MABUTRACE_MAX_TASKS];  // Slot MABUTRACE_TASK_ID_ISR is never used.
+static mabutrace_lock_t task_slots_mutex = MABUTRACE_LOCK_INITIALIZER;
+
+// Registers the caller as in-flight writer of the active buffer. Returns false if tracing is disabled, in which
+// case the caller must not touch the rings and must not call writer_exit.
+static inline bool IRAM_ATTR writer_enter(uint8_t* out_writer_slot) {
+  for (;;) {
+    uint8_t buffer = atomic_load(&active_buffer);
+    uint8_t slot = buffer * MABUTRACE_NUM_CPUS + mabutrace_platform_cpu_id();
+    atomic_fetch_add(&active_writers[slot], 1);
+    // Sequentially consistent with the stores in suspend and capture: either the suspending or capturing side
+    // sees this writer, or this writer sees that tracing got disabled or that the buffers were swapped.
+    if (tracing_enabled && buffer == atomic_load(&active_buffer)) {
+      *out_writer_slot = slot;
+      return true;
+    }
+    atomic_fetch_sub(&active_writers[slot], 1);
+    if (!tracing_enabled)
+      return false;
+  }
+}
+
+static void freeze_after_trigger();
+
+static inline void IRAM_ATTR writer_exit(uint8_t writer_slot) {
+  atomic_fetch_sub(&active_writers[writer_slot], 1);
+  if (trigger_state == TRIGGER_PENDING)
+    freeze_after_trigger();
+}
+
+// The rings the writer of the given slot writes to.
+static inline profiler_ring_t* IRAM_ATTR writer_rings(uint8_t writer_slot) {
+  return profiler_buffers[writer_slot / MABUTRACE_NUM_CPUS].rings;
+}
+
+// Waits until no writer of the buffer is in flight. Must be called after tracing_enabled has been cleared or the
+// buffer has been made inactive.
+static void wait_for_active_writers(uint8_t buffer) {
+  for (;;) {
+    unsigned int active = 0;
+    for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+      active += atomic_load(&active_writers[buffer * MABUTRACE_NUM_CPUS + i]);
+    }
+    if (active == 0)
+      return;
+    mabutrace_platform_delay_ms(1);
+  }
+}
+
+// Empties the rings of a buffer that no writer uses. The stale entries are left in place, nothing reads them.
+static void reset_buffer(profiler_buffer_t* buffer) {
+  for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+    profiler_ring_t* ring = &buffer->rings[i];
+    ring->current_task_id = MABUTRACE_TASK_ID_ISR;
+    ring->start_task_id = MABUTRACE_TASK_ID_ISR;
+    // Everything written so far is gone, which lets task IDs that were waiting for it be reused.
+    ring->evicted_bytes = ring->written_bytes;
+    ring->reset_bytes = ring->written_bytes;
+    ring->next_anchor_bytes = ring->written_bytes;
+  }
+}
+
+static void free_buffers() {
+  for (int i = 0; i < PROFILER_NUM_BUFFERS; i++) {
+    free(profiler_buffers[i].entries);
+    profiler_buffers[i].entries = NULL;
+  }
+}
 
-esp_err_t mabutrace_init() {
-  if(profiler_entries)
+esp_err_t mabutrace_init(const mabutrace_config_t* config) {
+  if(profiler_buffers[0].entries)
     return ESP_ERR_INVALID_STATE;
-#ifdef USE_PSRAM_IF_AVAILABLE
-  profiler_entries = heap_caps_calloc(PROFILER_BUFFER_SIZE_IN_BYTES, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-#endif
-  if(!profiler_entries)
-    profiler_entries = calloc(PROFILER_BUFFER_SIZE_IN_BYTES, 1);
-  if (!profiler_entries) {
-    ESP_LOGE(TAG, "Failed to allocate %d bytes for trace buffer.", (int)PROFILER_BUFFER_SIZE_IN_BYTES);
+  const mabutrace_config_t default_config = MABUTRACE_CONFIG_DEFAULT();
+  if (!config)
+    config = &default_config;
+  size_t max_ring_size = config->buffer_size / MABUTRACE_NUM_CPUS;
+  if (max_ring_size < MIN_RING_SIZE) {
+    ESP_LOGE(TAG, "Trace buffer of %u bytes is too small, it needs at least %d bytes per CPU.", (unsigned)config->buffer_size, MIN_RING_SIZE);
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (config->trace_heap && mabutrace_set_heap_tracing_enabled(false) != ESP_OK) {
+    ESP_LOGE(TAG, "Heap tracing requires a build with MABUTRACE_HEAP_TRACING.");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  // Rounding down to a power of two lets the ring indices be masked out of the byte counters.
+  ring_size = MIN_RING_SIZE;
+  while (ring_size < MAX_RING_SIZE && ring_size * 2 <= max_ring_size) {
+    ring_size *= 2;
+  }
+  ring_mask = ring_size - 1;
+  size_t buffer_size = MABUTRACE_NUM_CPUS * (ring_size + MAX_ENTRY_SIZE);
+  profiler_buffers[0].entries = mabutrace_platform_calloc(buffer_size, config->memory);
+  if (!profiler_buffers[0].entries) {
+    ESP_LOGE(TAG, "Failed to allocate %d bytes for trace buffer.", (int)buffer_size);
     return ESP_ERR_NO_MEM;
   }
   else
-    ESP_LOGI(TAG, "Allocated %d bytes for trace buffer.", (int)PROFILER_BUFFER_SIZE_IN_BYTES);
-  memset(task_handles, 0, sizeof(task_handles));
+    ESP_LOGI(TAG, "Allocated %d bytes for trace buffer.", (int)buffer_size);
+  if (config->spare_buffer) {
+    profiler_buffers[1].entries = mabutrace_platform_calloc(buffer_size, config->memory);
+    if (!profiler_buffers[1].entries)
+      ESP_LOGW(TAG, "Failed to allocate %d bytes for spare trace buffer, tracing is suspended during captures.", (int)buffer_size);
+  }
+  esp_err_t res = mabutrace_platform_clock_init();
+  if (res != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to initialize the trace clock.");
+    free_buffers();
+    return res;
+  }
+  for (int b = 0; b < PROFILER_NUM_BUFFERS; b++) {
+    if (!profiler_buffers[b].entries)
+      continue;
+    for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+      profiler_ring_t* ring = &profiler_buffers[b].rings[i];
+      ring->entries = (char*)profiler_buffers[b].entries + i * (ring_size + MAX_ENTRY_SIZE);
+      ring->written_bytes = 0;
+      ring->last_time_stamp = 0;
+    }
+    reset_buffer(&profiler_buffers[b]);
+  }
+  active_buffer = 0;
+  memset(task_slots, 0, sizeof(task_slots));
+  task_table_generation++;
 
   memset(type_sizes, 0, sizeof(type_sizes));
   type_sizes[EVENT_TYPE_NONE] = 0;
   type_sizes[EVENT_TYPE_DURATION] = sizeof(duration_entry_t);
-  type_sizes[EVENT_TYPE_DURATION_COLORED] = sizeof(duration_colored_entry_t);
-  type_sizes[EVENT_TYPE_INSTANT_COLORED] = sizeof(instant_colored_entry_t);
+  type_sizes[EVENT_TYPE_DURATION_LONG] = sizeof(duration_long_entry_t);
+  type_sizes[EVENT_TYPE_INSTANT] = sizeof(instant_entry_t);
   type_sizes[EVENT_TYPE_COUNTER] = sizeof(counter_entry_t);
   type_sizes[EVENT_TYPE_LINK] = sizeof(link_entry_t);
   type_sizes[EVENT_TYPE_TASK_SWITCH_IN] = sizeof(task_switch_entry_t);
   type_sizes[EVENT_TYPE_TASK_SWITCH_OUT] = sizeof(task_switch_entry_t);
+  type_sizes[EVENT_TYPE_TASK_CONTEXT] = sizeof(task_context_entry_t);
+  type_sizes[EVENT_TYPE_TIME_ANCHOR] = sizeof(time_anchor_entry_t);
+  type_sizes[EVENT_TYPE_DURATION_LONG_LONG] = sizeof(duration_long_long_entry_t);
+  type_sizes[EVENT_TYPE_SCOPE_BEGIN] = sizeof(scope_begin_entry_t);
+  type_sizes[EVENT_TYPE_COUNTER_LONG] = sizeof(counter_long_entry_t);
+  type_sizes[EVENT_TYPE_COUNTER_FLOAT] = sizeof(counter_float_entry_t);
+  type_sizes[EVENT_TYPE_ASYNC_BEGIN] = sizeof(async_entry_t);
+  type_sizes[EVENT_TYPE_ASYNC_END] = sizeof(async_entry_t);
+  type_sizes[EVENT_TYPE_ARGS] = sizeof(args_entry_t);
+  type_sizes[EVENT_TYPE_HEAP_ALLOC] = sizeof(heap_entry_t);
+  type_sizes[EVENT_TYPE_HEAP_FREE] = sizeof(heap_entry_t);
+  type_sizes[EVENT_TYPE_HEAP_ALLOC_FAILED] = sizeof(heap_entry_t);
+  type_sizes[EVENT_TYPE_QUEUE_SEND] = sizeof(queue_entry_t);
+  type_sizes[EVENT_TYPE_QUEUE_RECEIVE] = sizeof(queue_entry_t);
+  type_sizes[EVENT_TYPE_QUEUE_SEND_FAILED] = sizeof(queue_entry_t);
+  type_sizes[EVENT_TYPE_QUEUE_RECEIVE_FAILED] = sizeof(queue_entry_t);
+  type_sizes[EVENT_TYPE_TASK_READY] = sizeof(task_ready_entry_t);
 
-  #define MAX_CONCURRENT_WRITERS 255
-  active_writers_semaphore = xSemaphoreCreateCounting(MAX_CONCURRENT_WRITERS, 0);
-  if (active_writers_semaphore == NULL) {
-      free(profiler_entries);
-      profiler_entries = NULL;
-      ESP_LOGE(TAG, "Failed to create active_writers_semaphore");
-      return ESP_ERR_NO_MEM;
+  mabutrace_set_enabled_categories(config->enabled_categories);
+  post_trigger_ticks = (uint64_t)config->post_trigger_us * mabutrace_platform_clock_frequency() / 1000000;
+  trigger_state = TRIGGER_IDLE;
+  trace_task_switches = config->trace_task_switches;
+  scope_begin_records = config->scope_begin_records;
+  scope_events = config->scope_events;
+  scope_histograms = false;
+  if (config->scope_histograms) {
+    if (mabutrace_histograms_init(config->scope_histograms, config->memory) == ESP_OK)
+      scope_histograms = true;
+    else
+      ESP_LOGW(TAG, "Failed to allocate %u scope histograms.", (unsigned)config->scope_histograms);
   }
-
+  trace_interrupts_within_interrupted_tasks = config->trace_interrupts_within_interrupted_tasks;
   tracing_enabled = true;
+  if (config->trace_heap)
+    mabutrace_set_heap_tracing_enabled(true);
+  mabutrace_set_queue_tracing(config->trace_queues);
   return ESP_OK;
 }
 
 esp_err_t mabutrace_deinit() {
-  if(!profiler_entries)
+  if (!profiler_buffers[0].entries)
     return ESP_ERR_INVALID_STATE;
+  // A frozen trace nobody captured is dropped.
+  if (atomic_exchange(&capture_frozen, false))
+    mabutrace_capture_end();
+  if (capture_in_progress)
+    return ESP_ERR_INVALID_STATE;
+  mabutrace_set_heap_tracing_enabled(false);
+  mabutrace_set_queue_tracing(MABUTRACE_TRACE_QUEUES_NONE);
   tracing_enabled = false;
-  // Wait for writers to drain before deleting the semaphore
-  while(uxSemaphoreGetCount(active_writers_semaphore) > 0) {
-      vTaskDelay(pdMS_TO_TICKS(1));
-  }
-  vSemaphoreDelete(active_writers_semaphore);
-  active_writers_semaphore = NULL;
-  free(profiler_entries);
-  profiler_entries = NULL;
+  // Wait for writers to drain before freeing the buffer
+  for (int i = 0; i < PROFILER_NUM_BUFFERS; i++) {
+    wait_for_active_writers(i);
+  }
+  scope_histograms = false;
+  mabutrace_histograms_deinit();
+  mabutrace_platform_clock_deinit();
+  free_buffers();
   return ESP_OK;
 }
 
+uint64_t mabutrace_ticks_to_ns(uint64_t ticks) {
+  uint64_t frequency = mabutrace_platform_clock_frequency();
+  // Split into whole seconds and the remainder so that the multiplication can't overflow.
+  return (ticks / frequency) * 1000000000ull + (ticks % frequency) * 1000000000ull / frequency;
+}
+
 void set_trace_interrupts_within_interrupted_tasks(bool enabled) {
   trace_interrupts_within_interrupted_tasks = enabled;
 }
 
 static inline TaskHandle_t IRAM_ATTR get_current_task_handle() {
-  if (!trace_interrupts_within_interrupted_tasks && xPortInIsrContext()) {
+  if (!trace_interrupts_within_interrupted_tasks && mabutrace_platform_in_isr()) {
     return NULL;
   }
   else {
-    return xTaskGetCurrentTaskHandle();
+    return mabutrace_platform_current_task();
   }
 }
 
-static inline void semaphore_give(SemaphoreHandle_t semaphore, BaseType_t* must_yield_from_isr) {
-  if (xPortInIsrContext()) {
-    xSemaphoreGiveFromISR(semaphore, must_yield_from_isr);
-  } else {
-    xSemaphoreGive(semaphore);
+static inline uint16_t IRAM_ATTR task_slot_hash(TaskHandle_t handle) {
+  // Slot 0 is MABUTRACE_TASK_ID_ISR.
+  return 1 + mabutrace_hash_pointer(handle, 0, MABUTRACE_MAX_TASKS - 1);
+}
+
+static inline uint16_t IRAM_ATTR task_slot_next(uint16_t id) {
+  return id == MABUTRACE_MAX_TASKS - 1 ? 1 : id + 1;
+}
+
+// Lock free lookup of a live task. Returns MABUTRACE_TASK_ID_UNREGISTERED if the task has no slot.
+static inline uint16_t IRAM_ATTR find_task(TaskHandle_t handle) {
+  uint16_t id = task_slot_hash(handle);
+  for (int i = 1; i < MABUTRACE_MAX_TASKS; i++) {
+    uint8_t state = atomic_load(&task_slots[id].state);
+    if (state == TASK_SLOT_EMPTY)
+      break;
+    if (state == TASK_SLOT_LIVE && task_slots[id].handle == handle)
+      return id;
+    id = task_slot_next(id);
   }
+  return MABUTRACE_TASK_ID_UNREGISTERED;
 }
 
-static inline void semaphore_take(SemaphoreHandle_t semaphore, BaseType_t* must_yield_from_isr) {
-  if (xPortInIsrContext()) {
-    xSemaphoreTakeFromISR(semaphore, must_yield_from_isr);
-  } else {
-    xSemaphoreTake(semaphore, portMAX_DELAY);
+void IRAM_ATTR mabutrace_mark_rings(mabutrace_rings_mark_t* out_mark) {
+  out_mark->buffer = atomic_load(&active_buffer);
+  const profiler_ring_t* rings = profiler_buffers[out_mark->buffer].rings;
+  for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+    out_mark->written_bytes[i] = rings[i].written_bytes;
   }
 }
 
-static inline TaskHandle_t IRAM_ATTR get_task_handle_from_id(uint8_t id) {
-  return task_handles[id];
+// True once the events written before mark to the rings of the CPUs in on_cpu (all of them if NULL) have been
+// evicted. Events written to the other buffer before the mark are either gone once it has been reset, or being
+// exported by a capture, during which no ID is reused.
+static inline bool IRAM_ATTR rings_evicted(const mabutrace_rings_mark_t* mark, const bool* on_cpu) {
+  if (capture_in_progress)
+    return false;
+  const profiler_ring_t* rings = profiler_buffers[mark->buffer].rings;
+  for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+    if ((!on_cpu || on_cpu[i]) && (int32_t)(rings[i].evicted_bytes - mark->written_bytes[i]) < 0)
+      return false;
+  }
+  return true;
 }
 
-static inline uint8_t IRAM_ATTR get_current_task_id() {
-  TaskHandle_t handle = get_current_task_handle();
-  if (!handle) {
-    return 0;
-  } else {
-    for (uint8_t i = 1; i < 16; i++) {
-      TaskHandle_t* handle_i = &task_handles[i];
-      if (!*handle_i) {
-        *handle_i = handle;
-        return i;
-      } else if (*handle_i == handle) {
-        return i;
-      }
+bool IRAM_ATTR mabutrace_rings_evicted(const mabutrace_rings_mark_t* mark) {
+  return rings_evicted(mark, NULL);
+}
+
+// True once every event of a deleted task has been evicted from the rings. Must hold task_slots_mutex.
+static inline bool IRAM_ATTR task_events_evicted(const task_slot_t* slot) {
+  return rings_evicted(&slot->deleted_at, slot->written_on_cpu);
+}
+
+// Slow path of get_current_task_id, taken once per task (or on every event if no task local storage is
+// available and the task is unknown).
+static uint16_t IRAM_ATTR register_task(TaskHandle_t handle) {
+  uint16_t result = MABUTRACE_TASK_ID_UNREGISTERED;
+  uint16_t free_id = MABUTRACE_TASK_ID_UNREGISTERED;
+  mabutrace_platform_lock(&task_slots_mutex);
+  uint16_t id = task_slot_hash(handle);
+  for (int i = 1; i < MABUTRACE_MAX_TASKS; i++) {
+    task_slot_t* slot = &task_slots[id];
+    uint8_t state = atomic_load(&slot->state);
+    if (state == TASK_SLOT_DELETED && task_events_evicted(slot)) {
+      state = TASK_SLOT_FREE;
+      atomic_store(&slot->state, state);
     }
-  }
-  assert(false); // never get here.
-  return 0;
-}
-
-static inline void IRAM_ATTR advance_pointers(uint8_t type_size, size_t* out_entry_idx) {
-  taskENTER_CRITICAL(&profiler_index_mutex);
-  {
-    assert(entries_next_index <= PROFILER_BUFFER_SIZE_IN_BYTES);
-    //critical section
-    size_t start_idx = 0;
-    size_t entry_idx = entries_next_index;
-    //advance pointers
-    if (PROFILER_BUFFER_SIZE_IN_BYTES - entry_idx < type_size) {
-      // entry doesn't fit into end of buffer.
-      // clear tail to indicate end.
-      memset(profiler_entries + entries_next_index, 0, PROFILER_BUFFER_SIZE_IN_BYTES - entry_idx);
-      // set entry_idx to start of buffer.
-      entry_idx = 0;
-      start_idx = 0;
-      entries_next_index = type_size;
+    if (state == TASK_SLOT_LIVE && slot->handle == handle) {
+      // Registered by an interrupt on another CPU in the meantime.
+      result = id;
+      goto cleanup;
     }
-    else {
-      // fits in.
-      start_idx = entries_start_index;
-      entries_next_index = entry_idx + type_size;
+    if (state == TASK_SLOT_FREE && free_id == MABUTRACE_TASK_ID_UNREGISTERED)
+      free_id = id;
+    if (state == TASK_SLOT_EMPTY) {
+      if (free_id == MABUTRACE_TASK_ID_UNREGISTERED)
+        free_id = id;
+      break;
     }
-    // advance start_idx
-    while (start_idx >= entry_idx && start_idx < entries_next_index) {
-      entry_header_t* start_header = (entry_header_t*)(profiler_entries + start_idx);
-      if (start_header->type == EVENT_TYPE_NONE) {
-        start_idx = 0;
+    id = task_slot_next(id);
+  }
+  if (free_id != MABUTRACE_TASK_ID_UNREGISTERED) {
+    task_slot_t* slot = &task_slots[free_id];
+    slot->handle = handle;
+    memset(slot->written_on_cpu, 0, sizeof(slot->written_on_cpu));
+    slot->blocked_since = 0;
+    mabutrace_platform_task_name(handle, slot->name, sizeof(slot->name));
+    // Publishes the slot to find_task.
+    atomic_store(&slot->state, TASK_SLOT_LIVE);
+    result = free_id;
+  }
+  cleanup:
+  mabutrace_platform_unlock(&task_slots_mutex);
+  return result;
+}
+
+static inline uint16_t IRAM_ATTR get_current_task_id() {
+  TaskHandle_t handle = get_current_task_handle();
+  if (!handle) {
+    return MABUTRACE_TASK_ID_ISR;
+  }
+  // Fast path: the ID is cached in the task local storage of the task, tagged with the generation of the task
+  // table so that IDs cached before a mabutrace_deinit/mabutrace_init cycle are not reused.
+  uintptr_t cached = mabutrace_platform_get_task_local(handle);
+  if ((cached >> 16) == task_table_generation) {
+    return (uint16_t)cached;
+  }
+  uint16_t id = find_task(handle);
+  if (id == MABUTRACE_TASK_ID_UNREGISTERED)
+    id = register_task(handle);
+  if (id != MABUTRACE_TASK_ID_UNREGISTERED && !mabutrace_platform_in_isr()) {
+    mabutrace_platform_set_task_local(handle, (task_table_generation << 16) | id);
+  }
+  return id;
+}
+
+void trace_task_delete(void* task) {
+  if (!profiler_buffers[0].entries)
+    return;
+  mabutrace_platform_lock(&task_slots_mutex);
+  uint16_t id = find_task((TaskHandle_t)task);
+  if (id != MABUTRACE_TASK_ID_UNREGISTERED) {
+    task_slot_t* slot = &task_slots[id];
+    // The task can't write any more events, so everything written so far is all there will be.
+    mabutrace_mark_rings(&slot->deleted_at);
+    mabutrace_platform_task_name(slot->handle, slot->name, sizeof(slot->name));
+    atomic_store(&slot->state, TASK_SLOT_DELETED);
+  }
+  mabutrace_platform_unlock(&task_slots_mutex);
+}
+
+static inline uint8_t IRAM_ATTR get_entry_size(const entry_header_t* header) {
+  uint8_t size = type_sizes[header->type] + header->delta_length;
+  if (header->type == EVENT_TYPE_ARGS)
+    size += ((const args_entry_t*)header)->length;
+  return size;
+}
+
+// Drops the oldest entry of the ring.
+static inline void IRAM_ATTR evict_oldest_entry(profiler_ring_t* ring) {
+  const entry_header_t* start_header = (const entry_header_t*)(ring->entries + (ring->evicted_bytes & ring_mask));
+  if (start_header->type == EVENT_TYPE_TASK_CONTEXT) {
+    ring->start_task_id = ((const task_context_entry_t*)start_header)->task_id;
+  }
+  ring->evicted_bytes += get_entry_size(start_header);
+}
+
+// Reserves entry_size bytes at the end of the ring, evicting the oldest entries they would overwrite. The bytes
+// are contiguous, past the end of the ring they continue in the overflow area.
+static inline char* IRAM_ATTR reserve_ring_bytes(profiler_ring_t* ring, uint8_t entry_size) {
+  assert(entry_size <= MAX_ENTRY_SIZE);
+  uint32_t written_bytes = ring->written_bytes + entry_size;
+  // A byte of the overflow area aliases the byte at the start of the ring, so evicting whatever is more than a
+  // ring size behind the new end frees both.
+  while (written_bytes - ring->evicted_bytes > ring_size) {
+    evict_oldest_entry(ring);
+  }
+  char* entry = ring->entries + (ring->written_bytes & ring_mask);
+  ring->written_bytes = written_bytes;
+  return entry;
+}
+
+// Appends an entry of the given type and size written at time now, followed by its time delta to the previous
+// entry.
+static inline char* IRAM_ATTR append_sized_entry(profiler_ring_t* ring, uint8_t type, uint8_t size, uint64_t now) {
+  uint64_t delta = now - ring->last_time_stamp;
+  uint8_t delta_length = 0;
+  for (uint64_t rest = delta; rest; rest >>= 8) {
+    delta_length++;
+  }
+  char* entry = reserve_ring_bytes(ring, size + delta_length);
+  entry_header_t* header = (entry_header_t*)entry;
+  header->type = type;
+  header->delta_length = delta_length;
+  uint8_t* delta_bytes = (uint8_t*)entry + size;
+  for (uint8_t i = 0; i < delta_length; i++) {
+    delta_bytes[i] = (uint8_t)delta;
+    delta >>= 8;
+  }
+  ring->last_time_stamp = now;
+  return entry;
+}
+
+static inline char* IRAM_ATTR append_entry(profiler_ring_t* ring, uint8_t type, uint64_t now) {
+  return append_sized_entry(ring, type, type_sizes[type], now);
+}
+
+static inline void IRAM_ATTR expire_counter_values() {
+  if (atomic_fetch_add(&counter_epoch, 1) + 1 == 0)
+    atomic_fetch_add(&counter_epoch, 1);
+}
+
+// Reserves an entry of the given type for the given task in the ring of cpu_id and fills in its header. It is
+// preceded by a time anchor every half lap of the ring, and by a task context entry if the previous entry of the
+// ring belongs to another task. now must be read after entering the core local section, so that the time
+// stamps of each ring never decrease. Must be called between mabutrace_platform_enter_core_local and
+// mabutrace_platform_exit_core_local of cpu_id, on the rings of an in-flight writer.
+static inline char* IRAM_ATTR reserve_entry(profiler_ring_t* rings, uint8_t cpu_id, uint16_t task_id, uint8_t type, uint64_t now) {
+  profiler_ring_t* ring = &rings[cpu_id];
+  if ((int64_t)(now - ring->last_time_stamp) < 0) {
+    now = ring->last_time_stamp;
+  }
+  if ((int32_t)(ring->written_bytes - ring->next_anchor_bytes) >= 0) {
+    // An anchor every half lap is only evicted after the next one has been written, so the ring always holds at
+    // least one, and the first entry after a reset gets one.
+    // The buffer swap before the first anchor after a reset has already expired the counter values.
+    if (ring->written_bytes != ring->reset_bytes)
+      expire_counter_values();
+    ring->next_anchor_bytes = ring->written_bytes + ring_size / 2;
+    time_anchor_entry_t* anchor = (time_anchor_entry_t*)append_entry(ring, EVENT_TYPE_TIME_ANCHOR, now);
+    anchor->time_stamp_ticks = now;
+  }
+  if (ring->current_task_id != task_id) {
+    task_context_entry_t* context = (task_context_entry_t*)append_entry(ring, EVENT_TYPE_TASK_CONTEXT, now);
+    context->task_id = task_id;
+    ring->current_task_id = task_id;
+    if (task_id < MABUTRACE_MAX_TASKS)
+      task_slots[task_id].written_on_cpu[cpu_id] = true;
+  }
+  return append_entry(ring, type, now);
+}
+
+// Encodes the arguments of an event into out, which holds MABUTRACE_MAX_ARGS_LENGTH bytes, and returns their
+// length. Done before entering the core local section, the entry then only needs a copy.
+static uint8_t IRAM_ATTR encode_args(const mabutrace_arg_t* args, uint8_t num_args, uint8_t* out) {
+  uint8_t length = 0;
+  for (uint8_t i = 0; i < num_args; i++) {
+    const mabutrace_arg_t* arg = &args[i];
+    if (!arg->key)
+      continue;
+    // Keys are registered like tracepoints, their state doesn't matter.
+    if (arg->key->id == 0)
+      mabutrace_register_tracepoint(arg->key);
+    uint16_t key_id = arg->key->id;
+    if (key_id == 0)
+      continue;
+    uint8_t type = arg->type;
+    size_t value_length;
+    size_t string_length = 0;
+    switch (type) {
+      case MABUTRACE_ARG_INT:
+        if (arg->int_value >= INT32_MIN && arg->int_value <= INT32_MAX)
+          type = MABUTRACE_ARG_INT32;
+        value_length = type == MABUTRACE_ARG_INT32 ? sizeof(int32_t) : sizeof(int64_t);
         break;
-      }
-      else {
-        start_idx += type_sizes[start_header->type];
-      }
+      case MABUTRACE_ARG_FLOAT:
+        value_length = sizeof(float);
+        break;
+      case MABUTRACE_ARG_STRING:
+        string_length = arg->string_value ? strnlen(arg->string_value, MABUTRACE_MAX_ARG_STRING_LENGTH) : 0;
+        // Don't cut a UTF-8 sequence in half.
+        while (string_length && (arg->string_value[string_length] & 0xC0) == 0x80) {
+          string_length--;
+        }
+        value_length = 1 + string_length;
+        break;
+      default:
+        continue;
     }
-    if (start_idx == PROFILER_BUFFER_SIZE_IN_BYTES) {
-      start_idx = 0;
+    if (length + sizeof(key_id) + 1 + value_length > MABUTRACE_MAX_ARGS_LENGTH)
+      continue;
+    memcpy(out + length, &key_id, sizeof(key_id));
+    out[length + sizeof(key_id)] = type;
+    length += sizeof(key_id) + 1;
+    if (type == MABUTRACE_ARG_INT32) {
+      int32_t value = arg->int_value;
+      memcpy(out + length, &value, sizeof(value));
+    } else if (type == MABUTRACE_ARG_INT) {
+      memcpy(out + length, &arg->int_value, sizeof(arg->int_value));
+    } else if (type == MABUTRACE_ARG_FLOAT) {
+      memcpy(out + length, &arg->float_value, sizeof(arg->float_value));
+    } else {
+      out[length] = string_length;
+      memcpy(out + length + 1, arg->string_value, string_length);
     }
-    entries_start_index = start_idx;
-    *out_entry_idx = entry_idx;
+    length += value_length;
   }
-  taskEXIT_CRITICAL(&profiler_index_mutex);
+  return length;
 }
 
-static inline void IRAM_ATTR insert_link_event(uint16_t link, uint8_t link_type, uint64_t time_stamp, uint8_t cpu_id, uint8_t task_id) {
-  if(!active_writers_semaphore)
-    return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
-
-  size_t type_size = sizeof(link_entry_t);
-  size_t entry_idx = 0;
-  advance_pointers(type_size, &entry_idx);
-  link_entry_t* entry = (link_entry_t*)(profiler_entries + entry_idx);
-  entry->header.type = EVENT_TYPE_LINK;
-  entry->header.cpu_id = cpu_id;
-  entry->header.task_id = task_id;
-  entry->time_stamp_begin_microseconds = (uint32_t)time_stamp;
+// Appends the arguments of the entry reserve_entry just returned, in the same core local section, so that nothing
+// comes between the two. It has the time of the entry and needs neither a time anchor nor a task context.
+static inline void IRAM_ATTR append_args_entry(profiler_ring_t* rings, uint8_t cpu_id, const uint8_t* args, uint8_t length) {
+  profiler_ring_t* ring = &rings[cpu_id];
+  args_entry_t* entry = (args_entry_t*)append_sized_entry(ring, EVENT_TYPE_ARGS, sizeof(args_entry_t) + length, ring->last_time_stamp);
+  entry->length = length;
+  memcpy(entry + 1, args, length);
+}
+
+// IDs of flow links and async slices. 0 marks an ID that hasn't been assigned, and is skipped when the counter
+// wraps around.
+static inline uint32_t IRAM_ATTR new_link_id() {
+  uint32_t id;
+  do {
+    id = atomic_fetch_add(&link_index, 1) + 1;
+  } while (id == 0);
+  return id;
+}
+
+// Must only be called by an in-flight writer.
+static inline void IRAM_ATTR insert_link_event(uint8_t writer_slot, uint32_t link, uint8_t link_type, uint64_t time_stamp, uint16_t task_id) {
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  link_entry_t* entry = (link_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_LINK, now);
+  uint64_t offset = now > time_stamp ? now - time_stamp : 0;
+  entry->time_offset_ticks = offset < 0xFFFFFF ? offset : 0xFFFFFF;
   entry->link = link;
   entry->link_type = link_type;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+}
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+static void get_ring_views(uint8_t buffer_index, profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]) {
+  const profiler_buffer_t* buffer = &profiler_buffers[buffer_index];
+  const profiler_buffer_t* other_buffer = &profiler_buffers[buffer_index ^ 1];
+  for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+    // Nothing has been written to the other buffer since its reset, or it would be the active one.
+    out_rings[i].end_offset = buffer->rings[i].written_bytes + other_buffer->rings[i].reset_bytes;
+    out_rings[i].entries = buffer->rings[i].entries;
+    out_rings[i].size = ring_size;
+    out_rings[i].start_idx = buffer->rings[i].evicted_bytes & ring_mask;
+    out_rings[i].length = buffer->rings[i].written_bytes - buffer->rings[i].evicted_bytes;
+    out_rings[i].start_task_id = buffer->rings[i].start_task_id;
+  }
 }
 
-const char* suspend_tracing_and_get_profiler_entries(size_t* out_start_idx, size_t* out_end_idx) {
+void suspend_tracing_and_get_profiler_rings(profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]) {
   tracing_enabled = false;
   //Wait for all active writers to finish.
-  while (uxSemaphoreGetCount(active_writers_semaphore) > 0) {
-    vTaskDelay(pdMS_TO_TICKS(1));
-  }
-  *out_start_idx = entries_start_index;
-  *out_end_idx = entries_next_index;
-  return (char*)profiler_entries;
+  uint8_t buffer = atomic_load(&active_buffer);
+  wait_for_active_writers(buffer);
+  get_ring_views(buffer, out_rings);
 }
 
 void resume_tracing() {
   tracing_enabled = true;
 }
 
-const TaskHandle_t* profiler_get_task_handles() {
-  assert(!tracing_enabled && "Must only call profiler_get_task_handles while tracing is suspended.");
-  return task_handles;
+// Freezes the trace for the next capture, like mabutrace_capture_begin but without waiting for writers, so that
+// it can be called by a writer or an interrupt. Does nothing if a capture is in progress.
+static void IRAM_ATTR freeze_trace() {
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&capture_in_progress, &expected, true))
+    return;
+  uint8_t old_buffer = atomic_load(&active_buffer);
+  capture_swapped = profiler_buffers[old_buffer ^ 1].entries != NULL;
+  if (capture_swapped) {
+    expire_counter_values();
+    atomic_store(&active_buffer, old_buffer ^ 1);
+  }
+  else
+    tracing_enabled = false;
+  atomic_store(&capture_frozen, true);
+}
+
+static void IRAM_ATTR freeze_after_trigger() {
+  if ((int64_t)(mabutrace_platform_clock_ticks() - trigger_freeze_ticks) < 0)
+    return;
+  uint8_t expected = TRIGGER_PENDING;
+  if (atomic_compare_exchange_strong(&trigger_state, &expected, TRIGGER_IDLE))
+    freeze_trace();
+}
+
+void IRAM_ATTR mabutrace_trigger() {
+  if (!profiler_buffers[0].entries || capture_in_progress)
+    return;
+  uint64_t now = mabutrace_platform_clock_ticks();
+  uint8_t expected = TRIGGER_IDLE;
+  if (!atomic_compare_exchange_strong(&trigger_state, &expected, TRIGGER_FIRING))
+    return;
+  trigger_freeze_ticks = now + post_trigger_ticks;
+  atomic_store(&trigger_state, TRIGGER_PENDING);
+  if (post_trigger_ticks == 0)
+    freeze_after_trigger();
+}
+
+bool mabutrace_has_frozen_trace() {
+  return capture_frozen;
+}
+
+// Waits for the writers of the trace frozen by a trigger and returns views of its rings.
+static void get_frozen_rings(profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]) {
+  uint8_t buffer = atomic_load(&active_buffer);
+  if (capture_swapped)
+    buffer ^= 1;
+  wait_for_active_writers(buffer);
+  get_ring_views(buffer, out_rings);
+}
+
+esp_err_t mabutrace_capture_begin(profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]) {
+  if (!profiler_buffers[0].entries)
+    return ESP_ERR_INVALID_STATE;
+  // The post trigger time may have passed without anything being traced since.
+  if (trigger_state == TRIGGER_PENDING)
+    freeze_after_trigger();
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&capture_in_progress, &expected, true)) {
+    // Either a capture is in progress, or a trigger froze the trace, which this capture takes over.
+    if (!atomic_exchange(&capture_frozen, false))
+      return ESP_ERR_INVALID_STATE;
+    ESP_LOGI(TAG, "Capturing the trace frozen by a trigger.");
+    mabutrace_platform_lock(&task_slots_mutex);
+    mabutrace_platform_unlock(&task_slots_mutex);
+    get_frozen_rings(out_rings);
+    return ESP_OK;
+  }
+  // Wait for register_task calls that may have checked capture_in_progress before it was set, so that no task
+  // ID is reused from here on.
+  mabutrace_platform_lock(&task_slots_mutex);
+  mabutrace_platform_unlock(&task_slots_mutex);
+  uint8_t old_buffer = atomic_load(&active_buffer);
+  uint8_t new_buffer = old_buffer ^ 1;
+  capture_swapped = profiler_buffers[new_buffer].entries != NULL;
+  if (!capture_swapped) {
+    suspend_tracing_and_get_profiler_rings(out_rings);
+    return ESP_OK;
+  }
+  // The new buffer has been reset when the previous capture ended. Writers that see the swap start writing to
+  // it, the old one is exported as soon as the writers that still use it are done. Writers that see the swap also
+  // see the new counter epoch.
+  expire_counter_values();
+  atomic_store(&active_buffer, new_buffer);
+  wait_for_active_writers(old_buffer);
+  get_ring_views(old_buffer, out_rings);
+  return ESP_OK;
+}
+
+bool mabutrace_has_spare_buffer() {
+  return profiler_buffers[1].entries != NULL;
+}
+
+void mabutrace_capture_end() {
+  if (!capture_in_progress)
+    return;
+  if (capture_swapped) {
+    // Drop the exported events, the buffer is the next one to swap in.
+    reset_buffer(&profiler_buffers[atomic_load(&active_buffer) ^ 1]);
+  } else {
+    resume_tracing();
+  }
+  atomic_store(&capture_in_progress, false);
+}
+
+const char* profiler_get_task_name(uint16_t task_id) {
+  if (task_id == MABUTRACE_TASK_ID_UNREGISTERED || task_id >= MABUTRACE_MAX_TASKS)
+    return "Unregistered Tasks";
+  // The name of a slot only changes while it is claimed, which doesn't happen to slots of deleted tasks during a
+  // capture.
+  uint8_t state = atomic_load(&task_slots[task_id].state);
+  if (state != TASK_SLOT_LIVE && state != TASK_SLOT_DELETED)
+    return "Unknown Task";
+  return task_slots[task_id].name;
+}
+
+// Registers the tracepoint on first use. Returns false if it is disabled.
+static inline bool IRAM_ATTR tracepoint_enabled(mabutrace_tracepoint_t* tracepoint) {
+  uint8_t state = tracepoint->state;
+  if (state == MABUTRACE_TRACEPOINT_UNREGISTERED)
+    state = mabutrace_register_tracepoint(tracepoint);
+  return state == MABUTRACE_TRACEPOINT_ENABLED;
 }
 
 profiler_duration_handle_t IRAM_ATTR trace_begin(const char* name, uint8_t color) {
   return trace_begin_linked(name, 0, NULL, color);
 }
 
-profiler_duration_handle_t IRAM_ATTR trace_begin_linked(const char* name, uint16_t link_in, uint16_t* link_out, uint8_t color) {
-  profiler_duration_handle_t result = {0};
-  if(!active_writers_semaphore)
+profiler_duration_handle_t IRAM_ATTR trace_begin_linked(const char* name, uint32_t link_in, uint32_t* link_out, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (!tracepoint) {
+    profiler_duration_handle_t result = {0};
+    return result;
+  }
+  return trace_begin_tracepoint(tracepoint, link_in, link_out);
+}
+
+profiler_duration_handle_t IRAM_ATTR trace_begin_args(const char* name, const mabutrace_arg_t* args, uint8_t num_args, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (!tracepoint) {
+    profiler_duration_handle_t result = {0};
     return result;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
   }
+  return trace_begin_args_tracepoint(tracepoint, args, num_args);
+}
 
-  result.time_stamp_begin_microseconds = esp_timer_get_time();
-  result.name = name;
+// Inlined into both callers, so scopes without arguments don't check for them.
+static inline profiler_duration_handle_t IRAM_ATTR begin_scope(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out,
+                                                               const mabutrace_arg_t* args, uint8_t num_args) {
+  profiler_duration_handle_t result = {0};
+  if (!tracepoint_enabled(tracepoint))
+    return result;
+  // Scope histograms keep going while tracing is suspended.
+  uint8_t writer_slot;
+  bool writing = scope_events && writer_enter(&writer_slot);
+  if (!writing && !scope_histograms)
+    return result;
+
+  uint8_t encoded_args[MABUTRACE_MAX_ARGS_LENGTH];
+  uint8_t args_length = writing && num_args ? encode_args(args, num_args, encoded_args) : 0;
+  if (writing && (scope_begin_records || args_length)) {
+    uint16_t task_id = get_current_task_id();
+    uint8_t cpu_id;
+    mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+    uint64_t now = mabutrace_platform_clock_ticks();
+    scope_begin_entry_t* entry = (scope_begin_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_SCOPE_BEGIN, now);
+    entry->tracepoint_id = tracepoint->id;
+    if (args_length)
+      append_args_entry(writer_rings(writer_slot), cpu_id, encoded_args, args_length);
+    mabutrace_platform_exit_core_local(cpu_id, irq_state);
+    result.time_stamp_begin_ticks = now;
+  } else {
+    result.time_stamp_begin_ticks = mabutrace_platform_clock_ticks();
+  }
+  result.tracepoint_id = tracepoint->id;
   result.link_in = link_in;
-  result.color = color;
   if (link_out) {
     if (*link_out == 0) {
-      taskENTER_CRITICAL(&link_index_mutex);
-        //critical section
-        result.link_out = ++link_index;
-      taskEXIT_CRITICAL(&link_index_mutex);
+      result.link_out = new_link_id();
       *link_out = result.link_out;
     } else {
       result.link_out = *link_out;
@@ -266,225 +860,405 @@ profiler_duration_handle_t IRAM_ATTR trace_begin_linked(const char* name, uint16
     result.link_out = 0;
   }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  if (writing)
+    writer_exit(writer_slot);
   return result;
 }
 
+profiler_duration_handle_t IRAM_ATTR trace_begin_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out) {
+  return begin_scope(tracepoint, link_in, link_out, NULL, 0);
+}
+
+profiler_duration_handle_t IRAM_ATTR trace_begin_args_tracepoint(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args) {
+  return begin_scope(tracepoint, 0, NULL, args, num_args);
+}
+
 void IRAM_ATTR trace_end(profiler_duration_handle_t* handle) {
-  if(!active_writers_semaphore)
+  if (!handle->tracepoint_id)
     return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
-
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
-  size_t type_size = 0;
-  if (handle->color == 0) {
-    type_size = sizeof(duration_entry_t);
-  } else {
-    type_size = sizeof(duration_colored_entry_t);
-  }
-
-  size_t entry_idx = 0;
-  advance_pointers(type_size, &entry_idx);
-  
-  uint64_t duration = now - handle->time_stamp_begin_microseconds;
-  if (handle->color == 0) {
-    duration_entry_t* entry = (duration_entry_t*)(profiler_entries + entry_idx);
-    entry->header.type = EVENT_TYPE_DURATION;
-    entry->header.cpu_id = cpu_id;
-    entry->header.task_id = task_id;
-    entry->time_stamp_begin_microseconds = (uint32_t)handle->time_stamp_begin_microseconds;
-    entry->time_duration_microseconds = duration;
-    entry->name = handle->name;
-  } else {
-    duration_colored_entry_t* entry = (duration_colored_entry_t*)(profiler_entries + entry_idx);
-    entry->header.type = EVENT_TYPE_DURATION_COLORED;
-    entry->header.cpu_id = cpu_id;
-    entry->header.task_id = task_id;
-    entry->time_stamp_begin_microseconds = (uint32_t)handle->time_stamp_begin_microseconds;
-    entry->time_duration_microseconds = duration;
-    entry->name = handle->name;
-    entry->color = handle->color;
+  uint8_t writer_slot;
+  bool writing = scope_events && writer_enter(&writer_slot);
+  if (!writing && !scope_histograms)
+    return;
+
+  uint16_t task_id = writing ? get_current_task_id() : MABUTRACE_TASK_ID_ISR;
+
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  // Reading the time after masking interrupts keeps the entries of each ring ordered by their end time.
+  uint64_t now = mabutrace_platform_clock_ticks();
+  // A task that migrated to another core since trace_begin reads a different cycle counter, which can
+  // be slightly behind the one the scope began on.
+  uint64_t duration = now > handle->time_stamp_begin_ticks ? now - handle->time_stamp_begin_ticks : 0;
+  if (scope_histograms)
+    mabutrace_record_scope_duration(handle->tracepoint_id, cpu_id, duration);
+  if (writing) {
+    if (duration < (1 << 24)) {
+      duration_entry_t* entry = (duration_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_DURATION, now);
+      entry->tracepoint_id = handle->tracepoint_id;
+      entry->time_duration_ticks = duration;
+    } else if (duration <= UINT32_MAX) {
+      duration_long_entry_t* entry = (duration_long_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_DURATION_LONG, now);
+      entry->tracepoint_id = handle->tracepoint_id;
+      entry->time_duration_ticks = duration;
+    } else {
+      duration_long_long_entry_t* entry = (duration_long_long_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_DURATION_LONG_LONG, now);
+      entry->tracepoint_id = handle->tracepoint_id;
+      entry->time_duration_ticks = duration;
+    }
   }
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+  if (mabutrace_tracepoint_triggers[handle->tracepoint_id])
+    mabutrace_evaluate_trigger(handle->tracepoint_id, EVENT_TYPE_DURATION, duration);
+  if (!writing)
+    return;
+
   if (handle->link_in) {
-    insert_link_event(handle->link_in, LINK_TYPE_IN, handle->time_stamp_begin_microseconds-1, cpu_id, task_id);
+    insert_link_event(writer_slot, handle->link_in, LINK_TYPE_IN, handle->time_stamp_begin_ticks-1, task_id);
   }
   if (handle->link_out) {
-    insert_link_event(handle->link_out, LINK_TYPE_OUT, handle->time_stamp_begin_microseconds + duration - 1, cpu_id, task_id);
+    insert_link_event(writer_slot, handle->link_out, LINK_TYPE_OUT, handle->time_stamp_begin_ticks + duration - 1, task_id);
   }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  writer_exit(writer_slot);
 }
 
 void IRAM_ATTR trace_task_switch(uint8_t type) {
-  if(!active_writers_semaphore)
+  if (!trace_task_switches)
+    return;
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
     return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
 
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
-  size_t type_size = sizeof(task_switch_entry_t);
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  reserve_entry(writer_rings(writer_slot), cpu_id, task_id, type, now);
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
 
-  size_t entry_idx = 0;
-  advance_pointers(type_size, &entry_idx);
+  writer_exit(writer_slot);
+}
 
-  task_switch_entry_t* entry = (task_switch_entry_t*)(profiler_entries + entry_idx);
-  entry->header.type = type;
-  entry->header.cpu_id = cpu_id;
-  entry->header.task_id = task_id;
-  entry->time_stamp = (uint32_t)now;
+// The ready task is usually another one than the caller, often woken from an interrupt, so it is looked up by its
+// handle instead of through its task local storage.
+void IRAM_ATTR trace_task_ready(void* task, unsigned int priority) {
+  if (!trace_task_switches)
+    return;
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  uint16_t ready_task_id = find_task((TaskHandle_t)task);
+  if (ready_task_id == MABUTRACE_TASK_ID_UNREGISTERED)
+    ready_task_id = register_task((TaskHandle_t)task);
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  task_ready_entry_t* entry = (task_ready_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_TASK_READY, now);
+  entry->task_id = ready_task_id;
+  entry->priority = priority < 0xFF ? priority : 0xFF;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+
+  writer_exit(writer_slot);
 }
 
-void IRAM_ATTR trace_flow_out(uint16_t* link_out, const char* name, uint8_t color) {
-  if(!active_writers_semaphore)
+void IRAM_ATTR mabutrace_record_heap_event(uint8_t type, uint32_t size, uint32_t caller, uint64_t latency_ticks) {
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
     return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
 
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  heap_entry_t* entry = (heap_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, type, now);
+  entry->size = size;
+  entry->caller = caller;
+  entry->latency_ticks = latency_ticks < 0xFFFFFF ? latency_ticks : 0xFFFFFF;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+
+  writer_exit(writer_slot);
+}
+
+// Interrupts never block, and may run on behalf of a task that does (see
+// set_trace_interrupts_within_interrupted_tasks), so they leave the blocking state alone.
+static inline task_slot_t* IRAM_ATTR get_blocking_task_slot() {
+  if (!profiler_buffers[0].entries || mabutrace_platform_in_isr())
+    return NULL;
+  uint16_t task_id = get_current_task_id();
+  if (task_id == MABUTRACE_TASK_ID_ISR || task_id >= MABUTRACE_MAX_TASKS)
+    return NULL;
+  return &task_slots[task_id];
+}
+
+void IRAM_ATTR mabutrace_begin_queue_blocking() {
+  task_slot_t* slot = get_blocking_task_slot();
+  // FreeRTOS blocks again if the task was woken but another one got the item first, the wait began the first time.
+  if (slot && !slot->blocked_since)
+    slot->blocked_since = mabutrace_platform_clock_ticks();
+}
+
+uint64_t IRAM_ATTR mabutrace_end_queue_blocking() {
+  task_slot_t* slot = get_blocking_task_slot();
+  if (!slot || !slot->blocked_since)
+    return 0;
+  uint64_t now = mabutrace_platform_clock_ticks();
+  uint64_t blocked_ticks = now > slot->blocked_since ? now - slot->blocked_since : 0;
+  slot->blocked_since = 0;
+  return blocked_ticks;
+}
+
+void IRAM_ATTR mabutrace_record_queue_event(uint8_t type, uint16_t tracepoint_id, uint16_t fill, uint32_t item, uint64_t blocked_ticks) {
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
+
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  queue_entry_t* entry = (queue_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, type, now);
+  entry->tracepoint_id = tracepoint_id;
+  entry->fill = fill;
+  entry->item = item;
+  entry->blocked_ticks = blocked_ticks < 0xFFFFFFFF ? blocked_ticks : 0xFFFFFFFF;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+
+  writer_exit(writer_slot);
+}
+
+void IRAM_ATTR trace_flow_out(uint32_t* link_out, const char* name, uint8_t color) {
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
+
+  uint16_t task_id = get_current_task_id();
+  uint64_t now = mabutrace_platform_clock_ticks();
 
   if (link_out) {
     if (*link_out == 0) {
-      taskENTER_CRITICAL(&link_index_mutex);
-      //critical section
-        *link_out = ++link_index;
-      taskEXIT_CRITICAL(&link_index_mutex);
+      *link_out = new_link_id();
     }
   }
   if (link_out && *link_out) {
-    insert_link_event(*link_out, LINK_TYPE_OUT, now, cpu_id, task_id);
+    insert_link_event(writer_slot, *link_out, LINK_TYPE_OUT, now, task_id);
   }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  writer_exit(writer_slot);
 }
 
-void IRAM_ATTR trace_flow_in(uint16_t link_in) {
-  if(!active_writers_semaphore)
+void IRAM_ATTR trace_flow_in(uint32_t link_in) {
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
     return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
 
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
+  uint16_t task_id = get_current_task_id();
+  uint64_t now = mabutrace_platform_clock_ticks();
   if (link_in) {
-    insert_link_event(link_in, LINK_TYPE_IN, now, cpu_id, task_id);
+    insert_link_event(writer_slot, link_in, LINK_TYPE_IN, now, task_id);
   }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  writer_exit(writer_slot);
 }
 
 void IRAM_ATTR trace_instant(const char* name, uint8_t color) {
   trace_instant_linked(name, 0, NULL, color);
 }
 
-void IRAM_ATTR trace_instant_linked(const char* name, uint16_t link_in, uint16_t* link_out, uint8_t color) {
-  if(!active_writers_semaphore)
-    return;
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
-  }
+void IRAM_ATTR trace_instant_linked(const char* name, uint32_t link_in, uint32_t* link_out, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_instant_tracepoint(tracepoint, link_in, link_out);
+}
 
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
-  size_t type_size = sizeof(instant_colored_entry_t);
+void IRAM_ATTR trace_instant_args(const char* name, const mabutrace_arg_t* args, uint8_t num_args, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_instant_args_tracepoint(tracepoint, args, num_args);
+}
 
-  size_t entry_idx = 0;
-  advance_pointers(type_size, &entry_idx);
+static inline void IRAM_ATTR write_instant(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out,
+                                           const mabutrace_arg_t* args, uint8_t num_args) {
+  if (!tracepoint_enabled(tracepoint))
+    return;
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
 
-  instant_colored_entry_t* entry = (instant_colored_entry_t*)(profiler_entries + entry_idx);
-  entry->header.type = EVENT_TYPE_INSTANT_COLORED;
-  entry->header.cpu_id = cpu_id;
-  entry->header.task_id = task_id;
-  entry->time_stamp_begin_microseconds = (uint32_t)now;
-  entry->name = name;
-  entry->color = color;
+  uint8_t encoded_args[MABUTRACE_MAX_ARGS_LENGTH];
+  uint8_t args_length = num_args ? encode_args(args, num_args, encoded_args) : 0;
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  instant_entry_t* entry = (instant_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_INSTANT, now);
+  entry->tracepoint_id = tracepoint->id;
+  if (args_length)
+    append_args_entry(writer_rings(writer_slot), cpu_id, encoded_args, args_length);
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+  if (mabutrace_tracepoint_triggers[tracepoint->id])
+    mabutrace_evaluate_trigger(tracepoint->id, EVENT_TYPE_INSTANT, 0);
 
   if (link_out) {
     if (*link_out == 0) {
-      taskENTER_CRITICAL(&link_index_mutex);
-      //critical section
-        *link_out = ++link_index;
-      taskEXIT_CRITICAL(&link_index_mutex);
+      *link_out = new_link_id();
     }
   }
 
   if (link_in) {
-    insert_link_event(link_in, LINK_TYPE_IN, now, cpu_id, task_id);
+    insert_link_event(writer_slot, link_in, LINK_TYPE_IN, now, task_id);
   }
   if (link_out && *link_out) {
-    insert_link_event(*link_out, LINK_TYPE_OUT, now, cpu_id, task_id);
+    insert_link_event(writer_slot, *link_out, LINK_TYPE_OUT, now, task_id);
   }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  writer_exit(writer_slot);
+}
+
+void IRAM_ATTR trace_instant_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out) {
+  write_instant(tracepoint, link_in, link_out, NULL, 0);
+}
+
+void IRAM_ATTR trace_instant_args_tracepoint(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args) {
+  write_instant(tracepoint, 0, NULL, args, num_args);
 }
 
-void IRAM_ATTR trace_counter(const char* name, int32_t value, uint8_t color) {
-  BaseType_t must_yield_from_isr = pdFALSE;
-  semaphore_give(active_writers_semaphore, &must_yield_from_isr);
-  if(!tracing_enabled) {
-    goto cleanup;
+void IRAM_ATTR trace_async_begin(const char* name, uint32_t* async_id, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_async_begin_tracepoint(tracepoint, async_id);
+}
+
+void IRAM_ATTR trace_async_end(const char* name, uint32_t async_id, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_async_end_tracepoint(tracepoint, async_id);
+}
+
+static inline void IRAM_ATTR write_async_entry(mabutrace_tracepoint_t* tracepoint, uint8_t type, uint32_t async_id) {
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
+
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  async_entry_t* entry = (async_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, type, now);
+  entry->tracepoint_id = tracepoint->id;
+  entry->async_id = async_id;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+
+  writer_exit(writer_slot);
+}
+
+void IRAM_ATTR trace_async_begin_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t* async_id) {
+  if (*async_id == 0)
+    *async_id = new_link_id();
+  if (tracepoint_enabled(tracepoint))
+    write_async_entry(tracepoint, EVENT_TYPE_ASYNC_BEGIN, *async_id);
+}
+
+void IRAM_ATTR trace_async_end_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t async_id) {
+  if (async_id && tracepoint_enabled(tracepoint))
+    write_async_entry(tracepoint, EVENT_TYPE_ASYNC_END, async_id);
+}
+
+void IRAM_ATTR trace_counter(const char* name, int64_t value, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_counter_tracepoint(tracepoint, value);
+}
+
+void IRAM_ATTR trace_counter_float(const char* name, float value, uint8_t color) {
+  mabutrace_tracepoint_t* tracepoint = mabutrace_intern_tracepoint(name, color);
+  if (tracepoint)
+    trace_counter_float_tracepoint(tracepoint, value, 0, NULL);
+}
+
+void IRAM_ATTR trace_counter_tracepoint(mabutrace_tracepoint_t* tracepoint, int64_t value) {
+  trace_counter_deadband_tracepoint(tracepoint, value, 0, NULL);
+}
+
+// True if the last value recorded by a deadband counter may be gone from the trace. Must be called by an in-flight
+// writer, so that it sees the epoch of the buffer it writes to.
+static inline bool IRAM_ATTR counter_value_expired(const mabutrace_counter_state_t* state) {
+  return state->epoch != atomic_load(&counter_epoch);
+}
+
+// Deadband counters keep their last value in the static state of the call site. Call sites shared by several tasks
+// may record a value more than necessary, which is harmless.
+void IRAM_ATTR trace_counter_deadband_tracepoint(mabutrace_tracepoint_t* tracepoint, int64_t value, uint64_t deadband, mabutrace_counter_state_t* state) {
+  if (!tracepoint_enabled(tracepoint))
+    return;
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
+
+  if (state) {
+    uint64_t change = value > state->last_value ? (uint64_t)value - (uint64_t)state->last_value : (uint64_t)state->last_value - (uint64_t)value;
+    if (change <= deadband && !counter_value_expired(state)) {
+      writer_exit(writer_slot);
+      return;
+    }
+    state->epoch = atomic_load(&counter_epoch);
+    state->last_value = value;
   }
 
-  uint8_t task_id = get_current_task_id();
-  uint8_t cpu_id = (uint8_t)xPortGetCoreID();
-  uint64_t now = esp_timer_get_time();
-  size_t type_size = sizeof(counter_entry_t);
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  if (value >= -0x800000 && value < 0x800000) {
+    counter_entry_t* entry = (counter_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_COUNTER, now);
+    entry->tracepoint_id = tracepoint->id;
+    entry->value = value;
+  } else {
+    counter_long_entry_t* entry = (counter_long_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_COUNTER_LONG, now);
+    entry->tracepoint_id = tracepoint->id;
+    entry->value = value;
+  }
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+  if (mabutrace_tracepoint_triggers[tracepoint->id])
+    mabutrace_evaluate_trigger(tracepoint->id, EVENT_TYPE_COUNTER, value);
 
-  size_t entry_idx = 0;
-  advance_pointers(type_size, &entry_idx);
+  writer_exit(writer_slot);
+}
 
-  counter_entry_t* entry = (counter_entry_t*)(profiler_entries + entry_idx);
-  entry->header.type = EVENT_TYPE_COUNTER;
-  entry->header.cpu_id = cpu_id;
-  entry->header.task_id = task_id;
-  entry->time_stamp_begin_microseconds = (uint32_t)now;
-  entry->name = name;
+void IRAM_ATTR trace_counter_float_tracepoint(mabutrace_tracepoint_t* tracepoint, float value, float deadband, mabutrace_counter_state_t* state) {
+  if (!tracepoint_enabled(tracepoint))
+    return;
+  uint8_t writer_slot;
+  if(!writer_enter(&writer_slot))
+    return;
+
+  if (state) {
+    float change = value > state->last_float_value ? value - state->last_float_value : state->last_float_value - value;
+    if (change <= deadband && !counter_value_expired(state)) {
+      writer_exit(writer_slot);
+      return;
+    }
+    state->epoch = atomic_load(&counter_epoch);
+    state->last_float_value = value;
+  }
+
+  uint16_t task_id = get_current_task_id();
+  uint8_t cpu_id;
+  mabutrace_irq_state_t irq_state = mabutrace_platform_enter_core_local(&cpu_id);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  counter_float_entry_t* entry = (counter_float_entry_t*)reserve_entry(writer_rings(writer_slot), cpu_id, task_id, EVENT_TYPE_COUNTER_FLOAT, now);
+  entry->tracepoint_id = tracepoint->id;
   entry->value = value;
+  mabutrace_platform_exit_core_local(cpu_id, irq_state);
+  if (mabutrace_tracepoint_triggers[tracepoint->id]) {
+    // Triggers compare integers. NaN never fires, out of range values saturate.
+    if (value == value) {
+      int64_t int_value = value >= 0x1p63f ? INT64_MAX : value <= -0x1p63f ? INT64_MIN : (int64_t)value;
+      mabutrace_evaluate_trigger(tracepoint->id, EVENT_TYPE_COUNTER, int_value);
+    }
+  }
 
-  cleanup:
-  semaphore_take(active_writers_semaphore, &must_yield_from_isr);
-  if(must_yield_from_isr)
-    portYIELD_FROM_ISR();
+  writer_exit(writer_slot);
 }
\ No newline at end of file
@@ -23,20 +23,101 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "esp_err.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "mabutrace_platform.h"
 
 /*
-* Size of the circular buffer.
+* Default size of the circular buffer (mabutrace_config_t.buffer_size). It is split evenly into one ring per CPU.
 */
+#ifndef PROFILER_BUFFER_SIZE_IN_BYTES
 #define PROFILER_BUFFER_SIZE_IN_BYTES 65536 // 64kB
+#endif
+
+/*
+* Default of mabutrace_config_t.spare_buffer. The spare buffer has the same size as the trace buffer, capturing a
+* trace swaps buffers and tracing continues while the old one is exported. Define as 0 to save the memory, tracing
+* is then suspended while a trace is exported.
+*/
+#ifndef MABUTRACE_SPARE_BUFFER
+#define MABUTRACE_SPARE_BUFFER 1
+#endif
+
+/*
+* Interval at which the live stream sends the events traced in the meantime. The buffer has to be large enough to
+* hold the events of one interval, plus the time it takes to send them.
+*/
+#ifndef MABUTRACE_STREAM_PERIOD_MS
+#define MABUTRACE_STREAM_PERIOD_MS 50
+#endif
+
+/*
+* FreeRTOS priority of the tasks that export traces, for downloads and the live stream. Tasks of higher priority
+* preempt the export, and every MABUTRACE_EXPORT_YIELD_INTERVAL_MS of run time it sleeps for a tick so that tasks
+* of lower priority (e.g. the idle task, which feeds the task watchdog) get to run as well.
+*/
+#ifndef MABUTRACE_EXPORT_TASK_PRIORITY
+#define MABUTRACE_EXPORT_TASK_PRIORITY 1
+#endif
+#ifndef MABUTRACE_EXPORT_YIELD_INTERVAL_MS
+#define MABUTRACE_EXPORT_YIELD_INTERVAL_MS 20
+#endif
 
 /*
-* Uncomment to place ringbuffer in external ram.
+* Uncomment to place ringbuffer in external ram by default (mabutrace_config_t.memory).
 */
 //#define USE_PSRAM_IF_AVAILABLE
 
+/*
+* Number of tasks that can be tracked at the same time. The ID of a deleted task is reused once all of its events
+* have been overwritten in the ring buffer. Events of tasks beyond this limit are attributed to a shared
+* "Unregistered Tasks" thread.
+*/
+#define MABUTRACE_MAX_TASKS 64
+
+/*
+* Size of the task name snapshot, including the terminating null. Names are captured when a task is first traced
+* and again when it is deleted, so they remain available after the task is gone.
+*/
+#define MABUTRACE_TASK_NAME_LENGTH 16
+
+/*
+* Number of FreeRTOS queues, semaphores and mutexes that can be traced at a time, see mabutrace_hooks.h. Each takes
+* a tracepoint ID. Once every event of a deleted queue has been evicted from the trace buffer, its ID is given to the
+* next new queue. Until then, queues beyond this limit are not traced.
+*/
+#define MABUTRACE_MAX_QUEUES 32
+
+/*
+* Size of the queue names, including the terminating null.
+*/
+#define MABUTRACE_QUEUE_NAME_LENGTH 16
+
+/*
+* Number of distinct tracepoints, i.e. TRACE_SCOPE, TRACE_INSTANT and TRACE_COUNTER call sites plus name/color
+* pairs passed to the trace_* functions directly. Tracepoints beyond this limit are not traced.
+*/
+#define MABUTRACE_MAX_TRACEPOINTS 256
+
+/*
+* Number of flight recorder triggers that can be armed at the same time, see mabutrace_trigger_on_instant.
+*/
+#define MABUTRACE_MAX_TRIGGERS 8
+
+/*
+* Category (0 to 31) of the tracepoints of a source file. Define it before including mabutrace.h to put the
+* instrumentation of a module into its own category, which can then be switched on and off at runtime with
+* mabutrace_set_category_enabled.
+*/
+#ifndef MABUTRACE_CATEGORY
+#define MABUTRACE_CATEGORY 0
+#endif
+
+/*
+* Bitmask of the categories that are compiled in. The TRACE_ macros of other categories compile to nothing.
+*/
+#ifndef MABUTRACE_COMPILED_CATEGORIES
+#define MABUTRACE_COMPILED_CATEGORIES 0xFFFFFFFFu
+#endif
+
 /*
 * Predefined colors.
 */
@@ -54,101 +135,233 @@
 
 /*
 * The following macros should be used for tracing ([] denotes optional argument).
-* Note that name is NOT copied, meaning the pointer must remain valid until the trace is converted to JSON.
-* For this reason it's recommended that the macros are only used with string literals as name.
+* Each TRACE_SCOPE, TRACE_INSTANT and TRACE_COUNTER call site defines a static tracepoint holding its name, color
+* and category, and events only store the 16 bit ID of their tracepoint. name and color must therefore be the
+* same every time a call site is executed (string literals and color constants), and name is NOT copied. Text that
+* changes at runtime belongs into a TRACE_ARG_STR argument, which is copied (see below). The trace_* functions that
+* take a name need string literals as well (see mabutrace_intern_tracepoint).
 *
 * TRC();
 * TRACE_SCOPE(const char* name, [uint8_t color]);
-* TRACE_FLOW_OUT(uint16_t* link_out, [const char* name], [uint8_t color]);
-* TRACE_FLOW_IN(uint16_t link_in);
+* TRACE_FLOW_OUT(uint32_t* link_out, [const char* name], [uint8_t color]);
+* TRACE_FLOW_IN(uint32_t link_in);
 * TRACE_INSTANT(const char* name, [uint8_t color]);
-* TRACE_COUNTER(const char* name, int24_t value, [uint8_t color]);
+* TRACE_ASYNC_BEGIN(const char* name, uint32_t* async_id, [uint8_t color]);
+* TRACE_ASYNC_END(const char* name, uint32_t async_id, [uint8_t color]);
+* TRACE_COUNTER(const char* name, int64_t value, [uint8_t color]);
+* TRACE_COUNTER_FLOAT(const char* name, float value, [uint8_t color]);
+* TRACE_COUNTER_DEADBAND(const char* name, int64_t value, uint64_t deadband, [uint8_t color]);
+* TRACE_COUNTER_FLOAT_DEADBAND(const char* name, float value, float deadband, [uint8_t color]);
+* TRACE_SCOPE_ARGS(const char* name, args...);
+* TRACE_SCOPE_ARGS_COLORED(const char* name, uint8_t color, args...);
+* TRACE_INSTANT_ARGS(const char* name, args...);
+* TRACE_INSTANT_ARGS_COLORED(const char* name, uint8_t color, args...);
+*
+* The args of the _ARGS variants are one or more of TRACE_ARG_INT(const char* key, int64_t value),
+* TRACE_ARG_FLOAT(const char* key, float value) and TRACE_ARG_STR(const char* key, const char* value), shown in the
+* args of the event. Like names, keys must be string literals. String values are copied, so they can be built at
+* runtime, but are cut to MABUTRACE_MAX_ARG_STRING_LENGTH characters, and all arguments of an event together take
+* at most MABUTRACE_MAX_ARGS_LENGTH bytes (3 bytes per argument plus the value). They are stored in an entry of their
+* own after the event, so events without arguments don't pay for them. The arguments of a scope are taken when it
+* begins, and are recorded along with a begin record even if scope_begin_records is off. The argument values of
+* TRACE_SCOPE_ARGS are evaluated even if the tracepoint is disabled.
+*
+* Counter values are stored in 3 bytes if they fit into 24 bits, in 8 bytes otherwise. The _DEADBAND variants
+* only record a value if it differs from the last one recorded by more than deadband, which keeps counters that are
+* sampled at a high rate cheap. Every capture, and every half lap of a ring, records the next value regardless, so
+* the current value of the counter is known throughout the trace.
+*
+* Flow links and async slices are identified by 32 bit IDs. A link_out or async_id that is 0 is assigned a new ID,
+* which is then passed on (e.g. in a queue message) to the matching TRACE_FLOW_IN or TRACE_ASYNC_END. Async slices
+* are operations that begin and end in different tasks or interrupts, such as a request passed through several
+* queues. They are shown on tracks of their own, and their names must match at both ends.
 */
 
 #define _OVERLOAD_MACRO(_1,_2,_3, _4, NAME,...) NAME
 
 #define TRC() TRACE_SCOPE(__func__)
 #define TRACE_SCOPE(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, 0, _TRACE_SCOPE_COLORED, _TRACE_SCOPE_UNCOLORED)(__VA_ARGS__)
-#define TRACE_FLOW_OUT(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, TRACE_FLOW_OUT_COLORED, _TRACE_FLOW_OUT_UNCOLORED, _TRACE_FLOW_OUT_UNNAMED_UNCOLORED)(__VA_ARGS__)
+#define TRACE_FLOW_OUT(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, _TRACE_FLOW_OUT_COLORED, _TRACE_FLOW_OUT_UNCOLORED, _TRACE_FLOW_OUT_UNNAMED_UNCOLORED)(__VA_ARGS__)
 #define TRACE_FLOW_IN(link_in) trace_flow_in(link_in);
+#define TRACE_ASYNC_BEGIN(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, _TRACE_ASYNC_BEGIN_COLORED, _TRACE_ASYNC_BEGIN_UNCOLORED, 0)(__VA_ARGS__)
+#define TRACE_ASYNC_END(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, _TRACE_ASYNC_END_COLORED, _TRACE_ASYNC_END_UNCOLORED, 0)(__VA_ARGS__)
 #define TRACE_INSTANT(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, 0, _TRACE_INSTANT_COLORED, _TRACE_INSTANT_UNCOLORED)(__VA_ARGS__)
 #define TRACE_COUNTER(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, _TRACE_COUNTER_COLORED, _TRACE_COUNTER_UNCOLORED, 0)(__VA_ARGS__)
+#define TRACE_COUNTER_FLOAT(...) _OVERLOAD_MACRO(__VA_ARGS__, 0, _TRACE_COUNTER_FLOAT_COLORED, _TRACE_COUNTER_FLOAT_UNCOLORED, 0)(__VA_ARGS__)
+#define TRACE_COUNTER_DEADBAND(...) _OVERLOAD_MACRO(__VA_ARGS__, _TRACE_COUNTER_DEADBAND_COLORED, _TRACE_COUNTER_DEADBAND_UNCOLORED, 0, 0)(__VA_ARGS__)
+#define TRACE_COUNTER_FLOAT_DEADBAND(...) _OVERLOAD_MACRO(__VA_ARGS__, _TRACE_COUNTER_FLOAT_DEADBAND_COLORED, _TRACE_COUNTER_FLOAT_DEADBAND_UNCOLORED, 0, 0)(__VA_ARGS__)
 
 #define _TRACE_FLOW_OUT_UNNAMED_UNCOLORED(link_out) trace_flow_out(link_out, "flow", COLOR_UNDEFINED);
 #define _TRACE_FLOW_OUT_UNCOLORED(link_out, name) trace_flow_out(link_out, name, COLOR_UNDEFINED);
 #define _TRACE_FLOW_OUT_COLORED(link_out, name, color) trace_flow_out(link_out, name, color);
-#define _TRACE_INSTANT_UNCOLORED(name) trace_instant(name, COLOR_UNDEFINED);
-#define _TRACE_INSTANT_COLORED(name, color) trace_instant(name, color);
-#define _TRACE_INSTANT_LINKED(name, link_in, link_out, color) trace_instant_linked(name, link_in, link_out, color);
-#define _TRACE_COUNTER_UNCOLORED(name, value) trace_counter(name, value, COLOR_UNDEFINED);
-#define _TRACE_COUNTER_COLORED(name, value, color) trace_counter(name, value, color);
+#define _TRACE_INSTANT_UNCOLORED(name) _TRACE_INSTANT_LINKED(name, 0, NULL, COLOR_UNDEFINED)
+#define _TRACE_INSTANT_COLORED(name, color) _TRACE_INSTANT_LINKED(name, 0, NULL, color)
+#define _TRACE_INSTANT_LINKED(name, link_in, link_out, color) do { _MABUTRACE_TRACEPOINT(instant_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(instant_trace_helper_tracepoint)) trace_instant_tracepoint(&instant_trace_helper_tracepoint, link_in, link_out); } while(0);
+#define _TRACE_ASYNC_BEGIN_UNCOLORED(name, async_id) _TRACE_ASYNC_BEGIN_COLORED(name, async_id, COLOR_UNDEFINED)
+#define _TRACE_ASYNC_BEGIN_COLORED(name, async_id, color) do { _MABUTRACE_TRACEPOINT(async_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(async_trace_helper_tracepoint)) trace_async_begin_tracepoint(&async_trace_helper_tracepoint, async_id); } while(0);
+#define _TRACE_ASYNC_END_UNCOLORED(name, async_id) _TRACE_ASYNC_END_COLORED(name, async_id, COLOR_UNDEFINED)
+#define _TRACE_ASYNC_END_COLORED(name, async_id, color) do { _MABUTRACE_TRACEPOINT(async_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(async_trace_helper_tracepoint)) trace_async_end_tracepoint(&async_trace_helper_tracepoint, async_id); } while(0);
+#define _TRACE_COUNTER_UNCOLORED(name, value) _TRACE_COUNTER_COLORED(name, value, COLOR_UNDEFINED)
+#define _TRACE_COUNTER_COLORED(name, value, color) do { _MABUTRACE_TRACEPOINT(counter_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(counter_trace_helper_tracepoint)) trace_counter_tracepoint(&counter_trace_helper_tracepoint, value); } while(0);
+#define _TRACE_COUNTER_FLOAT_UNCOLORED(name, value) _TRACE_COUNTER_FLOAT_COLORED(name, value, COLOR_UNDEFINED)
+#define _TRACE_COUNTER_FLOAT_COLORED(name, value, color) do { _MABUTRACE_TRACEPOINT(counter_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(counter_trace_helper_tracepoint)) trace_counter_float_tracepoint(&counter_trace_helper_tracepoint, value, 0, NULL); } while(0);
+#define _TRACE_COUNTER_DEADBAND_UNCOLORED(name, value, deadband) _TRACE_COUNTER_DEADBAND_COLORED(name, value, deadband, COLOR_UNDEFINED)
+#define _TRACE_COUNTER_DEADBAND_COLORED(name, value, deadband, color) do { _MABUTRACE_TRACEPOINT(counter_trace_helper_tracepoint, name, color); static mabutrace_counter_state_t counter_trace_helper_state; if (_MABUTRACE_TRACEPOINT_ACTIVE(counter_trace_helper_tracepoint)) trace_counter_deadband_tracepoint(&counter_trace_helper_tracepoint, value, deadband, &counter_trace_helper_state); } while(0);
+#define _TRACE_COUNTER_FLOAT_DEADBAND_UNCOLORED(name, value, deadband) _TRACE_COUNTER_FLOAT_DEADBAND_COLORED(name, value, deadband, COLOR_UNDEFINED)
+#define _TRACE_COUNTER_FLOAT_DEADBAND_COLORED(name, value, deadband, color) do { _MABUTRACE_TRACEPOINT(counter_trace_helper_tracepoint, name, color); static mabutrace_counter_state_t counter_trace_helper_state; if (_MABUTRACE_TRACEPOINT_ACTIVE(counter_trace_helper_tracepoint)) trace_counter_float_tracepoint(&counter_trace_helper_tracepoint, value, deadband, &counter_trace_helper_state); } while(0);
+#define TRACE_INSTANT_ARGS(name, ...) TRACE_INSTANT_ARGS_COLORED(name, COLOR_UNDEFINED, __VA_ARGS__)
+#define TRACE_INSTANT_ARGS_COLORED(name, color, ...) do { _MABUTRACE_TRACEPOINT(instant_trace_helper_tracepoint, name, color); if (_MABUTRACE_TRACEPOINT_ACTIVE(instant_trace_helper_tracepoint)) { const mabutrace_arg_t instant_trace_helper_args[] = {__VA_ARGS__}; trace_instant_args_tracepoint(&instant_trace_helper_tracepoint, instant_trace_helper_args, sizeof(instant_trace_helper_args) / sizeof(instant_trace_helper_args[0])); } } while(0);
+#define TRACE_SCOPE_ARGS(name, ...) TRACE_SCOPE_ARGS_COLORED(name, COLOR_UNDEFINED, __VA_ARGS__)
+#define TRACE_ARG_INT(key, value) mabutrace_arg_int(_MABUTRACE_ARG_KEY(key), value)
+#define TRACE_ARG_FLOAT(key, value) mabutrace_arg_float(_MABUTRACE_ARG_KEY(key), value)
+#define TRACE_ARG_STR(key, value) mabutrace_arg_string(_MABUTRACE_ARG_KEY(key), value)
+#define _TRACE_SCOPE_UNCOLORED(name) _TRACE_SCOPE_LINKED_COLORED(name, 0, NULL, COLOR_UNDEFINED)
+#define _TRACE_SCOPE_COLORED(name, color) _TRACE_SCOPE_LINKED_COLORED(name, 0, NULL, color)
+#define _TRACE_SCOPE_LINKED_UNCOLORED(name, link_in, link_out) _TRACE_SCOPE_LINKED_COLORED(name, link_in, link_out, COLOR_UNDEFINED)
+
+#define _MABUTRACE_CATEGORY_COMPILED ((((uint32_t)(MABUTRACE_COMPILED_CATEGORIES)) >> (MABUTRACE_CATEGORY)) & 1)
+#define _MABUTRACE_TRACEPOINT(var, name, color) static mabutrace_tracepoint_t var = MABUTRACE_TRACEPOINT_INIT(name, color, MABUTRACE_CATEGORY)
+// Constant false for categories that are not compiled in, so the optimizer drops the tracepoint altogether.
+#define _MABUTRACE_TRACEPOINT_ACTIVE(var) (_MABUTRACE_CATEGORY_COMPILED && (var).state != MABUTRACE_TRACEPOINT_DISABLED)
+// Keys are tracepoints of their own, defined where the argument is built.
+#define _MABUTRACE_ARG_KEY(key) ({ static mabutrace_tracepoint_t arg_key_helper_tracepoint = MABUTRACE_TRACEPOINT_INIT(key, COLOR_UNDEFINED, MABUTRACE_CATEGORY); &arg_key_helper_tracepoint; })
+#define _TRACE_SCOPE_ARGS_HELPER_COUNT (sizeof(scope_trace_helper_args) / sizeof(scope_trace_helper_args[0]))
 
 #ifdef __cplusplus
-#define _TRACE_SCOPE_UNCOLORED(name) Profiler scope_trace_helper_object(name, COLOR_UNDEFINED);
-#define _TRACE_SCOPE_COLORED(name, color) Profiler scope_trace_helper_object(name, color);
-#define _TRACE_SCOPE_LINKED_UNCOLORED(name, link_in, link_out) Profiler scope_trace_helper_object(name, link_in, link_out, COLOR_UNDEFINED);
-#define _TRACE_SCOPE_LINKED_COLORED(name, link_in, link_out, color) Profiler scope_trace_helper_object(name, link_in, link_out, color);
+// The casts pick the linked constructor of Profiler for 0 and NULL, which would also convert to the args one.
+#define _TRACE_SCOPE_LINKED_COLORED(name, link_in, link_out, color) _MABUTRACE_TRACEPOINT(scope_trace_helper_tracepoint, name, color); Profiler scope_trace_helper_object(_MABUTRACE_CATEGORY_COMPILED ? &scope_trace_helper_tracepoint : NULL, (uint32_t)(link_in), (uint32_t*)(link_out));
+#define TRACE_SCOPE_ARGS_COLORED(name, color, ...) _MABUTRACE_TRACEPOINT(scope_trace_helper_tracepoint, name, color); const mabutrace_arg_t scope_trace_helper_args[] = {__VA_ARGS__}; Profiler scope_trace_helper_object(_MABUTRACE_CATEGORY_COMPILED ? &scope_trace_helper_tracepoint : NULL, scope_trace_helper_args, _TRACE_SCOPE_ARGS_HELPER_COUNT);
 extern "C" {
 #else
-#define _TRACE_SCOPE_UNCOLORED(name) profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_end))) = trace_begin(name, COLOR_UNDEFINED);
-#define _TRACE_SCOPE_COLORED(name, color) profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_end))) = trace_begin(name, color);
-#define _TRACE_SCOPE_LINKED_UNCOLORED(name, link_in, link_out) profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_end))) = trace_begin_linked(name, link_in, link_out, COLOR_UNDEFINED);
-#define _TRACE_SCOPE_LINKED_COLORED(name, link_in, link_out, color) profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_end))) = trace_begin_linked(name, link_in, link_out, color);
+#define _TRACE_SCOPE_LINKED_COLORED(name, link_in, link_out, color) _MABUTRACE_TRACEPOINT(scope_trace_helper_tracepoint, name, color); profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_scope_end))) = trace_scope_begin(_MABUTRACE_CATEGORY_COMPILED ? &scope_trace_helper_tracepoint : NULL, link_in, link_out);
+#define TRACE_SCOPE_ARGS_COLORED(name, color, ...) _MABUTRACE_TRACEPOINT(scope_trace_helper_tracepoint, name, color); const mabutrace_arg_t scope_trace_helper_args[] = {__VA_ARGS__}; profiler_duration_handle_t scope_trace_helper_handle __attribute__ ((__cleanup__(trace_scope_end))) = trace_scope_begin_args(_MABUTRACE_CATEGORY_COMPILED ? &scope_trace_helper_tracepoint : NULL, scope_trace_helper_args, _TRACE_SCOPE_ARGS_HELPER_COUNT);
 #endif
 
+/*
+* Static description of a trace call site. Registered on first use, which assigns its ID.
+*/
 typedef struct {
-  uint64_t time_stamp_begin_microseconds;
   const char* name;
-  uint16_t link_in;
-  uint16_t link_out;
   uint8_t color;
+  uint8_t category;
+  uint8_t state;  // MABUTRACE_TRACEPOINT_*, the only field checked on the tracing fast path.
+  uint8_t disabled;  // Disabled with mabutrace_set_tracepoint_enabled.
+  uint16_t id;  // 0 until registered.
+  uint16_t name_generation;  // Changes when the name changes after registration, which only queues do.
+} mabutrace_tracepoint_t;
+#define MABUTRACE_TRACEPOINT_UNREGISTERED 0
+#define MABUTRACE_TRACEPOINT_ENABLED 1
+#define MABUTRACE_TRACEPOINT_DISABLED 2
+#define MABUTRACE_TRACEPOINT_INIT(name, color, category) {name, color, category, MABUTRACE_TRACEPOINT_UNREGISTERED, 0, 0, 0}
+
+/*
+* Argument of TRACE_SCOPE_ARGS and TRACE_INSTANT_ARGS, built with TRACE_ARG_*. The key is a tracepoint, so that the
+* trace only stores its ID, string values are copied into the trace buffer.
+*/
+#define MABUTRACE_ARG_INT 1
+#define MABUTRACE_ARG_FLOAT 2
+#define MABUTRACE_ARG_STRING 3
+typedef struct {
+  mabutrace_tracepoint_t* key;  // Holds the name of the argument. NULL arguments are skipped.
+  uint8_t type;  // MABUTRACE_ARG_INT, MABUTRACE_ARG_FLOAT or MABUTRACE_ARG_STRING.
+  union {
+    int64_t int_value;
+    float float_value;
+    const char* string_value;
+  };
+} mabutrace_arg_t;
+
+static inline mabutrace_arg_t mabutrace_arg_int(mabutrace_tracepoint_t* key, int64_t value) {
+  mabutrace_arg_t arg;
+  arg.key = key;
+  arg.type = MABUTRACE_ARG_INT;
+  arg.int_value = value;
+  return arg;
+}
+
+static inline mabutrace_arg_t mabutrace_arg_float(mabutrace_tracepoint_t* key, float value) {
+  mabutrace_arg_t arg;
+  arg.key = key;
+  arg.type = MABUTRACE_ARG_FLOAT;
+  arg.float_value = value;
+  return arg;
+}
+
+static inline mabutrace_arg_t mabutrace_arg_string(mabutrace_tracepoint_t* key, const char* value) {
+  mabutrace_arg_t arg;
+  arg.key = key;
+  arg.type = MABUTRACE_ARG_STRING;
+  arg.string_value = value;
+  return arg;
+}
+
+/*
+* Last value recorded by a TRACE_COUNTER_DEADBAND call site. epoch is 0 until the first value is recorded.
+*/
+typedef struct {
+  uint32_t epoch;
+  union {
+    int64_t last_value;
+    float last_float_value;
+  };
+} mabutrace_counter_state_t;
+
+typedef struct {
+  uint64_t time_stamp_begin_ticks;
+  uint16_t tracepoint_id;  // 0 if the scope is not traced.
+  uint32_t link_in;
+  uint32_t link_out;
 } profiler_duration_handle_t;
 
+/*
+* The CPU of an entry is given by the ring it is stored in, the task by the last EVENT_TYPE_TASK_CONTEXT entry
+* written before it.
+* Times are measured in ticks of the trace clock (see mabutrace_platform_clock_ticks), convert them with
+* mabutrace_ticks_to_ns. Entries don't store absolute time stamps. Each entry is followed by delta_length bytes
+* (little endian) holding the ticks elapsed since the previous entry of the same ring was written, so an entry
+* takes sizeof(<entry struct>) + delta_length bytes, plus its arguments for EVENT_TYPE_ARGS. EVENT_TYPE_TIME_ANCHOR
+* entries written every half lap of a ring carry the full 64 bit time, from which the exporter reconstructs the
+* time of all other entries.
+*/
 typedef struct {
-  uint8_t type : 3;  // 2^3 = 8 different event types.
-  uint8_t cpu_id : 1;  // 2 cpus.
-  uint8_t task_id : 4;  // 2^4 = 16 different tasks.
+  uint8_t type : 5;  // 2^5 = 32 different event types.
+  uint8_t delta_length : 3;  // 0 to 7 bytes of time delta.
 } __attribute__((packed)) entry_header_t;
 #define EVENT_TYPE_NONE 0
+#define MABUTRACE_MAX_DELTA_LENGTH 7
 
 typedef struct {
   entry_header_t header;
-  unsigned int time_duration_microseconds : 24;  // Duration of event in microseconds. 24bit yields up to 16 seconds duration.
-  uint32_t time_stamp_begin_microseconds;  // Start of event start in microseconds since device started. 32bit overflows every 70 minutes.
-  const char* name;  // Name of the event.
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  unsigned int time_duration_ticks : 24;  // Duration of event. The entry is written when the event ends.
 } __attribute__((packed)) duration_entry_t;
 #define EVENT_TYPE_DURATION 1
 
 typedef struct {
   entry_header_t header;
-  uint8_t color;
-  unsigned int time_duration_microseconds;  // Duration of event in microseconds.
-  uint32_t time_stamp_begin_microseconds;  // Start of event start in microseconds since device started. 32bit overflows every 70 minutes.
-  const char* name;  // Name of the event.
-} __attribute__((packed)) duration_colored_entry_t;
-#define EVENT_TYPE_DURATION_COLORED 2
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  uint32_t time_duration_ticks;  // Used for events that don't fit into duration_entry_t.
+} __attribute__((packed)) duration_long_entry_t;
+#define EVENT_TYPE_DURATION_LONG 2
 
 typedef struct {
   entry_header_t header;
-  uint8_t color;
-  uint32_t time_stamp_begin_microseconds;  // Start of event start in microseconds since device started. 32bit overflows every 70 minutes.
-  const char* name;  // Name of the event.
-} __attribute__((packed)) instant_colored_entry_t;
-#define EVENT_TYPE_INSTANT_COLORED 3
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+} __attribute__((packed)) instant_entry_t;
+#define EVENT_TYPE_INSTANT 3
 
 typedef struct {
   entry_header_t header;
   signed int value : 24;  // 24 bits allows for values between -8388608 and 8388607
-  uint32_t time_stamp_begin_microseconds;  // Start of event start in microseconds since device started. 32bit overflows every 70 minutes.
-  const char* name;  // Name of the event.
+  uint16_t tracepoint_id;  // Name, color and category of the event.
 } __attribute__((packed)) counter_entry_t;
 #define EVENT_TYPE_COUNTER 4
 
 typedef struct {
   entry_header_t header;
   uint8_t link_type;  // 0: in, 1: out
-  uint16_t link;  // Link id
-  uint32_t time_stamp_begin_microseconds;  // Start of event start in microseconds since device started. 32bit overflows every 70 minutes.
+  uint32_t link;  // Link id
+  unsigned int time_offset_ticks : 24;  // How long before the entry was written the link happened.
 } __attribute__((packed)) link_entry_t;
 #define EVENT_TYPE_LINK 5
 #define LINK_TYPE_IN 0
@@ -156,54 +369,559 @@ typedef struct {
 
 typedef struct {
   entry_header_t header;
-  uint32_t time_stamp;  // Timestamp of the entry
 } __attribute__((packed)) task_switch_entry_t;
 #define EVENT_TYPE_TASK_SWITCH_IN 6
 #define EVENT_TYPE_TASK_SWITCH_OUT 7
 
 typedef struct {
-  uint8_t type;  // Type of event. Based on this type, different fields from the union part are valid.
-  uint8_t cpu_id;  // ID of CPU from which event was traced.
-  uint8_t color;  // One of a few predefined color values.
-  uint16_t link_in;  // Flow Event id's to visualize links between events.
-  uint16_t link_out;
-  void* task_handle;  // FreeRTOS task handle. NULL if called from interrupt.
-  const char* name;  // Name of the event.
-  uint32_t time_stamp_begin_microseconds; // Start of event start in microseconds since device started.
-  union {
-    struct {  // EVENT_TYPE_DURATION additional fields.
-      uint32_t time_duration_microseconds; // Duration of event in microseconds.
-    };
-    struct {  // EVENT_TYPE_COUNTER additional fields.
-      int32_t counter_value;  // Value of the counter to keep track of.
-    };
-  };
-} profiler_entry_t;
+  entry_header_t header;
+  uint16_t task_id;  // Task that writes the following entries of the ring.
+} __attribute__((packed)) task_context_entry_t;
+#define EVENT_TYPE_TASK_CONTEXT 8
+
+typedef struct {
+  entry_header_t header;
+  uint64_t time_stamp_ticks;  // Time at which the entry was written.
+} __attribute__((packed)) time_anchor_entry_t;
+#define EVENT_TYPE_TIME_ANCHOR 9
+
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  uint64_t time_duration_ticks;  // Used for events that don't fit into duration_long_entry_t.
+} __attribute__((packed)) duration_long_long_entry_t;
+#define EVENT_TYPE_DURATION_LONG_LONG 10
+
+/*
+* Written when a scope begins if mabutrace_config_t.scope_begin_records is set. The scope ends with a duration
+* entry, as without begin records. Scopes whose begin entry has no duration entry after it were still open when
+* the trace was captured.
+*/
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+} __attribute__((packed)) scope_begin_entry_t;
+#define EVENT_TYPE_SCOPE_BEGIN 11
+
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  int64_t value;  // Used for values that don't fit into counter_entry_t.
+} __attribute__((packed)) counter_long_entry_t;
+#define EVENT_TYPE_COUNTER_LONG 12
+
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  float value;
+} __attribute__((packed)) counter_float_entry_t;
+#define EVENT_TYPE_COUNTER_FLOAT 13
+
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name, color and category of the event.
+  uint32_t async_id;  // Shared by the begin and the end of the slice.
+} __attribute__((packed)) async_entry_t;
+#define EVENT_TYPE_ASYNC_BEGIN 14
+#define EVENT_TYPE_ASYNC_END 15
+
+/*
+* Typed arguments of the event entry written right before it in the same ring, see TRACE_INSTANT_ARGS. The entry is
+* followed by length bytes of encoded arguments and only then by its time delta, so it takes
+* sizeof(args_entry_t) + length + delta_length bytes. Each argument is the 16 bit tracepoint ID of its key, a
+* MABUTRACE_ARG_* type byte and the value: 8 bytes for MABUTRACE_ARG_INT, 4 bytes for MABUTRACE_ARG_INT32 and
+* MABUTRACE_ARG_FLOAT, and a length byte followed by the characters (not terminated) for MABUTRACE_ARG_STRING.
+*/
+typedef struct {
+  entry_header_t header;
+  uint8_t length;  // Bytes of encoded arguments, at most MABUTRACE_MAX_ARGS_LENGTH.
+} __attribute__((packed)) args_entry_t;
+#define EVENT_TYPE_ARGS 16
+#define MABUTRACE_MAX_ARGS_LENGTH 64  // Arguments that don't fit anymore are dropped.
+#define MABUTRACE_MAX_ARG_STRING_LENGTH 32  // Longer strings are cut.
+#define MABUTRACE_ARG_INT32 4  // How MABUTRACE_ARG_INT values that fit into 32 bits are stored.
+
+/*
+* Allocator calls, recorded by mabutrace_heap.c in builds with MABUTRACE_HEAP_TRACING. The entry is written when the
+* call returns.
+*/
+typedef struct {
+  entry_header_t header;
+  uint32_t size;  // Bytes requested (allocations) or usable size of the block (frees).
+  uint32_t caller;  // Return address into the code that called the allocator, its lower 32 bits on 64 bit hosts.
+  unsigned int latency_ticks : 24;  // Time spent in the allocator, saturated.
+} __attribute__((packed)) heap_entry_t;
+#define EVENT_TYPE_HEAP_ALLOC 17
+#define EVENT_TYPE_HEAP_FREE 18
+#define EVENT_TYPE_HEAP_ALLOC_FAILED 19
+
+/*
+* Operations on FreeRTOS queues, semaphores and mutexes, recorded by the hooks of mabutrace_hooks.h in builds with
+* MABUTRACE_QUEUE_TRACING. Semaphores and mutexes are given by sending and taken by receiving. The entry is written
+* when the operation completes or fails. Items are numbered in the order they are sent to a queue, a receive takes
+* the oldest one, so a send and the receive with the same item number are both ends of a flow link.
+*/
+typedef struct {
+  entry_header_t header;
+  uint16_t tracepoint_id;  // Name of the queue.
+  uint16_t fill;  // Items in the queue after the operation, MABUTRACE_QUEUE_FILL_NONE for mutexes.
+  uint32_t item;  // Number of the item sent or received, 0 if it isn't linked.
+  uint32_t blocked_ticks;  // How long the task was blocked on the queue before, saturated.
+} __attribute__((packed)) queue_entry_t;
+#define EVENT_TYPE_QUEUE_SEND 20
+#define EVENT_TYPE_QUEUE_RECEIVE 21
+#define EVENT_TYPE_QUEUE_SEND_FAILED 22
+#define EVENT_TYPE_QUEUE_RECEIVE_FAILED 23
+#define MABUTRACE_QUEUE_FILL_NONE 0xFFFF
+
+/*
+* A task was made ready to run: woken from blocking, created, resumed, or its priority changed. Written by the
+* traceMOVED_TASK_TO_READY_STATE hook, in the context of the task or interrupt that readied it. Together with the
+* task switches, the exporter derives how long each task waited for a CPU.
+*/
+typedef struct {
+  entry_header_t header;
+  uint16_t task_id;  // Task that was made ready.
+  uint8_t priority;  // Its priority, saturated.
+} __attribute__((packed)) task_ready_entry_t;
+#define EVENT_TYPE_TASK_READY 24
+
+#define MABUTRACE_TASK_ID_ISR 0  // Interrupts, and tasks interrupted by them unless set_trace_interrupts_within_interrupted_tasks is enabled.
+#define MABUTRACE_TASK_ID_UNREGISTERED 0xFFFF  // Tasks that didn't get an ID because the task table was full.
+
+/*
+* View of the ring of one CPU, valid until the capture ends or tracing is resumed. The entries take length bytes
+* from start_idx on, wrapping around at the end of the ring. An entry is always stored in one piece: the one that
+* crosses the end of the ring continues behind it, in the overflow area, and the next one starts where it would
+* have ended in the ring. Entries before the first EVENT_TYPE_TASK_CONTEXT entry belong to start_task_id.
+*/
+typedef struct {
+  const char* entries;
+  size_t size;
+  size_t start_idx;
+  size_t length;
+  uint16_t start_task_id;
+  // Number of bytes written to the CPU's rings, in both buffers, up to end_idx. Views of consecutive captures
+  // are contiguous if the end_offset of the first one plus the size of the entries of the second one equals the
+  // end_offset of the second one. Wraps around.
+  uint32_t end_offset;
+} profiler_ring_view_t;
+
+/*
+* Configuration of mabutrace_init. Start from MABUTRACE_CONFIG_DEFAULT() and change what you need.
+*/
+typedef struct {
+  // Size of the trace buffer, split evenly into one ring per CPU. The size of each ring is rounded down to a
+  // power of two, and must be at least 1 kB.
+  size_t buffer_size;
+  uint8_t memory;  // MABUTRACE_MEMORY_*, where the trace buffers are allocated.
+  bool spare_buffer;  // Allocate a second trace buffer, so that captures don't suspend tracing.
+  uint32_t enabled_categories;  // Bitmask of the categories that start enabled, see mabutrace_set_category_enabled.
+  bool trace_task_switches;  // Record the task switches and ready tasks reported by the hooks of mabutrace_hooks.h.
+  bool trace_interrupts_within_interrupted_tasks;  // See set_trace_interrupts_within_interrupted_tasks.
+  uint32_t post_trigger_us;  // How long tracing goes on after a trigger fired before the trace is frozen.
+  // Also record when scopes begin, so that scopes which are still open when the trace is captured (e.g. the
+  // main loop of a task, or a stalled operation) show up. Costs an entry per scope more.
+  bool scope_begin_records;
+  // Number of tracepoints whose scope durations are aggregated into histograms, see mabutrace_get_scope_stats. 0
+  // disables the histograms. Each takes about 1.1 kB per CPU, twice, allocated like the trace buffers.
+  uint16_t scope_histograms;
+  // Write scopes to the trace buffer. Turn it off to only update the histograms of scope_histograms, which then
+  // keep going while a capture suspends tracing.
+  bool scope_events;
+  // Record every malloc, calloc, realloc and free (and so C++ new and delete) with its size, caller and latency,
+  // along with heap usage counters. Requires a build with MABUTRACE_HEAP_TRACING, see mabutrace_heap.c.
+  bool trace_heap;
+  // Which queues, semaphores and mutexes the hooks of mabutrace_hooks.h record in builds with
+  // MABUTRACE_QUEUE_TRACING, see mabutrace_set_queue_tracing.
+  uint8_t trace_queues;
+} mabutrace_config_t;
+
+#ifdef USE_PSRAM_IF_AVAILABLE
+#define MABUTRACE_DEFAULT_MEMORY MABUTRACE_MEMORY_PREFER_EXTERNAL
+#else
+#define MABUTRACE_DEFAULT_MEMORY MABUTRACE_MEMORY_DEFAULT
+#endif
+
+#define MABUTRACE_CONFIG_DEFAULT() { \
+  .buffer_size = PROFILER_BUFFER_SIZE_IN_BYTES, \
+  .memory = MABUTRACE_DEFAULT_MEMORY, \
+  .spare_buffer = MABUTRACE_SPARE_BUFFER, \
+  .enabled_categories = 0xFFFFFFFFu, \
+  .trace_task_switches = true, \
+  .trace_interrupts_within_interrupted_tasks = false, \
+  .post_trigger_us = 0, \
+  .scope_begin_records = false, \
+  .scope_histograms = 0, \
+  .scope_events = true, \
+  .trace_heap = false, \
+  .trace_queues = MABUTRACE_TRACE_QUEUES_ALL, \
+}
 
-esp_err_t mabutrace_init();
+/*
+* Allocates the trace buffers and starts tracing. config may be NULL for MABUTRACE_CONFIG_DEFAULT(). Returns
+* ESP_ERR_INVALID_ARG if the buffer is too small and ESP_ERR_NO_MEM if it can't be allocated.
+*/
+esp_err_t mabutrace_init(const mabutrace_config_t* config);
 esp_err_t mabutrace_deinit();
 esp_err_t mabutrace_start_server(int port);
+
+/*
+* Starts a task that streams the trace to a client connecting to the given TCP port, in the binary format of
+* mabutrace_format.h. One client at a time is served. Events are sent every MABUTRACE_STREAM_PERIOD_MS, and are
+* no longer available for download once sent. Requires the spare buffer (mabutrace_config_t.spare_buffer).
+*/
+esp_err_t mabutrace_start_stream_server(int port);
+esp_err_t mabutrace_stop_stream_server();
+/*
+* Captures the trace and writes it in the Chrome JSON format. Like the other get_*_trace_chunked functions, the
+* trace is formatted by a task of MABUTRACE_EXPORT_TASK_PRIORITY, while process_chunk is called by the caller.
+*/
 esp_err_t get_json_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t));
 void set_trace_interrupts_within_interrupted_tasks(bool enabled);
 
-const char* suspend_tracing_and_get_profiler_entries(size_t* out_start_idx, size_t* out_end_idx);
+/*
+* Starts or stops recording allocator calls at runtime, see mabutrace_config_t.trace_heap. Returns
+* ESP_ERR_NOT_SUPPORTED if the build lacks MABUTRACE_HEAP_TRACING.
+*/
+esp_err_t mabutrace_set_heap_tracing_enabled(bool enabled);
+
+/*
+* Which FreeRTOS queues, semaphores and mutexes are traced, see mabutrace_config_t.trace_queues. Only has an effect
+* in builds with MABUTRACE_QUEUE_TRACING.
+*/
+#define MABUTRACE_TRACE_QUEUES_NONE 0
+#define MABUTRACE_TRACE_QUEUES_NAMED 1  // Only those named with mabutrace_name_queue or vQueueAddToRegistry.
+#define MABUTRACE_TRACE_QUEUES_ALL 2
+void mabutrace_set_queue_tracing(uint8_t mode);
+
+/*
+* Names a queue, semaphore or mutex in the trace. Unnamed ones are called "Queue <n>", "Semaphore <n>" or
+* "Mutex <n>". vQueueAddToRegistry names them as well. The name is copied, and cut to
+* MABUTRACE_QUEUE_NAME_LENGTH - 1 characters.
+*/
+void mabutrace_name_queue(void* queue, const char* name);
+
+/*
+* Throughput of a trace export.
+*/
+typedef struct {
+  uint32_t num_events;  // Events written. Not counted for binary traces, whose entries are copied as they are.
+  uint32_t num_bytes;  // Size of the trace, before compression.
+  uint32_t duration_us;  // From the capture until the last byte was handed on for sending.
+} mabutrace_export_stats_t;
+
+/*
+* Returns the throughput of the last trace download (get_*_trace_chunked), which is also logged.
+*/
+void mabutrace_get_export_stats(mabutrace_export_stats_t* out_stats);
+
+/*
+* Events to export and the names their IDs refer to. For downloads this is a capture of the trace buffer of the
+* device, for the host side decoder the content of a binary trace.
+*/
+typedef struct {
+  const profiler_ring_view_t* rings;  // One per CPU.
+  uint8_t num_rings;
+  uint16_t num_task_ids;  // Task IDs are below this, except MABUTRACE_TASK_ID_UNREGISTERED.
+  uint16_t num_tracepoint_ids;  // Tracepoint IDs are below this.
+  uint64_t clock_frequency;  // Ticks per second of the trace clock.
+  // Returns the tracepoint with the given ID, or NULL if there is none.
+  const mabutrace_tracepoint_t* (*get_tracepoint)(void* ctx, uint16_t id);
+  const char* (*get_task_name)(void* ctx, uint16_t task_id);
+  void* ctx;
+  // Run time after which the exporter sleeps for a tick, so that tasks of lower priority get to run. 0: never.
+  uint32_t yield_interval_us;
+  mabutrace_export_stats_t* stats;  // If not NULL, receives the number of exported events.
+} mabutrace_trace_t;
+
+/*
+* Writes a trace in the Chrome JSON trace event format.
+*/
+esp_err_t mabutrace_write_json(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Writes a trace in the Perfetto protobuf format, with interned event names. Task switches are written as sched
+* events, so Perfetto shows them on its CPU tracks. Much smaller than the JSON trace, and faster to load.
+*/
+esp_err_t mabutrace_write_perfetto(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Captures the trace and writes it in the Perfetto protobuf format.
+*/
+esp_err_t get_perfetto_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Captures the trace and writes it in the binary format of mabutrace_format.h.
+*/
+esp_err_t get_binary_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Streaming gzip compression of exporter output, with a fixed amount of memory. mabutrace_gzip_begin writes the
+* gzip header to process_chunk and returns NULL if compression is not available (no deflate implementation or
+* not enough memory), in which case the data should be sent uncompressed. Pass mabutrace_gzip_chunk as
+* process_chunk to an exporter, with the stream as ctx. mabutrace_gzip_end writes the rest of the compressed data
+* and frees the stream.
+*/
+typedef struct mabutrace_gzip_stream_t mabutrace_gzip_stream_t;
+mabutrace_gzip_stream_t* mabutrace_gzip_begin(void* ctx, void (*process_chunk)(void*, const char*, size_t));
+void mabutrace_gzip_chunk(void* ctx, const char* chunk, size_t size);
+esp_err_t mabutrace_gzip_end(mabutrace_gzip_stream_t* stream);
+
+/*
+* What the reader of a binary trace (see mabutrace_format.h) has already received, so that
+* mabutrace_write_binary_rings only sends what is new to it.
+*/
+typedef struct {
+  uint16_t next_tracepoint_id;  // Tracepoints with lower IDs have been sent.
+  uint16_t tracepoint_generations[MABUTRACE_MAX_TRACEPOINTS];  // name_generation of each tracepoint when it was sent.
+  bool ring_sent[MABUTRACE_NUM_CPUS];
+  uint32_t end_offsets[MABUTRACE_NUM_CPUS];  // end_offset of the last ring view sent of each CPU.
+  bool task_name_sent[MABUTRACE_MAX_TASKS];
+  char task_names[MABUTRACE_MAX_TASKS][MABUTRACE_TASK_NAME_LENGTH];  // Last name sent for each task ID.
+} mabutrace_binary_state_t;
+
+/*
+* Starts a binary trace: writes the magic and the info record and initializes state.
+*/
+void mabutrace_write_binary_header(mabutrace_binary_state_t* state, void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Writes the entries of captured rings as binary records, preceded by the tracepoints and task names they need
+* that have not been sent yet or were renamed since, and by a lost record for each CPU whose entries don't continue
+* the ones written by the previous call.
+*/
+esp_err_t mabutrace_write_binary_rings(mabutrace_binary_state_t* state, const profiler_ring_view_t rings[MABUTRACE_NUM_CPUS],
+                                       void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+/*
+* Converts a time of the trace clock to nanoseconds since boot.
+*/
+uint64_t mabutrace_ticks_to_ns(uint64_t ticks);
+
+/*
+* Freezes the events traced so far for export and returns views of the rings holding them. If a spare buffer is
+* available, tracing continues into it, otherwise tracing is suspended until mabutrace_capture_end. Returns
+* ESP_ERR_INVALID_STATE if another capture is in progress.
+*/
+esp_err_t mabutrace_capture_begin(profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]);
+
+/*
+* Releases the rings of mabutrace_capture_begin. Their events are discarded if tracing continued in the spare
+* buffer.
+*/
+void mabutrace_capture_end();
+
+/*
+* True if the spare buffer has been allocated, i.e. if captures don't suspend tracing.
+*/
+bool mabutrace_has_spare_buffer();
+
+/*
+* Flight recorder. When a trigger fires, tracing goes on for mabutrace_config_t.post_trigger_us and then the trace
+* is frozen: tracing continues in the spare buffer (or is suspended without one), and the next capture, e.g. a
+* download from the web server, returns the frozen trace with the events that led up to the trigger. Triggers are
+* ignored while a capture is in progress or a frozen trace waits to be captured, they fire again afterwards.
+*
+* Triggers are armed on all tracepoints with the given name, and stay armed until mabutrace_clear_triggers. A
+* tracepoint has at most one trigger, the one armed last. Return ESP_ERR_NO_MEM if MABUTRACE_MAX_TRIGGERS are armed.
+*/
+esp_err_t mabutrace_trigger_on_instant(const char* name);
+// Fires when a scope of the given name lasts at least min_duration_us.
+esp_err_t mabutrace_trigger_on_duration(const char* name, uint32_t min_duration_us);
+// Fires when a counter reaches the threshold from below (rising) or from above (falling). Values of float counters
+// are rounded toward zero.
+esp_err_t mabutrace_trigger_on_counter(const char* name, int64_t threshold, bool rising);
+void mabutrace_clear_triggers();
+
+/*
+* Fires the flight recorder from code. Can be called from interrupts.
+*/
+void mabutrace_trigger();
+
+/*
+* True if a trigger froze the trace and it hasn't been captured yet.
+*/
+bool mabutrace_has_frozen_trace();
+
+/*
+* Duration statistics of the scopes of a tracepoint over a window, from mabutrace_config_t.scope_histograms. The
+* percentiles are accurate to about 6 %.
+*/
+typedef struct {
+  uint16_t tracepoint_id;
+  const char* name;
+  uint32_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+} mabutrace_scope_stats_t;
+
+/*
+* Returns the statistics of the scopes that ended since the previous call (or since mabutrace_init), one entry per
+* tracepoint with at least one scope, and starts a new window. out_window_ns, if not NULL, receives the length of
+* the window. Tracepoints beyond scope_histograms distinct ones are not counted. Returns ESP_ERR_INVALID_STATE if
+* histograms are disabled or another call is in progress.
+*/
+esp_err_t mabutrace_get_scope_stats(mabutrace_scope_stats_t* out_stats, size_t max_stats, size_t* out_count, uint64_t* out_window_ns);
+
+/*
+* Writes the scope statistics of mabutrace_get_scope_stats as JSON, served at /stats by the web server.
+*/
+esp_err_t get_scope_stats_json_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+void suspend_tracing_and_get_profiler_rings(profiler_ring_view_t out_rings[MABUTRACE_NUM_CPUS]);
 void resume_tracing();
-const TaskHandle_t* profiler_get_task_handles();
+const char* profiler_get_task_name(uint16_t task_id);
+/*
+* Registers a tracepoint on first use and returns its new state. Called by the tracing functions.
+*/
+uint8_t mabutrace_register_tracepoint(mabutrace_tracepoint_t* tracepoint);
+
+/*
+* Returns the tracepoint of a name/color pair passed to one of the trace_* functions that take a name, creating
+* it on first use. NULL if no more tracepoints can be created, the event is then dropped. Names are told apart by
+* their pointer, not their contents, and are never copied or released: the trace_* functions that take a name need
+* string literals (or other strings that never change or go away), like the TRACE_ macros. A buffer that is reused
+* for different text keeps the name it had when it was first used, and up to 64 different names can be interned.
+*/
+mabutrace_tracepoint_t* mabutrace_intern_tracepoint(const char* name, uint8_t color);
+
+/*
+* Start position of a pointer in an open addressing table of table_size positions, used by the registries of tasks,
+* queues and interned tracepoints. salt is mixed into the hash for keys that are more than a pointer. Takes the high
+* bits of a multiplicative hash, so aligned pointers spread as well as unaligned ones.
+*/
+static inline uint16_t IRAM_ATTR mabutrace_hash_pointer(const void* pointer, uint32_t salt, uint16_t table_size) {
+  uint32_t hash = ((uint32_t)(uintptr_t)pointer ^ salt) * 2654435761u;
+  return (hash >> 16) % table_size;
+}
+
+/*
+* 1 + index of the trigger armed on each tracepoint ID, 0 if none. The tracing functions call
+* mabutrace_evaluate_trigger for events of tracepoints with a trigger, with the duration in ticks or the counter
+* value. mabutrace_arm_triggers arms the triggers on a tracepoint when it is registered.
+*/
+extern uint8_t mabutrace_tracepoint_triggers[MABUTRACE_MAX_TRACEPOINTS];
+void mabutrace_evaluate_trigger(uint16_t tracepoint_id, uint8_t event_type, int64_t value);
+void mabutrace_arm_triggers(const mabutrace_tracepoint_t* tracepoint);
+
+/*
+* Scope histograms, allocated by mabutrace_init if enabled. trace_end calls mabutrace_record_scope_duration in its
+* core local section of cpu_id.
+*/
+esp_err_t mabutrace_histograms_init(uint16_t count, uint8_t memory);
+void mabutrace_histograms_deinit();
+void mabutrace_record_scope_duration(uint16_t tracepoint_id, uint8_t cpu_id, uint64_t duration_ticks);
+
+/*
+* Writes an EVENT_TYPE_HEAP_* entry for the calling task. Called by the allocator hooks of mabutrace_heap.c.
+*/
+void mabutrace_record_heap_event(uint8_t type, uint32_t size, uint32_t caller, uint64_t latency_ticks);
+
+/*
+* Called by the queue hooks of mabutrace_queue.c. mabutrace_begin_queue_blocking remembers when the calling task
+* started to block on a queue, mabutrace_end_queue_blocking returns for how many ticks it has been blocked since (0
+* if it didn't block) and forgets it. mabutrace_record_queue_event writes an EVENT_TYPE_QUEUE_* entry for the
+* calling task.
+*/
+void mabutrace_begin_queue_blocking();
+uint64_t mabutrace_end_queue_blocking();
+void mabutrace_record_queue_event(uint8_t type, uint16_t tracepoint_id, uint16_t fill, uint32_t item, uint64_t blocked_ticks);
+
+/*
+* Where the rings were when something that events refer to by ID went away. mabutrace_mark_rings records it,
+* mabutrace_rings_evicted returns true once every event written before the mark has left the rings, from then on
+* the ID can be given to something else. Both registries of tasks and queues recycle their IDs like this.
+*/
+typedef struct {
+  uint32_t written_bytes[MABUTRACE_NUM_CPUS];
+  uint8_t buffer;
+} mabutrace_rings_mark_t;
+void mabutrace_mark_rings(mabutrace_rings_mark_t* out_mark);
+bool mabutrace_rings_evicted(const mabutrace_rings_mark_t* mark);
+
+/*
+* Returns the tracepoint with the given ID, or NULL if there is none.
+*/
+const mabutrace_tracepoint_t* mabutrace_get_tracepoint(uint16_t id);
+
+/*
+* Enables or disables all tracepoints of a category (0 to 31) at runtime. All categories start enabled, unless
+* mabutrace_config_t.enabled_categories says otherwise.
+*/
+void mabutrace_set_category_enabled(uint8_t category, bool enabled);
+
+/*
+* Enables the categories whose bit is set in the bitmask and disables all others.
+*/
+void mabutrace_set_enabled_categories(uint32_t categories);
+
+/*
+* Enables or disables all tracepoints with the given name at runtime. Only tracepoints that have been executed at
+* least once are known, returns ESP_ERR_NOT_FOUND if there is none with that name.
+*/
+esp_err_t mabutrace_set_tracepoint_enabled(const char* name, bool enabled);
+
+profiler_duration_handle_t trace_begin_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out);
+void trace_instant_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out);
+profiler_duration_handle_t trace_begin_args_tracepoint(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args);
+void trace_instant_args_tracepoint(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args);
+void trace_async_begin_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t* async_id);
+void trace_async_end_tracepoint(mabutrace_tracepoint_t* tracepoint, uint32_t async_id);
+void trace_counter_tracepoint(mabutrace_tracepoint_t* tracepoint, int64_t value);
+// state is NULL to record every value.
+void trace_counter_deadband_tracepoint(mabutrace_tracepoint_t* tracepoint, int64_t value, uint64_t deadband, mabutrace_counter_state_t* state);
+void trace_counter_float_tracepoint(mabutrace_tracepoint_t* tracepoint, float value, float deadband, mabutrace_counter_state_t* state);
 profiler_duration_handle_t trace_begin(const char* name, uint8_t color);
-profiler_duration_handle_t trace_begin_linked(const char* name, uint16_t link_in, uint16_t* link_out, uint8_t color);
+profiler_duration_handle_t trace_begin_linked(const char* name, uint32_t link_in, uint32_t* link_out, uint8_t color);
 void trace_end(profiler_duration_handle_t* handle);
-void trace_flow_out(uint16_t* link_out, const char* name, uint8_t color);
-void trace_flow_in(uint16_t link_in);
+void trace_flow_out(uint32_t* link_out, const char* name, uint8_t color);
+void trace_flow_in(uint32_t link_in);
+void trace_async_begin(const char* name, uint32_t* async_id, uint8_t color);
+void trace_async_end(const char* name, uint32_t async_id, uint8_t color);
 void trace_instant(const char* name, uint8_t color);
-void trace_instant_linked(const char* name, uint16_t link_in, uint16_t* link_out, uint8_t color);
-void trace_counter(const char* name, int32_t value, uint8_t color);
+void trace_instant_linked(const char* name, uint32_t link_in, uint32_t* link_out, uint8_t color);
+// Keys of args passed to these are tracepoints too, e.g. mabutrace_intern_tracepoint(key, COLOR_UNDEFINED).
+profiler_duration_handle_t trace_begin_args(const char* name, const mabutrace_arg_t* args, uint8_t num_args, uint8_t color);
+void trace_instant_args(const char* name, const mabutrace_arg_t* args, uint8_t num_args, uint8_t color);
+void trace_counter(const char* name, int64_t value, uint8_t color);
+void trace_counter_float(const char* name, float value, uint8_t color);
+
+// Used by TRACE_SCOPE. Disabled tracepoints cost a single byte compare, without calling into the tracer.
+static inline profiler_duration_handle_t trace_scope_begin(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out) {
+  if (!tracepoint || tracepoint->state == MABUTRACE_TRACEPOINT_DISABLED) {
+    profiler_duration_handle_t handle = {0, 0, 0, 0};
+    return handle;
+  }
+  return trace_begin_tracepoint(tracepoint, link_in, link_out);
+}
+
+// Used by TRACE_SCOPE_ARGS.
+static inline profiler_duration_handle_t trace_scope_begin_args(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args) {
+  if (!tracepoint || tracepoint->state == MABUTRACE_TRACEPOINT_DISABLED) {
+    profiler_duration_handle_t handle = {0, 0, 0, 0};
+    return handle;
+  }
+  return trace_begin_args_tracepoint(tracepoint, args, num_args);
+}
+
+static inline void trace_scope_end(profiler_duration_handle_t* handle) {
+  if (handle->tracepoint_id)
+    trace_end(handle);
+}
 
 #ifdef __cplusplus
 class Profiler {
 public:
   Profiler(const char* name, uint8_t color) { _handle = trace_begin(name, color); }
-  Profiler(const char* name, uint16_t link_in, uint16_t* link_out, uint8_t color) { _handle = trace_begin_linked(name, link_in, link_out, color); }
-  ~Profiler() { trace_end(&_handle); }
+  Profiler(const char* name, uint32_t link_in, uint32_t* link_out, uint8_t color) { _handle = trace_begin_linked(name, link_in, link_out, color); }
+  Profiler(mabutrace_tracepoint_t* tracepoint, uint32_t link_in, uint32_t* link_out) { _handle = trace_scope_begin(tracepoint, link_in, link_out); }
+  Profiler(mabutrace_tracepoint_t* tracepoint, const mabutrace_arg_t* args, uint8_t num_args) { _handle = trace_scope_begin_args(tracepoint, args, num_args); }
+  ~Profiler() { trace_scope_end(&_handle); }
 private:
   profiler_duration_handle_t _handle;
 };
@@ -18,19 +18,23 @@
  */
 
 #include "mabutrace.h"
+#include "mabutrace_format.h"
 
 #include <assert.h>
-
-#include "esp_log.h"
-#include "freertos/FreeRTOS.h"
+#include <float.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "MABUTRACE";
 
-// An upper bound estimate for the number of chars required for the json output of each entry
-#define MAX_CHARS_PER_ENTRY 512
+// Size of the blocks the JSON output is handed to process_chunk in.
+#define JSON_CHUNK_SIZE 4096
 
 static const char* json_header = "{\n"
                                  "  \"traceEvents\": [\n";
+// Leaves otherData open for the scheduling statistics.
 static const char* json_footer = "    {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"Tasks & Interrupts\"}},\n"
                                  "    {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"CPU Task Scheduling\"}},\n"
                                  "    {\"name\": \"process_sort_index\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"sort_index\": 0}},\n"
@@ -38,9 +42,7 @@ static const char* json_footer = "    {\"name\": \"process_name\", \"ph\": \"M\"
                                  "  ],\n"
                                  "  \"displayTimeUnit\": \"ms\",\n"
                                  "  \"otherData\": {\n"
-                                 "    \"version\": \"MabuTrace Profiler v1.0\"\n"
-                                 "  }\n"
-                                 "}";
+                                 "    \"version\": \"MabuTrace Profiler v1.0\"";
 
 static const char* colorNameLookup[] = {
   "",                                        // COLOR_UNDEFINED
@@ -56,80 +58,970 @@ static const char* colorNameLookup[] = {
   ",\"cname\":\"grey\""                      // COLOR_LIGHT_GRAY
 };
 
-esp_err_t get_json_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
-  esp_err_t res = ESP_OK;
-  char buf[MAX_CHARS_PER_ENTRY];
-  size_t start_idx;
-  size_t end_idx;
-  const char* profiler_entries = suspend_tracing_and_get_profiler_entries(&start_idx, &end_idx);
-  const TaskHandle_t* task_handles = profiler_get_task_handles();
-
-  size_t lineLength = snprintf(buf, sizeof(buf), "%s", json_header);
-  assert(lineLength >= 0 && lineLength < sizeof(buf) && "Failed to correctly write header.");
-  process_chunk(ctx, buf, lineLength);
-
-  size_t idx = start_idx;
-  size_t loopCount = 0;
-  int entry_counter = 0;
+// Thread ids of the JSON output. Tasks use their task ID, interrupts one thread per CPU.
+#define ISR_TID_BASE 0x10000
+
+// Iterates over the entries of one ring in the order they were written.
+typedef struct {
+  profiler_ring_view_t ring;
+  size_t idx;
+  size_t remaining;  // Bytes of entries from idx on.
+  uint8_t cpu_id;
+  uint16_t task_id;  // Task of the entry the cursor points to.
+  uint64_t time;  // Time of the last consumed entry.
+  uint64_t entry_time;  // Time of the entry returned by cursor_peek.
+} ring_cursor_t;
+
+// Names of the EVENT_TYPE_HEAP_* events, in the order of their types.
+#define HEAP_EVENT_NAMES "malloc", "free", "malloc failed"
+// Operations of the EVENT_TYPE_QUEUE_* events, in the order of their types.
+#define QUEUE_OPERATION_NAMES "send", "receive", "send failed", "receive failed"
+// Flow ID linking the send and the receive of a queue item, above the 32 bit IDs of TRACE_FLOW_OUT links.
+#define QUEUE_FLOW_ID(tracepoint_id, item) ((1ull << 48) | ((uint64_t)(tracepoint_id) << 32) | (item))
+// Slices of tasks waiting for a CPU, indexed by whether the task was woken (or else preempted).
+#define SCHED_WAIT_NAMES "ready: preempted", "ready: woken"
+
+static size_t get_type_size(uint8_t type) {
+  switch (type) {
+    case EVENT_TYPE_DURATION: return sizeof(duration_entry_t);
+    case EVENT_TYPE_DURATION_LONG: return sizeof(duration_long_entry_t);
+    case EVENT_TYPE_INSTANT: return sizeof(instant_entry_t);
+    case EVENT_TYPE_COUNTER: return sizeof(counter_entry_t);
+    case EVENT_TYPE_LINK: return sizeof(link_entry_t);
+    case EVENT_TYPE_TASK_SWITCH_IN:
+    case EVENT_TYPE_TASK_SWITCH_OUT: return sizeof(task_switch_entry_t);
+    case EVENT_TYPE_TASK_CONTEXT: return sizeof(task_context_entry_t);
+    case EVENT_TYPE_TIME_ANCHOR: return sizeof(time_anchor_entry_t);
+    case EVENT_TYPE_DURATION_LONG_LONG: return sizeof(duration_long_long_entry_t);
+    case EVENT_TYPE_SCOPE_BEGIN: return sizeof(scope_begin_entry_t);
+    case EVENT_TYPE_COUNTER_LONG: return sizeof(counter_long_entry_t);
+    case EVENT_TYPE_COUNTER_FLOAT: return sizeof(counter_float_entry_t);
+    case EVENT_TYPE_ASYNC_BEGIN:
+    case EVENT_TYPE_ASYNC_END: return sizeof(async_entry_t);
+    case EVENT_TYPE_ARGS: return sizeof(args_entry_t);
+    case EVENT_TYPE_HEAP_ALLOC:
+    case EVENT_TYPE_HEAP_FREE:
+    case EVENT_TYPE_HEAP_ALLOC_FAILED: return sizeof(heap_entry_t);
+    case EVENT_TYPE_QUEUE_SEND:
+    case EVENT_TYPE_QUEUE_RECEIVE:
+    case EVENT_TYPE_QUEUE_SEND_FAILED:
+    case EVENT_TYPE_QUEUE_RECEIVE_FAILED: return sizeof(queue_entry_t);
+    case EVENT_TYPE_TASK_READY: return sizeof(task_ready_entry_t);
+    default: return 0;
+  }
+}
+
+// Size of the entry up to its time delta.
+static size_t get_entry_body_size(const entry_header_t* entry_header) {
+  size_t size = get_type_size(entry_header->type);
+  if (entry_header->type == EVENT_TYPE_ARGS)
+    size += ((const args_entry_t*)entry_header)->length;
+  return size;
+}
+
+static size_t get_entry_size(const entry_header_t* entry_header) {
+  return get_entry_body_size(entry_header) + entry_header->delta_length;
+}
+
+// Trace clock ticks between the previous entry of the ring and this one.
+static uint64_t get_entry_delta(const entry_header_t* entry_header) {
+  const uint8_t* delta_bytes = (const uint8_t*)entry_header + get_entry_body_size(entry_header);
+  uint64_t delta = 0;
+  for (int i = entry_header->delta_length - 1; i >= 0; i--) {
+    delta = (delta << 8) | delta_bytes[i];
+  }
+  return delta;
+}
+
+static void cursor_advance(ring_cursor_t* cursor, size_t entry_size) {
+  // An entry crossing the end of the ring is stored in one piece, the next one starts where it ends modulo size.
+  cursor->idx += entry_size;
+  if (cursor->idx >= cursor->ring.size)
+    cursor->idx -= cursor->ring.size;
+  cursor->remaining = entry_size < cursor->remaining ? cursor->remaining - entry_size : 0;
+}
+
+// Returns the entry at the position of the cursor, or NULL if all entries of the ring have been visited.
+static const entry_header_t* cursor_current(ring_cursor_t* cursor) {
+  if (cursor->remaining == 0)
+    return NULL;
+  const entry_header_t* entry_header = (const entry_header_t*)(cursor->ring.entries + cursor->idx);
+  // Not an entry, the rest of the ring can't be parsed.
+  if (get_type_size(entry_header->type) == 0)
+    return NULL;
+  return entry_header;
+}
+
+static void cursor_init(ring_cursor_t* cursor, const profiler_ring_view_t* ring, uint8_t cpu_id) {
+  cursor->ring = *ring;
+  cursor->idx = ring->start_idx;
+  cursor->remaining = ring->length;
+  cursor->cpu_id = cpu_id;
+  cursor->task_id = ring->start_task_id;
+  cursor->time = 0;
+  // The oldest entries may have lost their time anchor to eviction. Find the first anchor still in the ring and
+  // walk the deltas back from it to the time before the oldest entry.
+  ring_cursor_t scan = *cursor;
+  uint64_t delta_sum = 0;
+  const entry_header_t* entry_header;
+  while ((entry_header = cursor_current(&scan))) {
+    delta_sum += get_entry_delta(entry_header);
+    if (entry_header->type == EVENT_TYPE_TIME_ANCHOR) {
+      cursor->time = ((const time_anchor_entry_t*)entry_header)->time_stamp_ticks - delta_sum;
+      break;
+    }
+    cursor_advance(&scan, get_entry_size(entry_header));
+  }
+}
+
+static void cursor_consume(ring_cursor_t* cursor, const entry_header_t* entry_header) {
+  cursor->time = cursor->entry_time;
+  cursor_advance(cursor, get_entry_size(entry_header));
+}
+
+// Returns the event the cursor points to and sets entry_time to its time, or NULL if all entries of the ring have
+// been visited. Task context and time anchor entries are consumed on the way, and so are argument entries, which
+// are read along with their event by cursor_args.
+static const entry_header_t* cursor_peek(ring_cursor_t* cursor) {
+  const entry_header_t* entry_header;
+  while ((entry_header = cursor_current(cursor))) {
+    cursor->entry_time = cursor->time + get_entry_delta(entry_header);
+    if (entry_header->type == EVENT_TYPE_TASK_CONTEXT) {
+      cursor->task_id = ((const task_context_entry_t*)entry_header)->task_id;
+      cursor_consume(cursor, entry_header);
+      continue;
+    }
+    if (entry_header->type == EVENT_TYPE_TIME_ANCHOR) {
+      cursor->entry_time = ((const time_anchor_entry_t*)entry_header)->time_stamp_ticks;
+      cursor_consume(cursor, entry_header);
+      continue;
+    }
+    if (entry_header->type == EVENT_TYPE_ARGS) {
+      cursor_consume(cursor, entry_header);
+      continue;
+    }
+    return entry_header;
+  }
+  return NULL;
+}
+
+// Returns the arguments of the event the cursor points to, or NULL if it has none.
+static const args_entry_t* cursor_args(const ring_cursor_t* cursor, const entry_header_t* entry_header) {
+  ring_cursor_t next = *cursor;
+  cursor_advance(&next, get_entry_size(entry_header));
+  const entry_header_t* next_header = cursor_current(&next);
+  return next_header && next_header->type == EVENT_TYPE_ARGS ? (const args_entry_t*)next_header : NULL;
+}
+
+typedef struct {
+  uint16_t key_id;  // Tracepoint ID of the name of the argument.
+  uint8_t type;  // MABUTRACE_ARG_INT, MABUTRACE_ARG_FLOAT or MABUTRACE_ARG_STRING.
+  int64_t int_value;
+  float float_value;
+  char string_value[MABUTRACE_MAX_ARG_STRING_LENGTH + 1];
+} event_arg_t;
+
+// Decodes the argument at *offset of an argument entry and moves offset past it. Returns false after the last one.
+static bool next_event_arg(const args_entry_t* args, size_t* offset, event_arg_t* out_arg) {
+  const uint8_t* data = (const uint8_t*)(args + 1);
+  size_t length = args->length;
+  if (*offset + sizeof(out_arg->key_id) + 1 > length)
+    return false;
+  memcpy(&out_arg->key_id, data + *offset, sizeof(out_arg->key_id));
+  out_arg->type = data[*offset + sizeof(out_arg->key_id)];
+  size_t value_offset = *offset + sizeof(out_arg->key_id) + 1;
+  size_t value_length;
+  switch (out_arg->type) {
+    case MABUTRACE_ARG_INT32: {
+      value_length = sizeof(int32_t);
+      if (value_offset + value_length > length)
+        return false;
+      int32_t value;
+      memcpy(&value, data + value_offset, sizeof(value));
+      out_arg->type = MABUTRACE_ARG_INT;
+      out_arg->int_value = value;
+      break;
+    }
+    case MABUTRACE_ARG_INT:
+      value_length = sizeof(int64_t);
+      if (value_offset + value_length > length)
+        return false;
+      memcpy(&out_arg->int_value, data + value_offset, sizeof(out_arg->int_value));
+      break;
+    case MABUTRACE_ARG_FLOAT:
+      value_length = sizeof(float);
+      if (value_offset + value_length > length)
+        return false;
+      memcpy(&out_arg->float_value, data + value_offset, sizeof(out_arg->float_value));
+      break;
+    case MABUTRACE_ARG_STRING: {
+      if (value_offset + 1 > length)
+        return false;
+      size_t string_length = data[value_offset];
+      value_length = 1 + string_length;
+      if (string_length > MABUTRACE_MAX_ARG_STRING_LENGTH || value_offset + value_length > length)
+        return false;
+      memcpy(out_arg->string_value, data + value_offset + 1, string_length);
+      out_arg->string_value[string_length] = 0;
+      break;
+    }
+    default:
+      return false;
+  }
+  *offset = value_offset + value_length;
+  return true;
+}
+
+// Merges the rings of all CPUs by returning the oldest pending entry and the cursor pointing to it, or NULL once
+// all entries have been visited. Entries are written to their ring when they end, so this merges them by their end
+// time.
+static const entry_header_t* merge_next(ring_cursor_t* cursors, int num_cursors, ring_cursor_t** out_cursor) {
+  const entry_header_t* entry_header = NULL;
+  for (int i = 0; i < num_cursors; i++) {
+    const entry_header_t* candidate = cursor_peek(&cursors[i]);
+    if (candidate && (!entry_header || cursors[i].entry_time < (*out_cursor)->entry_time)) {
+      *out_cursor = &cursors[i];
+      entry_header = candidate;
+    }
+  }
+  return entry_header;
+}
+
+// Counts the exported events, and sleeps for a tick whenever the exporter has run for yield_interval_us.
+typedef struct {
+  uint32_t num_events;
+  uint64_t slice_start_us;
+} export_progress_t;
+
+static void export_progress_init(export_progress_t* progress) {
+  progress->num_events = 0;
+  progress->slice_start_us = mabutrace_platform_time_us();
+}
+
+static void export_progress(const mabutrace_trace_t* trace, export_progress_t* progress) {
+  progress->num_events++;
+  // Reading the time costs about as much as formatting an event, so it is only checked every few events.
+  if (!trace->yield_interval_us || progress->num_events % 32 != 0)
+    return;
+  if (mabutrace_platform_time_us() - progress->slice_start_us < trace->yield_interval_us)
+    return;
+  mabutrace_platform_delay_ms(1);
+  progress->slice_start_us = mabutrace_platform_time_us();
+}
+
+static void export_progress_end(const mabutrace_trace_t* trace, const export_progress_t* progress) {
+  if (trace->stats)
+    trace->stats->num_events = progress->num_events;
+}
+
+static const mabutrace_tracepoint_t unknown_tracepoint = MABUTRACE_TRACEPOINT_INIT("Unknown Tracepoint", COLOR_UNDEFINED, 0);
+
+static const mabutrace_tracepoint_t* get_tracepoint(const mabutrace_trace_t* trace, uint16_t id) {
+  const mabutrace_tracepoint_t* tracepoint = trace->get_tracepoint(trace->ctx, id);
+  if (!tracepoint)
+    return &unknown_tracepoint;
+  return tracepoint;
+}
+
+static void get_thread_name(const mabutrace_trace_t* trace, uint16_t task_id, uint8_t cpu_id, char* name, size_t name_size) {
+  if (task_id == MABUTRACE_TASK_ID_ISR) {
+    snprintf(name, name_size, "ISR On CPU %d", (int)cpu_id);
+  } else {
+    snprintf(name, name_size, "%s", trace->get_task_name(trace->ctx, task_id));
+  }
+}
+
+// Returns the tracepoint and the value of an entry of one of the integer counter types.
+static int64_t get_counter_value(const entry_header_t* entry_header, uint16_t* out_tracepoint_id) {
+  if (entry_header->type == EVENT_TYPE_COUNTER) {
+    const counter_entry_t* entry = (const counter_entry_t*)entry_header;
+    *out_tracepoint_id = entry->tracepoint_id;
+    return entry->value;
+  }
+  const counter_long_entry_t* entry = (const counter_long_entry_t*)entry_header;
+  *out_tracepoint_id = entry->tracepoint_id;
+  return entry->value;
+}
+
+// Returns the tracepoint and the duration of an entry of one of the duration types.
+static uint64_t get_duration(const entry_header_t* entry_header, uint16_t* out_tracepoint_id) {
+  switch (entry_header->type) {
+    case EVENT_TYPE_DURATION: {
+      const duration_entry_t* entry = (const duration_entry_t*)entry_header;
+      *out_tracepoint_id = entry->tracepoint_id;
+      return entry->time_duration_ticks;
+    }
+    case EVENT_TYPE_DURATION_LONG: {
+      const duration_long_entry_t* entry = (const duration_long_entry_t*)entry_header;
+      *out_tracepoint_id = entry->tracepoint_id;
+      return entry->time_duration_ticks;
+    }
+    default: {
+      const duration_long_long_entry_t* entry = (const duration_long_long_entry_t*)entry_header;
+      *out_tracepoint_id = entry->tracepoint_id;
+      return entry->time_duration_ticks;
+    }
+  }
+}
+
+// Index of a thread of the trace: task IDs first, then the ISRs of each CPU, then the unregistered tasks. There
+// are num_task_ids + MABUTRACE_NUM_CPUS + 1 of them.
+static int get_thread_slot(const mabutrace_trace_t* trace, uint16_t task_id, uint8_t cpu_id) {
+  if (task_id == MABUTRACE_TASK_ID_ISR)
+    return trace->num_task_ids + cpu_id;
+  if (task_id < trace->num_task_ids)
+    return task_id;
+  return trace->num_task_ids + MABUTRACE_NUM_CPUS;
+}
+
+// Scopes of a thread whose begin entry has been written, but not their end yet. Scopes of a thread are nested,
+// so a duration entry ends the innermost open scope if it has the same tracepoint. Otherwise its begin entry is not
+// in the trace (it was overwritten, or scope begin records are off) and it is written as a complete slice.
+#define MAX_OPEN_SCOPES 16
+
+typedef struct {
+  uint8_t depth;
+  uint16_t tracepoint_ids[MAX_OPEN_SCOPES];
+} open_scopes_t;
+
+// Returns false if too many scopes are open, the scope is then written as a complete slice when it ends.
+static bool open_scope(open_scopes_t* scopes, uint16_t tracepoint_id) {
+  if (scopes->depth == MAX_OPEN_SCOPES)
+    return false;
+  scopes->tracepoint_ids[scopes->depth++] = tracepoint_id;
+  return true;
+}
+
+// Returns true if the scope ended was opened by open_scope.
+static bool close_scope(open_scopes_t* scopes, uint16_t tracepoint_id) {
+  if (scopes->depth == 0 || scopes->tracepoint_ids[scopes->depth - 1] != tracepoint_id)
+    return false;
+  scopes->depth--;
+  return true;
+}
+
+static uint64_t ticks_to_ns(const mabutrace_trace_t* trace, uint64_t ticks) {
+  // Split into whole seconds and the remainder so that the multiplication can't overflow.
+  return (ticks / trace->clock_frequency) * 1000000000ull + (ticks % trace->clock_frequency) * 1000000000ull / trace->clock_frequency;
+}
+
+// Scheduling latency of the tasks, derived from the ready events and the task switches. A task waits for a CPU from
+// the ready event that wakes it until it is switched in. A task that is switched out and then switched in again
+// without being made ready in between didn't block, it was preempted and waited from the switch out on.
+#define SCHED_PRIORITY_UNKNOWN 0xFF
+#define SCHED_LATENCY_BUCKETS 16  // Bucket 0 counts latencies below 1 us, bucket i those below 2^i us, the last the rest.
+
+typedef struct {
+  uint64_t ready_since_ns;  // Start of the current wait for a CPU, 0 if the task doesn't wait.
+  bool running;
+  bool woken;  // The wait began with a ready event, otherwise with a switch out, and may turn out to be blocking.
+  uint8_t priority;  // As of the last ready event.
+  uint32_t wakeups;
+  uint64_t latency_sum_ns;
+  uint64_t latency_min_ns;
+  uint64_t latency_max_ns;
+  uint32_t latency_buckets[SCHED_LATENCY_BUCKETS];
+  uint32_t preemptions;
+  uint64_t preempted_ns;
+} task_sched_t;
+
+typedef struct {
+  task_sched_t* tasks;  // Per task ID.
+  // Traces without ready events (older ones, or hosts that don't report them) can't tell preemption from
+  // blocking, so waits are only reported once a ready event has been seen.
+  bool ready_seen;
+} sched_tracker_t;
+
+// Leaves sched->tasks NULL if it can't be allocated.
+static void sched_init(sched_tracker_t* sched, const mabutrace_trace_t* trace) {
+  sched->ready_seen = false;
+  sched->tasks = (task_sched_t*)calloc(trace->num_task_ids, sizeof(task_sched_t));
+  for (int i = 0; sched->tasks && i < trace->num_task_ids; i++) {
+    sched->tasks[i].priority = SCHED_PRIORITY_UNKNOWN;
+  }
+}
+
+static void sched_task_ready(sched_tracker_t* sched, const mabutrace_trace_t* trace, const task_ready_entry_t* entry,
+                             uint64_t time_ns) {
+  sched->ready_seen = true;
+  if (entry->task_id >= trace->num_task_ids)
+    return;
+  task_sched_t* task = &sched->tasks[entry->task_id];
+  task->priority = entry->priority;
+  // Priority changes of a running task or one that already waits don't start a wait.
+  if (task->running || task->woken)
+    return;
+  task->ready_since_ns = time_ns;
+  task->woken = true;
+}
+
+static void sched_task_switched_out(sched_tracker_t* sched, const mabutrace_trace_t* trace, uint16_t task_id, uint64_t time_ns) {
+  if (task_id >= trace->num_task_ids)
+    return;
+  task_sched_t* task = &sched->tasks[task_id];
+  task->running = false;
+  task->ready_since_ns = time_ns;
+  task->woken = false;
+}
+
+// Returns true if the task waited for a CPU since *out_ready_since_ns, because it was woken if *out_woken is set,
+// otherwise because it was preempted.
+static bool sched_task_switched_in(sched_tracker_t* sched, const mabutrace_trace_t* trace, uint16_t task_id,
+                                   uint64_t time_ns, uint64_t* out_ready_since_ns, bool* out_woken) {
+  if (task_id >= trace->num_task_ids)
+    return false;
+  task_sched_t* task = &sched->tasks[task_id];
+  // A wait only starts while the task isn't running, so a wait of a running task means its switch in was lost.
+  bool waited = sched->ready_seen && task->ready_since_ns && !task->running && time_ns >= task->ready_since_ns;
+  *out_ready_since_ns = task->ready_since_ns;
+  *out_woken = task->woken;
+  task->running = true;
+  task->ready_since_ns = 0;
+  task->woken = false;
+  if (!waited)
+    return false;
+  uint64_t wait_ns = time_ns - *out_ready_since_ns;
+  if (*out_woken) {
+    if (task->wakeups == 0 || wait_ns < task->latency_min_ns)
+      task->latency_min_ns = wait_ns;
+    if (wait_ns > task->latency_max_ns)
+      task->latency_max_ns = wait_ns;
+    task->wakeups++;
+    task->latency_sum_ns += wait_ns;
+    uint64_t wait_us = wait_ns / 1000;
+    int bucket = wait_us ? 64 - __builtin_clzll(wait_us) : 0;
+    task->latency_buckets[bucket < SCHED_LATENCY_BUCKETS ? bucket : SCHED_LATENCY_BUCKETS - 1]++;
+  } else {
+    task->preemptions++;
+    task->preempted_ns += wait_ns;
+  }
+  return true;
+}
+
+#define THREAD_NAME_SIZE (MABUTRACE_TASK_NAME_LENGTH + 16)
+
+// Formats the JSON output directly into a buffer, which is handed to process_chunk whenever it is full.
+typedef struct {
+  const mabutrace_trace_t* trace;
+  void* ctx;
+  void (*process_chunk)(void*, const char*, size_t);
+  size_t length;
+  char buffer[JSON_CHUNK_SIZE];
+  // Names of the threads, looked up on first use. Task IDs first, then the ISRs of each CPU, then the
+  // unregistered tasks.
+  char (*thread_names)[THREAD_NAME_SIZE];
+  open_scopes_t* open_scopes;  // Per thread slot.
+} json_writer_t;
+
+static void json_flush(json_writer_t* writer) {
+  if (writer->length)
+    writer->process_chunk(writer->ctx, writer->buffer, writer->length);
+  writer->length = 0;
+}
+
+static void json_append(json_writer_t* writer, const char* data, size_t length) {
+  while (length > sizeof(writer->buffer) - writer->length) {
+    size_t part = sizeof(writer->buffer) - writer->length;
+    memcpy(writer->buffer + writer->length, data, part);
+    writer->length += part;
+    data += part;
+    length -= part;
+    json_flush(writer);
+  }
+  memcpy(writer->buffer + writer->length, data, length);
+  writer->length += length;
+}
+
+#define json_append_literal(writer, literal) json_append(writer, literal, sizeof(literal) - 1)
+
+static void json_append_char(json_writer_t* writer, char c) {
+  if (writer->length == sizeof(writer->buffer))
+    json_flush(writer);
+  writer->buffer[writer->length++] = c;
+}
+
+static void json_append_uint(json_writer_t* writer, uint64_t value) {
+  char digits[20];
+  int count = 0;
   do {
-    entry_header_t* entry_header = (entry_header_t*)(profiler_entries + idx);
-    if(entry_header->type == EVENT_TYPE_NONE) {
-      idx = 0;
-      loopCount++;
+    digits[sizeof(digits) - ++count] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  json_append(writer, digits + sizeof(digits) - count, count);
+}
+
+static void json_append_int(json_writer_t* writer, int64_t value) {
+  if (value < 0) {
+    json_append_char(writer, '-');
+    json_append_uint(writer, -(uint64_t)value);
+  } else {
+    json_append_uint(writer, value);
+  }
+}
+
+// Times are written as microseconds with three decimals.
+static void json_append_us(json_writer_t* writer, uint64_t ns) {
+  json_append_uint(writer, ns / 1000);
+  unsigned int fraction = ns % 1000;
+  char decimals[4] = {'.', (char)('0' + fraction / 100), (char)('0' + fraction / 10 % 10), (char)('0' + fraction % 10)};
+  json_append(writer, decimals, sizeof(decimals));
+}
+
+// Float values are written with six decimals. JSON has no NaN and infinity, they are written as null.
+static void json_append_float(json_writer_t* writer, float value) {
+  if (value != value || value > FLT_MAX || value < -FLT_MAX) {
+    json_append_literal(writer, "null");
+    return;
+  }
+  double magnitude = value;
+  if (magnitude < 0) {
+    json_append_char(writer, '-');
+    magnitude = -magnitude;
+  }
+  // Rounded to microunits first, so that the carry of the decimals goes into the integer part.
+  if (magnitude < 1e12) {
+    uint64_t micro = (uint64_t)(magnitude * 1000000 + 0.5);
+    json_append_uint(writer, micro / 1000000);
+    uint32_t fraction = micro % 1000000;
+    char decimals[7] = {'.'};
+    for (int i = 6; i > 0; i--) {
+      decimals[i] = '0' + fraction % 10;
+      fraction /= 10;
+    }
+    json_append(writer, decimals, sizeof(decimals));
+  } else {
+    // Floats of this size have no decimals, and the exponent keeps the integer part within 20 digits.
+    int exponent = 0;
+    while (magnitude >= 1e18) {
+      magnitude /= 10;
+      exponent++;
+    }
+    json_append_uint(writer, (uint64_t)magnitude);
+    if (exponent) {
+      json_append_char(writer, 'e');
+      json_append_uint(writer, exponent);
+    }
+  }
+}
+
+// Appends a string in quotes, escaping the characters JSON doesn't allow in strings.
+static void json_append_string(json_writer_t* writer, const char* value) {
+  static const char hex_digits[] = "0123456789abcdef";
+  json_append_char(writer, '"');
+  const char* run = value;
+  const char* c = value;
+  for (; *c; c++) {
+    unsigned char ch = *c;
+    if (ch >= 0x20 && ch != '"' && ch != '\\')
+      continue;
+    json_append(writer, run, c - run);
+    if (ch == '"' || ch == '\\') {
+      char escaped[2] = {'\\', (char)ch};
+      json_append(writer, escaped, sizeof(escaped));
+    } else {
+      char escaped[6] = {'\\', 'u', '0', '0', hex_digits[ch >> 4], hex_digits[ch & 0xF]};
+      json_append(writer, escaped, sizeof(escaped));
+    }
+    run = c + 1;
+  }
+  json_append(writer, run, c - run);
+  json_append_char(writer, '"');
+}
+
+// Appends the arguments of an event as members of its args object, which already has one.
+static void json_append_event_args(json_writer_t* writer, const args_entry_t* args) {
+  if (!args)
+    return;
+  size_t offset = 0;
+  event_arg_t arg;
+  while (next_event_arg(args, &offset, &arg)) {
+    json_append_char(writer, ',');
+    json_append_string(writer, get_tracepoint(writer->trace, arg.key_id)->name);
+    json_append_char(writer, ':');
+    if (arg.type == MABUTRACE_ARG_INT)
+      json_append_int(writer, arg.int_value);
+    else if (arg.type == MABUTRACE_ARG_FLOAT)
+      json_append_float(writer, arg.float_value);
+    else
+      json_append_string(writer, arg.string_value);
+  }
+}
+
+static const char* get_cached_thread_name(json_writer_t* writer, uint16_t task_id, uint8_t cpu_id) {
+  char* name = writer->thread_names[get_thread_slot(writer->trace, task_id, cpu_id)];
+  if (!name[0])
+    get_thread_name(writer->trace, task_id, cpu_id, name, THREAD_NAME_SIZE);
+  return name;
+}
+
+// Appends the scheduling latency of each task that waited for a CPU to otherData: how often it was woken, how long
+// it then took until it ran, as a histogram with power of two buckets, and how long it was preempted.
+static void json_append_sched_stats(json_writer_t* writer, const sched_tracker_t* sched) {
+  bool first = true;
+  for (int i = 0; i < writer->trace->num_task_ids; i++) {
+    const task_sched_t* task = &sched->tasks[i];
+    if (!task->wakeups && !task->preemptions)
       continue;
+    if (first)
+      json_append_literal(writer, ",\n    \"scheduling\": [\n");
+    else
+      json_append_literal(writer, ",\n");
+    first = false;
+    json_append_literal(writer, "      {\"task\":");
+    json_append_string(writer, get_cached_thread_name(writer, i, 0));
+    if (task->priority != SCHED_PRIORITY_UNKNOWN) {
+      json_append_literal(writer, ",\"priority\":");
+      json_append_uint(writer, task->priority);
+    }
+    json_append_literal(writer, ",\"wakeups\":");
+    json_append_uint(writer, task->wakeups);
+    if (task->wakeups) {
+      json_append_literal(writer, ",\"latency_min_us\":");
+      json_append_us(writer, task->latency_min_ns);
+      json_append_literal(writer, ",\"latency_mean_us\":");
+      json_append_us(writer, task->latency_sum_ns / task->wakeups);
+      json_append_literal(writer, ",\"latency_max_us\":");
+      json_append_us(writer, task->latency_max_ns);
+      // Keyed by the upper bound of each bucket that isn't empty.
+      json_append_literal(writer, ",\"latency_histogram_us\":{");
+      bool first_bucket = true;
+      for (int bucket = 0; bucket < SCHED_LATENCY_BUCKETS; bucket++) {
+        if (!task->latency_buckets[bucket])
+          continue;
+        if (!first_bucket)
+          json_append_char(writer, ',');
+        first_bucket = false;
+        if (bucket < SCHED_LATENCY_BUCKETS - 1) {
+          json_append_literal(writer, "\"<");
+          json_append_uint(writer, 1u << bucket);
+        } else {
+          json_append_literal(writer, "\">=");
+          json_append_uint(writer, 1u << (bucket - 1));
+        }
+        json_append_literal(writer, "\":");
+        json_append_uint(writer, task->latency_buckets[bucket]);
+      }
+      json_append_char(writer, '}');
     }
+    json_append_literal(writer, ",\"preemptions\":");
+    json_append_uint(writer, task->preemptions);
+    json_append_literal(writer, ",\"preempted_us\":");
+    json_append_us(writer, task->preempted_ns);
+    json_append_char(writer, '}');
+  }
+  if (!first)
+    json_append_literal(writer, "\n    ]");
+}
+
+esp_err_t mabutrace_write_json(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  esp_err_t res = ESP_OK;
+  if (trace->num_rings > MABUTRACE_NUM_CPUS)
+    return ESP_ERR_NOT_SUPPORTED;
+  // Threads that have events, to emit their names as metadata once all events are written.
+  bool* task_seen = (bool*)calloc(trace->num_task_ids, sizeof(bool));
+  // Too large for the stack of the HTTP server task.
+  json_writer_t* writer = (json_writer_t*)malloc(sizeof(json_writer_t));
+  char (*thread_names)[THREAD_NAME_SIZE] = (char (*)[THREAD_NAME_SIZE])calloc(trace->num_task_ids + MABUTRACE_NUM_CPUS + 1, THREAD_NAME_SIZE);
+  open_scopes_t* open_scopes = (open_scopes_t*)calloc(trace->num_task_ids + MABUTRACE_NUM_CPUS + 1, sizeof(open_scopes_t));
+  sched_tracker_t sched;
+  sched_init(&sched, trace);
+  if (!task_seen || !writer || !thread_names || !open_scopes || !sched.tasks) {
+    res = ESP_ERR_NO_MEM;
+    goto cleanup;
+  }
+  writer->trace = trace;
+  writer->ctx = ctx;
+  writer->process_chunk = process_chunk;
+  writer->length = 0;
+  writer->thread_names = thread_names;
+  writer->open_scopes = open_scopes;
+  bool isr_seen[MABUTRACE_NUM_CPUS] = {0};
+  bool unregistered_seen = false;
+  bool cpu_seen[MABUTRACE_NUM_CPUS] = {0};
 
-    const char* threadName = pcTaskGetName(task_handles[entry_header->task_id]);
-    if(entry_header->task_id == 0) {
-      threadName = (entry_header->cpu_id == 0) ? "ISR On CPU 0" : "ISR On CPU 1";
+  ring_cursor_t cursors[MABUTRACE_NUM_CPUS];
+  for (int i = 0; i < trace->num_rings; i++) {
+    cursor_init(&cursors[i], &trace->rings[i], i);
+  }
+
+  json_append(writer, json_header, strlen(json_header));
+
+  export_progress_t progress;
+  export_progress_init(&progress);
+  ring_cursor_t* cursor;
+  const entry_header_t* entry_header;
+  while ((entry_header = merge_next(cursors, trace->num_rings, &cursor))) {
+    int cpu_id = cursor->cpu_id;
+    uint16_t task_id = cursor->task_id;
+    unsigned int tid;
+    if (task_id == MABUTRACE_TASK_ID_ISR) {
+      tid = ISR_TID_BASE + cpu_id;
+      isr_seen[cpu_id] = true;
+    } else {
+      tid = task_id;
+      if (task_id < trace->num_task_ids)
+        task_seen[task_id] = true;
+      else
+        unregistered_seen = true;
     }
-    size_t entry_size;
+    uint64_t time_stamp_ns = ticks_to_ns(trace, cursor->entry_time);
     switch (entry_header->type) {
-      case EVENT_TYPE_DURATION: {
-        duration_entry_t* entry = (duration_entry_t*)entry_header;
-        entry_size = sizeof(duration_entry_t);
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":\"%s\",\"ts\":%llu,\"dur\":%llu,\"args\":{\"cpu\":%d}},\n",
-                              entry->name, threadName, (unsigned long long int)entry->time_stamp_begin_microseconds, (unsigned long long int)entry->time_duration_microseconds, (int)entry_header->cpu_id);
+      case EVENT_TYPE_DURATION:
+      case EVENT_TYPE_DURATION_LONG:
+      case EVENT_TYPE_DURATION_LONG_LONG: {
+        uint16_t tracepoint_id;
+        uint64_t duration = get_duration(entry_header, &tracepoint_id);
+        if (close_scope(&writer->open_scopes[get_thread_slot(trace, task_id, cpu_id)], tracepoint_id)) {
+          json_append_literal(writer, "    {\"ph\":\"E\",\"pid\":1,\"tid\":");
+          json_append_uint(writer, tid);
+          json_append_literal(writer, ",\"ts\":");
+          json_append_us(writer, time_stamp_ns);
+          json_append_literal(writer, "},\n");
+          break;
+        }
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, tracepoint_id);
+        uint64_t begin_ns = ticks_to_ns(trace, cursor->entry_time - duration);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"ph\":\"X\",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, begin_ns);
+        json_append_literal(writer, ",\"dur\":");
+        json_append_us(writer, time_stamp_ns - begin_ns);
+        json_append_literal(writer, ",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_char(writer, '}');
+        json_append(writer, colorNameLookup[tracepoint->color], strlen(colorNameLookup[tracepoint->color]));
+        json_append_literal(writer, "},\n");
         break;
       }
-      case EVENT_TYPE_DURATION_COLORED: {
-        duration_colored_entry_t* entry = (duration_colored_entry_t*)entry_header;
-        entry_size = sizeof(duration_colored_entry_t);
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":\"%s\",\"ts\":%llu,\"dur\":%llu,\"args\":{\"cpu\":%d}%s},\n",
-                              entry->name, threadName, (unsigned long long int)entry->time_stamp_begin_microseconds, (unsigned long long int)entry->time_duration_microseconds, (int)entry_header->cpu_id, colorNameLookup[entry->color]);
+      case EVENT_TYPE_SCOPE_BEGIN: {
+        const scope_begin_entry_t* entry = (const scope_begin_entry_t*)entry_header;
+        if (!open_scope(&writer->open_scopes[get_thread_slot(trace, task_id, cpu_id)], entry->tracepoint_id))
+          break;
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, entry->tracepoint_id);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"ph\":\"B\",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, ",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_event_args(writer, cursor_args(cursor, entry_header));
+        json_append_char(writer, '}');
+        json_append(writer, colorNameLookup[tracepoint->color], strlen(colorNameLookup[tracepoint->color]));
+        json_append_literal(writer, "},\n");
         break;
       }
-      case EVENT_TYPE_INSTANT_COLORED: {
-        instant_colored_entry_t* entry = (instant_colored_entry_t*)entry_header;
-        entry_size = sizeof(instant_colored_entry_t);
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"%s\",\"ph\":\"i\",\"pid\":1,\"tid\":\"%s\",\"ts\":%llu,\"s\":\"p\",\"args\":{\"cpu\":%d}%s},\n",
-                              entry->name, threadName, (unsigned long long int)entry->time_stamp_begin_microseconds, (int)entry_header->cpu_id, colorNameLookup[entry->color]);
+      case EVENT_TYPE_INSTANT: {
+        const instant_entry_t* entry = (const instant_entry_t*)entry_header;
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, entry->tracepoint_id);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"ph\":\"i\",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, ",\"s\":\"p\",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_event_args(writer, cursor_args(cursor, entry_header));
+        json_append_char(writer, '}');
+        json_append(writer, colorNameLookup[tracepoint->color], strlen(colorNameLookup[tracepoint->color]));
+        json_append_literal(writer, "},\n");
         break;
       }
-      case EVENT_TYPE_COUNTER: {
-        counter_entry_t* entry = (counter_entry_t*)entry_header;
-        entry_size = sizeof(counter_entry_t);
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":\"%s\",\"ts\":%llu,\"args\":{\"value\":%d}},\n",
-                              entry->name, threadName, (unsigned long long int)entry->time_stamp_begin_microseconds, (int)entry->value);
+      case EVENT_TYPE_COUNTER:
+      case EVENT_TYPE_COUNTER_LONG:
+      case EVENT_TYPE_COUNTER_FLOAT: {
+        uint16_t tracepoint_id;
+        int64_t value = 0;
+        if (entry_header->type == EVENT_TYPE_COUNTER_FLOAT)
+          tracepoint_id = ((const counter_float_entry_t*)entry_header)->tracepoint_id;
+        else
+          value = get_counter_value(entry_header, &tracepoint_id);
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, tracepoint_id);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"ph\":\"C\",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, ",\"args\":{\"value\":");
+        if (entry_header->type == EVENT_TYPE_COUNTER_FLOAT)
+          json_append_float(writer, ((const counter_float_entry_t*)entry_header)->value);
+        else
+          json_append_int(writer, value);
+        json_append_literal(writer, "}},\n");
         break;
       }
       case EVENT_TYPE_LINK: {
-        link_entry_t* entry = (link_entry_t*)entry_header;
-        entry_size = sizeof(link_entry_t);
-        char phase = (entry->link_type == LINK_TYPE_IN) ? 'f' : 's';
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"flow\",\"cat\":\"flow\",\"id\":%u,\"ph\":\"%c\",\"pid\":1,\"tid\":\"%s\",\"ts\":%llu},\n",
-                              (unsigned int)entry->link, phase, threadName, (unsigned long long int)entry->time_stamp_begin_microseconds);
+        const link_entry_t* entry = (const link_entry_t*)entry_header;
+        json_append_literal(writer, "    {\"name\":\"flow\",\"cat\":\"flow\",\"id\":");
+        json_append_uint(writer, entry->link);
+        json_append_literal(writer, ",\"ph\":");
+        if (entry->link_type == LINK_TYPE_IN)
+          json_append_literal(writer, "\"f\"");
+        else
+          json_append_literal(writer, "\"s\"");
+        json_append_literal(writer, ",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, ticks_to_ns(trace, cursor->entry_time - entry->time_offset_ticks));
+        json_append_literal(writer, "},\n");
+        break;
+      }
+      case EVENT_TYPE_ASYNC_BEGIN:
+      case EVENT_TYPE_ASYNC_END: {
+        const async_entry_t* entry = (const async_entry_t*)entry_header;
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, entry->tracepoint_id);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"cat\":\"async\",\"id\":");
+        json_append_uint(writer, entry->async_id);
+        if (entry_header->type == EVENT_TYPE_ASYNC_BEGIN)
+          json_append_literal(writer, ",\"ph\":\"b\"");
+        else
+          json_append_literal(writer, ",\"ph\":\"e\"");
+        json_append_literal(writer, ",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, ",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_char(writer, '}');
+        json_append(writer, colorNameLookup[tracepoint->color], strlen(colorNameLookup[tracepoint->color]));
+        json_append_literal(writer, "},\n");
+        break;
+      }
+      case EVENT_TYPE_HEAP_ALLOC:
+      case EVENT_TYPE_HEAP_FREE:
+      case EVENT_TYPE_HEAP_ALLOC_FAILED: {
+        static const char* heap_event_names[] = {HEAP_EVENT_NAMES};
+        const heap_entry_t* entry = (const heap_entry_t*)entry_header;
+        json_append_literal(writer, "    {\"name\":\"");
+        json_append(writer, heap_event_names[entry_header->type - EVENT_TYPE_HEAP_ALLOC], strlen(heap_event_names[entry_header->type - EVENT_TYPE_HEAP_ALLOC]));
+        json_append_literal(writer, "\",\"cat\":\"heap\",\"ph\":\"i\",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, ",\"s\":\"t\",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_literal(writer, ",\"size\":");
+        json_append_uint(writer, entry->size);
+        char caller[16];
+        snprintf(caller, sizeof(caller), "0x%08x", (unsigned)entry->caller);
+        json_append_literal(writer, ",\"caller\":");
+        json_append_string(writer, caller);
+        json_append_literal(writer, ",\"latency_us\":");
+        json_append_us(writer, ticks_to_ns(trace, entry->latency_ticks));
+        json_append_literal(writer, "}},\n");
         break;
       }
+      case EVENT_TYPE_QUEUE_SEND:
+      case EVENT_TYPE_QUEUE_RECEIVE:
+      case EVENT_TYPE_QUEUE_SEND_FAILED:
+      case EVENT_TYPE_QUEUE_RECEIVE_FAILED: {
+        // A slice covering the time the task was blocked on the queue, or an instant if it wasn't.
+        static const char* queue_operation_names[] = {QUEUE_OPERATION_NAMES};
+        const queue_entry_t* entry = (const queue_entry_t*)entry_header;
+        const char* operation = queue_operation_names[entry_header->type - EVENT_TYPE_QUEUE_SEND];
+        const mabutrace_tracepoint_t* tracepoint = get_tracepoint(trace, entry->tracepoint_id);
+        uint64_t begin_ns = ticks_to_ns(trace, cursor->entry_time - entry->blocked_ticks);
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, tracepoint->name);
+        json_append_literal(writer, ",\"cat\":\"queue\",\"ph\":");
+        if (entry->blocked_ticks)
+          json_append_literal(writer, "\"X\"");
+        else
+          json_append_literal(writer, "\"i\",\"s\":\"t\"");
+        json_append_literal(writer, ",\"pid\":1,\"tid\":");
+        json_append_uint(writer, tid);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, begin_ns);
+        if (entry->blocked_ticks) {
+          json_append_literal(writer, ",\"dur\":");
+          json_append_us(writer, time_stamp_ns - begin_ns);
+        }
+        json_append_literal(writer, ",\"args\":{\"cpu\":");
+        json_append_uint(writer, cpu_id);
+        json_append_literal(writer, ",\"op\":\"");
+        json_append(writer, operation, strlen(operation));
+        json_append_char(writer, '"');
+        if (entry->fill != MABUTRACE_QUEUE_FILL_NONE) {
+          json_append_literal(writer, ",\"fill\":");
+          json_append_uint(writer, entry->fill);
+        }
+        json_append_literal(writer, "}},\n");
+        if (entry->item) {
+          json_append_literal(writer, "    {\"name\":\"flow\",\"cat\":\"flow\",\"id\":");
+          json_append_uint(writer, QUEUE_FLOW_ID(entry->tracepoint_id, entry->item));
+          if (entry_header->type == EVENT_TYPE_QUEUE_RECEIVE)
+            json_append_literal(writer, ",\"ph\":\"f\"");
+          else
+            json_append_literal(writer, ",\"ph\":\"s\"");
+          json_append_literal(writer, ",\"pid\":1,\"tid\":");
+          json_append_uint(writer, tid);
+          json_append_literal(writer, ",\"ts\":");
+          json_append_us(writer, begin_ns);
+          json_append_literal(writer, "},\n");
+        }
+        if (entry->fill != MABUTRACE_QUEUE_FILL_NONE) {
+          json_append_literal(writer, "    {\"name\":");
+          json_append_string(writer, tracepoint->name);
+          json_append_literal(writer, ",\"ph\":\"C\",\"pid\":1,\"tid\":");
+          json_append_uint(writer, tid);
+          json_append_literal(writer, ",\"ts\":");
+          json_append_us(writer, time_stamp_ns);
+          json_append_literal(writer, ",\"args\":{\"fill\":");
+          json_append_uint(writer, entry->fill);
+          json_append_literal(writer, "}},\n");
+        }
+        break;
+      }
+      case EVENT_TYPE_TASK_READY:
+        sched_task_ready(&sched, trace, (const task_ready_entry_t*)entry_header, time_stamp_ns);
+        break;
       case EVENT_TYPE_TASK_SWITCH_IN:
       case EVENT_TYPE_TASK_SWITCH_OUT: {
-        task_switch_entry_t* entry = (task_switch_entry_t*)entry_header;
-        entry_size = sizeof(task_switch_entry_t);
-        char phase = (entry_header->type == EVENT_TYPE_TASK_SWITCH_IN) ? 'B' : 'E';
-        char* cpu_name = (entry_header->cpu_id == 0) ? "CPU 0" : "CPU 1";
-        // Using the CPU name as tid since this doesn't track a particular task but task execution on a particular CPU core
-        lineLength = snprintf(buf, sizeof(buf), "    {\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"%c\",\"pid\":2,\"tid\":\"%s\",\"ts\":%llu},\n",
-                             threadName, phase, cpu_name, (unsigned long long int)entry->time_stamp);
+        cpu_seen[cpu_id] = true;
+        uint64_t ready_since_ns;
+        bool woken;
+        if (entry_header->type == EVENT_TYPE_TASK_SWITCH_OUT) {
+          sched_task_switched_out(&sched, trace, task_id, time_stamp_ns);
+        } else if (sched_task_switched_in(&sched, trace, task_id, time_stamp_ns, &ready_since_ns, &woken)) {
+          // The wait is shown on the track of the task, where it ends right before the task's next events.
+          static const char* sched_wait_names[] = {SCHED_WAIT_NAMES};
+          json_append_literal(writer, "    {\"name\":\"");
+          json_append(writer, sched_wait_names[woken], strlen(sched_wait_names[woken]));
+          json_append_literal(writer, "\",\"cat\":\"sched\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+          json_append_uint(writer, tid);
+          json_append_literal(writer, ",\"ts\":");
+          json_append_us(writer, ready_since_ns);
+          json_append_literal(writer, ",\"dur\":");
+          json_append_us(writer, time_stamp_ns - ready_since_ns);
+          json_append_literal(writer, ",\"args\":{\"cpu\":");
+          json_append_uint(writer, cpu_id);
+          if (sched.tasks[task_id].priority != SCHED_PRIORITY_UNKNOWN) {
+            json_append_literal(writer, ",\"priority\":");
+            json_append_uint(writer, sched.tasks[task_id].priority);
+          }
+          json_append_literal(writer, "}},\n");
+        }
+        json_append_literal(writer, "    {\"name\":");
+        json_append_string(writer, get_cached_thread_name(writer, task_id, cpu_id));
+        json_append_literal(writer, ",\"cat\":\"task\",\"ph\":");
+        if (entry_header->type == EVENT_TYPE_TASK_SWITCH_IN)
+          json_append_literal(writer, "\"B\"");
+        else
+          json_append_literal(writer, "\"E\"");
+        // Using the CPU as tid since this doesn't track a particular task but task execution on a particular CPU core
+        json_append_literal(writer, ",\"pid\":2,\"tid\":");
+        json_append_uint(writer, cpu_id);
+        json_append_literal(writer, ",\"ts\":");
+        json_append_us(writer, time_stamp_ns);
+        json_append_literal(writer, "},\n");
         break;
       }
       case EVENT_TYPE_NONE:
@@ -141,26 +1033,1054 @@ esp_err_t get_json_trace_chunked(void* ctx, void (*process_chunk)(void*, const c
         break;
       }
     }
-    assert(lineLength >= 0 && lineLength < sizeof(buf) && "Failed to correctly write line.");
-    process_chunk(ctx, buf, lineLength);
 
-    // advance idx
-    idx += entry_size;
-    if(idx >= PROFILER_BUFFER_SIZE_IN_BYTES) {
-      loopCount++;
-      idx = 0;
+    cursor_consume(cursor, entry_header);
+    export_progress(trace, &progress);
+  }
+
+  // Thread names, taken from the snapshots of the task registry so that deleted tasks keep their name.
+  int num_task_ids = trace->num_task_ids;
+  for (int i = 0; i < num_task_ids + MABUTRACE_NUM_CPUS * 2 + 1; i++) {
+    char cpu_name[16];
+    const char* thread_name;
+    int pid = 1;
+    unsigned int tid;
+    if (i < num_task_ids) {
+      if (!task_seen[i])
+        continue;
+      tid = i;
+      thread_name = get_cached_thread_name(writer, i, 0);
+    } else if (i < num_task_ids + MABUTRACE_NUM_CPUS) {
+      int cpu_id = i - num_task_ids;
+      if (!isr_seen[cpu_id])
+        continue;
+      tid = ISR_TID_BASE + cpu_id;
+      thread_name = get_cached_thread_name(writer, MABUTRACE_TASK_ID_ISR, cpu_id);
+    } else if (i < num_task_ids + MABUTRACE_NUM_CPUS * 2) {
+      int cpu_id = i - num_task_ids - MABUTRACE_NUM_CPUS;
+      if (!cpu_seen[cpu_id])
+        continue;
+      pid = 2;
+      tid = cpu_id;
+      snprintf(cpu_name, sizeof(cpu_name), "CPU %d", cpu_id);
+      thread_name = cpu_name;
+    } else {
+      if (!unregistered_seen)
+        continue;
+      tid = MABUTRACE_TASK_ID_UNREGISTERED;
+      thread_name = get_cached_thread_name(writer, MABUTRACE_TASK_ID_UNREGISTERED, 0);
+    }
+    json_append_literal(writer, "    {\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+    json_append_uint(writer, pid);
+    json_append_literal(writer, ",\"tid\":");
+    json_append_uint(writer, tid);
+    json_append_literal(writer, ",\"args\":{\"name\":");
+    json_append_string(writer, thread_name);
+    json_append_literal(writer, "}},\n");
+  }
+
+  json_append(writer, json_footer, strlen(json_footer));
+  json_append_sched_stats(writer, &sched);
+  json_append_literal(writer, "\n  }\n}");
+  json_flush(writer);
+  export_progress_end(trace, &progress);
+
+  cleanup:
+  free(thread_names);
+  free(open_scopes);
+  free(sched.tasks);
+  free(writer);
+  free(task_seen);
+  return res;
+}
+
+// Perfetto protobuf trace (protos/perfetto/trace/trace.proto in the Perfetto repository), written without a
+// protobuf library. Every packet is assembled in a pb_message_t and written as a TracePacket field of the Trace
+// message. Nested messages reserve two bytes for their length, which is filled in as a redundant varint once the
+// message is complete.
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_FIXED64 1
+#define PB_WIRE_LENGTH 2
+
+#define PB_TRACE_PACKET 1
+#define PB_PACKET_FTRACE_EVENTS 1
+#define PB_PACKET_TIMESTAMP 8
+#define PB_PACKET_SEQUENCE_ID 10
+#define PB_PACKET_TRACK_EVENT 11
+#define PB_PACKET_INTERNED_DATA 12
+#define PB_PACKET_SEQUENCE_FLAGS 13
+#define PB_PACKET_TRACK_DESCRIPTOR 60
+#define PB_TRACK_EVENT_DEBUG_ANNOTATIONS 4
+#define PB_TRACK_EVENT_TYPE 9
+#define PB_TRACK_EVENT_NAME_IID 10
+#define PB_TRACK_EVENT_TRACK_UUID 11
+#define PB_TRACK_EVENT_COUNTER_VALUE 30
+#define PB_TRACK_EVENT_DOUBLE_COUNTER_VALUE 44
+#define PB_TRACK_EVENT_FLOW_IDS 47
+#define PB_DEBUG_ANNOTATION_INT_VALUE 4
+#define PB_DEBUG_ANNOTATION_DOUBLE_VALUE 5
+#define PB_DEBUG_ANNOTATION_STRING_VALUE 6
+#define PB_DEBUG_ANNOTATION_POINTER_VALUE 7
+#define PB_DEBUG_ANNOTATION_NAME 10
+#define PB_INTERNED_EVENT_NAMES 2
+#define PB_EVENT_NAME_IID 1
+#define PB_EVENT_NAME_NAME 2
+#define PB_TRACK_UUID 1
+#define PB_TRACK_NAME 2
+#define PB_TRACK_PROCESS 3
+#define PB_TRACK_THREAD 4
+#define PB_TRACK_PARENT_UUID 5
+#define PB_TRACK_COUNTER 8
+#define PB_PROCESS_PID 1
+#define PB_PROCESS_NAME 6
+#define PB_THREAD_PID 1
+#define PB_THREAD_TID 2
+#define PB_THREAD_NAME 5
+#define PB_FTRACE_BUNDLE_CPU 1
+#define PB_FTRACE_BUNDLE_EVENT 2
+#define PB_FTRACE_TIMESTAMP 1
+#define PB_FTRACE_PID 2
+#define PB_FTRACE_SCHED_SWITCH 4
+#define PB_SCHED_SWITCH_PREV_COMM 1
+#define PB_SCHED_SWITCH_PREV_PID 2
+#define PB_SCHED_SWITCH_PREV_STATE 4
+#define PB_SCHED_SWITCH_NEXT_COMM 5
+#define PB_SCHED_SWITCH_NEXT_PID 6
+
+#define TRACK_EVENT_SLICE_BEGIN 1
+#define TRACK_EVENT_SLICE_END 2
+#define TRACK_EVENT_INSTANT 3
+#define TRACK_EVENT_COUNTER 4
+#define SEQ_INCREMENTAL_STATE_CLEARED 1
+#define SEQ_NEEDS_INCREMENTAL_STATE 2
+// FreeRTOS doesn't tell whether a task that was switched out blocked or was preempted, it is shown as sleeping.
+#define SCHED_STATE_SLEEPING 1
+
+#define PERFETTO_MAX_MESSAGE_SIZE 1024
+#define PERFETTO_MAX_STRING_LENGTH 64  // Longer names are cut, so that every packet fits into a message.
+#define PERFETTO_MAX_SCHED_SWITCH_SIZE (2 * PERFETTO_MAX_STRING_LENGTH + 64)
+#define PERFETTO_MAX_DEBUG_ANNOTATION_SIZE (PERFETTO_MAX_STRING_LENGTH + MABUTRACE_MAX_ARG_STRING_LENGTH + 32)
+#define PERFETTO_SEQUENCE_ID 1  // All track events are written by one sequence, which owns the interned names.
+#define PERFETTO_PROCESS_PID 1
+#define PERFETTO_PROCESS_TRACK_UUID 1
+#define PERFETTO_THREAD_TRACK_UUID(tid) (2 + 2 * (uint64_t)(tid))
+#define PERFETTO_COUNTER_TRACK_UUID(tracepoint_id) (3 + 2 * (uint64_t)(tracepoint_id))
+// Every async slice has a track, so that slices which overlap without nesting are shown correctly.
+#define PERFETTO_ASYNC_TRACK_UUID(async_id) ((1ull << 32) + (uint64_t)(async_id))
+// Names of track events, interned with ID + 1. Tracepoint IDs are 16 bit, the names of events without a tracepoint
+// follow them.
+#define PERFETTO_NAME_FLOW 0x10000
+#define PERFETTO_NAME_HEAP(type) (0x10001 + (type) - EVENT_TYPE_HEAP_ALLOC)
+#define PERFETTO_NAME_SCHED_WAIT(woken) (0x10004 + (woken))
+#define PERFETTO_NUM_FIXED_NAMES 6
+#define PERFETTO_NAME_NONE UINT32_MAX
+
+typedef struct {
+  uint8_t data[PERFETTO_MAX_MESSAGE_SIZE];
+  size_t length;
+} pb_message_t;
+
+static size_t pb_encode_varint(uint8_t* out, uint64_t value) {
+  size_t length = 0;
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    out[length++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return length;
+}
+
+static void pb_write_tag(pb_message_t* message, uint32_t field, uint8_t wire_type) {
+  assert(message->length + 16 <= sizeof(message->data) && "Protobuf message too large.");
+  message->length += pb_encode_varint(message->data + message->length, (field << 3) | wire_type);
+}
+
+static void pb_write_uint(pb_message_t* message, uint32_t field, uint64_t value) {
+  pb_write_tag(message, field, PB_WIRE_VARINT);
+  message->length += pb_encode_varint(message->data + message->length, value);
+}
+
+static void pb_write_fixed64(pb_message_t* message, uint32_t field, uint64_t value) {
+  pb_write_tag(message, field, PB_WIRE_FIXED64);
+  for (int i = 0; i < 8; i++) {
+    message->data[message->length++] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static void pb_write_string(pb_message_t* message, uint32_t field, const char* value) {
+  size_t length = strnlen(value, PERFETTO_MAX_STRING_LENGTH);
+  pb_write_tag(message, field, PB_WIRE_LENGTH);
+  message->length += pb_encode_varint(message->data + message->length, length);
+  assert(message->length + length <= sizeof(message->data) && "Protobuf message too large.");
+  memcpy(message->data + message->length, value, length);
+  message->length += length;
+}
+
+// Starts a nested message, returns the offset of its content for pb_end_nested.
+static size_t pb_begin_nested(pb_message_t* message, uint32_t field) {
+  pb_write_tag(message, field, PB_WIRE_LENGTH);
+  message->length += 2;
+  return message->length;
+}
+
+static void pb_end_nested(pb_message_t* message, size_t begin) {
+  size_t length = message->length - begin;
+  message->data[begin - 2] = (length & 0x7F) | 0x80;
+  message->data[begin - 1] = length >> 7;
+}
+
+typedef struct {
+  const mabutrace_trace_t* trace;
+  void* ctx;
+  void (*process_chunk)(void*, const char*, size_t);
+  bool* name_interned;  // Per tracepoint ID.
+  bool* counter_described;  // Per tracepoint ID, whether the counter track has been written.
+  bool* task_described;  // Per task ID, whether the thread track has been written.
+  open_scopes_t* open_scopes;  // Per thread slot.
+  bool isr_described[MABUTRACE_NUM_CPUS];
+  bool unregistered_described;
+  bool fixed_name_interned[PERFETTO_NUM_FIXED_NAMES];
+  int32_t sched_task_id[MABUTRACE_NUM_CPUS];  // Task running on each CPU according to the sched events, -1 if none.
+  sched_tracker_t sched;
+  pb_message_t packet;
+  pb_message_t sched_bundles[MABUTRACE_NUM_CPUS];  // Pending sched events of each CPU.
+} perfetto_writer_t;
+
+static void write_packet(perfetto_writer_t* writer, const pb_message_t* packet) {
+  uint8_t header[1 + 10];
+  header[0] = (PB_TRACE_PACKET << 3) | PB_WIRE_LENGTH;
+  size_t header_length = 1 + pb_encode_varint(header + 1, packet->length);
+  writer->process_chunk(writer->ctx, (const char*)header, header_length);
+  writer->process_chunk(writer->ctx, (const char*)packet->data, packet->length);
+}
+
+static uint32_t get_tid(uint16_t task_id, uint8_t cpu_id) {
+  return task_id == MABUTRACE_TASK_ID_ISR ? ISR_TID_BASE + cpu_id : task_id;
+}
+
+// Writes the descriptor of the track of an async slice, before its begin. The end refers to the same track.
+static uint64_t describe_async_track(perfetto_writer_t* writer, uint32_t async_id, uint16_t tracepoint_id) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  size_t track = pb_begin_nested(packet, PB_PACKET_TRACK_DESCRIPTOR);
+  pb_write_uint(packet, PB_TRACK_UUID, PERFETTO_ASYNC_TRACK_UUID(async_id));
+  pb_write_uint(packet, PB_TRACK_PARENT_UUID, PERFETTO_PROCESS_TRACK_UUID);
+  pb_write_string(packet, PB_TRACK_NAME, get_tracepoint(writer->trace, tracepoint_id)->name);
+  pb_end_nested(packet, track);
+  write_packet(writer, packet);
+  return PERFETTO_ASYNC_TRACK_UUID(async_id);
+}
+
+// Returns the track of the events of a task, and writes its descriptor before the first event on it.
+static uint64_t get_thread_track(perfetto_writer_t* writer, uint16_t task_id, uint8_t cpu_id) {
+  uint32_t tid = get_tid(task_id, cpu_id);
+  bool* described;
+  if (task_id == MABUTRACE_TASK_ID_ISR)
+    described = &writer->isr_described[cpu_id];
+  else if (task_id < writer->trace->num_task_ids)
+    described = &writer->task_described[task_id];
+  else
+    described = &writer->unregistered_described;
+  if (!*described) {
+    *described = true;
+    char thread_name[MABUTRACE_TASK_NAME_LENGTH + 16];
+    get_thread_name(writer->trace, task_id, cpu_id, thread_name, sizeof(thread_name));
+    pb_message_t* packet = &writer->packet;
+    packet->length = 0;
+    pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+    size_t track = pb_begin_nested(packet, PB_PACKET_TRACK_DESCRIPTOR);
+    pb_write_uint(packet, PB_TRACK_UUID, PERFETTO_THREAD_TRACK_UUID(tid));
+    size_t thread = pb_begin_nested(packet, PB_TRACK_THREAD);
+    pb_write_uint(packet, PB_THREAD_PID, PERFETTO_PROCESS_PID);
+    pb_write_uint(packet, PB_THREAD_TID, tid);
+    pb_write_string(packet, PB_THREAD_NAME, thread_name);
+    pb_end_nested(packet, thread);
+    pb_end_nested(packet, track);
+    write_packet(writer, packet);
+  }
+  return PERFETTO_THREAD_TRACK_UUID(tid);
+}
+
+// Tracepoint IDs the trace doesn't know are all named "Unknown Tracepoint", like tracepoint ID 0.
+static uint16_t get_known_tracepoint_id(const mabutrace_trace_t* trace, uint16_t tracepoint_id) {
+  return tracepoint_id < trace->num_tracepoint_ids ? tracepoint_id : 0;
+}
+
+// Returns the track of a counter, and writes its descriptor before its first value.
+static uint64_t get_counter_track(perfetto_writer_t* writer, uint16_t tracepoint_id) {
+  if (!writer->counter_described[tracepoint_id]) {
+    writer->counter_described[tracepoint_id] = true;
+    pb_message_t* packet = &writer->packet;
+    packet->length = 0;
+    pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+    size_t track = pb_begin_nested(packet, PB_PACKET_TRACK_DESCRIPTOR);
+    pb_write_uint(packet, PB_TRACK_UUID, PERFETTO_COUNTER_TRACK_UUID(tracepoint_id));
+    pb_write_uint(packet, PB_TRACK_PARENT_UUID, PERFETTO_PROCESS_TRACK_UUID);
+    pb_write_string(packet, PB_TRACK_NAME, get_tracepoint(writer->trace, tracepoint_id)->name);
+    size_t counter = pb_begin_nested(packet, PB_TRACK_COUNTER);
+    pb_end_nested(packet, counter);
+    pb_end_nested(packet, track);
+    write_packet(writer, packet);
+  }
+  return PERFETTO_COUNTER_TRACK_UUID(tracepoint_id);
+}
+
+// Returns the interned ID of a name, adding it to the interned data of the packet if it is new.
+static uint64_t intern_name(perfetto_writer_t* writer, uint32_t name_id) {
+  static const char* fixed_names[PERFETTO_NUM_FIXED_NAMES] = {"flow", HEAP_EVENT_NAMES, SCHED_WAIT_NAMES};
+  bool fixed = name_id >= PERFETTO_NAME_FLOW;
+  bool* interned = fixed ? &writer->fixed_name_interned[name_id - PERFETTO_NAME_FLOW] : &writer->name_interned[name_id];
+  if (!*interned) {
+    *interned = true;
+    pb_message_t* packet = &writer->packet;
+    size_t interned_data = pb_begin_nested(packet, PB_PACKET_INTERNED_DATA);
+    size_t event_name = pb_begin_nested(packet, PB_INTERNED_EVENT_NAMES);
+    pb_write_uint(packet, PB_EVENT_NAME_IID, name_id + 1);
+    pb_write_string(packet, PB_EVENT_NAME_NAME, fixed ? fixed_names[name_id - PERFETTO_NAME_FLOW] : get_tracepoint(writer->trace, name_id)->name);
+    pb_end_nested(packet, event_name);
+    pb_end_nested(packet, interned_data);
+  }
+  return name_id + 1;
+}
+
+// Writes the arguments of an event as debug annotations. Those that don't fit into the packet anymore are dropped.
+static void write_debug_annotations(perfetto_writer_t* writer, const args_entry_t* args) {
+  pb_message_t* packet = &writer->packet;
+  size_t offset = 0;
+  event_arg_t arg;
+  while (next_event_arg(args, &offset, &arg)) {
+    if (packet->length + PERFETTO_MAX_DEBUG_ANNOTATION_SIZE > sizeof(packet->data))
+      break;
+    size_t annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+    pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, get_tracepoint(writer->trace, arg.key_id)->name);
+    if (arg.type == MABUTRACE_ARG_INT) {
+      pb_write_uint(packet, PB_DEBUG_ANNOTATION_INT_VALUE, (uint64_t)arg.int_value);
+    } else if (arg.type == MABUTRACE_ARG_FLOAT) {
+      double value = arg.float_value;
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      pb_write_fixed64(packet, PB_DEBUG_ANNOTATION_DOUBLE_VALUE, bits);
+    } else {
+      pb_write_string(packet, PB_DEBUG_ANNOTATION_STRING_VALUE, arg.string_value);
+    }
+    pb_end_nested(packet, annotation);
+  }
+}
+
+// Writes a track event. The name, the flow ID and the arguments are left out if they are PERFETTO_NAME_NONE, 0 and
+// NULL, the value is only written for counters.
+static void write_track_event(perfetto_writer_t* writer, uint64_t time_ns, uint8_t type, uint64_t track_uuid,
+                              uint32_t name_id, int64_t counter_value, uint64_t flow_id, const args_entry_t* args) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_TIMESTAMP, time_ns);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  uint64_t name_iid = name_id != PERFETTO_NAME_NONE ? intern_name(writer, name_id) : 0;
+  size_t track_event = pb_begin_nested(packet, PB_PACKET_TRACK_EVENT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TYPE, type);
+  pb_write_uint(packet, PB_TRACK_EVENT_TRACK_UUID, track_uuid);
+  if (name_iid)
+    pb_write_uint(packet, PB_TRACK_EVENT_NAME_IID, name_iid);
+  if (type == TRACK_EVENT_COUNTER)
+    pb_write_uint(packet, PB_TRACK_EVENT_COUNTER_VALUE, (uint64_t)counter_value);
+  if (flow_id)
+    pb_write_fixed64(packet, PB_TRACK_EVENT_FLOW_IDS, flow_id);
+  if (args)
+    write_debug_annotations(writer, args);
+  pb_end_nested(packet, track_event);
+  write_packet(writer, packet);
+}
+
+static void write_double_counter_event(perfetto_writer_t* writer, uint64_t time_ns, uint64_t track_uuid, double value) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_TIMESTAMP, time_ns);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  size_t track_event = pb_begin_nested(packet, PB_PACKET_TRACK_EVENT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TYPE, TRACK_EVENT_COUNTER);
+  pb_write_uint(packet, PB_TRACK_EVENT_TRACK_UUID, track_uuid);
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  pb_write_fixed64(packet, PB_TRACK_EVENT_DOUBLE_COUNTER_VALUE, bits);
+  pb_end_nested(packet, track_event);
+  write_packet(writer, packet);
+}
+
+// Writes an allocator call as an instant on the track of the task that made it.
+static void write_heap_event(perfetto_writer_t* writer, uint64_t time_ns, uint64_t track_uuid, const heap_entry_t* entry) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_TIMESTAMP, time_ns);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  uint64_t name_iid = intern_name(writer, PERFETTO_NAME_HEAP(entry->header.type));
+  size_t track_event = pb_begin_nested(packet, PB_PACKET_TRACK_EVENT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TYPE, TRACK_EVENT_INSTANT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TRACK_UUID, track_uuid);
+  pb_write_uint(packet, PB_TRACK_EVENT_NAME_IID, name_iid);
+  size_t annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "size");
+  pb_write_uint(packet, PB_DEBUG_ANNOTATION_INT_VALUE, entry->size);
+  pb_end_nested(packet, annotation);
+  annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "caller");
+  pb_write_uint(packet, PB_DEBUG_ANNOTATION_POINTER_VALUE, entry->caller);
+  pb_end_nested(packet, annotation);
+  annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "latency_us");
+  double latency_us = ticks_to_ns(writer->trace, entry->latency_ticks) / 1000.0;
+  uint64_t bits;
+  memcpy(&bits, &latency_us, sizeof(bits));
+  pb_write_fixed64(packet, PB_DEBUG_ANNOTATION_DOUBLE_VALUE, bits);
+  pb_end_nested(packet, annotation);
+  pb_end_nested(packet, track_event);
+  write_packet(writer, packet);
+}
+
+// Writes a queue operation on the track of the task that did it. The time the task was blocked on the queue is a
+// slice ending with the operation, the operation is an instant if it didn't block.
+static void write_queue_event(perfetto_writer_t* writer, uint64_t begin_ns, uint64_t time_ns, uint64_t track_uuid,
+                              const queue_entry_t* entry) {
+  static const char* queue_operation_names[] = {QUEUE_OPERATION_NAMES};
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_TIMESTAMP, begin_ns);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  uint64_t name_iid = intern_name(writer, get_known_tracepoint_id(writer->trace, entry->tracepoint_id));
+  size_t track_event = pb_begin_nested(packet, PB_PACKET_TRACK_EVENT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TYPE, entry->blocked_ticks ? TRACK_EVENT_SLICE_BEGIN : TRACK_EVENT_INSTANT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TRACK_UUID, track_uuid);
+  pb_write_uint(packet, PB_TRACK_EVENT_NAME_IID, name_iid);
+  if (entry->item)
+    pb_write_fixed64(packet, PB_TRACK_EVENT_FLOW_IDS, QUEUE_FLOW_ID(entry->tracepoint_id, entry->item));
+  size_t annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "op");
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_STRING_VALUE, queue_operation_names[entry->header.type - EVENT_TYPE_QUEUE_SEND]);
+  pb_end_nested(packet, annotation);
+  if (entry->fill != MABUTRACE_QUEUE_FILL_NONE) {
+    annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+    pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "fill");
+    pb_write_uint(packet, PB_DEBUG_ANNOTATION_INT_VALUE, entry->fill);
+    pb_end_nested(packet, annotation);
+  }
+  pb_end_nested(packet, track_event);
+  write_packet(writer, packet);
+  if (entry->blocked_ticks)
+    write_track_event(writer, time_ns, TRACK_EVENT_SLICE_END, track_uuid, PERFETTO_NAME_NONE, 0, 0, NULL);
+}
+
+// Writes the time a task waited for a CPU as a slice on its track, ending when it was switched in.
+static void write_sched_wait(perfetto_writer_t* writer, uint64_t begin_ns, uint64_t time_ns, uint64_t track_uuid,
+                             uint8_t cpu_id, bool woken, uint8_t priority) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_TIMESTAMP, begin_ns);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  uint64_t name_iid = intern_name(writer, PERFETTO_NAME_SCHED_WAIT(woken));
+  size_t track_event = pb_begin_nested(packet, PB_PACKET_TRACK_EVENT);
+  pb_write_uint(packet, PB_TRACK_EVENT_TYPE, TRACK_EVENT_SLICE_BEGIN);
+  pb_write_uint(packet, PB_TRACK_EVENT_TRACK_UUID, track_uuid);
+  pb_write_uint(packet, PB_TRACK_EVENT_NAME_IID, name_iid);
+  size_t annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+  pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "cpu");
+  pb_write_uint(packet, PB_DEBUG_ANNOTATION_INT_VALUE, cpu_id);
+  pb_end_nested(packet, annotation);
+  if (priority != SCHED_PRIORITY_UNKNOWN) {
+    annotation = pb_begin_nested(packet, PB_TRACK_EVENT_DEBUG_ANNOTATIONS);
+    pb_write_string(packet, PB_DEBUG_ANNOTATION_NAME, "priority");
+    pb_write_uint(packet, PB_DEBUG_ANNOTATION_INT_VALUE, priority);
+    pb_end_nested(packet, annotation);
+  }
+  pb_end_nested(packet, track_event);
+  write_packet(writer, packet);
+  write_track_event(writer, time_ns, TRACK_EVENT_SLICE_END, track_uuid, PERFETTO_NAME_NONE, 0, 0, NULL);
+}
+
+static void flush_sched_events(perfetto_writer_t* writer, uint8_t cpu_id) {
+  pb_message_t* bundle = &writer->sched_bundles[cpu_id];
+  if (bundle->length == 0)
+    return;
+  // A packet holding just the bundle, which is written as it is.
+  uint8_t header[1 + 10];
+  header[0] = (PB_PACKET_FTRACE_EVENTS << 3) | PB_WIRE_LENGTH;
+  size_t header_length = 1 + pb_encode_varint(header + 1, bundle->length);
+  uint8_t packet_header[1 + 10];
+  packet_header[0] = (PB_TRACE_PACKET << 3) | PB_WIRE_LENGTH;
+  size_t packet_header_length = 1 + pb_encode_varint(packet_header + 1, header_length + bundle->length);
+  writer->process_chunk(writer->ctx, (const char*)packet_header, packet_header_length);
+  writer->process_chunk(writer->ctx, (const char*)header, header_length);
+  writer->process_chunk(writer->ctx, (const char*)bundle->data, bundle->length);
+  bundle->length = 0;
+}
+
+// Adds a sched_switch event from the task running on a CPU to next_task_id, or to idle if it is -1. Perfetto
+// shows these on its CPU tracks.
+static void add_sched_switch(perfetto_writer_t* writer, uint8_t cpu_id, uint64_t time_ns, int32_t next_task_id) {
+  pb_message_t* bundle = &writer->sched_bundles[cpu_id];
+  if (bundle->length + PERFETTO_MAX_SCHED_SWITCH_SIZE > sizeof(bundle->data))
+    flush_sched_events(writer, cpu_id);
+  if (bundle->length == 0)
+    pb_write_uint(bundle, PB_FTRACE_BUNDLE_CPU, cpu_id);
+  int32_t prev_task_id = writer->sched_task_id[cpu_id];
+  uint32_t prev_tid = prev_task_id >= 0 ? get_tid(prev_task_id, cpu_id) : 0;
+  char thread_name[MABUTRACE_TASK_NAME_LENGTH + 16];
+  size_t event = pb_begin_nested(bundle, PB_FTRACE_BUNDLE_EVENT);
+  pb_write_uint(bundle, PB_FTRACE_TIMESTAMP, time_ns);
+  pb_write_uint(bundle, PB_FTRACE_PID, prev_tid);
+  size_t sched_switch = pb_begin_nested(bundle, PB_FTRACE_SCHED_SWITCH);
+  if (prev_task_id >= 0) {
+    get_thread_name(writer->trace, prev_task_id, cpu_id, thread_name, sizeof(thread_name));
+    pb_write_string(bundle, PB_SCHED_SWITCH_PREV_COMM, thread_name);
+    pb_write_uint(bundle, PB_SCHED_SWITCH_PREV_PID, prev_tid);
+    pb_write_uint(bundle, PB_SCHED_SWITCH_PREV_STATE, SCHED_STATE_SLEEPING);
+  }
+  if (next_task_id >= 0) {
+    get_thread_name(writer->trace, next_task_id, cpu_id, thread_name, sizeof(thread_name));
+    pb_write_string(bundle, PB_SCHED_SWITCH_NEXT_COMM, thread_name);
+    pb_write_uint(bundle, PB_SCHED_SWITCH_NEXT_PID, get_tid(next_task_id, cpu_id));
+  }
+  pb_end_nested(bundle, sched_switch);
+  pb_end_nested(bundle, event);
+  writer->sched_task_id[cpu_id] = next_task_id;
+}
+
+static void write_perfetto_header(perfetto_writer_t* writer) {
+  pb_message_t* packet = &writer->packet;
+  packet->length = 0;
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+  pb_write_uint(packet, PB_PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+  size_t track = pb_begin_nested(packet, PB_PACKET_TRACK_DESCRIPTOR);
+  pb_write_uint(packet, PB_TRACK_UUID, PERFETTO_PROCESS_TRACK_UUID);
+  size_t process = pb_begin_nested(packet, PB_TRACK_PROCESS);
+  pb_write_uint(packet, PB_PROCESS_PID, PERFETTO_PROCESS_PID);
+  pb_write_string(packet, PB_PROCESS_NAME, "Tasks & Interrupts");
+  pb_end_nested(packet, process);
+  pb_end_nested(packet, track);
+  write_packet(writer, packet);
+}
+
+static esp_err_t write_perfetto_entry(perfetto_writer_t* writer, const ring_cursor_t* cursor, const entry_header_t* entry_header) {
+  const mabutrace_trace_t* trace = writer->trace;
+  uint8_t cpu_id = cursor->cpu_id;
+  uint16_t task_id = cursor->task_id;
+  uint64_t time_stamp_ns = ticks_to_ns(trace, cursor->entry_time);
+  switch (entry_header->type) {
+    case EVENT_TYPE_DURATION:
+    case EVENT_TYPE_DURATION_LONG:
+    case EVENT_TYPE_DURATION_LONG_LONG: {
+      uint16_t tracepoint_id;
+      uint64_t duration = get_duration(entry_header, &tracepoint_id);
+      uint64_t track_uuid = get_thread_track(writer, task_id, cpu_id);
+      // Perfetto sorts the events by time, so the begin can be written after the events that it precedes.
+      if (!close_scope(&writer->open_scopes[get_thread_slot(trace, task_id, cpu_id)], tracepoint_id)) {
+        write_track_event(writer, ticks_to_ns(trace, cursor->entry_time - duration), TRACK_EVENT_SLICE_BEGIN, track_uuid,
+                          get_known_tracepoint_id(trace, tracepoint_id), 0, 0, NULL);
+      }
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_SLICE_END, track_uuid, PERFETTO_NAME_NONE, 0, 0, NULL);
+      break;
+    }
+    case EVENT_TYPE_SCOPE_BEGIN: {
+      const scope_begin_entry_t* entry = (const scope_begin_entry_t*)entry_header;
+      if (!open_scope(&writer->open_scopes[get_thread_slot(trace, task_id, cpu_id)], entry->tracepoint_id))
+        break;
+      uint64_t track_uuid = get_thread_track(writer, task_id, cpu_id);
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_SLICE_BEGIN, track_uuid,
+                        get_known_tracepoint_id(trace, entry->tracepoint_id), 0, 0, cursor_args(cursor, entry_header));
+      break;
+    }
+    case EVENT_TYPE_INSTANT: {
+      const instant_entry_t* entry = (const instant_entry_t*)entry_header;
+      uint64_t track_uuid = get_thread_track(writer, task_id, cpu_id);
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_INSTANT, track_uuid,
+                        get_known_tracepoint_id(trace, entry->tracepoint_id), 0, 0, cursor_args(cursor, entry_header));
+      break;
+    }
+    case EVENT_TYPE_COUNTER:
+    case EVENT_TYPE_COUNTER_LONG: {
+      uint16_t tracepoint_id;
+      int64_t value = get_counter_value(entry_header, &tracepoint_id);
+      uint64_t track_uuid = get_counter_track(writer, get_known_tracepoint_id(trace, tracepoint_id));
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_COUNTER, track_uuid, PERFETTO_NAME_NONE, value, 0, NULL);
+      break;
+    }
+    case EVENT_TYPE_COUNTER_FLOAT: {
+      const counter_float_entry_t* entry = (const counter_float_entry_t*)entry_header;
+      uint64_t track_uuid = get_counter_track(writer, get_known_tracepoint_id(trace, entry->tracepoint_id));
+      write_double_counter_event(writer, time_stamp_ns, track_uuid, entry->value);
+      break;
+    }
+    case EVENT_TYPE_LINK: {
+      // Flow IDs must not be 0, both ends of a link share the ID.
+      const link_entry_t* entry = (const link_entry_t*)entry_header;
+      uint64_t track_uuid = get_thread_track(writer, task_id, cpu_id);
+      write_track_event(writer, ticks_to_ns(trace, cursor->entry_time - entry->time_offset_ticks), TRACK_EVENT_INSTANT,
+                        track_uuid, PERFETTO_NAME_FLOW, 0, (uint64_t)entry->link + 1, NULL);
+      break;
+    }
+    case EVENT_TYPE_ASYNC_BEGIN: {
+      const async_entry_t* entry = (const async_entry_t*)entry_header;
+      uint16_t tracepoint_id = get_known_tracepoint_id(trace, entry->tracepoint_id);
+      uint64_t track_uuid = describe_async_track(writer, entry->async_id, tracepoint_id);
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_SLICE_BEGIN, track_uuid, tracepoint_id, 0, 0, NULL);
+      break;
+    }
+    case EVENT_TYPE_ASYNC_END: {
+      // Ends whose begin has been overwritten are dropped by the trace processor.
+      const async_entry_t* entry = (const async_entry_t*)entry_header;
+      write_track_event(writer, time_stamp_ns, TRACK_EVENT_SLICE_END, PERFETTO_ASYNC_TRACK_UUID(entry->async_id),
+                        PERFETTO_NAME_NONE, 0, 0, NULL);
+      break;
+    }
+    case EVENT_TYPE_HEAP_ALLOC:
+    case EVENT_TYPE_HEAP_FREE:
+    case EVENT_TYPE_HEAP_ALLOC_FAILED:
+      write_heap_event(writer, time_stamp_ns, get_thread_track(writer, task_id, cpu_id), (const heap_entry_t*)entry_header);
+      break;
+    case EVENT_TYPE_QUEUE_SEND:
+    case EVENT_TYPE_QUEUE_RECEIVE:
+    case EVENT_TYPE_QUEUE_SEND_FAILED:
+    case EVENT_TYPE_QUEUE_RECEIVE_FAILED: {
+      const queue_entry_t* entry = (const queue_entry_t*)entry_header;
+      uint64_t begin_ns = ticks_to_ns(trace, cursor->entry_time - entry->blocked_ticks);
+      write_queue_event(writer, begin_ns, time_stamp_ns, get_thread_track(writer, task_id, cpu_id), entry);
+      if (entry->fill != MABUTRACE_QUEUE_FILL_NONE) {
+        uint64_t track_uuid = get_counter_track(writer, get_known_tracepoint_id(trace, entry->tracepoint_id));
+        write_track_event(writer, time_stamp_ns, TRACK_EVENT_COUNTER, track_uuid, PERFETTO_NAME_NONE, entry->fill, 0, NULL);
+      }
+      break;
+    }
+    case EVENT_TYPE_TASK_READY:
+      sched_task_ready(&writer->sched, trace, (const task_ready_entry_t*)entry_header, time_stamp_ns);
+      break;
+    case EVENT_TYPE_TASK_SWITCH_IN: {
+      add_sched_switch(writer, cpu_id, time_stamp_ns, task_id);
+      uint64_t ready_since_ns;
+      bool woken;
+      if (sched_task_switched_in(&writer->sched, trace, task_id, time_stamp_ns, &ready_since_ns, &woken)) {
+        write_sched_wait(writer, ready_since_ns, time_stamp_ns, get_thread_track(writer, task_id, cpu_id), cpu_id, woken,
+                         writer->sched.tasks[task_id].priority);
+      }
+      break;
+    }
+    case EVENT_TYPE_TASK_SWITCH_OUT:
+      add_sched_switch(writer, cpu_id, time_stamp_ns, -1);
+      sched_task_switched_out(&writer->sched, trace, task_id, time_stamp_ns);
+      break;
+    case EVENT_TYPE_NONE:
+    default: {
+      int type = entry_header->type;
+      ESP_LOGE(TAG, "invalid event type: %d\n", type);
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t mabutrace_write_perfetto(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  esp_err_t res = ESP_OK;
+  if (trace->num_rings > MABUTRACE_NUM_CPUS)
+    return ESP_ERR_NOT_SUPPORTED;
+  // Too large for the stack of the HTTP server task.
+  perfetto_writer_t* writer = (perfetto_writer_t*)calloc(1, sizeof(perfetto_writer_t));
+  if (!writer)
+    return ESP_ERR_NO_MEM;
+  writer->trace = trace;
+  writer->ctx = ctx;
+  writer->process_chunk = process_chunk;
+  writer->name_interned = (bool*)calloc(trace->num_tracepoint_ids, sizeof(bool));
+  writer->counter_described = (bool*)calloc(trace->num_tracepoint_ids, sizeof(bool));
+  writer->task_described = (bool*)calloc(trace->num_task_ids, sizeof(bool));
+  writer->open_scopes = (open_scopes_t*)calloc(trace->num_task_ids + MABUTRACE_NUM_CPUS + 1, sizeof(open_scopes_t));
+  sched_init(&writer->sched, trace);
+  if (!writer->name_interned || !writer->counter_described || !writer->task_described || !writer->open_scopes ||
+      !writer->sched.tasks) {
+    res = ESP_ERR_NO_MEM;
+    goto cleanup;
+  }
+  for (int i = 0; i < MABUTRACE_NUM_CPUS; i++) {
+    writer->sched_task_id[i] = -1;
+  }
+
+  ring_cursor_t cursors[MABUTRACE_NUM_CPUS];
+  for (int i = 0; i < trace->num_rings; i++) {
+    cursor_init(&cursors[i], &trace->rings[i], i);
+  }
+
+  write_perfetto_header(writer);
+  export_progress_t progress;
+  export_progress_init(&progress);
+  ring_cursor_t* cursor;
+  const entry_header_t* entry_header;
+  while ((entry_header = merge_next(cursors, trace->num_rings, &cursor))) {
+    res = write_perfetto_entry(writer, cursor, entry_header);
+    if (res != ESP_OK)
+      goto cleanup;
+    cursor_consume(cursor, entry_header);
+    export_progress(trace, &progress);
+  }
+  for (int i = 0; i < trace->num_rings; i++) {
+    flush_sched_events(writer, i);
+  }
+  export_progress_end(trace, &progress);
+
+  cleanup:
+  free(writer->name_interned);
+  free(writer->counter_described);
+  free(writer->task_described);
+  free(writer->open_scopes);
+  free(writer->sched.tasks);
+  free(writer);
+  return res;
+}
+
+static void write_record(void* ctx, void (*process_chunk)(void*, const char*, size_t), uint8_t type,
+                         const void* payload, size_t payload_size, const char* name) {
+  size_t name_length = name ? strlen(name) : 0;
+  mabutrace_record_header_t header = {type, (uint32_t)(payload_size + name_length)};
+  process_chunk(ctx, (const char*)&header, sizeof(header));
+  process_chunk(ctx, (const char*)payload, payload_size);
+  if (name_length)
+    process_chunk(ctx, name, name_length);
+}
+
+void mabutrace_write_binary_header(mabutrace_binary_state_t* state, void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  memset(state, 0, sizeof(*state));
+  state->next_tracepoint_id = 1;
+  process_chunk(ctx, MABUTRACE_FORMAT_MAGIC, sizeof(MABUTRACE_FORMAT_MAGIC) - 1);
+  mabutrace_info_record_t info = {0};
+  info.version = MABUTRACE_FORMAT_VERSION;
+  info.num_cpus = MABUTRACE_NUM_CPUS;
+  info.clock_frequency = mabutrace_platform_clock_frequency();
+  for (int type = 0; type < 32; type++) {
+    info.type_sizes[type] = get_type_size(type);
+  }
+  write_record(ctx, process_chunk, MABUTRACE_RECORD_INFO, &info, sizeof(info), NULL);
+}
+
+// Contiguous part of a ring.
+typedef struct {
+  size_t begin;
+  size_t end;
+} ring_segment_t;
+
+// Splits the entries of a ring into the contiguous parts they are stored in, in the order they were written, and
+// marks the tasks they belong to. Returns the number of segments.
+static int get_ring_segments(const profiler_ring_view_t* ring, ring_segment_t out_segments[2], bool task_used[MABUTRACE_MAX_TASKS]) {
+  ring_cursor_t cursor = {0};
+  cursor.ring = *ring;
+  cursor.idx = ring->start_idx;
+  cursor.remaining = ring->length;
+  int count = 0;
+  if (ring->start_task_id < MABUTRACE_MAX_TASKS)
+    task_used[ring->start_task_id] = true;
+  const entry_header_t* entry_header;
+  while ((entry_header = cursor_current(&cursor))) {
+    if (count == 0 || cursor.idx != out_segments[count - 1].end) {
+      assert(count < 2);
+      out_segments[count].begin = cursor.idx;
+      out_segments[count].end = cursor.idx;
+      count++;
     }
-    entry_counter++;
-    if(entry_counter % 100==0) {
-      vTaskDelay(pdMS_TO_TICKS(1));
+    if (entry_header->type == EVENT_TYPE_TASK_CONTEXT) {
+      uint16_t task_id = ((const task_context_entry_t*)entry_header)->task_id;
+      if (task_id < MABUTRACE_MAX_TASKS)
+        task_used[task_id] = true;
+    } else if (entry_header->type == EVENT_TYPE_TASK_READY) {
+      uint16_t task_id = ((const task_ready_entry_t*)entry_header)->task_id;
+      if (task_id < MABUTRACE_MAX_TASKS)
+        task_used[task_id] = true;
+    }
+    size_t entry_size = get_entry_size(entry_header);
+    out_segments[count - 1].end += entry_size;
+    cursor_advance(&cursor, entry_size);
+  }
+  return count;
+}
+
+static void write_tracepoint_record(mabutrace_binary_state_t* state, const mabutrace_tracepoint_t* tracepoint,
+                                    void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  // The generation is read before the name, a name that changes meanwhile is sent again by the next call.
+  state->tracepoint_generations[tracepoint->id] = tracepoint->name_generation;
+  atomic_thread_fence(memory_order_acquire);
+  mabutrace_tracepoint_record_t record = {tracepoint->id, tracepoint->color, tracepoint->category};
+  write_record(ctx, process_chunk, MABUTRACE_RECORD_TRACEPOINT, &record, sizeof(record), tracepoint->name);
+}
+
+esp_err_t mabutrace_write_binary_rings(mabutrace_binary_state_t* state, const profiler_ring_view_t rings[MABUTRACE_NUM_CPUS],
+                                       void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  // Tracepoints that were renamed, or given to another queue, since they were sent.
+  for (uint16_t id = 1; id < state->next_tracepoint_id; id++) {
+    const mabutrace_tracepoint_t* tracepoint = mabutrace_get_tracepoint(id);
+    if (tracepoint && tracepoint->name_generation != state->tracepoint_generations[id])
+      write_tracepoint_record(state, tracepoint, ctx, process_chunk);
+  }
+  const mabutrace_tracepoint_t* tracepoint;
+  while ((tracepoint = mabutrace_get_tracepoint(state->next_tracepoint_id))) {
+    write_tracepoint_record(state, tracepoint, ctx, process_chunk);
+    state->next_tracepoint_id++;
+  }
+
+  for (int cpu_id = 0; cpu_id < MABUTRACE_NUM_CPUS; cpu_id++) {
+    const profiler_ring_view_t* ring = &rings[cpu_id];
+    ring_segment_t segments[2];
+    bool task_used[MABUTRACE_MAX_TASKS] = {0};
+    int segment_count = get_ring_segments(ring, segments, task_used);
+    uint32_t size = 0;
+    for (int i = 0; i < segment_count; i++) {
+      size += segments[i].end - segments[i].begin;
+    }
+
+    for (int task_id = 0; task_id < MABUTRACE_MAX_TASKS; task_id++) {
+      if (!task_used[task_id] || task_id == MABUTRACE_TASK_ID_ISR)
+        continue;
+      const char* name = profiler_get_task_name(task_id);
+      if (state->task_name_sent[task_id] && strncmp(state->task_names[task_id], name, MABUTRACE_TASK_NAME_LENGTH) == 0)
+        continue;
+      mabutrace_task_record_t record = {(uint16_t)task_id};
+      write_record(ctx, process_chunk, MABUTRACE_RECORD_TASK, &record, sizeof(record), name);
+      strncpy(state->task_names[task_id], name, MABUTRACE_TASK_NAME_LENGTH);
+      state->task_name_sent[task_id] = true;
+    }
+
+    if (state->ring_sent[cpu_id]) {
+      uint32_t lost_bytes = ring->end_offset - size - state->end_offsets[cpu_id];
+      if ((int32_t)lost_bytes > 0) {
+        mabutrace_lost_record_t record = {(uint8_t)cpu_id, lost_bytes};
+        write_record(ctx, process_chunk, MABUTRACE_RECORD_LOST, &record, sizeof(record), NULL);
+      }
+    }
+    state->ring_sent[cpu_id] = true;
+    state->end_offsets[cpu_id] = ring->end_offset;
+    if (size == 0)
+      continue;
+
+    mabutrace_ring_record_t record = {(uint8_t)cpu_id, ring->start_task_id};
+    mabutrace_record_header_t header = {MABUTRACE_RECORD_RING, (uint32_t)(sizeof(record) + size)};
+    process_chunk(ctx, (const char*)&header, sizeof(header));
+    process_chunk(ctx, (const char*)&record, sizeof(record));
+    for (int i = 0; i < segment_count; i++) {
+      process_chunk(ctx, ring->entries + segments[i].begin, segments[i].end - segments[i].begin);
+    }
+  }
+  return ESP_OK;
+}
+
+// The capture of the trace buffer of this device, with the names of the live registries.
+static const mabutrace_tracepoint_t* get_capture_tracepoint(void* ctx, uint16_t id) {
+  (void)ctx;
+  return mabutrace_get_tracepoint(id);
+}
+
+static const char* get_capture_task_name(void* ctx, uint16_t task_id) {
+  (void)ctx;
+  return profiler_get_task_name(task_id);
+}
+
+static esp_err_t begin_capture(mabutrace_trace_t* out_trace, profiler_ring_view_t rings[MABUTRACE_NUM_CPUS]) {
+  esp_err_t res = mabutrace_capture_begin(rings);
+  if (res != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to capture trace, another capture is in progress.");
+    return res;
+  }
+  out_trace->rings = rings;
+  out_trace->num_rings = MABUTRACE_NUM_CPUS;
+  out_trace->num_task_ids = MABUTRACE_MAX_TASKS;
+  out_trace->num_tracepoint_ids = MABUTRACE_MAX_TRACEPOINTS;
+  out_trace->clock_frequency = mabutrace_platform_clock_frequency();
+  out_trace->get_tracepoint = get_capture_tracepoint;
+  out_trace->get_task_name = get_capture_task_name;
+  out_trace->ctx = NULL;
+  out_trace->yield_interval_us = MABUTRACE_EXPORT_YIELD_INTERVAL_MS * 1000;
+  out_trace->stats = NULL;
+  return ESP_OK;
+}
+
+static esp_err_t write_binary_trace(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  // Too large for the stack of the export task.
+  mabutrace_binary_state_t* state = (mabutrace_binary_state_t*)malloc(sizeof(mabutrace_binary_state_t));
+  if (!state)
+    return ESP_ERR_NO_MEM;
+  mabutrace_write_binary_header(state, ctx, process_chunk);
+  esp_err_t res = mabutrace_write_binary_rings(state, trace->rings, ctx, process_chunk);
+  free(state);
+  return res;
+}
+
+// Downloads are written by the export task into one of two buffers while the task that requested them sends the
+// other one, so formatting and sending overlap and the export runs at MABUTRACE_EXPORT_TASK_PRIORITY.
+#define EXPORT_TASK_STACK_SIZE 4096
+#define EXPORT_BUFFER_SIZE 4096
+
+typedef esp_err_t (*trace_writer_t)(const mabutrace_trace_t* trace, void* ctx, void (*process_chunk)(void*, const char*, size_t));
+
+typedef struct {
+  const mabutrace_trace_t* trace;
+  trace_writer_t write_trace;
+  esp_err_t result;
+  mabutrace_semaphore_t free_buffers;
+  mabutrace_semaphore_t full_buffers;  // A full buffer of length 0 marks the end of the export.
+  int fill_index;  // Buffer the export task writes to.
+  size_t lengths[2];
+  char buffers[2][EXPORT_BUFFER_SIZE];
+} export_pipe_t;
+
+static mabutrace_export_stats_t last_export_stats;
+
+// Hands the buffer being filled to the sending task and waits for the other one.
+static void pass_buffer(export_pipe_t* pipe) {
+  mabutrace_platform_semaphore_give(&pipe->full_buffers);
+  pipe->fill_index ^= 1;
+  mabutrace_platform_semaphore_take(&pipe->free_buffers);
+  pipe->lengths[pipe->fill_index] = 0;
+}
+
+static void pipe_chunk(void* ctx, const char* chunk, size_t size) {
+  export_pipe_t* pipe = (export_pipe_t*)ctx;
+  while (size) {
+    if (pipe->lengths[pipe->fill_index] == EXPORT_BUFFER_SIZE)
+      pass_buffer(pipe);
+    size_t length = pipe->lengths[pipe->fill_index];
+    size_t part = EXPORT_BUFFER_SIZE - length;
+    if (part > size)
+      part = size;
+    memcpy(pipe->buffers[pipe->fill_index] + length, chunk, part);
+    pipe->lengths[pipe->fill_index] = length + part;
+    chunk += part;
+    size -= part;
+  }
+}
+
+static void export_task(void* arg) {
+  export_pipe_t* pipe = (export_pipe_t*)arg;
+  pipe->result = pipe->write_trace(pipe->trace, pipe, pipe_chunk);
+  if (pipe->lengths[pipe->fill_index])
+    pass_buffer(pipe);
+  pipe->lengths[pipe->fill_index] = 0;
+  // The sending task frees the pipe once it gets the end marker, it must not be touched afterwards.
+  mabutrace_platform_semaphore_give(&pipe->full_buffers);
+}
+
+// Captures the trace, has write_trace format it in the export task and passes the output to process_chunk.
+static esp_err_t export_capture(trace_writer_t write_trace, void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  export_pipe_t* pipe = (export_pipe_t*)malloc(sizeof(export_pipe_t));
+  if (!pipe)
+    return ESP_ERR_NO_MEM;
+  esp_err_t res = mabutrace_platform_semaphore_init(&pipe->free_buffers, 2, 1);
+  if (res != ESP_OK) {
+    free(pipe);
+    return res;
+  }
+  res = mabutrace_platform_semaphore_init(&pipe->full_buffers, 2, 0);
+  if (res != ESP_OK) {
+    mabutrace_platform_semaphore_deinit(&pipe->free_buffers);
+    free(pipe);
+    return res;
+  }
+
+  uint64_t start_us = mabutrace_platform_time_us();
+  mabutrace_export_stats_t stats = {0};
+  profiler_ring_view_t rings[MABUTRACE_NUM_CPUS];
+  mabutrace_trace_t trace;
+  res = begin_capture(&trace, rings);
+  if (res != ESP_OK)
+    goto cleanup;
+  trace.stats = &stats;
+  pipe->trace = &trace;
+  pipe->write_trace = write_trace;
+  pipe->fill_index = 0;
+  pipe->lengths[0] = 0;
+  res = mabutrace_platform_start_task(export_task, "mabutrace_exp", EXPORT_TASK_STACK_SIZE, MABUTRACE_EXPORT_TASK_PRIORITY, pipe);
+  if (res == ESP_OK) {
+    for (int index = 0;; index ^= 1) {
+      mabutrace_platform_semaphore_take(&pipe->full_buffers);
+      if (!pipe->lengths[index])
+        break;
+      stats.num_bytes += pipe->lengths[index];
+      process_chunk(ctx, pipe->buffers[index], pipe->lengths[index]);
+      mabutrace_platform_semaphore_give(&pipe->free_buffers);
     }
-  } while (idx != end_idx && loopCount <= 1);
+    res = pipe->result;
+  } else {
+    ESP_LOGE(TAG, "Failed to start export task.");
+  }
+  mabutrace_capture_end();
+
+  stats.duration_us = mabutrace_platform_time_us() - start_us;
+  last_export_stats = stats;
+  ESP_LOGI(TAG, "Exported %u events, %u bytes in %u ms (%u kB/s).", (unsigned int)stats.num_events,
+           (unsigned int)stats.num_bytes, (unsigned int)(stats.duration_us / 1000),
+           (unsigned int)(stats.duration_us ? (uint64_t)stats.num_bytes * 1000 / stats.duration_us : 0));
+
+  cleanup:
+  mabutrace_platform_semaphore_deinit(&pipe->full_buffers);
+  mabutrace_platform_semaphore_deinit(&pipe->free_buffers);
+  free(pipe);
+  return res;
+}
+
+esp_err_t get_json_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  return export_capture(mabutrace_write_json, ctx, process_chunk);
+}
+
+esp_err_t get_perfetto_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  return export_capture(mabutrace_write_perfetto, ctx, process_chunk);
+}
+
+esp_err_t get_binary_trace_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  return export_capture(write_binary_trace, ctx, process_chunk);
+}
+
+void mabutrace_get_export_stats(mabutrace_export_stats_t* out_stats) {
+  *out_stats = last_export_stats;
+}
 
-  lineLength = snprintf(buf, sizeof(buf),"%s", json_footer);
-  assert(lineLength >= 0 && lineLength < sizeof(buf) && "Failed to correctly write footer.");
-  process_chunk(ctx, buf, lineLength);
+esp_err_t get_scope_stats_json_chunked(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  esp_err_t res = ESP_ERR_NO_MEM;
+  json_writer_t* writer = (json_writer_t*)calloc(1, sizeof(json_writer_t));
+  mabutrace_scope_stats_t* stats = (mabutrace_scope_stats_t*)malloc(MABUTRACE_MAX_TRACEPOINTS * sizeof(mabutrace_scope_stats_t));
+  if (!writer || !stats)
+    goto cleanup;
+  size_t count;
+  uint64_t window_ns;
+  res = mabutrace_get_scope_stats(stats, MABUTRACE_MAX_TRACEPOINTS, &count, &window_ns);
+  if (res != ESP_OK)
+    goto cleanup;
+  writer->ctx = ctx;
+  writer->process_chunk = process_chunk;
+  json_append_literal(writer, "{\"window_us\":");
+  json_append_us(writer, window_ns);
+  json_append_literal(writer, ",\"scopes\":[");
+  for (size_t i = 0; i < count; i++) {
+    if (i)
+      json_append_char(writer, ',');
+    json_append_literal(writer, "\n  {\"name\":");
+    json_append_string(writer, stats[i].name);
+    json_append_literal(writer, ",\"count\":");
+    json_append_uint(writer, stats[i].count);
+    json_append_literal(writer, ",\"min_us\":");
+    json_append_us(writer, stats[i].min_ns);
+    json_append_literal(writer, ",\"max_us\":");
+    json_append_us(writer, stats[i].max_ns);
+    json_append_literal(writer, ",\"mean_us\":");
+    json_append_us(writer, stats[i].mean_ns);
+    json_append_literal(writer, ",\"p50_us\":");
+    json_append_us(writer, stats[i].p50_ns);
+    json_append_literal(writer, ",\"p99_us\":");
+    json_append_us(writer, stats[i].p99_ns);
+    json_append_literal(writer, ",\"p999_us\":");
+    json_append_us(writer, stats[i].p999_ns);
+    json_append_char(writer, '}');
+  }
+  json_append_literal(writer, "\n]}\n");
+  json_flush(writer);
 
   cleanup:
-  resume_tracing();
+  free(stats);
+  free(writer);
   return res;
-}
\ No newline at end of file
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MABUTRACE_FORMAT_H__
+#define __MABUTRACE_FORMAT_H__
+
+#include <stdint.h>
+
+/*
+* Binary trace format, as sent by the live stream. It starts with the 8 characters of MABUTRACE_FORMAT_MAGIC,
+* followed by records. Every record is a mabutrace_record_header_t followed by size bytes of payload, so readers
+* can skip records they don't know. All integers are little endian.
+*
+* The entries of a RING record are copied from the ring buffer of one CPU as they are, in the order they were
+* written (see the entry structs in mabutrace.h). Each one is followed by its time delta to the previous entry,
+* and the record contains at least one time anchor, from which the time of the entries before it is found by
+* subtracting their deltas. TRACEPOINT and TASK records are sent before the first RING record that refers to them.
+*/
+#define MABUTRACE_FORMAT_MAGIC "MABUTRC\n"
+#define MABUTRACE_FORMAT_VERSION 1
+
+#define MABUTRACE_RECORD_INFO 1
+#define MABUTRACE_RECORD_TRACEPOINT 2
+#define MABUTRACE_RECORD_TASK 3
+#define MABUTRACE_RECORD_RING 4
+#define MABUTRACE_RECORD_LOST 5
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;
+  uint32_t size;  // Size of the payload that follows.
+} mabutrace_record_header_t;
+
+/*
+* First record of a trace.
+*/
+typedef struct __attribute__((packed)) {
+  uint16_t version;
+  uint8_t num_cpus;
+  uint8_t reserved;
+  uint64_t clock_frequency;  // Ticks per second of the trace clock.
+  uint8_t type_sizes[32];  // Size of the entry struct of each event type, excluding the time delta.
+} mabutrace_info_record_t;
+
+/*
+* Followed by the name, not null terminated.
+*/
+typedef struct __attribute__((packed)) {
+  uint16_t id;
+  uint8_t color;
+  uint8_t category;
+} mabutrace_tracepoint_record_t;
+
+/*
+* Name of a task ID, followed by the name, not null terminated. Sent again when the ID is reused by another task.
+*/
+typedef struct __attribute__((packed)) {
+  uint16_t task_id;
+} mabutrace_task_record_t;
+
+/*
+* Entries of the ring of a CPU, followed by the entries.
+*/
+typedef struct __attribute__((packed)) {
+  uint8_t cpu_id;
+  uint16_t start_task_id;  // Task of the entries before the first task context entry.
+} mabutrace_ring_record_t;
+
+/*
+* Entries of a CPU were overwritten before they could be sent. Events between the previous and the next RING
+* record of the CPU are missing.
+*/
+typedef struct __attribute__((packed)) {
+  uint8_t cpu_id;
+  uint32_t lost_bytes;  // Size of the missing entries.
+} mabutrace_lost_record_t;
+
+#endif  // __MABUTRACE_FORMAT_H__
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Streaming gzip compression of exporter output. The deflate backend is the miniz implementation in the ROM of
+// the ESP32 and zlib on the host. Both produce a raw deflate stream, the gzip header and trailer are written here.
+
+#include "mabutrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM) && __has_include("rom/miniz.h")
+#include "rom/miniz.h"
+#define MABUTRACE_GZIP_MINIZ 1
+#elif !defined(ESP_PLATFORM) && defined(MABUTRACE_ZLIB)
+#include <zlib.h>
+#define MABUTRACE_GZIP_ZLIB 1
+#endif
+
+#if MABUTRACE_GZIP_MINIZ || MABUTRACE_GZIP_ZLIB
+
+static const char *TAG = "MABUTRACE";
+
+// Fast settings, traces are very repetitive and compress well even with short match searches.
+#define GZIP_MINIZ_PROBES 16
+#define GZIP_ZLIB_LEVEL 1
+#define GZIP_ZLIB_WINDOW_BITS 15
+#define GZIP_ZLIB_MEM_LEVEL 8
+#define GZIP_OUTPUT_BUFFER_SIZE 4096
+
+struct mabutrace_gzip_stream_t {
+  void* ctx;
+  void (*process_chunk)(void*, const char*, size_t);
+  uint32_t crc;
+  uint32_t size;  // Uncompressed size, modulo 2^32 as gzip wants it.
+  bool failed;
+#if MABUTRACE_GZIP_MINIZ
+  tdefl_compressor compressor;
+#else
+  z_stream z;
+  char output[GZIP_OUTPUT_BUFFER_SIZE];
+#endif
+};
+
+// CRC-32 of gzip, with a table per nibble to keep it small.
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  crc = ~crc;
+  while (size--) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ table[crc & 0xF];
+    crc = (crc >> 4) ^ table[crc & 0xF];
+  }
+  return ~crc;
+}
+
+#if MABUTRACE_GZIP_MINIZ
+
+static mz_bool put_compressed(const void* data, int size, void* user) {
+  mabutrace_gzip_stream_t* stream = (mabutrace_gzip_stream_t*)user;
+  stream->process_chunk(stream->ctx, (const char*)data, size);
+  return MZ_TRUE;
+}
+
+static bool deflate_init(mabutrace_gzip_stream_t* stream) {
+  return tdefl_init(&stream->compressor, put_compressed, stream, GZIP_MINIZ_PROBES | TDEFL_GREEDY_PARSING_FLAG) == TDEFL_STATUS_OKAY;
+}
+
+static bool deflate_data(mabutrace_gzip_stream_t* stream, const char* data, size_t size, bool finish) {
+  tdefl_status status = tdefl_compress_buffer(&stream->compressor, data, size, finish ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+  return finish ? status == TDEFL_STATUS_DONE : status == TDEFL_STATUS_OKAY;
+}
+
+static void deflate_release(mabutrace_gzip_stream_t* stream) {
+  (void)stream;
+}
+
+#else
+
+static bool deflate_init(mabutrace_gzip_stream_t* stream) {
+  memset(&stream->z, 0, sizeof(stream->z));
+  // Negative window bits: raw deflate without zlib header.
+  return deflateInit2(&stream->z, GZIP_ZLIB_LEVEL, Z_DEFLATED, -GZIP_ZLIB_WINDOW_BITS, GZIP_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static bool deflate_data(mabutrace_gzip_stream_t* stream, const char* data, size_t size, bool finish) {
+  stream->z.next_in = (Bytef*)data;
+  stream->z.avail_in = size;
+  int result;
+  do {
+    stream->z.next_out = (Bytef*)stream->output;
+    stream->z.avail_out = sizeof(stream->output);
+    result = deflate(&stream->z, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (result == Z_STREAM_ERROR)
+      return false;
+    size_t produced = sizeof(stream->output) - stream->z.avail_out;
+    if (produced)
+      stream->process_chunk(stream->ctx, stream->output, produced);
+  } while (stream->z.avail_out == 0 || (finish && result != Z_STREAM_END));
+  return true;
+}
+
+static void deflate_release(mabutrace_gzip_stream_t* stream) {
+  deflateEnd(&stream->z);
+}
+
+#endif
+
+mabutrace_gzip_stream_t* mabutrace_gzip_begin(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  // Large on ESP, preferably in PSRAM.
+  mabutrace_gzip_stream_t* stream = (mabutrace_gzip_stream_t*)mabutrace_platform_calloc(sizeof(mabutrace_gzip_stream_t), MABUTRACE_MEMORY_PREFER_EXTERNAL);
+  if (!stream) {
+    ESP_LOGW(TAG, "Failed to allocate %d bytes for gzip compression.", (int)sizeof(mabutrace_gzip_stream_t));
+    return NULL;
+  }
+  stream->ctx = ctx;
+  stream->process_chunk = process_chunk;
+  if (!deflate_init(stream)) {
+    free(stream);
+    return NULL;
+  }
+  // Member header: magic, deflate, no flags, no modification time, no extra flags, unknown OS.
+  static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+  process_chunk(ctx, (const char*)header, sizeof(header));
+  return stream;
+}
+
+void mabutrace_gzip_chunk(void* ctx, const char* chunk, size_t size) {
+  mabutrace_gzip_stream_t* stream = (mabutrace_gzip_stream_t*)ctx;
+  if (stream->failed || !size)
+    return;
+  stream->crc = crc32_update(stream->crc, (const uint8_t*)chunk, size);
+  stream->size += size;
+  if (!deflate_data(stream, chunk, size, false))
+    stream->failed = true;
+}
+
+esp_err_t mabutrace_gzip_end(mabutrace_gzip_stream_t* stream) {
+  esp_err_t res = ESP_FAIL;
+  if (!stream->failed && deflate_data(stream, NULL, 0, true)) {
+    uint8_t trailer[8];
+    for (int i = 0; i < 4; i++) {
+      trailer[i] = stream->crc >> (8 * i);
+      trailer[4 + i] = stream->size >> (8 * i);
+    }
+    stream->process_chunk(stream->ctx, (const char*)trailer, sizeof(trailer));
+    res = ESP_OK;
+  }
+  deflate_release(stream);
+  free(stream);
+  return res;
+}
+
+#else  // No deflate implementation, callers send uncompressed data.
+
+mabutrace_gzip_stream_t* mabutrace_gzip_begin(void* ctx, void (*process_chunk)(void*, const char*, size_t)) {
+  (void)ctx;
+  (void)process_chunk;
+  return NULL;
+}
+
+void mabutrace_gzip_chunk(void* ctx, const char* chunk, size_t size) {
+  (void)ctx;
+  (void)chunk;
+  (void)size;
+}
+
+esp_err_t mabutrace_gzip_end(mabutrace_gzip_stream_t* stream) {
+  (void)stream;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
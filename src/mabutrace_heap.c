@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Heap allocation tracing. In builds with MABUTRACE_HEAP_TRACING, every call of malloc, calloc, realloc and free
+// is timed and recorded as an EVENT_TYPE_HEAP_* entry on the track of the calling task, and the heap usage
+// counters are updated along the way. On ESP-IDF the functions are wrapped at link time with -Wl,--wrap (set up by
+// CMakeLists.txt), which catches all their callers including C++ new and delete, but not direct calls of
+// heap_caps_malloc and friends. On the host they are interposed and forward to glibc.
+
+#include "mabutrace.h"
+
+#include <stdatomic.h>
+
+#ifdef MABUTRACE_HEAP_TRACING
+
+#ifdef ESP_PLATFORM
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+#define HEAP_HOOK(function) __wrap_##function
+#define HEAP_REAL(function) __real_##function
+#define HEAP_ALLOCATED_SIZE(ptr) heap_caps_get_allocated_size(ptr)
+#define HEAP_HOOK_TLS
+#else
+#include <malloc.h>
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+#define HEAP_HOOK(function) function
+#define HEAP_REAL(function) __libc_##function
+#define HEAP_ALLOCATED_SIZE(ptr) malloc_usable_size(ptr)
+// The default TLS model of a library may allocate on first access, which would call back into the hooks.
+#define HEAP_HOOK_TLS __attribute__((tls_model("initial-exec")))
+#endif
+
+#define HEAP_COUNTER_INTERVAL_MS 10  // The heap usage counters walk the heap, they are updated at most this often.
+
+static atomic_bool heap_tracing_enabled = false;
+static atomic_uint last_counter_update_ms;
+// Set while the calling task is in a hook, so that allocations of the tracer itself (e.g. while a thread
+// registers on the host) go straight to the allocator.
+static __thread bool in_heap_hook HEAP_HOOK_TLS = false;
+
+static inline uint32_t caller_address(void* return_address) {
+#ifdef __XTENSA__
+  // The upper two bits of the return address of a windowed call hold the window size.
+  return ((uint32_t)(uintptr_t)return_address & 0x3FFFFFFF) | 0x40000000;
+#else
+  return (uint32_t)(uintptr_t)return_address;
+#endif
+}
+
+static void update_heap_counters() {
+  uint32_t now_ms = mabutrace_platform_time_us() / 1000;
+  unsigned int last_ms = atomic_load(&last_counter_update_ms);
+  if (now_ms - last_ms < HEAP_COUNTER_INTERVAL_MS || !atomic_compare_exchange_strong(&last_counter_update_ms, &last_ms, now_ms))
+    return;
+  size_t used_bytes;
+  size_t free_bytes;
+  mabutrace_platform_heap_info(&used_bytes, &free_bytes);
+  TRACE_COUNTER("Heap Used", (int64_t)used_bytes);
+  TRACE_COUNTER(MABUTRACE_HEAP_FREE_COUNTER, (int64_t)free_bytes);
+}
+
+static void record_heap_event(uint8_t type, size_t size, void* return_address, uint64_t latency_ticks) {
+  mabutrace_record_heap_event(type, size < UINT32_MAX ? size : UINT32_MAX, caller_address(return_address), latency_ticks);
+  update_heap_counters();
+}
+
+void* HEAP_HOOK(malloc)(size_t size) {
+  if (!heap_tracing_enabled || in_heap_hook)
+    return HEAP_REAL(malloc)(size);
+  in_heap_hook = true;
+  uint64_t begin_ticks = mabutrace_platform_clock_ticks();
+  void* ptr = HEAP_REAL(malloc)(size);
+  uint64_t latency_ticks = mabutrace_platform_clock_ticks() - begin_ticks;
+  record_heap_event(ptr || !size ? EVENT_TYPE_HEAP_ALLOC : EVENT_TYPE_HEAP_ALLOC_FAILED, size, __builtin_return_address(0), latency_ticks);
+  in_heap_hook = false;
+  return ptr;
+}
+
+void* HEAP_HOOK(calloc)(size_t count, size_t size) {
+  if (!heap_tracing_enabled || in_heap_hook)
+    return HEAP_REAL(calloc)(count, size);
+  in_heap_hook = true;
+  uint64_t begin_ticks = mabutrace_platform_clock_ticks();
+  void* ptr = HEAP_REAL(calloc)(count, size);
+  uint64_t latency_ticks = mabutrace_platform_clock_ticks() - begin_ticks;
+  size_t total_size = count * size;
+  record_heap_event(ptr || !total_size ? EVENT_TYPE_HEAP_ALLOC : EVENT_TYPE_HEAP_ALLOC_FAILED, total_size, __builtin_return_address(0), latency_ticks);
+  in_heap_hook = false;
+  return ptr;
+}
+
+// Recorded as a free of the old block, if any, followed by an allocation that took the time of the call.
+void* HEAP_HOOK(realloc)(void* ptr, size_t size) {
+  if (!heap_tracing_enabled || in_heap_hook)
+    return HEAP_REAL(realloc)(ptr, size);
+  in_heap_hook = true;
+  size_t old_size = ptr ? HEAP_ALLOCATED_SIZE(ptr) : 0;
+  uint64_t begin_ticks = mabutrace_platform_clock_ticks();
+  void* new_ptr = HEAP_REAL(realloc)(ptr, size);
+  uint64_t latency_ticks = mabutrace_platform_clock_ticks() - begin_ticks;
+  void* return_address = __builtin_return_address(0);
+  if (!new_ptr && size) {
+    // The old block is left as it was.
+    record_heap_event(EVENT_TYPE_HEAP_ALLOC_FAILED, size, return_address, latency_ticks);
+  } else {
+    if (ptr)
+      record_heap_event(EVENT_TYPE_HEAP_FREE, old_size, return_address, size ? 0 : latency_ticks);
+    if (size)
+      record_heap_event(EVENT_TYPE_HEAP_ALLOC, size, return_address, latency_ticks);
+  }
+  in_heap_hook = false;
+  return new_ptr;
+}
+
+void HEAP_HOOK(free)(void* ptr) {
+  if (!ptr || !heap_tracing_enabled || in_heap_hook) {
+    HEAP_REAL(free)(ptr);
+    return;
+  }
+  in_heap_hook = true;
+  size_t size = HEAP_ALLOCATED_SIZE(ptr);
+  uint64_t begin_ticks = mabutrace_platform_clock_ticks();
+  HEAP_REAL(free)(ptr);
+  uint64_t latency_ticks = mabutrace_platform_clock_ticks() - begin_ticks;
+  record_heap_event(EVENT_TYPE_HEAP_FREE, size, __builtin_return_address(0), latency_ticks);
+  in_heap_hook = false;
+}
+
+esp_err_t mabutrace_set_heap_tracing_enabled(bool enabled) {
+  heap_tracing_enabled = enabled;
+  return ESP_OK;
+}
+
+#else
+
+esp_err_t mabutrace_set_heap_tracing_enabled(bool enabled) {
+  (void)enabled;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif  // MABUTRACE_HEAP_TRACING
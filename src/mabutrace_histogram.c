@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Duration histograms of scopes. Each tracepoint that ends a scope gets a histogram slot on first use, and each
+// slot has a histogram per CPU, which trace_end updates in its core local section, so updates need no lock. There
+// are two banks of them: reading the statistics switches the writers to the other bank, which starts a new window,
+// and reads and clears the old one.
+
+#include "mabutrace.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Log-linear buckets: durations below 2^SUB_BUCKET_BITS ticks have a bucket each, every power of two above is
+// split into 2^SUB_BUCKET_BITS buckets, so a bucket is at most 1/8 of its lower bound wide. Durations of
+// 2^HISTOGRAM_MAX_BITS ticks and more count into the last bucket.
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define SLOT_NONE 0xFFFF  // The tracepoint didn't get a slot because all were taken.
+#define BANK_OFF 2  // Histograms are not allocated.
+
+typedef struct {
+  uint32_t count;
+  uint64_t sum_ticks;
+  uint64_t min_ticks;
+  uint64_t max_ticks;
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static histogram_t* histograms;  // Bank, then CPU, then slot.
+static uint16_t num_slots;
+static uint16_t used_slots;
+// 1 + slot of each tracepoint ID, 0 if it has none yet, SLOT_NONE if it won't get one.
+static uint16_t tracepoint_slots[MABUTRACE_MAX_TRACEPOINTS];
+static mabutrace_lock_t slots_mutex = MABUTRACE_LOCK_INITIALIZER;
+static atomic_uchar active_bank = BANK_OFF;
+static atomic_uint bank_writers[2];  // Writers that may still update a histogram of the bank.
+static atomic_bool stats_in_progress = false;
+static uint64_t window_start_ticks;
+
+static inline histogram_t* IRAM_ATTR get_histogram(uint8_t bank, uint8_t cpu_id, uint16_t slot) {
+  return &histograms[((size_t)bank * MABUTRACE_NUM_CPUS + cpu_id) * num_slots + slot];
+}
+
+static inline int IRAM_ATTR get_bucket(uint64_t ticks) {
+  if (ticks < SUB_BUCKETS)
+    return ticks;
+  int exponent = 63 - __builtin_clzll(ticks);
+  if (exponent >= HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKETS - 1;
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + ((ticks >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Middle of the durations that count into a bucket.
+static uint64_t get_bucket_value(int bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return lower + ((1ull << shift) >> 1);
+}
+
+// Returns the slot of a tracepoint, or SLOT_NONE.
+static uint16_t IRAM_ATTR get_slot(uint16_t tracepoint_id) {
+  uint16_t slot = tracepoint_slots[tracepoint_id];
+  if (!slot) {
+    mabutrace_platform_lock(&slots_mutex);
+    slot = tracepoint_slots[tracepoint_id];
+    if (!slot) {
+      slot = used_slots < num_slots ? ++used_slots : SLOT_NONE;
+      tracepoint_slots[tracepoint_id] = slot;
+    }
+    mabutrace_platform_unlock(&slots_mutex);
+  }
+  return slot == SLOT_NONE ? SLOT_NONE : slot - 1;
+}
+
+esp_err_t mabutrace_histograms_init(uint16_t count, uint8_t memory) {
+  if (count > MABUTRACE_MAX_TRACEPOINTS)
+    count = MABUTRACE_MAX_TRACEPOINTS;
+  size_t size = 2 * MABUTRACE_NUM_CPUS * (size_t)count * sizeof(histogram_t);
+  histograms = (histogram_t*)mabutrace_platform_calloc(size, memory);
+  if (!histograms)
+    return ESP_ERR_NO_MEM;
+  num_slots = count;
+  used_slots = 0;
+  memset(tracepoint_slots, 0, sizeof(tracepoint_slots));
+  window_start_ticks = mabutrace_platform_clock_ticks();
+  atomic_store(&active_bank, 0);
+  return ESP_OK;
+}
+
+void mabutrace_histograms_deinit() {
+  uint8_t bank = atomic_exchange(&active_bank, BANK_OFF);
+  if (bank == BANK_OFF)
+    return;
+  while (atomic_load(&bank_writers[0]) || atomic_load(&bank_writers[1])) {
+    mabutrace_platform_delay_ms(1);
+  }
+  free(histograms);
+  histograms = NULL;
+}
+
+void IRAM_ATTR mabutrace_record_scope_duration(uint16_t tracepoint_id, uint8_t cpu_id, uint64_t duration_ticks) {
+  uint8_t bank;
+  // Like writer_enter: either the reader that switches banks sees this writer, or this writer sees the switch.
+  for (;;) {
+    bank = atomic_load(&active_bank);
+    if (bank == BANK_OFF)
+      return;
+    atomic_fetch_add(&bank_writers[bank], 1);
+    if (bank == atomic_load(&active_bank))
+      break;
+    atomic_fetch_sub(&bank_writers[bank], 1);
+  }
+  uint16_t slot = get_slot(tracepoint_id);
+  if (slot != SLOT_NONE) {
+    histogram_t* histogram = get_histogram(bank, cpu_id, slot);
+    if (histogram->count == 0 || duration_ticks < histogram->min_ticks)
+      histogram->min_ticks = duration_ticks;
+    if (duration_ticks > histogram->max_ticks)
+      histogram->max_ticks = duration_ticks;
+    histogram->count++;
+    histogram->sum_ticks += duration_ticks;
+    histogram->buckets[get_bucket(duration_ticks)]++;
+  }
+  atomic_fetch_sub(&bank_writers[bank], 1);
+}
+
+// Duration below which permille of the scopes of the merged histogram ended.
+static uint64_t get_percentile(const histogram_t* histogram, uint32_t permille) {
+  uint64_t rank = ((uint64_t)histogram->count * permille + 999) / 1000;
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  int bucket = 0;
+  for (; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen >= rank)
+      break;
+  }
+  uint64_t value = get_bucket_value(bucket);
+  if (value < histogram->min_ticks)
+    return histogram->min_ticks;
+  if (value > histogram->max_ticks)
+    return histogram->max_ticks;
+  return value;
+}
+
+esp_err_t mabutrace_get_scope_stats(mabutrace_scope_stats_t* out_stats, size_t max_stats, size_t* out_count, uint64_t* out_window_ns) {
+  *out_count = 0;
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&stats_in_progress, &expected, true))
+    return ESP_ERR_INVALID_STATE;
+  uint8_t bank = atomic_load(&active_bank);
+  if (bank == BANK_OFF) {
+    atomic_store(&stats_in_progress, false);
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t res = ESP_ERR_NO_MEM;
+  histogram_t* merged = (histogram_t*)malloc(sizeof(histogram_t));
+  if (!merged)
+    goto cleanup;
+  // Switch the writers to the other bank, which was cleared by the previous call, and wait for the ones that still
+  // update the old bank.
+  atomic_store(&active_bank, bank ^ 1);
+  uint64_t now = mabutrace_platform_clock_ticks();
+  while (atomic_load(&bank_writers[bank])) {
+    mabutrace_platform_delay_ms(1);
+  }
+  if (out_window_ns)
+    *out_window_ns = mabutrace_ticks_to_ns(now - window_start_ticks);
+  window_start_ticks = now;
+
+  for (uint16_t id = 1; id < MABUTRACE_MAX_TRACEPOINTS; id++) {
+    uint16_t slot = tracepoint_slots[id];
+    if (!slot || slot == SLOT_NONE)
+      continue;
+    slot--;
+    memset(merged, 0, sizeof(histogram_t));
+    for (uint8_t cpu = 0; cpu < MABUTRACE_NUM_CPUS; cpu++) {
+      histogram_t* histogram = get_histogram(bank, cpu, slot);
+      if (histogram->count == 0)
+        continue;
+      if (merged->count == 0 || histogram->min_ticks < merged->min_ticks)
+        merged->min_ticks = histogram->min_ticks;
+      if (histogram->max_ticks > merged->max_ticks)
+        merged->max_ticks = histogram->max_ticks;
+      merged->count += histogram->count;
+      merged->sum_ticks += histogram->sum_ticks;
+      for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        merged->buckets[i] += histogram->buckets[i];
+      }
+      memset(histogram, 0, sizeof(histogram_t));
+    }
+    if (merged->count == 0 || *out_count == max_stats)
+      continue;
+    mabutrace_scope_stats_t* stats = &out_stats[(*out_count)++];
+    stats->tracepoint_id = id;
+    stats->name = mabutrace_get_tracepoint(id)->name;
+    stats->count = merged->count;
+    stats->min_ns = mabutrace_ticks_to_ns(merged->min_ticks);
+    stats->max_ns = mabutrace_ticks_to_ns(merged->max_ticks);
+    stats->mean_ns = mabutrace_ticks_to_ns(merged->sum_ticks / merged->count);
+    stats->p50_ns = mabutrace_ticks_to_ns(get_percentile(merged, 500));
+    stats->p99_ns = mabutrace_ticks_to_ns(get_percentile(merged, 990));
+    stats->p999_ns = mabutrace_ticks_to_ns(get_percentile(merged, 999));
+  }
+  res = ESP_OK;
+
+  cleanup:
+  free(merged);
+  atomic_store(&stats_in_progress, false);
+  return res;
+}
@@ -27,6 +27,8 @@ extern "C" {
 
 #ifndef __ASSEMBLER__
 void trace_task_switch(unsigned char type);
+void trace_task_ready(void* task, unsigned int priority);
+void trace_task_delete(void* task);
 
 // This macro is called when a task is about to be switched out.
 #define traceTASK_SWITCHED_OUT() \
@@ -40,6 +42,56 @@ void trace_task_switch(unsigned char type);
     trace_task_switch(6); \
   } while(0)
 
+// This macro is called when a task is added to the ready list: when it is woken, created or resumed, and when its
+// priority changes while it is ready. Expanded inside FreeRTOS' tasks.c, where pxTCB is a TCB_t.
+#define traceMOVED_TASK_TO_READY_STATE(pxTCB) \
+  do { \
+    trace_task_ready(pxTCB, (pxTCB)->uxPriority); \
+  } while(0)
+
+// This macro is called when a task is about to be deleted. Snapshots its name and lets its ID be reused once its
+// events have left the trace buffer.
+#define traceTASK_DELETE(pxTaskToDelete) \
+  do { \
+    trace_task_delete(pxTaskToDelete); \
+  } while(0)
+
+void trace_queue_event(void* queue, unsigned char type, unsigned char kind, unsigned int messages_waiting,
+                       unsigned int length, unsigned int waiting_tasks);
+void trace_queue_blocking(void);
+void trace_queue_delete(void* queue);
+void mabutrace_name_queue(void* queue, const char* name);
+
+#ifdef MABUTRACE_QUEUE_TRACING
+// Queue hooks, expanded inside FreeRTOS' queue.c where pxQueue is a Queue_t. Semaphores and mutexes are queues
+// without item storage, mutexes without a storage pointer either. The send and receive hooks are called before
+// uxMessagesWaiting is updated, from the critical section of the queue. Failures after a timeout are reported
+// outside of it.
+#define _MABUTRACE_QUEUE_KIND(pxQueue) ((pxQueue)->uxItemSize != 0 ? 0 : (pxQueue)->pcHead != NULL ? 1 : 2)
+#define _MABUTRACE_QUEUE_EVENT(pxQueue, type) \
+  do { \
+    trace_queue_event(pxQueue, type, _MABUTRACE_QUEUE_KIND(pxQueue), (pxQueue)->uxMessagesWaiting, (pxQueue)->uxLength, \
+                      listCURRENT_LIST_LENGTH(&(pxQueue)->xTasksWaitingToReceive)); \
+  } while(0)
+
+// 20: EVENT_TYPE_QUEUE_SEND, 21: EVENT_TYPE_QUEUE_RECEIVE, 22 and 23: the same operations failed.
+#define traceQUEUE_SEND(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 20)
+#define traceQUEUE_SEND_FROM_ISR(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 20)
+#define traceQUEUE_RECEIVE(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 21)
+#define traceQUEUE_RECEIVE_FROM_ISR(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 21)
+#define traceQUEUE_SEND_FAILED(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 22)
+#define traceQUEUE_SEND_FROM_ISR_FAILED(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 22)
+#define traceQUEUE_RECEIVE_FAILED(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 23)
+#define traceQUEUE_RECEIVE_FROM_ISR_FAILED(pxQueue) _MABUTRACE_QUEUE_EVENT(pxQueue, 23)
+
+// Called when the task is about to block on the queue. The blocking time is recorded with the operation that ends it.
+#define traceBLOCKING_ON_QUEUE_SEND(pxQueue) trace_queue_blocking()
+#define traceBLOCKING_ON_QUEUE_RECEIVE(pxQueue) trace_queue_blocking()
+
+#define traceQUEUE_DELETE(pxQueue) trace_queue_delete(pxQueue)
+#define traceQUEUE_REGISTRY_ADD(xQueue, pcQueueName) mabutrace_name_queue(xQueue, pcQueueName)
+#endif
+
 #endif
 
 #ifdef __cplusplus
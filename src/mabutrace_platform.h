@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MABUTRACE_PLATFORM_H__
+#define __MABUTRACE_PLATFORM_H__
+
+/*
+* Platform abstraction layer.
+* The tracer core and the exporter only talk to the OS through the functions in this file. On ESP-IDF and
+* Arduino-ESP32 (ESP_PLATFORM defined) they map to FreeRTOS and esp_timer. Everywhere else the Linux host
+* backend is used, which maps tasks to pthreads and lets the ring buffer and JSON exporter run in host side
+* simulation builds and unit tests.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Sources of the trace clock. MABUTRACE_CLOCK_SOURCE can be defined to one of them to override the default, which
+* is the cycle counter where it is available and usable.
+*/
+#define MABUTRACE_CLOCK_SOURCE_TIMER 1  // esp_timer (ESP) or CLOCK_MONOTONIC (host).
+#define MABUTRACE_CLOCK_SOURCE_CYCLES 2  // CPU cycle counter: CCOUNT/mcycle (ESP), rdtsc/cntvct (host).
+
+#ifdef ESP_PLATFORM
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_idf_version.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include "esp_cpu.h"
+#define MABUTRACE_READ_CYCLE_COUNT() esp_cpu_get_cycle_count()
+#else
+#include "hal/cpu_hal.h"
+#define MABUTRACE_READ_CYCLE_COUNT() cpu_hal_get_cycle_count()
+#endif
+
+#define MABUTRACE_NUM_CPUS portNUM_PROCESSORS
+
+#ifndef MABUTRACE_CLOCK_SOURCE
+#if CONFIG_PM_ENABLE
+// Dynamic frequency scaling changes the rate of the cycle counter.
+#define MABUTRACE_CLOCK_SOURCE MABUTRACE_CLOCK_SOURCE_TIMER
+#else
+#define MABUTRACE_CLOCK_SOURCE MABUTRACE_CLOCK_SOURCE_CYCLES
+#endif
+#endif
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES && CONFIG_PM_ENABLE
+#error "The cycle counter can't be used as trace clock with CONFIG_PM_ENABLE, use MABUTRACE_CLOCK_SOURCE_TIMER."
+#endif
+
+typedef portMUX_TYPE mabutrace_lock_t;
+#define MABUTRACE_LOCK_INITIALIZER portMUX_INITIALIZER_UNLOCKED
+
+typedef UBaseType_t mabutrace_irq_state_t;
+
+typedef SemaphoreHandle_t mabutrace_semaphore_t;
+
+#define MABUTRACE_HEAP_FREE_COUNTER "Largest Free Block"
+
+#if !defined(MABUTRACE_TLS_INDEX) && configNUM_THREAD_LOCAL_STORAGE_POINTERS > 1
+#define MABUTRACE_TLS_INDEX (configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1)
+#endif
+
+#else  // Linux host backend
+
+#include <semaphore.h>
+#include <stdio.h>
+
+typedef int esp_err_t;
+#define ESP_OK                 0
+#define ESP_FAIL              -1
+#define ESP_ERR_NO_MEM         0x101
+#define ESP_ERR_INVALID_ARG    0x102
+#define ESP_ERR_INVALID_STATE  0x103
+#define ESP_ERR_INVALID_SIZE   0x104
+#define ESP_ERR_NOT_FOUND      0x105
+#define ESP_ERR_NOT_SUPPORTED  0x106
+#define ESP_ERR_TIMEOUT        0x107
+
+// On the host a task is a pthread. The handle is the pthread_t of the thread.
+typedef void* TaskHandle_t;
+
+#define IRAM_ATTR
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) fprintf(stderr, "I (%s) " format "\n", tag, ##__VA_ARGS__)
+// Safe to call from interrupts and with interrupts masked on ESP-IDF.
+#define ESP_EARLY_LOGW ESP_LOGW
+
+/*
+* Number of simulated CPUs. Host threads are mapped onto them by the CPU they currently run on.
+*/
+#ifndef MABUTRACE_NUM_CPUS
+#define MABUTRACE_NUM_CPUS 2
+#endif
+
+#ifndef MABUTRACE_CLOCK_SOURCE
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define MABUTRACE_CLOCK_SOURCE MABUTRACE_CLOCK_SOURCE_CYCLES
+#else
+#define MABUTRACE_CLOCK_SOURCE MABUTRACE_CLOCK_SOURCE_TIMER
+#endif
+#endif
+
+typedef struct {
+  volatile int locked;
+} mabutrace_lock_t;
+#define MABUTRACE_LOCK_INITIALIZER {0}
+
+typedef int mabutrace_irq_state_t;
+
+typedef sem_t mabutrace_semaphore_t;
+
+// glibc doesn't know its largest free block.
+#define MABUTRACE_HEAP_FREE_COUNTER "Free Bytes"
+
+#endif  // ESP_PLATFORM
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+* Time since boot (ESP) or since an arbitrary fixed point (host) in microseconds.
+*/
+static inline uint64_t mabutrace_platform_time_us();
+
+/*
+* Calibrates the trace clock against the reference timer (esp_timer on ESP, CLOCK_MONOTONIC on the host), which
+* includes measuring the offset of the cycle counter of every CPU. Must be called before the trace clock is used.
+*/
+esp_err_t mabutrace_platform_clock_init();
+void mabutrace_platform_clock_deinit();
+
+/*
+* Current time of the trace clock in ticks. The same on all CPUs, and ticks / mabutrace_platform_clock_frequency()
+* is the time in seconds of the reference timer.
+*/
+static inline uint64_t mabutrace_platform_clock_ticks();
+
+/*
+* Ticks per second of the trace clock.
+*/
+uint64_t mabutrace_platform_clock_frequency();
+
+/*
+* True if called from interrupt context. Always false on the host.
+*/
+static inline bool mabutrace_platform_in_isr();
+
+/*
+* Index of the CPU the caller currently runs on, in [0, MABUTRACE_NUM_CPUS).
+*/
+static inline uint8_t mabutrace_platform_cpu_id();
+
+/*
+* Handle of the calling task.
+*/
+static inline TaskHandle_t mabutrace_platform_current_task();
+
+/*
+* Copies the name of the given task into name (always null terminated).
+*/
+void mabutrace_platform_task_name(TaskHandle_t task, char* name, size_t name_size);
+
+/*
+* One pointer sized value per task that the tracer uses to cache the compact ID of the task, so that looking it
+* up is a single load. Reads 0 until set. Setting it is not allowed from interrupts.
+* On ESP-IDF this uses the FreeRTOS thread local storage pointer MABUTRACE_TLS_INDEX, which requires
+* CONFIG_FREERTOS_THREAD_LOCAL_STORAGE_POINTERS >= 2 (index 0 is used by the pthread component). Otherwise
+* nothing is cached and the tracer falls back to looking the task up in its task table. On the host only the
+* value of the calling thread is available, and setting it arranges for trace_task_delete to be called when the
+* thread exits.
+*/
+static inline uintptr_t mabutrace_platform_get_task_local(TaskHandle_t task);
+static inline void mabutrace_platform_set_task_local(TaskHandle_t task, uintptr_t value);
+
+/*
+* Spinlock that is safe to take from tasks and interrupts.
+*/
+static inline void mabutrace_platform_lock(mabutrace_lock_t* lock);
+static inline void mabutrace_platform_unlock(mabutrace_lock_t* lock);
+
+/*
+* Makes the caller the only context running on its CPU that can be inside such a section, i.e. it can't be
+* preempted or interrupted by other code that enters the section on the same CPU. Used to protect the per CPU
+* ring buffers. out_cpu_id receives the CPU of the caller, which can't change until the section is exited.
+*/
+static inline mabutrace_irq_state_t mabutrace_platform_enter_core_local(uint8_t* out_cpu_id);
+static inline void mabutrace_platform_exit_core_local(uint8_t cpu_id, mabutrace_irq_state_t state);
+
+/*
+* Blocks the calling task for at least the given number of milliseconds.
+*/
+static inline void mabutrace_platform_delay_ms(uint32_t ms);
+
+/*
+* Memory a buffer is allocated in. The host has no external RAM and uses the heap for all of them.
+*/
+#define MABUTRACE_MEMORY_DEFAULT 0  // Wherever malloc allocates.
+#define MABUTRACE_MEMORY_INTERNAL 1  // Internal RAM only.
+#define MABUTRACE_MEMORY_EXTERNAL 2  // External RAM (PSRAM) only, fails if there is none.
+#define MABUTRACE_MEMORY_PREFER_EXTERNAL 3  // External RAM if available, otherwise like MABUTRACE_MEMORY_DEFAULT.
+
+/*
+* Allocates a zero initialized buffer in the given memory (MABUTRACE_MEMORY_*). Returns NULL on failure.
+*/
+static inline void* mabutrace_platform_calloc(size_t size, uint8_t memory);
+
+/*
+* Bytes of the default heap in use and the free memory reported by the MABUTRACE_HEAP_FREE_COUNTER counter: the
+* size of the largest free block on ESP-IDF, all free bytes of the heap on the host. Walks the heap, so it is not cheap.
+*/
+void mabutrace_platform_heap_info(size_t* out_used_bytes, size_t* out_free_bytes);
+
+/*
+* Runs function(arg) in a new task (a detached thread on the host), which ends when function returns.
+* stack_size is in bytes, priority is the FreeRTOS priority. Both are ignored on the host.
+*/
+esp_err_t mabutrace_platform_start_task(void (*function)(void*), const char* name, uint32_t stack_size, uint8_t priority, void* arg);
+
+/*
+* Counting semaphore for handing work between tasks. take blocks until the count is above 0.
+*/
+esp_err_t mabutrace_platform_semaphore_init(mabutrace_semaphore_t* semaphore, uint32_t max_count, uint32_t initial_count);
+void mabutrace_platform_semaphore_deinit(mabutrace_semaphore_t* semaphore);
+void mabutrace_platform_semaphore_give(mabutrace_semaphore_t* semaphore);
+void mabutrace_platform_semaphore_take(mabutrace_semaphore_t* semaphore);
+
+#ifdef ESP_PLATFORM
+
+static inline uint64_t IRAM_ATTR mabutrace_platform_time_us() {
+  return (uint64_t)esp_timer_get_time();
+}
+
+// Implemented in mabutrace_platform_esp.c. The 32 bit cycle counter of each CPU is extended to 64 bits, and
+// offset so that it counts from the boot time of esp_timer.
+typedef struct {
+  uint32_t last_cycle_count;
+  uint32_t wrap_count;
+  uint64_t offset;
+} mabutrace_platform_esp_clock_t;
+extern mabutrace_platform_esp_clock_t mabutrace_platform_esp_clocks[MABUTRACE_NUM_CPUS];
+
+static inline uint64_t IRAM_ATTR mabutrace_platform_clock_ticks() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+  // Masking interrupts keeps the extension consistent and the caller on the CPU the counter was read from.
+  UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+  mabutrace_platform_esp_clock_t* clock = &mabutrace_platform_esp_clocks[xPortGetCoreID()];
+  uint32_t cycle_count = MABUTRACE_READ_CYCLE_COUNT();
+  if (cycle_count < clock->last_cycle_count)
+    clock->wrap_count++;
+  clock->last_cycle_count = cycle_count;
+  uint64_t ticks = (((uint64_t)clock->wrap_count << 32) | cycle_count) - clock->offset;
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+  return ticks;
+#else
+  return (uint64_t)esp_timer_get_time();
+#endif
+}
+
+static inline bool IRAM_ATTR mabutrace_platform_in_isr() {
+  return xPortInIsrContext();
+}
+
+static inline uint8_t IRAM_ATTR mabutrace_platform_cpu_id() {
+  return (uint8_t)xPortGetCoreID();
+}
+
+static inline TaskHandle_t IRAM_ATTR mabutrace_platform_current_task() {
+  return xTaskGetCurrentTaskHandle();
+}
+
+static inline uintptr_t IRAM_ATTR mabutrace_platform_get_task_local(TaskHandle_t task) {
+#ifdef MABUTRACE_TLS_INDEX
+  return (uintptr_t)pvTaskGetThreadLocalStoragePointer(task, MABUTRACE_TLS_INDEX);
+#else
+  return 0;
+#endif
+}
+
+static inline void IRAM_ATTR mabutrace_platform_set_task_local(TaskHandle_t task, uintptr_t value) {
+#ifdef MABUTRACE_TLS_INDEX
+  vTaskSetThreadLocalStoragePointer(task, MABUTRACE_TLS_INDEX, (void*)value);
+#endif
+}
+
+static inline void IRAM_ATTR mabutrace_platform_lock(mabutrace_lock_t* lock) {
+  taskENTER_CRITICAL(lock);
+}
+
+static inline void IRAM_ATTR mabutrace_platform_unlock(mabutrace_lock_t* lock) {
+  taskEXIT_CRITICAL(lock);
+}
+
+static inline mabutrace_irq_state_t IRAM_ATTR mabutrace_platform_enter_core_local(uint8_t* out_cpu_id) {
+  // Masking interrupts on the local CPU also prevents preemption and migration to another CPU.
+  mabutrace_irq_state_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+  *out_cpu_id = (uint8_t)xPortGetCoreID();
+  return state;
+}
+
+static inline void IRAM_ATTR mabutrace_platform_exit_core_local(uint8_t cpu_id, mabutrace_irq_state_t state) {
+  (void)cpu_id;
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+static inline void mabutrace_platform_delay_ms(uint32_t ms) {
+  // At least one tick, so that tasks of lower priority run even if ms is shorter than a tick.
+  TickType_t ticks = pdMS_TO_TICKS(ms);
+  vTaskDelay(ticks ? ticks : 1);
+}
+
+static inline void* mabutrace_platform_calloc(size_t size, uint8_t memory) {
+  switch (memory) {
+    case MABUTRACE_MEMORY_INTERNAL:
+      return heap_caps_calloc(size, 1, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    case MABUTRACE_MEMORY_EXTERNAL:
+      return heap_caps_calloc(size, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    case MABUTRACE_MEMORY_PREFER_EXTERNAL: {
+      void* buffer = heap_caps_calloc(size, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+      if (buffer)
+        return buffer;
+      break;
+    }
+  }
+  return calloc(size, 1);
+}
+
+#else  // Linux host backend
+
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+// Implemented in mabutrace_platform_linux.c, which needs _GNU_SOURCE.
+uint8_t mabutrace_platform_linux_cpu_id();
+// Invariant TSC and the generic timer are synchronized across CPUs, so one offset is enough.
+extern uint64_t mabutrace_platform_linux_clock_offset;
+TaskHandle_t mabutrace_platform_linux_current_task();
+void mabutrace_platform_linux_set_task_local(uintptr_t value);
+extern __thread uintptr_t mabutrace_platform_linux_task_local;
+// Host threads can't mask interrupts, so the per CPU sections are protected by one spinlock per simulated CPU.
+extern mabutrace_lock_t mabutrace_platform_linux_core_locks[MABUTRACE_NUM_CPUS];
+
+static inline uint64_t mabutrace_platform_time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+static inline uint64_t mabutrace_platform_linux_read_cycle_count() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES && (defined(__x86_64__) || defined(__i386__))
+  return __rdtsc();
+#elif MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES && defined(__aarch64__)
+  uint64_t count;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(count));
+  return count;
+#else
+  return 0;
+#endif
+}
+
+static inline uint64_t mabutrace_platform_clock_ticks() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+  return mabutrace_platform_linux_read_cycle_count() - mabutrace_platform_linux_clock_offset;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline bool mabutrace_platform_in_isr() {
+  return false;
+}
+
+static inline uint8_t mabutrace_platform_cpu_id() {
+  return mabutrace_platform_linux_cpu_id();
+}
+
+static inline TaskHandle_t mabutrace_platform_current_task() {
+  return mabutrace_platform_linux_current_task();
+}
+
+static inline uintptr_t mabutrace_platform_get_task_local(TaskHandle_t task) {
+  return task == mabutrace_platform_linux_current_task() ? mabutrace_platform_linux_task_local : 0;
+}
+
+static inline void mabutrace_platform_set_task_local(TaskHandle_t task, uintptr_t value) {
+  if (task == mabutrace_platform_linux_current_task())
+    mabutrace_platform_linux_set_task_local(value);
+}
+
+static inline void mabutrace_platform_lock(mabutrace_lock_t* lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+      sched_yield();
+  }
+}
+
+static inline void mabutrace_platform_unlock(mabutrace_lock_t* lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline mabutrace_irq_state_t mabutrace_platform_enter_core_local(uint8_t* out_cpu_id) {
+  uint8_t cpu_id = mabutrace_platform_linux_cpu_id();
+  mabutrace_platform_lock(&mabutrace_platform_linux_core_locks[cpu_id]);
+  *out_cpu_id = cpu_id;
+  return 0;
+}
+
+static inline void mabutrace_platform_exit_core_local(uint8_t cpu_id, mabutrace_irq_state_t state) {
+  (void)state;
+  mabutrace_platform_unlock(&mabutrace_platform_linux_core_locks[cpu_id]);
+}
+
+static inline void mabutrace_platform_delay_ms(uint32_t ms) {
+  usleep((useconds_t)ms * 1000);
+}
+
+static inline void* mabutrace_platform_calloc(size_t size, uint8_t memory) {
+  (void)memory;
+  return calloc(size, 1);
+}
+
+#endif  // ESP_PLATFORM
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __MABUTRACE_PLATFORM_H__
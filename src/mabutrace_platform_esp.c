@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// ESP-IDF / Arduino-ESP32 backend of the platform abstraction layer. See mabutrace_platform.h.
+
+#ifdef ESP_PLATFORM
+
+#include "mabutrace_platform.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_freertos_hooks.h"
+#include "esp_rom_sys.h"
+#if MABUTRACE_NUM_CPUS > 1
+#include "esp_ipc.h"
+#endif
+
+static const char *TAG = "MABUTRACE";
+
+mabutrace_platform_esp_clock_t mabutrace_platform_esp_clocks[MABUTRACE_NUM_CPUS];
+static uint64_t clock_frequency = 1000000;
+
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+// Reads the cycle counter and esp_timer back to back with interrupts masked and sets the offset that maps the
+// counter of the calling CPU onto the esp_timer time line. esp_timer only resolves microseconds, so the other CPUs
+// are aligned to this one with sync_cpu_clock instead.
+static void IRAM_ATTR calibrate_cpu_clock() {
+  UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+  mabutrace_platform_esp_clock_t* clock = &mabutrace_platform_esp_clocks[xPortGetCoreID()];
+  uint64_t reference_us = (uint64_t)esp_timer_get_time();
+  uint32_t cycle_count = MABUTRACE_READ_CYCLE_COUNT();
+  clock->last_cycle_count = cycle_count;
+  clock->wrap_count = 0;
+  clock->offset = (uint64_t)cycle_count - reference_us * (clock_frequency / 1000000);
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+#if MABUTRACE_NUM_CPUS > 1
+#define CLOCK_SYNC_ROUNDS 16
+
+// Handshake between the calibrated CPU and the one aligned to it. In each round the calibrated CPU posts a request
+// and the other one answers with its cycle counter, which was read between the request and the answer.
+static struct {
+  atomic_uint request;  // Round asked for. CLOCK_SYNC_ROUNDS + 1 ends the handshake.
+  atomic_uint reply;  // Round answered.
+  uint32_t cycle_count;  // Cycle counter of the answering CPU.
+} clock_sync;
+
+// Runs on the CPU that is aligned, through IPC. Interrupts stay masked until the handshake ends, so the answers
+// are not delayed and nothing reads the clock of this CPU while the calibrated CPU sets it.
+static void IRAM_ATTR answer_clock_sync(void* arg) {
+  (void)arg;
+  UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+  for (unsigned int round = 1; round <= CLOCK_SYNC_ROUNDS + 1; round++) {
+    while (atomic_load(&clock_sync.request) != round) {
+    }
+    clock_sync.cycle_count = MABUTRACE_READ_CYCLE_COUNT();
+    atomic_store(&clock_sync.reply, round);
+  }
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+// Aligns the cycle counter of another CPU to the one of the calling CPU, which must be calibrated and must not
+// change. The answer of the fastest round is taken to have been read halfway through it, so the clocks agree to
+// within half its round trip, a few dozen cycles.
+static esp_err_t sync_cpu_clock(int cpu) {
+  atomic_store(&clock_sync.request, 0);
+  atomic_store(&clock_sync.reply, 0);
+  // Returns once answer_clock_sync runs on the other CPU.
+  esp_err_t res = esp_ipc_call(cpu, answer_clock_sync, NULL);
+  if (res != ESP_OK)
+    return res;
+  UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+  // Updates last_cycle_count, so that the counter doesn't wrap again before the handshake ends.
+  (void)mabutrace_platform_clock_ticks();
+  const mabutrace_platform_esp_clock_t* clock = &mabutrace_platform_esp_clocks[xPortGetCoreID()];
+  uint32_t best_round_trip = UINT32_MAX;
+  uint32_t local_cycle_count = 0;
+  uint32_t remote_cycle_count = 0;
+  for (unsigned int round = 1; round <= CLOCK_SYNC_ROUNDS; round++) {
+    uint32_t before = MABUTRACE_READ_CYCLE_COUNT();
+    atomic_store(&clock_sync.request, round);
+    while (atomic_load(&clock_sync.reply) != round) {
+    }
+    uint32_t round_trip = MABUTRACE_READ_CYCLE_COUNT() - before;
+    if (round_trip < best_round_trip) {
+      best_round_trip = round_trip;
+      local_cycle_count = before + round_trip / 2;
+      remote_cycle_count = clock_sync.cycle_count;
+    }
+  }
+  uint64_t local_ticks = (((uint64_t)clock->wrap_count << 32) | clock->last_cycle_count) +
+                         (uint32_t)(local_cycle_count - clock->last_cycle_count) - clock->offset;
+  mabutrace_platform_esp_clock_t* remote_clock = &mabutrace_platform_esp_clocks[cpu];
+  remote_clock->last_cycle_count = remote_cycle_count;
+  remote_clock->wrap_count = 0;
+  remote_clock->offset = (uint64_t)remote_cycle_count - local_ticks;
+  atomic_store(&clock_sync.request, CLOCK_SYNC_ROUNDS + 1);
+  while (atomic_load(&clock_sync.reply) != CLOCK_SYNC_ROUNDS + 1) {
+  }
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+  return ESP_OK;
+}
+
+typedef struct {
+  SemaphoreHandle_t done;
+  esp_err_t res;
+} clock_calibration_t;
+
+// Pinned to CPU 0, so that the CPU the others are aligned to stays the same.
+static void calibrate_clocks_task(void* arg) {
+  clock_calibration_t* calibration = (clock_calibration_t*)arg;
+  calibrate_cpu_clock();
+  calibration->res = ESP_OK;
+  for (int cpu = 1; cpu < MABUTRACE_NUM_CPUS && calibration->res == ESP_OK; cpu++) {
+    calibration->res = sync_cpu_clock(cpu);
+    if (calibration->res != ESP_OK)
+      ESP_LOGE(TAG, "Failed to calibrate the cycle counter of CPU %d.", cpu);
+  }
+  xSemaphoreGive(calibration->done);
+  vTaskDelete(NULL);
+}
+#endif
+
+// The 32 bit cycle counter wraps every few seconds. Reading the clock from the tick interrupt of each CPU makes
+// sure no wrap goes unnoticed, even if nothing is traced for a long time.
+static void IRAM_ATTR clock_tick_hook() {
+  (void)mabutrace_platform_clock_ticks();
+}
+#endif
+
+esp_err_t mabutrace_platform_clock_init() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+  // The cycle counter runs at the CPU frequency, which is a whole number of MHz.
+  clock_frequency = (uint64_t)esp_rom_get_cpu_ticks_per_us() * 1000000;
+#if MABUTRACE_NUM_CPUS > 1
+  clock_calibration_t calibration = {xSemaphoreCreateBinary(), ESP_FAIL};
+  if (!calibration.done)
+    return ESP_ERR_NO_MEM;
+  if (xTaskCreatePinnedToCore(calibrate_clocks_task, "mabutrace_clk", 2048, &calibration, configMAX_PRIORITIES - 1,
+                              NULL, 0) != pdPASS) {
+    vSemaphoreDelete(calibration.done);
+    return ESP_ERR_NO_MEM;
+  }
+  xSemaphoreTake(calibration.done, portMAX_DELAY);
+  vSemaphoreDelete(calibration.done);
+  if (calibration.res != ESP_OK)
+    return calibration.res;
+#else
+  calibrate_cpu_clock();
+#endif
+  for (int cpu = 0; cpu < MABUTRACE_NUM_CPUS; cpu++) {
+    esp_err_t res = esp_register_freertos_tick_hook_for_cpu(clock_tick_hook, cpu);
+    if (res != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to register the clock tick hook of CPU %d.", cpu);
+      mabutrace_platform_clock_deinit();
+      return res;
+    }
+  }
+  ESP_LOGI(TAG, "Trace clock: cycle counter at %u MHz.", (unsigned int)(clock_frequency / 1000000));
+#else
+  clock_frequency = 1000000;
+#endif
+  return ESP_OK;
+}
+
+void mabutrace_platform_clock_deinit() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+  for (int cpu = 0; cpu < MABUTRACE_NUM_CPUS; cpu++) {
+    esp_deregister_freertos_tick_hook_for_cpu(clock_tick_hook, cpu);
+  }
+#endif
+}
+
+uint64_t mabutrace_platform_clock_frequency() {
+  return clock_frequency;
+}
+
+typedef struct {
+  void (*function)(void*);
+  void* arg;
+} task_start_t;
+
+static void task_entry(void* param) {
+  task_start_t start = *(task_start_t*)param;
+  free(param);
+  start.function(start.arg);
+  vTaskDelete(NULL);
+}
+
+esp_err_t mabutrace_platform_start_task(void (*function)(void*), const char* name, uint32_t stack_size, uint8_t priority, void* arg) {
+  task_start_t* start = (task_start_t*)malloc(sizeof(task_start_t));
+  if (!start)
+    return ESP_ERR_NO_MEM;
+  start->function = function;
+  start->arg = arg;
+  if (xTaskCreate(task_entry, name, stack_size, start, priority, NULL) != pdPASS) {
+    free(start);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t mabutrace_platform_semaphore_init(mabutrace_semaphore_t* semaphore, uint32_t max_count, uint32_t initial_count) {
+  *semaphore = xSemaphoreCreateCounting(max_count, initial_count);
+  return *semaphore ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+void mabutrace_platform_semaphore_deinit(mabutrace_semaphore_t* semaphore) {
+  vSemaphoreDelete(*semaphore);
+}
+
+void mabutrace_platform_semaphore_give(mabutrace_semaphore_t* semaphore) {
+  xSemaphoreGive(*semaphore);
+}
+
+void mabutrace_platform_semaphore_take(mabutrace_semaphore_t* semaphore) {
+  xSemaphoreTake(*semaphore, portMAX_DELAY);
+}
+
+void mabutrace_platform_task_name(TaskHandle_t task, char* name, size_t name_size) {
+  const char* task_name = task ? pcTaskGetName(task) : NULL;
+  strncpy(name, task_name ? task_name : "", name_size - 1);
+  name[name_size - 1] = '\0';
+}
+
+void mabutrace_platform_heap_info(size_t* out_used_bytes, size_t* out_free_bytes) {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  *out_used_bytes = info.total_allocated_bytes;
+  *out_free_bytes = info.largest_free_block;
+}
+
+#endif  // ESP_PLATFORM
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Linux host backend of the platform abstraction layer. See mabutrace_platform.h.
+
+#ifndef ESP_PLATFORM
+
+#define _GNU_SOURCE
+
+#include "mabutrace_platform.h"
+#include "mabutrace_hooks.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+mabutrace_lock_t mabutrace_platform_linux_core_locks[MABUTRACE_NUM_CPUS];
+__thread uintptr_t mabutrace_platform_linux_task_local = 0;
+uint64_t mabutrace_platform_linux_clock_offset = 0;
+static uint64_t clock_frequency = 1000000000;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+// Stands in for the traceTASK_DELETE hook of FreeRTOS, so the tracer snapshots the thread name while it is
+// still available and can recycle the ID of the thread.
+static void on_thread_exit(void* value) {
+  (void)value;
+  trace_task_delete(mabutrace_platform_linux_current_task());
+}
+
+static void create_thread_exit_key() {
+  pthread_key_create(&thread_exit_key, on_thread_exit);
+}
+
+uint8_t mabutrace_platform_linux_cpu_id() {
+  int cpu = sched_getcpu();
+  if (cpu < 0)
+    return 0;
+  return (uint8_t)(cpu % MABUTRACE_NUM_CPUS);
+}
+
+TaskHandle_t mabutrace_platform_linux_current_task() {
+  return (TaskHandle_t)pthread_self();
+}
+
+void mabutrace_platform_linux_set_task_local(uintptr_t value) {
+  mabutrace_platform_linux_task_local = value;
+  // The destructor of a key only runs for threads that set a non NULL value.
+  pthread_once(&thread_exit_key_once, create_thread_exit_key);
+  pthread_setspecific(thread_exit_key, (void*)1);
+}
+
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Reads the cycle counter and CLOCK_MONOTONIC as close together as possible, taking the tightest of a few tries.
+static void sample_clocks(uint64_t* out_ns, uint64_t* out_cycles) {
+  uint64_t best_window = UINT64_MAX;
+  for (int i = 0; i < 8; i++) {
+    uint64_t before = mabutrace_platform_linux_read_cycle_count();
+    uint64_t ns = monotonic_ns();
+    uint64_t after = mabutrace_platform_linux_read_cycle_count();
+    if (after - before < best_window) {
+      best_window = after - before;
+      *out_ns = ns;
+      *out_cycles = before + (after - before) / 2;
+    }
+  }
+}
+#endif
+
+esp_err_t mabutrace_platform_clock_init() {
+#if MABUTRACE_CLOCK_SOURCE == MABUTRACE_CLOCK_SOURCE_CYCLES
+  uint64_t start_ns, start_cycles, end_ns, end_cycles;
+  sample_clocks(&start_ns, &start_cycles);
+#if defined(__aarch64__)
+  uint64_t frequency;
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+  clock_frequency = frequency;
+  (void)end_ns;
+  (void)end_cycles;
+#else
+  // The TSC frequency is not exposed to user space, measure it.
+  usleep(50000);
+  sample_clocks(&end_ns, &end_cycles);
+  if (end_ns <= start_ns)
+    return ESP_FAIL;
+  clock_frequency = (uint64_t)((double)(end_cycles - start_cycles) * 1e9 / (double)(end_ns - start_ns));
+#endif
+  if (clock_frequency == 0)
+    return ESP_FAIL;
+  mabutrace_platform_linux_clock_offset = start_cycles - (uint64_t)((double)start_ns * 1e-9 * (double)clock_frequency);
+#else
+  clock_frequency = 1000000000;
+#endif
+  return ESP_OK;
+}
+
+void mabutrace_platform_clock_deinit() {
+}
+
+uint64_t mabutrace_platform_clock_frequency() {
+  return clock_frequency;
+}
+
+typedef struct {
+  void (*function)(void*);
+  void* arg;
+} task_start_t;
+
+static void* thread_entry(void* param) {
+  task_start_t start = *(task_start_t*)param;
+  free(param);
+  start.function(start.arg);
+  return NULL;
+}
+
+esp_err_t mabutrace_platform_start_task(void (*function)(void*), const char* name, uint32_t stack_size, uint8_t priority, void* arg) {
+  (void)stack_size;
+  (void)priority;
+  task_start_t* start = (task_start_t*)malloc(sizeof(task_start_t));
+  if (!start)
+    return ESP_ERR_NO_MEM;
+  start->function = function;
+  start->arg = arg;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, thread_entry, start) != 0) {
+    free(start);
+    return ESP_ERR_NO_MEM;
+  }
+  pthread_setname_np(thread, name);
+  pthread_detach(thread);
+  return ESP_OK;
+}
+
+esp_err_t mabutrace_platform_semaphore_init(mabutrace_semaphore_t* semaphore, uint32_t max_count, uint32_t initial_count) {
+  (void)max_count;
+  return sem_init(semaphore, 0, initial_count) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+void mabutrace_platform_semaphore_deinit(mabutrace_semaphore_t* semaphore) {
+  sem_destroy(semaphore);
+}
+
+void mabutrace_platform_semaphore_give(mabutrace_semaphore_t* semaphore) {
+  sem_post(semaphore);
+}
+
+void mabutrace_platform_semaphore_take(mabutrace_semaphore_t* semaphore) {
+  while (sem_wait(semaphore) != 0 && errno == EINTR) {
+  }
+}
+
+void mabutrace_platform_task_name(TaskHandle_t task, char* name, size_t name_size) {
+  name[0] = '\0';
+  if (!task || pthread_getname_np((pthread_t)task, name, name_size) != 0)
+    snprintf(name, name_size, "Thread %p", task);
+}
+
+void mabutrace_platform_heap_info(size_t* out_used_bytes, size_t* out_free_bytes) {
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+#else
+  struct mallinfo info = mallinfo();
+#endif
+  *out_used_bytes = (size_t)info.uordblks + (size_t)info.hblkhd;
+  *out_free_bytes = info.fordblks;
+}
+
+#endif  // ESP_PLATFORM
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Tracing of FreeRTOS queues, semaphores and mutexes. In builds with MABUTRACE_QUEUE_TRACING, the queue hooks of
+// mabutrace_hooks.h report every send and receive. Each one is recorded as an EVENT_TYPE_QUEUE_* entry on the
+// track of the calling task, with the fill level of the queue, how long the task was blocked on it and the number
+// of the item, which links the receiver to the sender. The hooks run in the critical section of their queue, so
+// the operations on a queue are serialized.
+
+#include "mabutrace.h"
+#include "mabutrace_hooks.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+// Kinds of queues reported by the hooks.
+#define QUEUE_KIND_QUEUE 0
+#define QUEUE_KIND_SEMAPHORE 1
+#define QUEUE_KIND_MUTEX 2
+
+#define QUEUE_INDEX_SIZE (MABUTRACE_MAX_QUEUES * 2)
+#define QUEUE_INDEX_DELETED UINT16_MAX  // Position of a deleted queue, can be reused but doesn't end a probe sequence.
+
+static const char *TAG = "MABUTRACE";
+
+// Registry of the traced queues, found by open addressing on the queue handle. Slots are claimed under
+// queue_slots_mutex. The slot of a deleted queue keeps its tracepoint until every event that refers to it has been
+// evicted from the rings, and only then is it given to another queue, together with the tracepoint ID.
+typedef struct {
+  void* queue;  // NULL once the queue has been deleted.
+  bool named;  // Named with mabutrace_name_queue.
+  uint32_t sent_items;  // Items sent since the queue was registered, numbers the items.
+  mabutrace_rings_mark_t deleted_at;  // Where the rings were when the queue was deleted.
+  mabutrace_tracepoint_t tracepoint;  // Named after the queue.
+  char name[MABUTRACE_QUEUE_NAME_LENGTH];
+} queue_slot_t;
+
+static queue_slot_t queue_slots[MABUTRACE_MAX_QUEUES];
+// 1 + index into queue_slots, 0 if empty or QUEUE_INDEX_DELETED.
+static _Atomic uint16_t queue_index[QUEUE_INDEX_SIZE];
+static uint16_t queue_count = 0;
+static unsigned int queue_number = 0;  // Numbers the queues in their default names.
+static bool queues_full_logged = false;
+static volatile uint8_t queue_tracing = MABUTRACE_TRACE_QUEUES_NONE;
+static mabutrace_lock_t queue_slots_mutex = MABUTRACE_LOCK_INITIALIZER;
+
+// Returns the slot of a queue and its index position, or NULL and the index position to insert it at
+// (QUEUE_INDEX_SIZE if the index is full).
+static inline queue_slot_t* IRAM_ATTR find_queue(void* queue, uint16_t* out_position) {
+  uint16_t position = mabutrace_hash_pointer(queue, 0, QUEUE_INDEX_SIZE);
+  *out_position = QUEUE_INDEX_SIZE;
+  for (int i = 0; i < QUEUE_INDEX_SIZE; i++) {
+    uint16_t index = atomic_load(&queue_index[position]);
+    if (index == QUEUE_INDEX_DELETED) {
+      if (*out_position == QUEUE_INDEX_SIZE)
+        *out_position = position;
+    } else if (index == 0) {
+      if (*out_position == QUEUE_INDEX_SIZE)
+        *out_position = position;
+      return NULL;
+    } else if (queue_slots[index - 1].queue == queue) {
+      *out_position = position;
+      return &queue_slots[index - 1];
+    }
+    position = (position + 1) % QUEUE_INDEX_SIZE;
+  }
+  return NULL;
+}
+
+// Returns an unused slot, or the slot of a deleted queue whose events are all gone, NULL if there is none. Must
+// hold queue_slots_mutex.
+static queue_slot_t* IRAM_ATTR claim_queue_slot() {
+  if (queue_count < MABUTRACE_MAX_QUEUES) {
+    queue_slot_t* slot = &queue_slots[queue_count++];
+    mabutrace_tracepoint_t tracepoint = MABUTRACE_TRACEPOINT_INIT(slot->name, COLOR_UNDEFINED, MABUTRACE_CATEGORY);
+    slot->tracepoint = tracepoint;
+    return slot;
+  }
+  for (int i = 0; i < MABUTRACE_MAX_QUEUES; i++) {
+    // The tracepoint keeps its ID, which now stands for the new queue.
+    if (!queue_slots[i].queue && mabutrace_rings_evicted(&queue_slots[i].deleted_at))
+      return &queue_slots[i];
+  }
+  return NULL;
+}
+
+// Writes prefix followed by number into name.
+static void IRAM_ATTR format_queue_name(char* name, const char* prefix, unsigned int number) {
+  size_t length = strlen(prefix);
+  memcpy(name, prefix, length);
+  char digits[10];
+  int count = 0;
+  do {
+    digits[count++] = '0' + number % 10;
+    number /= 10;
+  } while (number);
+  while (count) {
+    name[length++] = digits[--count];
+  }
+  name[length] = 0;
+}
+
+// Claims a slot for the queue, named after its kind until it is given a name. Returns NULL if the registry is full.
+static queue_slot_t* IRAM_ATTR register_queue(void* queue, uint8_t kind) {
+  static const char* kind_names[] = {"Queue ", "Semaphore ", "Mutex "};
+  uint16_t position;
+  mabutrace_platform_lock(&queue_slots_mutex);
+  // Look again, another context may have registered it in the meantime.
+  queue_slot_t* slot = find_queue(queue, &position);
+  if (!slot && position < QUEUE_INDEX_SIZE) {
+    slot = claim_queue_slot();
+    if (slot) {
+      slot->named = false;
+      slot->sent_items = 0;
+      format_queue_name(slot->name, kind_names[kind], ++queue_number);
+      // A recycled tracepoint has been sent to stream readers under the name of the deleted queue.
+      atomic_thread_fence(memory_order_release);
+      slot->tracepoint.name_generation++;
+      mabutrace_register_tracepoint(&slot->tracepoint);
+      slot->queue = queue;
+      // Published to find_queue after it is filled in.
+      atomic_store(&queue_index[position], slot - queue_slots + 1);
+    }
+  }
+  bool log_full = !slot && !queues_full_logged;
+  if (log_full)
+    queues_full_logged = true;
+  mabutrace_platform_unlock(&queue_slots_mutex);
+  if (log_full)
+    ESP_EARLY_LOGW(TAG, "All %d queue slots are taken, new queues aren't traced until deleted ones are evicted.",
+                   MABUTRACE_MAX_QUEUES);
+  return slot;
+}
+
+void mabutrace_set_queue_tracing(uint8_t mode) {
+  queue_tracing = mode;
+}
+
+void mabutrace_name_queue(void* queue, const char* name) {
+  uint16_t position;
+  queue_slot_t* slot = find_queue(queue, &position);
+  if (!slot)
+    slot = register_queue(queue, QUEUE_KIND_QUEUE);
+  if (!slot)
+    return;
+  mabutrace_platform_lock(&queue_slots_mutex);
+  strncpy(slot->name, name, sizeof(slot->name) - 1);
+  slot->name[sizeof(slot->name) - 1] = 0;
+  atomic_thread_fence(memory_order_release);
+  slot->tracepoint.name_generation++;
+  slot->named = true;
+  mabutrace_platform_unlock(&queue_slots_mutex);
+}
+
+void IRAM_ATTR trace_queue_blocking(void) {
+  if (queue_tracing != MABUTRACE_TRACE_QUEUES_NONE)
+    mabutrace_begin_queue_blocking();
+}
+
+void IRAM_ATTR trace_queue_event(void* queue, unsigned char type, unsigned char kind, unsigned int messages_waiting,
+                                 unsigned int length, unsigned int waiting_tasks) {
+  // Ends the blocking of every operation, so that it isn't attributed to a later one.
+  uint64_t blocked_ticks = mabutrace_end_queue_blocking();
+  uint8_t mode = queue_tracing;
+  if (mode == MABUTRACE_TRACE_QUEUES_NONE)
+    return;
+  uint16_t position;
+  queue_slot_t* slot = find_queue(queue, &position);
+  if (!slot && mode == MABUTRACE_TRACE_QUEUES_ALL)
+    slot = register_queue(queue, kind);
+  if (!slot || (mode == MABUTRACE_TRACE_QUEUES_NAMED && !slot->named))
+    return;
+
+  uint32_t fill = messages_waiting;
+  uint32_t item = 0;
+  if (type == EVENT_TYPE_QUEUE_SEND) {
+    // Sending to a full queue overwrites its only item.
+    if (messages_waiting < length)
+      fill++;
+    item = ++slot->sent_items;
+  } else if (type == EVENT_TYPE_QUEUE_RECEIVE) {
+    fill--;
+    // The oldest item was sent messages_waiting items ago, unknown if that was before the queue was registered.
+    if (slot->sent_items >= messages_waiting)
+      item = slot->sent_items - messages_waiting + 1;
+  }
+  if (kind == QUEUE_KIND_MUTEX) {
+    fill = MABUTRACE_QUEUE_FILL_NONE;
+    // Mutexes are mostly given back by the task that took them, only hand-overs to waiting tasks are linked.
+    if ((type == EVENT_TYPE_QUEUE_SEND && !waiting_tasks) || (type == EVENT_TYPE_QUEUE_RECEIVE && !blocked_ticks))
+      item = 0;
+  } else if (fill >= MABUTRACE_QUEUE_FILL_NONE) {
+    fill = MABUTRACE_QUEUE_FILL_NONE - 1;
+  }
+  if (slot->tracepoint.state == MABUTRACE_TRACEPOINT_ENABLED)
+    mabutrace_record_queue_event(type, slot->tracepoint.id, fill, item, blocked_ticks);
+}
+
+void trace_queue_delete(void* queue) {
+  uint16_t position;
+  mabutrace_platform_lock(&queue_slots_mutex);
+  queue_slot_t* slot = find_queue(queue, &position);
+  if (slot) {
+    // The queue can't be used any more, so everything written so far is all there will be.
+    mabutrace_mark_rings(&slot->deleted_at);
+    slot->queue = NULL;
+    atomic_store(&queue_index[position], QUEUE_INDEX_DELETED);
+  }
+  mabutrace_platform_unlock(&queue_slots_mutex);
+}
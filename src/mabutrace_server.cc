@@ -24,25 +24,76 @@
 #include "esp_http_server.h"
 #include "esp_log.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
 static const char *TAG = "MABUTRACE";
 
-void process_chunk(void* ctx, const char* chunk, size_t size) {
-    httpd_req_t* req = (httpd_req_t*)ctx;
-    assert(chunk[size] == '\0' && "Expected to be null terminated");
+// Collects the pieces written by the exporters into HTTP chunks. Large enough for a whole block of the JSON
+// exporter, each chunk costs a few socket sends.
+typedef struct {
+    httpd_req_t* req;
+    size_t length;
+    char buffer[4096];
+} chunked_response_t;
 
-    if (httpd_resp_send_chunk(req, chunk, size) != ESP_OK) {
+static void flush_response(chunked_response_t* response) {
+    if (response->length && httpd_resp_send_chunk(response->req, response->buffer, response->length) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to send chunk");
     }
+    response->length = 0;
 }
 
-esp_err_t request_handler_chunked(httpd_req_t *req) {
-    ESP_LOGI(TAG, "download request received.");
-    // Get the json string of trace
-    // Set the correct content type for JSON
-    httpd_resp_set_type(req, "application/json");
-    // Send the response
-    if(get_json_trace_chunked((void*)req, process_chunk) != ESP_OK) {
-        httpd_resp_send_500(req); // Convenience function for 500
+void process_chunk(void* ctx, const char* chunk, size_t size) {
+    chunked_response_t* response = (chunked_response_t*)ctx;
+    while (size) {
+        if (response->length == sizeof(response->buffer))
+            flush_response(response);
+        size_t part = std::min(size, sizeof(response->buffer) - response->length);
+        memcpy(response->buffer + response->length, chunk, part);
+        response->length += part;
+        chunk += part;
+        size -= part;
+    }
+}
+
+static bool accepts_gzip(httpd_req_t *req) {
+    char accept_encoding[128];
+    esp_err_t res = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding, sizeof(accept_encoding));
+    return (res == ESP_OK || res == ESP_ERR_HTTPD_RESULT_TRUNC) && strstr(accept_encoding, "gzip");
+}
+
+// Sends a trace written by get_trace, gzip compressed if the client accepts it.
+static esp_err_t send_trace(httpd_req_t *req, const char* content_type, const char* content_disposition,
+                            esp_err_t (*get_trace)(void*, void (*)(void*, const char*, size_t))) {
+    // Allocated, the stack of the server task is small.
+    chunked_response_t* response = (chunked_response_t*)malloc(sizeof(chunked_response_t));
+    if (!response) {
+        httpd_resp_send_500(req);
+        return ESP_OK;
+    }
+    response->req = req;
+    response->length = 0;
+    httpd_resp_set_type(req, content_type);
+    if (content_disposition)
+        httpd_resp_set_hdr(req, "Content-Disposition", content_disposition);
+    mabutrace_gzip_stream_t* gzip = accepts_gzip(req) ? mabutrace_gzip_begin(response, process_chunk) : NULL;
+    esp_err_t res;
+    if (gzip) {
+        // The gzip header is still in the response buffer, so the response headers haven't been sent yet.
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        res = get_trace(gzip, mabutrace_gzip_chunk);
+        esp_err_t gzip_res = mabutrace_gzip_end(gzip);
+        if (res == ESP_OK)
+            res = gzip_res;
+    } else {
+        res = get_trace(response, process_chunk);
+    }
+    flush_response(response);
+    free(response);
+    if (res != ESP_OK) {
+        httpd_resp_send_500(req);
         return ESP_OK;
     }
     // Send the final, zero-length chunk to signify the end of the response
@@ -53,6 +104,25 @@ esp_err_t request_handler_chunked(httpd_req_t *req) {
     return ESP_OK;
 }
 
+esp_err_t request_handler_chunked(httpd_req_t *req) {
+    ESP_LOGI(TAG, "download request received.");
+    return send_trace(req, "application/json", NULL, get_json_trace_chunked);
+}
+
+esp_err_t request_handler_binary(httpd_req_t *req) {
+    ESP_LOGI(TAG, "binary download request received.");
+    return send_trace(req, "application/octet-stream", "attachment; filename=\"trace.bin\"", get_binary_trace_chunked);
+}
+
+esp_err_t request_handler_perfetto(httpd_req_t *req) {
+    ESP_LOGI(TAG, "perfetto download request received.");
+    return send_trace(req, "application/octet-stream", "attachment; filename=\"trace.pftrace\"", get_perfetto_trace_chunked);
+}
+
+esp_err_t request_handler_stats(httpd_req_t *req) {
+    return send_trace(req, "application/json", NULL, get_scope_stats_json_chunked);
+}
+
 esp_err_t mabutrace_start_server(int port) {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.task_priority++;
@@ -86,6 +156,30 @@ esp_err_t mabutrace_start_server(int port) {
     };
     httpd_register_uri_handler(server_handle, &trace_uri);
 
+    httpd_uri_t trace_binary_uri = {
+        .uri       = "/trace.bin",
+        .method    = HTTP_GET,
+        .handler   = request_handler_binary,
+        .user_ctx  = NULL
+    };
+    httpd_register_uri_handler(server_handle, &trace_binary_uri);
+
+    httpd_uri_t trace_perfetto_uri = {
+        .uri       = "/trace.pftrace",
+        .method    = HTTP_GET,
+        .handler   = request_handler_perfetto,
+        .user_ctx  = NULL
+    };
+    httpd_register_uri_handler(server_handle, &trace_perfetto_uri);
+
+    httpd_uri_t stats_uri = {
+        .uri       = "/stats",
+        .method    = HTTP_GET,
+        .handler   = request_handler_stats,
+        .user_ctx  = NULL
+    };
+    httpd_register_uri_handler(server_handle, &stats_uri);
+
     ESP_LOGI(TAG, "Server started.");
     return ESP_OK;
 }
\ No newline at end of file
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Live streaming of the binary trace over TCP. Uses BSD sockets, which lwIP provides on ESP-IDF, so the same code
+// runs on the host.
+
+#include "mabutrace.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const char *TAG = "MABUTRACE";
+
+#define STREAM_TASK_STACK_SIZE 4096
+#define STREAM_SEND_BUFFER_SIZE 1436  // One TCP segment on Ethernet and WiFi.
+#define STREAM_SEND_TIMEOUT_S 5  // A client that doesn't accept data for this long is dropped.
+#define STREAM_SOCKET_BUFFER_SIZE 16384  // Data queued in the socket, about what lwIP buffers on the ESP32.
+#define STREAM_ACCEPT_TIMEOUT_MS 100  // How often the stream task checks whether it should stop.
+
+typedef struct {
+  int socket;
+  bool failed;
+  size_t length;
+  char buffer[STREAM_SEND_BUFFER_SIZE];
+} stream_client_t;
+
+static int listen_socket = -1;
+static atomic_bool stream_running = false;  // Cleared to stop the stream task.
+static atomic_bool stream_task_active = false;
+static stream_client_t client;
+static mabutrace_binary_state_t binary_state;
+
+static void flush_client(stream_client_t* stream_client) {
+  size_t sent = 0;
+  while (!stream_client->failed && sent < stream_client->length) {
+    ssize_t result = send(stream_client->socket, stream_client->buffer + sent, stream_client->length - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      stream_client->failed = true;
+      break;
+    }
+    sent += result;
+  }
+  stream_client->length = 0;
+}
+
+static void send_chunk(void* ctx, const char* chunk, size_t size) {
+  stream_client_t* stream_client = (stream_client_t*)ctx;
+  while (size && !stream_client->failed) {
+    if (stream_client->length == sizeof(stream_client->buffer))
+      flush_client(stream_client);
+    size_t part = sizeof(stream_client->buffer) - stream_client->length;
+    if (part > size)
+      part = size;
+    memcpy(stream_client->buffer + stream_client->length, chunk, part);
+    stream_client->length += part;
+    chunk += part;
+    size -= part;
+  }
+}
+
+// True if the client has closed the connection. The client never sends anything, data is ignored.
+static bool client_closed(stream_client_t* stream_client) {
+  char data;
+  ssize_t result = recv(stream_client->socket, &data, sizeof(data), MSG_DONTWAIT);
+  return result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static bool wait_for_client() {
+  fd_set sockets;
+  FD_ZERO(&sockets);
+  FD_SET(listen_socket, &sockets);
+  struct timeval timeout = {0, STREAM_ACCEPT_TIMEOUT_MS * 1000};
+  return select(listen_socket + 1, &sockets, NULL, NULL, &timeout) > 0;
+}
+
+// Sends the events of each period to the client. The buffers are swapped for every period, so tracing goes on
+// while the events are sent. If the network can't keep up, periods get longer, the ring overwrites its oldest
+// entries and the client gets a lost record.
+static void stream_client_events() {
+  mabutrace_write_binary_header(&binary_state, &client, send_chunk);
+  flush_client(&client);
+  while (stream_running && !client.failed && !client_closed(&client)) {
+    mabutrace_platform_delay_ms(MABUTRACE_STREAM_PERIOD_MS);
+    profiler_ring_view_t rings[MABUTRACE_NUM_CPUS];
+    // Fails while a trace is being downloaded, its events are reported as lost in the next period.
+    if (mabutrace_capture_begin(rings) != ESP_OK)
+      continue;
+    mabutrace_write_binary_rings(&binary_state, rings, &client, send_chunk);
+    mabutrace_capture_end();
+    flush_client(&client);
+  }
+}
+
+static void stream_task(void* arg) {
+  (void)arg;
+  while (stream_running) {
+    if (!wait_for_client())
+      continue;
+    int client_socket = accept(listen_socket, NULL, NULL);
+    if (client_socket < 0)
+      continue;
+    struct timeval send_timeout = {STREAM_SEND_TIMEOUT_S, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    // A slow client holds up the stream task after this much, and the buffer overwrites its oldest events instead
+    // of the socket piling up megabytes (on Linux) that arrive seconds late.
+    int socket_buffer_size = STREAM_SOCKET_BUFFER_SIZE;
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &socket_buffer_size, sizeof(socket_buffer_size));
+    ESP_LOGI(TAG, "Stream client connected.");
+    client.socket = client_socket;
+    client.failed = false;
+    client.length = 0;
+    stream_client_events();
+    close(client_socket);
+    ESP_LOGI(TAG, "Stream client disconnected.");
+  }
+  stream_task_active = false;
+}
+
+esp_err_t mabutrace_start_stream_server(int port) {
+  if (stream_task_active)
+    return ESP_ERR_INVALID_STATE;
+  if (!mabutrace_has_spare_buffer()) {
+    ESP_LOGE(TAG, "Streaming requires the spare trace buffer.");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  esp_err_t res = ESP_FAIL;
+  listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_socket < 0) {
+    ESP_LOGE(TAG, "Failed to create stream socket.");
+    return ESP_FAIL;
+  }
+  int reuse = 1;
+  setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listen_socket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_socket, 1) != 0) {
+    ESP_LOGE(TAG, "Failed to listen on stream port %d.", port);
+    goto cleanup;
+  }
+  stream_running = true;
+  stream_task_active = true;
+  res = mabutrace_platform_start_task(stream_task, "mabutrace_strm", STREAM_TASK_STACK_SIZE, MABUTRACE_EXPORT_TASK_PRIORITY, NULL);
+  if (res != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start stream task.");
+    stream_running = false;
+    stream_task_active = false;
+    goto cleanup;
+  }
+  ESP_LOGI(TAG, "Streaming trace on port %d.", port);
+  return ESP_OK;
+
+  cleanup:
+  close(listen_socket);
+  listen_socket = -1;
+  return res;
+}
+
+esp_err_t mabutrace_stop_stream_server() {
+  if (!stream_running)
+    return ESP_ERR_INVALID_STATE;
+  stream_running = false;
+  while (stream_task_active) {
+    mabutrace_platform_delay_ms(STREAM_ACCEPT_TIMEOUT_MS);
+  }
+  close(listen_socket);
+  listen_socket = -1;
+  return ESP_OK;
+}
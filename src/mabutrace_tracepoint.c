@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mabutrace.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+
+static const char *TAG = "MABUTRACE";
+
+// Tracepoints created for names passed to the trace_* functions directly, found by open addressing on the name
+// pointer and color.
+#define INTERNED_TRACEPOINT_COUNT 64
+#define INTERNED_INDEX_SIZE (INTERNED_TRACEPOINT_COUNT * 2)
+
+static mabutrace_tracepoint_t* tracepoints[MABUTRACE_MAX_TRACEPOINTS];  // Index is the ID. ID 0 is never assigned.
+static uint16_t tracepoint_count = 1;
+static uint32_t disabled_categories = 0;
+static mabutrace_tracepoint_t interned_tracepoints[INTERNED_TRACEPOINT_COUNT];
+static _Atomic uint16_t interned_index[INTERNED_INDEX_SIZE];  // 1 + index into interned_tracepoints, 0 if empty.
+static uint16_t interned_count = 0;
+static bool interned_full_logged = false;
+static mabutrace_lock_t tracepoints_mutex = MABUTRACE_LOCK_INITIALIZER;
+
+// Must hold tracepoints_mutex.
+static inline uint8_t IRAM_ATTR get_tracepoint_state(const mabutrace_tracepoint_t* tracepoint) {
+  if (tracepoint->disabled || ((disabled_categories >> tracepoint->category) & 1))
+    return MABUTRACE_TRACEPOINT_DISABLED;
+  return MABUTRACE_TRACEPOINT_ENABLED;
+}
+
+uint8_t IRAM_ATTR mabutrace_register_tracepoint(mabutrace_tracepoint_t* tracepoint) {
+  mabutrace_platform_lock(&tracepoints_mutex);
+  if (tracepoint->id == 0) {
+    if (tracepoint_count < MABUTRACE_MAX_TRACEPOINTS) {
+      tracepoints[tracepoint_count] = tracepoint;
+      tracepoint->id = tracepoint_count++;
+      tracepoint->state = get_tracepoint_state(tracepoint);
+      mabutrace_arm_triggers(tracepoint);
+    } else {
+      // Out of IDs, the tracepoint is never traced.
+      tracepoint->state = MABUTRACE_TRACEPOINT_DISABLED;
+    }
+  }
+  uint8_t state = tracepoint->state;
+  mabutrace_platform_unlock(&tracepoints_mutex);
+  return state;
+}
+
+// Returns the interned tracepoint of name and color, or NULL and the index slot to insert it at.
+static inline mabutrace_tracepoint_t* IRAM_ATTR find_interned_tracepoint(const char* name, uint8_t color, uint16_t* out_free_slot) {
+  uint16_t slot = mabutrace_hash_pointer(name, color, INTERNED_INDEX_SIZE);
+  *out_free_slot = INTERNED_INDEX_SIZE;
+  for (int i = 0; i < INTERNED_INDEX_SIZE; i++) {
+    uint16_t index = atomic_load(&interned_index[slot]);
+    if (index == 0) {
+      *out_free_slot = slot;
+      return NULL;
+    }
+    mabutrace_tracepoint_t* tracepoint = &interned_tracepoints[index - 1];
+    if (tracepoint->name == name && tracepoint->color == color)
+      return tracepoint;
+    slot = (slot + 1) % INTERNED_INDEX_SIZE;
+  }
+  return NULL;
+}
+
+mabutrace_tracepoint_t* IRAM_ATTR mabutrace_intern_tracepoint(const char* name, uint8_t color) {
+  uint16_t slot;
+  mabutrace_tracepoint_t* tracepoint = find_interned_tracepoint(name, color, &slot);
+  if (tracepoint)
+    return tracepoint;
+  mabutrace_platform_lock(&tracepoints_mutex);
+  // Look again, another context may have interned it in the meantime.
+  tracepoint = find_interned_tracepoint(name, color, &slot);
+  if (!tracepoint && slot < INTERNED_INDEX_SIZE && interned_count < INTERNED_TRACEPOINT_COUNT) {
+    tracepoint = &interned_tracepoints[interned_count++];
+    tracepoint->name = name;
+    tracepoint->color = color;
+    // Published after it is filled in, registration happens on first use like for static tracepoints.
+    atomic_store(&interned_index[slot], interned_count);
+  }
+  bool log_full = !tracepoint && !interned_full_logged;
+  if (log_full)
+    interned_full_logged = true;
+  mabutrace_platform_unlock(&tracepoints_mutex);
+  if (log_full)
+    ESP_EARLY_LOGW(TAG, "All %d names for the trace_* functions are taken, events with new names are dropped.",
+                   INTERNED_TRACEPOINT_COUNT);
+  return tracepoint;
+}
+
+const mabutrace_tracepoint_t* mabutrace_get_tracepoint(uint16_t id) {
+  if (id == 0 || id >= tracepoint_count)
+    return NULL;
+  return tracepoints[id];
+}
+
+// Must hold tracepoints_mutex.
+static void update_tracepoint_states() {
+  for (uint16_t id = 1; id < tracepoint_count; id++) {
+    tracepoints[id]->state = get_tracepoint_state(tracepoints[id]);
+  }
+}
+
+void mabutrace_set_category_enabled(uint8_t category, bool enabled) {
+  assert(category < 32);
+  mabutrace_platform_lock(&tracepoints_mutex);
+  if (enabled)
+    disabled_categories &= ~(1u << category);
+  else
+    disabled_categories |= 1u << category;
+  update_tracepoint_states();
+  mabutrace_platform_unlock(&tracepoints_mutex);
+}
+
+void mabutrace_set_enabled_categories(uint32_t categories) {
+  mabutrace_platform_lock(&tracepoints_mutex);
+  disabled_categories = ~categories;
+  update_tracepoint_states();
+  mabutrace_platform_unlock(&tracepoints_mutex);
+}
+
+esp_err_t mabutrace_set_tracepoint_enabled(const char* name, bool enabled) {
+  esp_err_t res = ESP_ERR_NOT_FOUND;
+  mabutrace_platform_lock(&tracepoints_mutex);
+  for (uint16_t id = 1; id < tracepoint_count; id++) {
+    mabutrace_tracepoint_t* tracepoint = tracepoints[id];
+    if (strcmp(tracepoint->name, name) == 0) {
+      tracepoint->disabled = !enabled;
+      tracepoint->state = get_tracepoint_state(tracepoint);
+      res = ESP_OK;
+    }
+  }
+  mabutrace_platform_unlock(&tracepoints_mutex);
+  return res;
+}
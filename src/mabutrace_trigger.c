@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Triggers of the flight recorder. A trigger is armed on every tracepoint with its name, including the ones that
+// are registered later, and fires mabutrace_trigger when an event of the tracepoint meets its condition.
+
+#include "mabutrace.h"
+
+#include <string.h>
+
+#define TRIGGER_NONE 0
+#define TRIGGER_INSTANT 1
+#define TRIGGER_DURATION 2
+#define TRIGGER_COUNTER_RISING 3
+#define TRIGGER_COUNTER_FALLING 4
+
+typedef struct {
+  uint8_t type;  // TRIGGER_*
+  volatile bool beyond;  // Counter triggers: the last value was at or beyond the threshold.
+  const char* name;
+  int64_t threshold;  // Minimum duration in ticks, or counter value.
+} trigger_t;
+
+uint8_t mabutrace_tracepoint_triggers[MABUTRACE_MAX_TRACEPOINTS];
+static trigger_t triggers[MABUTRACE_MAX_TRIGGERS];
+static mabutrace_lock_t triggers_mutex = MABUTRACE_LOCK_INITIALIZER;
+
+// Must hold triggers_mutex.
+static void arm_on_tracepoint(uint8_t trigger_index, const mabutrace_tracepoint_t* tracepoint) {
+  if (strcmp(tracepoint->name, triggers[trigger_index].name) == 0)
+    mabutrace_tracepoint_triggers[tracepoint->id] = trigger_index + 1;
+}
+
+static esp_err_t add_trigger(uint8_t type, const char* name, int64_t threshold) {
+  esp_err_t res = ESP_ERR_NO_MEM;
+  mabutrace_platform_lock(&triggers_mutex);
+  for (uint8_t i = 0; i < MABUTRACE_MAX_TRIGGERS; i++) {
+    if (triggers[i].type != TRIGGER_NONE)
+      continue;
+    triggers[i].name = name;
+    triggers[i].threshold = threshold;
+    triggers[i].beyond = false;
+    triggers[i].type = type;
+    // Tracepoints registered from here on are armed by mabutrace_arm_triggers.
+    const mabutrace_tracepoint_t* tracepoint;
+    for (uint16_t id = 1; (tracepoint = mabutrace_get_tracepoint(id)); id++) {
+      arm_on_tracepoint(i, tracepoint);
+    }
+    res = ESP_OK;
+    break;
+  }
+  mabutrace_platform_unlock(&triggers_mutex);
+  return res;
+}
+
+esp_err_t mabutrace_trigger_on_instant(const char* name) {
+  return add_trigger(TRIGGER_INSTANT, name, 0);
+}
+
+esp_err_t mabutrace_trigger_on_duration(const char* name, uint32_t min_duration_us) {
+  int64_t min_duration_ticks = (int64_t)min_duration_us * (int64_t)mabutrace_platform_clock_frequency() / 1000000;
+  return add_trigger(TRIGGER_DURATION, name, min_duration_ticks);
+}
+
+esp_err_t mabutrace_trigger_on_counter(const char* name, int64_t threshold, bool rising) {
+  return add_trigger(rising ? TRIGGER_COUNTER_RISING : TRIGGER_COUNTER_FALLING, name, threshold);
+}
+
+void mabutrace_clear_triggers() {
+  mabutrace_platform_lock(&triggers_mutex);
+  memset(mabutrace_tracepoint_triggers, 0, sizeof(mabutrace_tracepoint_triggers));
+  for (int i = 0; i < MABUTRACE_MAX_TRIGGERS; i++) {
+    triggers[i].type = TRIGGER_NONE;
+  }
+  mabutrace_platform_unlock(&triggers_mutex);
+}
+
+void mabutrace_arm_triggers(const mabutrace_tracepoint_t* tracepoint) {
+  mabutrace_platform_lock(&triggers_mutex);
+  for (uint8_t i = 0; i < MABUTRACE_MAX_TRIGGERS; i++) {
+    if (triggers[i].type != TRIGGER_NONE)
+      arm_on_tracepoint(i, tracepoint);
+  }
+  mabutrace_platform_unlock(&triggers_mutex);
+}
+
+void IRAM_ATTR mabutrace_evaluate_trigger(uint16_t tracepoint_id, uint8_t event_type, int64_t value) {
+  uint8_t trigger_index = mabutrace_tracepoint_triggers[tracepoint_id];
+  if (trigger_index == 0)
+    return;
+  trigger_t* trigger = &triggers[trigger_index - 1];
+  bool fire = false;
+  switch (trigger->type) {
+    case TRIGGER_INSTANT:
+      fire = event_type == EVENT_TYPE_INSTANT;
+      break;
+    case TRIGGER_DURATION:
+      fire = event_type == EVENT_TYPE_DURATION && value >= trigger->threshold;
+      break;
+    case TRIGGER_COUNTER_RISING:
+    case TRIGGER_COUNTER_FALLING: {
+      if (event_type != EVENT_TYPE_COUNTER)
+        break;
+      bool beyond = trigger->type == TRIGGER_COUNTER_RISING ? value >= trigger->threshold : value <= trigger->threshold;
+      // Only crossing the threshold fires, so a counter that stays beyond it doesn't fire again after every capture.
+      fire = beyond && !trigger->beyond;
+      trigger->beyond = beyond;
+      break;
+    }
+  }
+  if (fire)
+    mabutrace_trigger();
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Records 64-bit, float and deadband counters and checks the values in the JSON export, including that deadband
+// counters record their value again after a capture and after their entry may have been overwritten.
+
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <math.h>
+
+static void capture(test_buffer_t* json) {
+  CHECK(get_json_trace_chunked(json, test_append_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json->data));
+}
+
+// Counter events of the given name and value.
+static int count_counter(const char* json, const char* name, const char* value) {
+  char event[128];
+  snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"C\"", name);
+  char arg[64];
+  snprintf(arg, sizeof(arg), "\"args\":{\"value\":%s}}", value);
+  int count = 0;
+  for (const char* found = strstr(json, event); found; found = strstr(found + 1, event)) {
+    const char* end = strchr(found, '\n');
+    const char* found_arg = strstr(found, arg);
+    if (found_arg && (!end || found_arg < end))
+      count++;
+  }
+  return count;
+}
+
+// A single call site, so that all values share the state of the deadband.
+static void level(int64_t value) {
+  TRACE_COUNTER_DEADBAND("level", value, 10);
+}
+
+static void temperature(float value) {
+  TRACE_COUNTER_FLOAT_DEADBAND("temperature", value, 1.0f);
+}
+
+int main() {
+  mabutrace_config_t config = MABUTRACE_CONFIG_DEFAULT();
+  config.buffer_size = 16 * 1024;
+  config.spare_buffer = true;
+  CHECK(mabutrace_init(&config) == ESP_OK);
+  test_buffer_t json = {0};
+
+  // Values beyond 24 bits are not truncated.
+  TRACE_COUNTER("small", 0x7FFFFF);
+  TRACE_COUNTER("small", -0x800000);
+  TRACE_COUNTER("large", 0x800000);
+  TRACE_COUNTER("large", 5000000000LL);
+  TRACE_COUNTER("large", INT64_MIN);
+  TRACE_COUNTER_FLOAT("float", 21.5f);
+  TRACE_COUNTER_FLOAT("float", -0.25f);
+  TRACE_COUNTER_FLOAT("float", 0.9999999f);
+  TRACE_COUNTER_FLOAT("float", NAN);
+  capture(&json);
+  CHECK(count_counter(json.data, "small", "8388607") == 1);
+  CHECK(count_counter(json.data, "small", "-8388608") == 1);
+  CHECK(count_counter(json.data, "large", "8388608") == 1);
+  CHECK(count_counter(json.data, "large", "5000000000") == 1);
+  CHECK(count_counter(json.data, "large", "-9223372036854775808") == 1);
+  CHECK(count_counter(json.data, "float", "21.500000") == 1);
+  CHECK(count_counter(json.data, "float", "-0.250000") == 1);
+  CHECK(count_counter(json.data, "float", "1.000000") == 1);
+  CHECK(count_counter(json.data, "float", "null") == 1);
+  test_buffer_free(&json);
+
+  // Only changes of more than the deadband are recorded.
+  for (int i = 0; i < 100; i++)
+    level(i);
+  for (int i = 0; i < 20; i++)
+    temperature(i * 0.5f);
+  capture(&json);
+  CHECK(test_count(json.data, "{\"name\":\"level\"") == 10);
+  for (int i = 0; i < 100; i += 11) {
+    char value[8];
+    snprintf(value, sizeof(value), "%d", i);
+    CHECK(count_counter(json.data, "level", value) == 1);
+  }
+  CHECK(test_count(json.data, "{\"name\":\"temperature\"") == 7);
+  CHECK(count_counter(json.data, "temperature", "0.000000") == 1);
+  CHECK(count_counter(json.data, "temperature", "1.500000") == 1);
+  CHECK(count_counter(json.data, "temperature", "9.000000") == 1);
+  test_buffer_free(&json);
+
+  // After a capture, the next value is recorded even if it is within the deadband, so that the new trace starts
+  // with the current level.
+  level(100);
+  level(101);
+  temperature(9.5f);
+  capture(&json);
+  CHECK(test_count(json.data, "{\"name\":\"level\"") == 1);
+  CHECK(count_counter(json.data, "level", "100") == 1);
+  CHECK(test_count(json.data, "{\"name\":\"temperature\"") == 1);
+  CHECK(count_counter(json.data, "temperature", "9.500000") == 1);
+  test_buffer_free(&json);
+
+  // Same once the recorded value may have been overwritten by a lap of its ring.
+  level(102);
+  level(103);
+  for (int i = 0; i < 20000; i++)
+    TRACE_COUNTER("fill", i);
+  level(104);
+  capture(&json);
+  CHECK(count_counter(json.data, "level", "104") == 1);
+  CHECK(count_counter(json.data, "level", "103") == 0);
+  test_buffer_free(&json);
+
+  mabutrace_deinit();
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Exports one capture as binary trace and as Chrome JSON, converts the binary trace with mabutrace_decode (whose
+// path is the first argument) and checks that the result matches the JSON export. The decoder numbers the tasks
+// anew, so thread IDs are left out of the comparison.
+
+#include "mabutrace.h"
+#include "mabutrace_format.h"
+#include "test_util.h"
+
+#include <pthread.h>
+#include <sys/wait.h>
+
+static void* worker(void* arg) {
+  for (int i = 0; i < 100; i++) {
+    TRACE_SCOPE("work");
+    TRACE_COUNTER("progress", i);
+    TRACE_INSTANT_ARGS("step", TRACE_ARG_INT("i", i), TRACE_ARG_FLOAT("half", i / 2.0f), TRACE_ARG_STR("s", "text"));
+  }
+  return arg;
+}
+
+static void write_file(const char* path, const test_buffer_t* buffer) {
+  FILE* file = fopen(path, "wb");
+  CHECK(file);
+  CHECK(fwrite(buffer->data, 1, buffer->length, file) == buffer->length);
+  fclose(file);
+}
+
+static void read_file(const char* path, test_buffer_t* buffer) {
+  FILE* file = fopen(path, "rb");
+  CHECK(file);
+  char chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    test_append_chunk(buffer, chunk, length);
+  }
+  fclose(file);
+}
+
+static const mabutrace_tracepoint_t* get_tracepoint(void* ctx, uint16_t id) {
+  (void)ctx;
+  return mabutrace_get_tracepoint(id);
+}
+
+static const char* get_task_name(void* ctx, uint16_t task_id) {
+  (void)ctx;
+  return profiler_get_task_name(task_id);
+}
+
+// Removes the value of every "tid" member in place.
+static void strip_thread_ids(char* json) {
+  char* out = json;
+  for (const char* in = json; *in;) {
+    if (strncmp(in, "\"tid\":", 6) == 0) {
+      memmove(out, in, 6);
+      out += 6;
+      in += 6;
+      in += strspn(in, "0123456789");
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = 0;
+}
+
+int main(int argc, char** argv) {
+  CHECK(argc == 2);
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+  pthread_t threads[2];
+  for (int i = 0; i < 2; i++) {
+    CHECK(pthread_create(&threads[i], NULL, worker, NULL) == 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  profiler_ring_view_t rings[MABUTRACE_NUM_CPUS];
+  CHECK(mabutrace_capture_begin(rings) == ESP_OK);
+  test_buffer_t binary = {0};
+  mabutrace_binary_state_t state;
+  mabutrace_write_binary_header(&state, &binary, test_append_chunk);
+  CHECK(mabutrace_write_binary_rings(&state, rings, &binary, test_append_chunk) == ESP_OK);
+  size_t magic_length = strlen(MABUTRACE_FORMAT_MAGIC);
+  CHECK(binary.length > magic_length && memcmp(binary.data, MABUTRACE_FORMAT_MAGIC, magic_length) == 0);
+  write_file("test_decode.bin", &binary);
+  mabutrace_trace_t trace = {
+    .rings = rings,
+    .num_rings = MABUTRACE_NUM_CPUS,
+    .num_task_ids = MABUTRACE_MAX_TASKS,
+    .num_tracepoint_ids = MABUTRACE_MAX_TRACEPOINTS,
+    .clock_frequency = mabutrace_platform_clock_frequency(),
+    .get_tracepoint = get_tracepoint,
+    .get_task_name = get_task_name,
+  };
+  test_buffer_t json = {0};
+  CHECK(mabutrace_write_json(&trace, &json, test_append_chunk) == ESP_OK);
+  mabutrace_capture_end();
+  CHECK(mabutrace_deinit() == ESP_OK);
+
+  char command[1024];
+  snprintf(command, sizeof(command), "\"%s\" test_decode.bin test_decode.json", argv[1]);
+  CHECK(system(command) == 0);
+  test_buffer_t decoded = {0};
+  read_file("test_decode.json", &decoded);
+  CHECK(test_is_valid_json(decoded.data));
+  CHECK(test_count(decoded.data, "{\"name\":\"work\"") == 200);
+  CHECK(test_count(decoded.data, "\"s\":\"text\"") == 200);
+  strip_thread_ids(json.data);
+  strip_thread_ids(decoded.data);
+  CHECK(strcmp(json.data, decoded.data) == 0);
+
+  // A truncated trace decodes up to the last complete record, a corrupted one must not crash the decoder.
+  binary.length -= 7;
+  write_file("test_decode.bin", &binary);
+  CHECK(system(command) == 0);
+  memset(binary.data + binary.length / 2, 0xFF, 64);
+  write_file("test_decode.bin", &binary);
+  int status = system(command);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) <= 1);
+
+  test_buffer_free(&binary);
+  test_buffer_free(&json);
+  test_buffer_free(&decoded);
+  return 0;
+}
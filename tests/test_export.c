@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Traces events of every kind from two threads, with names that need escaping, and exports them as Chrome JSON and
+// as Perfetto protobuf.
+
+#define _GNU_SOURCE
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <pthread.h>
+
+#define ITERATIONS 200
+
+static void* worker(void* arg) {
+  pthread_setname_np(pthread_self(), "worker \"q\"");
+  TRACE_INSTANT("say \"hi\"\n");
+  uint32_t async_id = 0;
+  TRACE_ASYNC_BEGIN("request", &async_id);
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint32_t link = 0;
+    TRACE_SCOPE("work", COLOR_GREEN);
+    TRACE_COUNTER("progress", i);
+    TRACE_COUNTER_FLOAT("ratio", i / (float)ITERATIONS);
+    TRACE_INSTANT_ARGS("step", TRACE_ARG_INT("i", i), TRACE_ARG_STR("quote", "say \"hi\"\n"));
+    TRACE_FLOW_OUT(&link);
+    TRACE_FLOW_IN(link);
+  }
+  TRACE_ASYNC_END("request", async_id);
+  return arg;
+}
+
+// Each capture swaps in the spare buffer, so the events are traced again for every export.
+static void run_workers() {
+  pthread_t threads[2];
+  for (int i = 0; i < 2; i++) {
+    CHECK(pthread_create(&threads[i], NULL, worker, NULL) == 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Reads a protobuf varint, returns false if it runs past end.
+static bool read_varint(const unsigned char** data, const unsigned char* end, uint64_t* out_value) {
+  *out_value = 0;
+  for (int shift = 0; *data < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*data)++;
+    *out_value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// Checks that the trace is a sequence of TracePacket fields (field 1, length delimited) that add up to its length,
+// returns the number of packets.
+static int count_perfetto_packets(const test_buffer_t* trace) {
+  const unsigned char* data = (const unsigned char*)trace->data;
+  const unsigned char* end = data + trace->length;
+  int count = 0;
+  while (data < end) {
+    uint64_t tag;
+    uint64_t length;
+    CHECK(read_varint(&data, end, &tag));
+    CHECK(tag == ((1 << 3) | 2));
+    CHECK(read_varint(&data, end, &length));
+    CHECK(length <= (uint64_t)(end - data));
+    data += length;
+    count++;
+  }
+  return count;
+}
+
+// Records the largest chunk, the JSON exporter hands out chunks of its output buffer instead of single events.
+static size_t largest_chunk = 0;
+static int chunk_count = 0;
+
+static void append_counted_chunk(void* ctx, const char* chunk, size_t length) {
+  if (length > largest_chunk)
+    largest_chunk = length;
+  chunk_count++;
+  test_append_chunk(ctx, chunk, length);
+}
+
+// Checks that the events of a category come in pairs with the same ID, and that no two pairs share an ID.
+static void check_id_pairs(const char* json, const char* category) {
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "\"cat\":\"%s\",\"id\":", category);
+  for (const char* event = strstr(json, prefix); event; event = strstr(event + 1, prefix)) {
+    char id[32];
+    snprintf(id, sizeof(id), "%s%lu,", prefix, strtoul(event + strlen(prefix), NULL, 10));
+    CHECK(test_count(json, id) == 2);
+  }
+}
+
+static bool contains_bytes(const test_buffer_t* buffer, const char* text) {
+  return memmem(buffer->data, buffer->length, text, strlen(text)) != NULL;
+}
+
+int main() {
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+
+  run_workers();
+  test_buffer_t json = {0};
+  CHECK(get_json_trace_chunked(&json, append_counted_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json.data));
+  CHECK(largest_chunk <= 4096 && chunk_count < ITERATIONS);
+  // Names are escaped.
+  CHECK(test_count(json.data, "{\"name\":\"say \\\"hi\\\"\\u000a\"") == 2);
+  CHECK(strstr(json.data, "\"args\":{\"name\":\"worker \\\"q\\\"\"}"));
+  CHECK(test_count(json.data, "{\"name\":\"work\"") == 2 * ITERATIONS);
+  CHECK(test_count(json.data, "{\"name\":\"step\"") == 2 * ITERATIONS);
+  CHECK(test_count(json.data, "\"quote\":\"say \\\"hi\\\"\\u000a\"") == 2 * ITERATIONS);
+  CHECK(test_count(json.data, "\"i\":199") == 2);
+  CHECK(test_count(json.data, "{\"name\":\"progress\"") >= 2 * ITERATIONS);
+  CHECK(test_count(json.data, "{\"name\":\"ratio\"") == 2 * ITERATIONS);
+  CHECK(test_count(json.data, "\"args\":{\"value\":0.995000}") == 2);
+  CHECK(test_count(json.data, "\"cat\":\"flow\"") == 2 * 2 * ITERATIONS);
+  check_id_pairs(json.data, "flow");
+  CHECK(test_count(json.data, "{\"name\":\"request\",\"cat\":\"async\"") == 2 * 2);
+  check_id_pairs(json.data, "async");
+
+  run_workers();
+  test_buffer_t perfetto = {0};
+  CHECK(get_perfetto_trace_chunked(&perfetto, test_append_chunk) == ESP_OK);
+  CHECK(count_perfetto_packets(&perfetto) > 4 * ITERATIONS);
+  CHECK(contains_bytes(&perfetto, "work"));
+  CHECK(contains_bytes(&perfetto, "progress"));
+  CHECK(contains_bytes(&perfetto, "ratio"));
+  CHECK(contains_bytes(&perfetto, "request"));
+  CHECK(contains_bytes(&perfetto, "quote"));
+
+  test_buffer_free(&json);
+  test_buffer_free(&perfetto);
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compresses data and a JSON trace with the streaming gzip wrapper and checks that zlib decompresses them back to
+// the original, including the CRC-32 and size in the gzip trailer.
+
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <zlib.h>
+
+static void gunzip(const test_buffer_t* compressed, test_buffer_t* out_data) {
+  CHECK(compressed->length >= 18 && (unsigned char)compressed->data[0] == 0x1f && (unsigned char)compressed->data[1] == 0x8b);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Only accepts the gzip format, which checks the trailer.
+  CHECK(inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK);
+  stream.next_in = (Bytef*)compressed->data;
+  stream.avail_in = compressed->length;
+  int result;
+  do {
+    char chunk[4096];
+    stream.next_out = (Bytef*)chunk;
+    stream.avail_out = sizeof(chunk);
+    result = inflate(&stream, Z_NO_FLUSH);
+    CHECK(result == Z_OK || result == Z_STREAM_END);
+    test_append_chunk(out_data, chunk, sizeof(chunk) - stream.avail_out);
+  } while (result != Z_STREAM_END);
+  // Nothing after the gzip member.
+  CHECK(stream.avail_in == 0);
+  inflateEnd(&stream);
+}
+
+// Compresses data in pieces of the given size.
+static void gzip(const char* data, size_t length, size_t piece, test_buffer_t* out_compressed) {
+  mabutrace_gzip_stream_t* stream = mabutrace_gzip_begin(out_compressed, test_append_chunk);
+  CHECK(stream);
+  for (size_t offset = 0; offset < length; offset += piece) {
+    mabutrace_gzip_chunk(stream, data + offset, length - offset < piece ? length - offset : piece);
+  }
+  CHECK(mabutrace_gzip_end(stream) == ESP_OK);
+}
+
+static void check_round_trip(const char* data, size_t length, size_t piece) {
+  test_buffer_t compressed = {0};
+  test_buffer_t decompressed = {0};
+  gzip(data, length, piece, &compressed);
+  gunzip(&compressed, &decompressed);
+  CHECK(decompressed.length == length);
+  CHECK(length == 0 || memcmp(decompressed.data, data, length) == 0);
+  test_buffer_free(&compressed);
+  test_buffer_free(&decompressed);
+}
+
+int main() {
+  // Repetitive text like a trace, followed by data that doesn't compress, so the deflate output exceeds its buffers.
+  size_t length = 1024 * 1024;
+  char* data = (char*)malloc(length);
+  CHECK(data);
+  for (size_t i = 0; i < length / 2; i++) {
+    data[i] = "{\"name\":\"work\",\"ph\":\"X\"}\n"[i % 26];
+  }
+  uint32_t random = 1;
+  for (size_t i = length / 2; i < length; i++) {
+    random = random * 1103515245u + 12345u;
+    data[i] = (char)(random >> 16);
+  }
+  check_round_trip(data, 0, 1);
+  check_round_trip(data, 1, 1);
+  check_round_trip(data, length, 1);
+  check_round_trip(data, length, 4096);
+  check_round_trip(data, length, length);
+  free(data);
+
+  // A trace compressed while it is exported, like the web server does.
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+  for (int i = 0; i < 1000; i++) {
+    TRACE_SCOPE("work");
+    TRACE_COUNTER("progress", i);
+  }
+  test_buffer_t compressed = {0};
+  mabutrace_gzip_stream_t* stream = mabutrace_gzip_begin(&compressed, test_append_chunk);
+  CHECK(stream);
+  CHECK(get_json_trace_chunked(stream, mabutrace_gzip_chunk) == ESP_OK);
+  CHECK(mabutrace_gzip_end(stream) == ESP_OK);
+  test_buffer_t json = {0};
+  gunzip(&compressed, &json);
+  CHECK(test_is_valid_json(json.data));
+  CHECK(test_count(json.data, "{\"name\":\"work\"") == 1000);
+  CHECK(compressed.length * 4 < json.length);
+  test_buffer_free(&compressed);
+  test_buffer_free(&json);
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks the buckets and percentiles of the scope histograms, and the statistics of mabutrace_get_scope_stats.
+// Includes the histogram source to reach its static functions. Its definitions take the place of the ones in the
+// library, which the linker then doesn't pull from the archive.
+
+#include "../src/mabutrace_histogram.c"
+#include "test_util.h"
+
+// Percentiles are accurate to the width of a bucket, which is at most 1/8 of its lower bound.
+static bool is_close(uint64_t value, uint64_t expected) {
+  uint64_t error = value > expected ? value - expected : expected - value;
+  return error <= expected / 8;
+}
+
+static void check_buckets() {
+  for (uint64_t ticks = 0; ticks < SUB_BUCKETS; ticks++) {
+    CHECK(get_bucket(ticks) == (int)ticks);
+    CHECK(get_bucket_value(ticks) == ticks);
+  }
+  // Buckets grow with the duration, and the value of each bucket lies within it.
+  int last_bucket = 0;
+  for (uint64_t ticks = 1; ticks < (1ull << HISTOGRAM_MAX_BITS); ticks += 1 + ticks / 64) {
+    int bucket = get_bucket(ticks);
+    CHECK(bucket >= last_bucket && bucket < HISTOGRAM_BUCKETS);
+    CHECK(is_close(get_bucket_value(bucket), ticks));
+    last_bucket = bucket;
+  }
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    CHECK(get_bucket(get_bucket_value(bucket)) == bucket);
+  }
+  CHECK(get_bucket((1ull << HISTOGRAM_MAX_BITS) - 1) == HISTOGRAM_BUCKETS - 1);
+  CHECK(get_bucket(1ull << HISTOGRAM_MAX_BITS) == HISTOGRAM_BUCKETS - 1);
+  CHECK(get_bucket(UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+}
+
+static void add(histogram_t* histogram, uint64_t ticks) {
+  if (histogram->count == 0 || ticks < histogram->min_ticks)
+    histogram->min_ticks = ticks;
+  if (ticks > histogram->max_ticks)
+    histogram->max_ticks = ticks;
+  histogram->count++;
+  histogram->sum_ticks += ticks;
+  histogram->buckets[get_bucket(ticks)]++;
+}
+
+static void check_percentiles() {
+  static histogram_t histogram;
+  memset(&histogram, 0, sizeof(histogram));
+  for (uint64_t ticks = 1; ticks <= 10000; ticks++)
+    add(&histogram, ticks);
+  CHECK(is_close(get_percentile(&histogram, 500), 5000));
+  CHECK(is_close(get_percentile(&histogram, 990), 9900));
+  CHECK(is_close(get_percentile(&histogram, 999), 9990));
+  CHECK(get_percentile(&histogram, 0) == 1);
+  CHECK(is_close(get_percentile(&histogram, 1000), 10000));
+
+  // The middle of the bucket is clamped to the durations seen.
+  memset(&histogram, 0, sizeof(histogram));
+  add(&histogram, 1000);
+  CHECK(get_percentile(&histogram, 500) == 1000);
+  CHECK(get_percentile(&histogram, 999) == 1000);
+
+  // A few outliers only show in the tail.
+  memset(&histogram, 0, sizeof(histogram));
+  for (int i = 0; i < 995; i++)
+    add(&histogram, 100);
+  for (int i = 0; i < 5; i++)
+    add(&histogram, 1000000);
+  CHECK(get_percentile(&histogram, 500) == 100);
+  CHECK(get_percentile(&histogram, 990) == 100);
+  CHECK(is_close(get_percentile(&histogram, 999), 1000000));
+}
+
+static void check_scope_stats() {
+  mabutrace_config_t config = MABUTRACE_CONFIG_DEFAULT();
+  config.scope_histograms = 4;
+  config.scope_events = false;
+  CHECK(mabutrace_init(&config) == ESP_OK);
+  mabutrace_tracepoint_t* fast = mabutrace_intern_tracepoint("fast", COLOR_UNDEFINED);
+  mabutrace_tracepoint_t* slow = mabutrace_intern_tracepoint("slow", COLOR_UNDEFINED);
+  CHECK(fast && slow);
+  CHECK(mabutrace_register_tracepoint(fast) == MABUTRACE_TRACEPOINT_ENABLED);
+  CHECK(mabutrace_register_tracepoint(slow) == MABUTRACE_TRACEPOINT_ENABLED);
+
+  // Both CPUs' histograms are merged.
+  for (uint64_t ticks = 1; ticks <= 1000; ticks++)
+    mabutrace_record_scope_duration(fast->id, ticks % MABUTRACE_NUM_CPUS, ticks);
+  mabutrace_record_scope_duration(slow->id, 0, 1ull << 40);
+  mabutrace_scope_stats_t stats[4];
+  size_t count;
+  uint64_t window_ns = 0;
+  CHECK(mabutrace_get_scope_stats(stats, 4, &count, &window_ns) == ESP_OK);
+  CHECK(count == 2 && window_ns > 0);
+  for (size_t i = 0; i < count; i++) {
+    if (stats[i].tracepoint_id == fast->id) {
+      CHECK(strcmp(stats[i].name, "fast") == 0);
+      CHECK(stats[i].count == 1000);
+      CHECK(stats[i].min_ns == mabutrace_ticks_to_ns(1));
+      CHECK(stats[i].max_ns == mabutrace_ticks_to_ns(1000));
+      CHECK(stats[i].mean_ns == mabutrace_ticks_to_ns(500));
+      CHECK(is_close(stats[i].p50_ns, mabutrace_ticks_to_ns(500)));
+      CHECK(is_close(stats[i].p99_ns, mabutrace_ticks_to_ns(990)));
+    } else {
+      // Beyond the last bucket, the percentiles are clamped to the maximum.
+      CHECK(stats[i].tracepoint_id == slow->id && stats[i].count == 1);
+      CHECK(stats[i].p50_ns == mabutrace_ticks_to_ns(1ull << 40));
+    }
+  }
+
+  // Each call returns a new window.
+  CHECK(mabutrace_get_scope_stats(stats, 4, &count, NULL) == ESP_OK);
+  CHECK(count == 0);
+  mabutrace_record_scope_duration(slow->id, 0, 5);
+  CHECK(mabutrace_get_scope_stats(stats, 4, &count, NULL) == ESP_OK);
+  CHECK(count == 1 && stats[0].count == 1 && stats[0].max_ns == mabutrace_ticks_to_ns(5));
+
+  CHECK(mabutrace_deinit() == ESP_OK);
+  CHECK(mabutrace_get_scope_stats(stats, 4, &count, NULL) == ESP_ERR_INVALID_STATE);
+}
+
+int main() {
+  check_buckets();
+  check_percentiles();
+  check_scope_stats();
+  return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Expands every TRACE_ macro in C++, where they go through the Profiler class instead of the cleanup attribute,
+// and checks that each event reaches the JSON export.
+
+#include "mabutrace.h"
+
+#include <stdio.h>
+#include <string>
+
+static void append_chunk(void* ctx, const char* chunk, size_t length) {
+  static_cast<std::string*>(ctx)->append(chunk, length);
+}
+
+static void traced_function() {
+  TRC();
+}
+
+int main() {
+  if (mabutrace_init(NULL) != ESP_OK) {
+    fprintf(stderr, "mabutrace_init failed\n");
+    return 1;
+  }
+
+  uint32_t link = 0;
+  uint32_t async_id = 0;
+  traced_function();
+  {
+    TRACE_SCOPE("scope");
+  }
+  {
+    TRACE_SCOPE("colored scope", COLOR_GRAY);
+  }
+  {
+    TRACE_SCOPE_ARGS("scope args", TRACE_ARG_INT("int", -1), TRACE_ARG_FLOAT("float", 0.5f), TRACE_ARG_STR("str", "text"));
+  }
+  {
+    TRACE_SCOPE_ARGS_COLORED("colored scope args", COLOR_GREEN, TRACE_ARG_INT("int", 1));
+  }
+  TRACE_FLOW_OUT(&link);
+  TRACE_FLOW_IN(link);
+  link = 0;
+  TRACE_FLOW_OUT(&link, "named flow");
+  TRACE_FLOW_IN(link);
+  link = 0;
+  TRACE_FLOW_OUT(&link, "colored flow", COLOR_YELLOW);
+  TRACE_FLOW_IN(link);
+  TRACE_ASYNC_BEGIN("async", &async_id);
+  TRACE_ASYNC_END("async", async_id);
+  async_id = 0;
+  TRACE_ASYNC_BEGIN("colored async", &async_id, COLOR_OLIVE);
+  TRACE_ASYNC_END("colored async", async_id, COLOR_OLIVE);
+  TRACE_INSTANT("instant");
+  TRACE_INSTANT("colored instant", COLOR_DARK_RED);
+  TRACE_INSTANT_ARGS("instant args", TRACE_ARG_INT("int", 2));
+  TRACE_INSTANT_ARGS_COLORED("colored instant args", COLOR_BLACK, TRACE_ARG_STR("str", "text"));
+  TRACE_COUNTER("counter", 1);
+  TRACE_COUNTER("colored counter", 2, COLOR_WHITE);
+  TRACE_COUNTER_FLOAT("float counter", 1.5f);
+  TRACE_COUNTER_FLOAT("colored float counter", 2.5f, COLOR_LIGHT_GRAY);
+  TRACE_COUNTER_DEADBAND("deadband counter", 10, 5);
+  TRACE_COUNTER_DEADBAND("colored deadband counter", 10, 5, COLOR_LIGHT_GREEN);
+  TRACE_COUNTER_FLOAT_DEADBAND("float deadband counter", 1.0f, 0.5f);
+  TRACE_COUNTER_FLOAT_DEADBAND("colored float deadband counter", 1.0f, 0.5f, COLOR_DARK_ORANGE);
+
+  std::string json;
+  esp_err_t res = get_json_trace_chunked(&json, append_chunk);
+  mabutrace_deinit();
+  if (res != ESP_OK) {
+    fprintf(stderr, "get_json_trace_chunked failed\n");
+    return 1;
+  }
+  static const char* names[] = {
+    "traced_function", "scope", "colored scope", "scope args", "colored scope args", "flow", "async", "colored async",
+    "instant", "colored instant", "instant args", "colored instant args", "counter", "colored counter",
+    "float counter", "colored float counter", "deadband counter", "colored deadband counter",
+    "float deadband counter", "colored float deadband counter",
+  };
+  int failures = 0;
+  for (const char* name : names) {
+    if (json.find("\"name\":\"" + std::string(name) + "\"") == std::string::npos) {
+      fprintf(stderr, "no event named %s\n", name);
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Calls the queue hooks like FreeRTOS does, streams the events in several binary chunks like the live stream, and
+// converts them with mabutrace_decode (whose path is the first argument). A queue that is renamed, and a deleted
+// queue whose tracepoint ID is given to a new one, must keep their old name for the events before and show the new
+// one for the events after.
+
+#include "mabutrace.h"
+#include "mabutrace_hooks.h"
+#include "test_util.h"
+
+#define QUEUE_LENGTH 4
+
+// Only their addresses are used, as queue handles.
+static char queues[MABUTRACE_MAX_QUEUES + 1];
+
+static void send(int queue) {
+  trace_queue_event(&queues[queue], EVENT_TYPE_QUEUE_SEND, 0, 0, QUEUE_LENGTH, 0);
+}
+
+// Sends what was traced since the previous call, like one period of the live stream.
+static void stream(mabutrace_binary_state_t* state, test_buffer_t* binary) {
+  profiler_ring_view_t rings[MABUTRACE_NUM_CPUS];
+  CHECK(mabutrace_capture_begin(rings) == ESP_OK);
+  CHECK(mabutrace_write_binary_rings(state, rings, binary, test_append_chunk) == ESP_OK);
+  mabutrace_capture_end();
+}
+
+// Counts the queue events of a name in the decoded trace.
+static int count_queue_events(const char* json, const char* name) {
+  char event[64];
+  snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"queue\"", name);
+  return test_count(json, event);
+}
+
+int main(int argc, char** argv) {
+  CHECK(argc == 2);
+  mabutrace_config_t config = MABUTRACE_CONFIG_DEFAULT();
+  config.spare_buffer = true;
+  config.trace_queues = MABUTRACE_TRACE_QUEUES_ALL;
+  CHECK(mabutrace_init(&config) == ESP_OK);
+  test_buffer_t binary = {0};
+  mabutrace_binary_state_t state;
+  mabutrace_write_binary_header(&state, &binary, test_append_chunk);
+
+  // Fills the registry, the queues are called "Queue 1" to "Queue 32".
+  for (int i = 0; i < MABUTRACE_MAX_QUEUES; i++)
+    send(i);
+  mabutrace_name_queue(&queues[0], "first");
+  send(0);
+  stream(&state, &binary);
+
+  mabutrace_name_queue(&queues[0], "renamed");
+  send(0);
+  send(0);
+  // Not traced while the registry is full.
+  send(MABUTRACE_MAX_QUEUES);
+  trace_queue_delete(&queues[1]);
+  stream(&state, &binary);
+
+  // The events of the deleted queue are gone once both buffers have been captured, its ID goes to the next queue.
+  stream(&state, &binary);
+  send(MABUTRACE_MAX_QUEUES);
+  stream(&state, &binary);
+  CHECK(mabutrace_deinit() == ESP_OK);
+
+  FILE* file = fopen("test_queues.bin", "wb");
+  CHECK(file);
+  CHECK(fwrite(binary.data, 1, binary.length, file) == binary.length);
+  fclose(file);
+  char command[1024];
+  snprintf(command, sizeof(command), "\"%s\" test_queues.bin", argv[1]);
+  FILE* decoder = popen(command, "r");
+  CHECK(decoder);
+  test_buffer_t json = {0};
+  char chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), decoder)) > 0) {
+    test_append_chunk(&json, chunk, length);
+  }
+  CHECK(pclose(decoder) == 0);
+  CHECK(test_is_valid_json(json.data));
+
+  // The first send of queue 0 was streamed under its default name, which the decoder replaced before any event.
+  CHECK(count_queue_events(json.data, "Queue 1") == 0);
+  CHECK(count_queue_events(json.data, "first") == 2);
+  CHECK(count_queue_events(json.data, "renamed") == 2);
+  CHECK(count_queue_events(json.data, "Queue 2") == 1);
+  CHECK(count_queue_events(json.data, "Queue 33") == 1);
+
+  test_buffer_free(&binary);
+  test_buffer_free(&json);
+  return 0;
+}
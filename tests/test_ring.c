@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Writes many laps of a small ring and checks that the oldest events are evicted and the remaining ones come out
+// complete and in order, with the timestamps that are reconstructed from the time deltas increasing. Then checks
+// that a capture starts a fresh buffer and keeps the events written while it runs, or suspends tracing without the
+// spare buffer.
+
+#define _GNU_SOURCE
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#define EVENT_COUNT 20000
+#define GAP_MICROSECONDS 50000
+
+// Counts the chunks of a capture and writes an event for each of the first ones, while the capture is in progress.
+#define TRACED_CHUNKS 50
+static int chunks_during_capture = 0;
+
+static void append_chunk_and_trace(void* ctx, const char* chunk, size_t length) {
+  test_append_chunk(ctx, chunk, length);
+  if (chunks_during_capture < TRACED_CHUNKS)
+    TRACE_COUNTER("during capture", chunks_during_capture);
+  chunks_during_capture++;
+}
+
+// Checks one pass over the ring: the events are numbered without gaps up to the last one. If gap_before isn't -1,
+// that event was written GAP_MICROSECONDS after the one before it, which takes a longer time delta than the others.
+// Returns the number of the first event in the export.
+static int check_export(int last, int gap_before) {
+  test_buffer_t json = {0};
+  CHECK(get_json_trace_chunked(&json, append_chunk_and_trace) == ESP_OK);
+  CHECK(test_is_valid_json(json.data));
+  int first = -1;
+  long expected = -1;
+  double last_ts = 0;
+  for (const char* event = strstr(json.data, "{\"name\":\"seq\""); event; event = strstr(event + 1, "{\"name\":\"seq\"")) {
+    const char* ts = strstr(event, "\"ts\":");
+    const char* n = strstr(event, "\"value\":");
+    CHECK(ts && n);
+    double time_stamp = strtod(ts + 5, NULL);
+    long number = strtol(n + 8, NULL, 10);
+    if (expected >= 0)
+      CHECK(number == expected);
+    else
+      first = number;
+    CHECK(time_stamp >= last_ts);
+    if (number == gap_before)
+      CHECK(time_stamp - last_ts >= GAP_MICROSECONDS - 1 && time_stamp - last_ts < 10 * GAP_MICROSECONDS);
+    expected = number + 1;
+    last_ts = time_stamp;
+  }
+  CHECK(first >= 0);
+  CHECK(expected - 1 == last);
+  test_buffer_free(&json);
+  return first;
+}
+
+static void check_rings(bool spare_buffer) {
+  mabutrace_config_t config = MABUTRACE_CONFIG_DEFAULT();
+  config.buffer_size = 16 * 1024;
+  config.spare_buffer = spare_buffer;
+  CHECK(mabutrace_init(&config) == ESP_OK);
+
+  // The ring holds far fewer events than are written, the first ones are evicted.
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    TRACE_SCOPE("scope");
+    TRACE_COUNTER("seq", i);
+  }
+  CHECK(check_export(EVENT_COUNT - 1, -1) > 0);
+
+  int gap_before = 2 * EVENT_COUNT - 10;
+  for (int i = EVENT_COUNT; i < 2 * EVENT_COUNT; i++) {
+    if (i == gap_before)
+      usleep(GAP_MICROSECONDS);
+    TRACE_COUNTER("seq", i);
+  }
+  CHECK(check_export(2 * EVENT_COUNT - 1, gap_before) > EVENT_COUNT);
+
+  for (int i = 2 * EVENT_COUNT; i < 2 * EVENT_COUNT + 100; i++) {
+    TRACE_COUNTER("seq", i);
+  }
+  chunks_during_capture = 0;
+  int first = check_export(2 * EVENT_COUNT + 99, -1);
+  int chunks = chunks_during_capture;
+  CHECK(chunks > 0);
+  TRACE_COUNTER("seq", 2 * EVENT_COUNT + 100);
+  test_buffer_t json = {0};
+  CHECK(get_json_trace_chunked(&json, test_append_chunk) == ESP_OK);
+  if (spare_buffer) {
+    // A capture swaps in the spare buffer, so the next one only holds what was written since, including the events
+    // written while the previous capture was exported.
+    CHECK(first == 2 * EVENT_COUNT);
+    CHECK(test_count(json.data, "{\"name\":\"during capture\"") == (chunks < TRACED_CHUNKS ? chunks : TRACED_CHUNKS));
+    CHECK(test_count(json.data, "{\"name\":\"seq\"") == 1);
+  } else {
+    // Without spare buffer, tracing is suspended during a capture and resumes where it stopped.
+    CHECK(first < 2 * EVENT_COUNT);
+    CHECK(test_count(json.data, "{\"name\":\"during capture\"") == 0);
+    CHECK(test_count(json.data, "{\"name\":\"seq\"") > 100);
+  }
+  test_buffer_free(&json);
+
+  CHECK(mabutrace_deinit() == ESP_OK);
+}
+
+int main() {
+  // Keep all events in one ring, the host picks the ring by the CPU the thread runs on.
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sched_getcpu() >= 0 ? sched_getcpu() : 0, &cpus);
+  CHECK(sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+
+  check_rings(true);
+  check_rings(false);
+  return 0;
+}
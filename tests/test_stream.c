@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Streams the trace to clients on 127.0.0.1 while a thread traces events, and checks the records they receive. The
+// second client stops reading for a while, which must not block the traced code but show up as lost events.
+
+#include "mabutrace.h"
+#include "mabutrace_format.h"
+#include "test_util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECEIVE_MS 500
+#define STALL_MS 1000
+
+static volatile bool stop_worker = false;
+static volatile int worker_events = 0;
+
+static void* worker(void* arg) {
+  for (int i = 0; !stop_worker; i++) {
+    TRACE_SCOPE("streamed");
+    TRACE_COUNTER("count", i);
+    worker_events = i;
+    usleep(100);
+  }
+  return arg;
+}
+
+static uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// A port that is free right now, the stream server binds it again.
+static int free_port() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(sock >= 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  CHECK(bind(sock, (struct sockaddr*)&address, sizeof(address)) == 0);
+  CHECK(getsockname(sock, (struct sockaddr*)&address, &length) == 0);
+  close(sock);
+  return ntohs(address.sin_port);
+}
+
+// Receives the stream for RECEIVE_MS, after not reading for stall_ms. A stalled client has a small receive buffer,
+// so the server can't get ahead of it by much.
+static void receive_stream(int port, int stall_ms, test_buffer_t* stream) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(sock >= 0);
+  if (stall_ms) {
+    int size = 4096;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  int attempt = 0;
+  while (connect(sock, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    CHECK(++attempt < 50);
+    usleep(20000);
+  }
+  usleep(stall_ms * 1000);
+  struct timeval timeout = {0, 100000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  uint64_t start = now_ms();
+  while (now_ms() - start < RECEIVE_MS) {
+    char chunk[4096];
+    ssize_t length = recv(sock, chunk, sizeof(chunk), 0);
+    if (length > 0)
+      test_append_chunk(stream, chunk, length);
+    else if (length == 0)
+      break;
+  }
+  close(sock);
+}
+
+// Checks the records of a stream and counts them by type.
+static void check_stream(const test_buffer_t* stream, int counts[8]) {
+  size_t magic_length = strlen(MABUTRACE_FORMAT_MAGIC);
+  CHECK(stream->length > magic_length && memcmp(stream->data, MABUTRACE_FORMAT_MAGIC, magic_length) == 0);
+  memset(counts, 0, 8 * sizeof(int));
+  bool streamed_tracepoint = false;
+  size_t offset = magic_length;
+  // The client stopped at an arbitrary point, the last record may be incomplete.
+  while (offset + sizeof(mabutrace_record_header_t) <= stream->length) {
+    mabutrace_record_header_t header;
+    memcpy(&header, stream->data + offset, sizeof(header));
+    offset += sizeof(header);
+    if (offset + header.size > stream->length)
+      break;
+    const char* payload = stream->data + offset;
+    CHECK(header.type >= MABUTRACE_RECORD_INFO && header.type <= MABUTRACE_RECORD_LOST);
+    CHECK(counts[MABUTRACE_RECORD_INFO] == (header.type == MABUTRACE_RECORD_INFO ? 0 : 1));
+    if (header.type == MABUTRACE_RECORD_INFO) {
+      mabutrace_info_record_t info;
+      CHECK(header.size >= sizeof(info));
+      memcpy(&info, payload, sizeof(info));
+      CHECK(info.version == MABUTRACE_FORMAT_VERSION);
+      CHECK(info.num_cpus == MABUTRACE_NUM_CPUS);
+    } else if (header.type == MABUTRACE_RECORD_TRACEPOINT) {
+      size_t name_length = header.size - sizeof(mabutrace_tracepoint_record_t);
+      const char* name = payload + sizeof(mabutrace_tracepoint_record_t);
+      if (name_length == strlen("streamed") && memcmp(name, "streamed", name_length) == 0)
+        streamed_tracepoint = true;
+    } else if (header.type == MABUTRACE_RECORD_RING) {
+      mabutrace_ring_record_t ring;
+      CHECK(header.size > sizeof(ring));
+      memcpy(&ring, payload, sizeof(ring));
+      CHECK(ring.cpu_id < MABUTRACE_NUM_CPUS);
+    } else if (header.type == MABUTRACE_RECORD_LOST) {
+      mabutrace_lost_record_t lost;
+      CHECK(header.size == sizeof(lost));
+      memcpy(&lost, payload, sizeof(lost));
+      CHECK(lost.cpu_id < MABUTRACE_NUM_CPUS && lost.lost_bytes > 0);
+    }
+    counts[header.type]++;
+    offset += header.size;
+  }
+  CHECK(streamed_tracepoint);
+}
+
+int main() {
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+  int port = free_port();
+  CHECK(mabutrace_start_stream_server(port) == ESP_OK);
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, worker, NULL) == 0);
+
+  test_buffer_t stream = {0};
+  int counts[8];
+  receive_stream(port, 0, &stream);
+  check_stream(&stream, counts);
+  // Events are sent every MABUTRACE_STREAM_PERIOD_MS, a period of the worker's events easily fits into the buffer.
+  CHECK(counts[MABUTRACE_RECORD_RING] >= 2);
+  CHECK(counts[MABUTRACE_RECORD_LOST] == 0);
+  test_buffer_free(&stream);
+
+  // The server blocks on the stalled client while the worker keeps tracing, the buffer overwrites its oldest events
+  // and the stream reports them as lost once the client reads again. Each client gets the tracepoints again.
+  int events_before_stall = worker_events;
+  receive_stream(port, STALL_MS, &stream);
+  check_stream(&stream, counts);
+  CHECK(counts[MABUTRACE_RECORD_LOST] >= 1);
+  CHECK(counts[MABUTRACE_RECORD_RING] >= 1);
+  test_buffer_free(&stream);
+  // The worker didn't wait for the client.
+  CHECK(worker_events - events_before_stall > 1000);
+
+  stop_worker = true;
+  pthread_join(thread, NULL);
+  CHECK(mabutrace_stop_stream_server() == ESP_OK);
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
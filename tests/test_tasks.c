@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Runs more short lived threads than the task table has slots and checks that the IDs of exited threads are only
+// handed out again once their events have been evicted from the rings.
+
+#define _GNU_SOURCE
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+static void* worker(void* arg) {
+  CHECK(pthread_setname_np(pthread_self(), (const char*)arg) == 0);
+  TRACE_INSTANT("work");
+  return NULL;
+}
+
+static void run_worker(const char* name) {
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, worker, (void*)name) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+}
+
+int main() {
+  // Keep all events in one ring, the threads inherit the affinity.
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sched_getcpu() >= 0 ? sched_getcpu() : 0, &cpus);
+  CHECK(sched_setaffinity(0, sizeof(cpus), &cpus) == 0);
+
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+
+  // The events of the exited threads are still in the ring, so their IDs stay taken and the threads beyond the
+  // size of the table share the unregistered track.
+  static char names[MABUTRACE_MAX_TASKS + 8][16];
+  for (int i = 0; i < MABUTRACE_MAX_TASKS + 8; i++) {
+    snprintf(names[i], sizeof(names[i]), "worker %d", i);
+    run_worker(names[i]);
+  }
+  test_buffer_t json = {0};
+  CHECK(get_json_trace_chunked(&json, test_append_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json.data));
+  CHECK(strstr(json.data, "\"args\":{\"name\":\"worker 0\"}"));
+  CHECK(test_count(json.data, "\"args\":{\"name\":\"worker ") == MABUTRACE_MAX_TASKS - 1);
+  CHECK(strstr(json.data, "\"args\":{\"name\":\"Unregistered Tasks\"}"));
+  test_buffer_free(&json);
+
+  // Once a few laps of the ring have evicted them, the IDs are free again.
+  for (int i = 0; i < 20000; i++) {
+    TRACE_COUNTER("fill", i);
+  }
+  run_worker("recycled");
+  CHECK(get_json_trace_chunked(&json, test_append_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json.data));
+  const char* recycled = strstr(json.data, "\"args\":{\"name\":\"recycled\"}");
+  CHECK(recycled);
+  while (recycled > json.data && strncmp(recycled, "\"tid\":", 6) != 0)
+    recycled--;
+  long tid = strtol(recycled + 6, NULL, 10);
+  CHECK(tid > MABUTRACE_TASK_ID_ISR && tid < MABUTRACE_MAX_TASKS);
+  CHECK(!strstr(json.data, "\"args\":{\"name\":\"worker "));
+  CHECK(!strstr(json.data, "Unregistered Tasks"));
+  test_buffer_free(&json);
+
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Switches tracepoints and categories on and off at runtime and checks which events make it into the trace.
+
+#define MABUTRACE_CATEGORY 3
+// Everything but category 5.
+#define MABUTRACE_COMPILED_CATEGORIES 0xFFFFFFDFu
+#include "mabutrace.h"
+#include "test_util.h"
+
+static void trace_events() {
+  TRACE_INSTANT("a");
+  TRACE_INSTANT("b");
+#undef MABUTRACE_CATEGORY
+#define MABUTRACE_CATEGORY 5
+  TRACE_INSTANT("not compiled");
+#undef MABUTRACE_CATEGORY
+#define MABUTRACE_CATEGORY 3
+}
+
+int main() {
+  CHECK(mabutrace_init(NULL) == ESP_OK);
+
+  trace_events();
+  CHECK(mabutrace_set_tracepoint_enabled("a", false) == ESP_OK);
+  trace_events();
+  mabutrace_set_category_enabled(3, false);
+  trace_events();
+  // Enabling the category again keeps the tracepoint that was disabled by name off.
+  mabutrace_set_category_enabled(3, true);
+  trace_events();
+  CHECK(mabutrace_set_tracepoint_enabled("a", true) == ESP_OK);
+  trace_events();
+  // Other categories don't matter.
+  mabutrace_set_category_enabled(0, false);
+  trace_events();
+  mabutrace_set_category_enabled(0, true);
+
+  CHECK(mabutrace_set_tracepoint_enabled("never executed", false) == ESP_ERR_NOT_FOUND);
+  CHECK(mabutrace_set_tracepoint_enabled("not compiled", false) == ESP_ERR_NOT_FOUND);
+
+  test_buffer_t json = {0};
+  CHECK(get_json_trace_chunked(&json, test_append_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json.data));
+  CHECK(test_count(json.data, "{\"name\":\"a\"") == 3);
+  CHECK(test_count(json.data, "{\"name\":\"b\"") == 5);
+  CHECK(test_count(json.data, "not compiled") == 0);
+  test_buffer_free(&json);
+
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
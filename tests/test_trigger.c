@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Fires the flight recorder triggers and checks that the captured trace is frozen with the events before the
+// trigger and the ones of the post trigger window, but not the ones after it.
+
+#include "mabutrace.h"
+#include "test_util.h"
+
+#include <unistd.h>
+
+// Finds the counter events of a name. Returns the time stamp of the one with the given value, or of the last one if
+// value is -1. Returns -1 if there is none.
+static double counter_time(const char* json, const char* name, long value, long* out_last_value) {
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "{\"name\":\"%s\",\"ph\":\"C\"", name);
+  double time = -1;
+  for (const char* event = strstr(json, prefix); event; event = strstr(event + 1, prefix)) {
+    const char* ts = strstr(event, "\"ts\":");
+    const char* event_value = strstr(event, "\"value\":");
+    CHECK(ts && event_value);
+    long number = strtol(event_value + 8, NULL, 10);
+    if (value == -1 || number == value)
+      time = strtod(ts + 5, NULL);
+    if (out_last_value)
+      *out_last_value = number;
+    if (number == value)
+      break;
+  }
+  return time;
+}
+
+// Value of the last "seq" counter, -1 if there is none.
+static long last_seq(const char* json) {
+  long last = -1;
+  counter_time(json, "seq", -1, &last);
+  return last;
+}
+
+static void capture(test_buffer_t* json) {
+  CHECK(get_json_trace_chunked(json, test_append_chunk) == ESP_OK);
+  CHECK(test_is_valid_json(json->data));
+}
+
+static void init(uint32_t post_trigger_us) {
+  mabutrace_config_t config = MABUTRACE_CONFIG_DEFAULT();
+  config.spare_buffer = true;
+  config.post_trigger_us = post_trigger_us;
+  CHECK(mabutrace_init(&config) == ESP_OK);
+}
+
+int main() {
+  test_buffer_t json = {0};
+
+  // Without post trigger window, the trace ends at the trigger. Tracing goes on in the spare buffer.
+  init(0);
+  CHECK(mabutrace_trigger_on_instant("alarm") == ESP_OK);
+  for (int i = 0; i < 100; i++) {
+    TRACE_COUNTER("seq", i);
+  }
+  CHECK(!mabutrace_has_frozen_trace());
+  TRACE_INSTANT("alarm");
+  for (int i = 100; i < 200; i++) {
+    TRACE_COUNTER("seq", i);
+  }
+  CHECK(mabutrace_has_frozen_trace());
+  // Ignored while the frozen trace waits.
+  TRACE_INSTANT("alarm");
+  mabutrace_trigger();
+  capture(&json);
+  CHECK(!mabutrace_has_frozen_trace());
+  CHECK(counter_time(json.data, "seq", 0, NULL) >= 0);
+  CHECK(test_count(json.data, "{\"name\":\"alarm\"") == 1);
+  CHECK(last_seq(json.data) <= 100);
+  test_buffer_free(&json);
+  capture(&json);
+  CHECK(test_count(json.data, "{\"name\":\"alarm\"") == 1);
+  CHECK(last_seq(json.data) == 199);
+  test_buffer_free(&json);
+
+  // Triggers fire again once the frozen trace has been captured, until they are cleared.
+  TRACE_INSTANT("alarm");
+  CHECK(mabutrace_has_frozen_trace());
+  capture(&json);
+  test_buffer_free(&json);
+  mabutrace_clear_triggers();
+  TRACE_INSTANT("alarm");
+  CHECK(!mabutrace_has_frozen_trace());
+  mabutrace_trigger();
+  CHECK(mabutrace_has_frozen_trace());
+  capture(&json);
+  test_buffer_free(&json);
+
+  // Only scopes lasting at least the given time fire.
+  CHECK(mabutrace_trigger_on_duration("slow", 20000) == ESP_OK);
+  {
+    TRACE_SCOPE("slow");
+    usleep(1000);
+  }
+  CHECK(!mabutrace_has_frozen_trace());
+  {
+    TRACE_SCOPE("slow");
+    usleep(30000);
+  }
+  CHECK(mabutrace_has_frozen_trace());
+  CHECK(mabutrace_deinit() == ESP_OK);
+
+  // With a post trigger window, the events written in the window after the counter crossed its threshold are kept.
+  init(50000);
+  CHECK(mabutrace_trigger_on_counter("level", 10, true) == ESP_OK);
+  for (int i = 0; i < 10; i++) {
+    TRACE_COUNTER("level", i);
+  }
+  CHECK(!mabutrace_has_frozen_trace());
+  TRACE_COUNTER("level", 10);
+  for (int i = 0; i < 200; i++) {
+    TRACE_COUNTER("seq", i);
+    usleep(1000);
+  }
+  CHECK(mabutrace_has_frozen_trace());
+  capture(&json);
+  double trigger_time = counter_time(json.data, "level", 10, NULL);
+  double seq_time = counter_time(json.data, "seq", -1, NULL);
+  CHECK(trigger_time >= 0 && seq_time >= 0);
+  CHECK(seq_time - trigger_time >= 50000 - 2000 && seq_time - trigger_time < 50000 + 50000);
+  test_buffer_free(&json);
+  CHECK(mabutrace_deinit() == ESP_OK);
+  return 0;
+}
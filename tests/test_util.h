@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Helpers shared by the host tests. Each test is a program that exits with 0 if it passes.
+
+#ifndef __MABUTRACE_TEST_UTIL_H__
+#define __MABUTRACE_TEST_UTIL_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      exit(1); \
+    } \
+  } while (0)
+
+/*
+* Growing buffer that collects the chunks of a get_*_trace_chunked call, null terminated.
+*/
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+} test_buffer_t;
+
+static inline void test_append_chunk(void* ctx, const char* chunk, size_t length) {
+  test_buffer_t* buffer = (test_buffer_t*)ctx;
+  if (buffer->length + length + 1 > buffer->capacity) {
+    buffer->capacity = (buffer->length + length + 1) * 2;
+    buffer->data = (char*)realloc(buffer->data, buffer->capacity);
+    CHECK(buffer->data);
+  }
+  memcpy(buffer->data + buffer->length, chunk, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = 0;
+}
+
+static inline void test_buffer_free(test_buffer_t* buffer) {
+  free(buffer->data);
+  memset(buffer, 0, sizeof(*buffer));
+}
+
+static inline const char* test_skip_json_value(const char* text);
+
+static inline const char* test_skip_json_space(const char* text) {
+  while (*text == ' ' || *text == '\n' || *text == '\r' || *text == '\t')
+    text++;
+  return text;
+}
+
+static inline const char* test_skip_json_string(const char* text) {
+  if (*text++ != '"')
+    return NULL;
+  while (*text != '"') {
+    if ((unsigned char)*text < 0x20)
+      return NULL;
+    if (*text == '\\') {
+      text++;
+      if (*text == 'u') {
+        for (int i = 1; i <= 4; i++) {
+          if (!text[i] || !strchr("0123456789abcdefABCDEF", text[i]))
+            return NULL;
+        }
+        text += 4;
+      } else if (!*text || !strchr("\"\\/bfnrt", *text)) {
+        return NULL;
+      }
+    }
+    text++;
+  }
+  return text + 1;
+}
+
+static inline const char* test_skip_json_number(const char* text) {
+  const char* start = text;
+  if (*text == '-')
+    text++;
+  if (*text < '0' || *text > '9')
+    return NULL;
+  text += strspn(text, "0123456789");
+  if (*text == '.') {
+    text++;
+    if (*text < '0' || *text > '9')
+      return NULL;
+    text += strspn(text, "0123456789");
+  }
+  if (*text == 'e' || *text == 'E') {
+    text++;
+    if (*text == '+' || *text == '-')
+      text++;
+    if (*text < '0' || *text > '9')
+      return NULL;
+    text += strspn(text, "0123456789");
+  }
+  return text > start ? text : NULL;
+}
+
+// Skips the members of an object (close '}') or the elements of an array (close ']').
+static inline const char* test_skip_json_members(const char* text, char close) {
+  text = test_skip_json_space(text);
+  if (*text == close)
+    return text + 1;
+  while (text) {
+    if (close == '}') {
+      text = test_skip_json_string(text);
+      if (!text)
+        return NULL;
+      text = test_skip_json_space(text);
+      if (*text++ != ':')
+        return NULL;
+    }
+    text = test_skip_json_value(test_skip_json_space(text));
+    if (!text)
+      return NULL;
+    text = test_skip_json_space(text);
+    if (*text == close)
+      return text + 1;
+    if (*text++ != ',')
+      return NULL;
+    text = test_skip_json_space(text);
+  }
+  return NULL;
+}
+
+static inline const char* test_skip_json_value(const char* text) {
+  switch (*text) {
+    case '{': return test_skip_json_members(text + 1, '}');
+    case '[': return test_skip_json_members(text + 1, ']');
+    case '"': return test_skip_json_string(text);
+    case 't': return strncmp(text, "true", 4) == 0 ? text + 4 : NULL;
+    case 'f': return strncmp(text, "false", 5) == 0 ? text + 5 : NULL;
+    case 'n': return strncmp(text, "null", 4) == 0 ? text + 4 : NULL;
+    default: return test_skip_json_number(text);
+  }
+}
+
+/*
+* True if text is a single valid JSON value, surrounded by nothing but white space.
+*/
+static inline bool test_is_valid_json(const char* text) {
+  const char* end = test_skip_json_value(test_skip_json_space(text));
+  return end && *test_skip_json_space(end) == 0;
+}
+
+/*
+* Number of occurrences of needle in text.
+*/
+static inline int test_count(const char* text, const char* needle) {
+  int count = 0;
+  for (const char* found = strstr(text, needle); found; found = strstr(found + 1, needle)) {
+    count++;
+  }
+  return count;
+}
+
+#endif  // __MABUTRACE_TEST_UTIL_H__
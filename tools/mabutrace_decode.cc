@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) 2020 Matthias Bühlmann
+ *
+ * This file is part of MabuTrace.
+ *
+ * MabuTrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MabuTrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MabuTrace.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Host side decoder of binary traces, i.e. /trace.bin downloads and recorded live streams (see mabutrace_format.h).
+// Converts them to the Chrome JSON trace event format, which chrome://tracing and ui.perfetto.dev open, or to the
+// Perfetto protobuf format if the output file ends in .pftrace, using the same exporters as the device. Output
+// files ending in .gz are gzip compressed.
+//
+// Usage: mabutrace_decode <trace.bin> [<trace.json>|<trace.pftrace>[.gz]]
+// "-" reads from stdin or writes to stdout, which is also the default output, as JSON.
+
+#include "mabutrace.h"
+#include "mabutrace_format.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Shown at the time the entries of a CPU continue after a lost record.
+const uint16_t LOST_TRACEPOINT_ID = 0xFFFE;
+
+// Size of the entry struct of each event type, to check that the trace was written with the same entry layout.
+size_t expected_type_size(uint8_t type) {
+  switch (type) {
+    case EVENT_TYPE_DURATION: return sizeof(duration_entry_t);
+    case EVENT_TYPE_DURATION_LONG: return sizeof(duration_long_entry_t);
+    case EVENT_TYPE_INSTANT: return sizeof(instant_entry_t);
+    case EVENT_TYPE_COUNTER: return sizeof(counter_entry_t);
+    case EVENT_TYPE_LINK: return sizeof(link_entry_t);
+    case EVENT_TYPE_TASK_SWITCH_IN:
+    case EVENT_TYPE_TASK_SWITCH_OUT: return sizeof(task_switch_entry_t);
+    case EVENT_TYPE_TASK_CONTEXT: return sizeof(task_context_entry_t);
+    case EVENT_TYPE_TIME_ANCHOR: return sizeof(time_anchor_entry_t);
+    case EVENT_TYPE_DURATION_LONG_LONG: return sizeof(duration_long_long_entry_t);
+    case EVENT_TYPE_SCOPE_BEGIN: return sizeof(scope_begin_entry_t);
+    case EVENT_TYPE_COUNTER_LONG: return sizeof(counter_long_entry_t);
+    case EVENT_TYPE_COUNTER_FLOAT: return sizeof(counter_float_entry_t);
+    case EVENT_TYPE_ASYNC_BEGIN:
+    case EVENT_TYPE_ASYNC_END: return sizeof(async_entry_t);
+    case EVENT_TYPE_ARGS: return sizeof(args_entry_t);
+    case EVENT_TYPE_HEAP_ALLOC:
+    case EVENT_TYPE_HEAP_FREE:
+    case EVENT_TYPE_HEAP_ALLOC_FAILED: return sizeof(heap_entry_t);
+    case EVENT_TYPE_QUEUE_SEND:
+    case EVENT_TYPE_QUEUE_RECEIVE:
+    case EVENT_TYPE_QUEUE_SEND_FAILED:
+    case EVENT_TYPE_QUEUE_RECEIVE_FAILED: return sizeof(queue_entry_t);
+    case EVENT_TYPE_TASK_READY: return sizeof(task_ready_entry_t);
+    default: return 0;
+  }
+}
+
+// Offset of the tracepoint ID in the entry struct of each event type, 0 if it has none.
+size_t tracepoint_id_offset(uint8_t type) {
+  switch (type) {
+    case EVENT_TYPE_DURATION: return offsetof(duration_entry_t, tracepoint_id);
+    case EVENT_TYPE_DURATION_LONG: return offsetof(duration_long_entry_t, tracepoint_id);
+    case EVENT_TYPE_INSTANT: return offsetof(instant_entry_t, tracepoint_id);
+    case EVENT_TYPE_COUNTER: return offsetof(counter_entry_t, tracepoint_id);
+    case EVENT_TYPE_DURATION_LONG_LONG: return offsetof(duration_long_long_entry_t, tracepoint_id);
+    case EVENT_TYPE_SCOPE_BEGIN: return offsetof(scope_begin_entry_t, tracepoint_id);
+    case EVENT_TYPE_COUNTER_LONG: return offsetof(counter_long_entry_t, tracepoint_id);
+    case EVENT_TYPE_COUNTER_FLOAT: return offsetof(counter_float_entry_t, tracepoint_id);
+    case EVENT_TYPE_ASYNC_BEGIN:
+    case EVENT_TYPE_ASYNC_END: return offsetof(async_entry_t, tracepoint_id);
+    case EVENT_TYPE_QUEUE_SEND:
+    case EVENT_TYPE_QUEUE_RECEIVE:
+    case EVENT_TYPE_QUEUE_SEND_FAILED:
+    case EVENT_TYPE_QUEUE_RECEIVE_FAILED: return offsetof(queue_entry_t, tracepoint_id);
+    default: return 0;
+  }
+}
+
+struct Tracepoint {
+  std::string name;
+  mabutrace_tracepoint_t tracepoint;
+};
+
+// Collects the records of a binary trace into one entry buffer per CPU, which the exporter reads like a ring.
+// The entries of each ring record are preceded by a time anchor and a task context entry, so they decode on
+// their own. Task IDs the device reused for another task are given new IDs, so that each task keeps its name, and
+// so are tracepoint IDs that were sent again with another name (queues that were renamed or recycled).
+class TraceDecoder {
+public:
+  bool decode(const std::vector<char>& data, std::string* error);
+  mabutrace_trace_t trace();
+  uint32_t lost_bytes() const { return _lost_bytes; }
+
+private:
+  bool decode_record(uint8_t type, const char* payload, size_t size, std::string* error);
+  bool decode_ring(const mabutrace_ring_record_t& record, const char* entries, size_t size, std::string* error);
+  uint16_t map_task_id(uint16_t task_id);
+  uint16_t map_tracepoint_id(uint16_t id);
+  template <typename T> void append(uint8_t cpu_id, const T& entry) {
+    const char* bytes = reinterpret_cast<const char*>(&entry);
+    _entries[cpu_id].insert(_entries[cpu_id].end(), bytes, bytes + sizeof(entry));
+  }
+
+  static const mabutrace_tracepoint_t* get_tracepoint(void* ctx, uint16_t id);
+  static const char* get_task_name(void* ctx, uint16_t task_id);
+
+  bool _has_info = false;
+  mabutrace_info_record_t _info = {};
+  std::map<uint16_t, Tracepoint> _tracepoints;
+  std::map<uint16_t, uint16_t> _tracepoint_ids;  // Tracepoint IDs on the device that were given a new ID.
+  uint16_t _next_tracepoint_id = MABUTRACE_MAX_TRACEPOINTS;
+  std::map<uint16_t, uint16_t> _task_ids;  // Task ID on the device to task ID of the decoded trace.
+  std::vector<std::string> _task_names{""};  // Index 0 is MABUTRACE_TASK_ID_ISR.
+  std::vector<char> _entries[MABUTRACE_NUM_CPUS];
+  bool _lost[MABUTRACE_NUM_CPUS] = {};
+  uint32_t _lost_bytes = 0;
+  profiler_ring_view_t _rings[MABUTRACE_NUM_CPUS];
+};
+
+bool TraceDecoder::decode(const std::vector<char>& data, std::string* error) {
+  const size_t magic_length = sizeof(MABUTRACE_FORMAT_MAGIC) - 1;
+  if (data.size() < magic_length || memcmp(data.data(), MABUTRACE_FORMAT_MAGIC, magic_length) != 0) {
+    *error = "not a MabuTrace binary trace";
+    return false;
+  }
+  Tracepoint& lost = _tracepoints[LOST_TRACEPOINT_ID];
+  lost.name = "Events Lost";
+  lost.tracepoint = MABUTRACE_TRACEPOINT_INIT(lost.name.c_str(), COLOR_DARK_RED, 0);
+  lost.tracepoint.id = LOST_TRACEPOINT_ID;
+
+  size_t offset = magic_length;
+  while (offset < data.size()) {
+    mabutrace_record_header_t header;
+    if (data.size() - offset < sizeof(header)) {
+      fprintf(stderr, "Warning: trace ends in a record header, ignoring the rest.\n");
+      break;
+    }
+    memcpy(&header, data.data() + offset, sizeof(header));
+    offset += sizeof(header);
+    if (data.size() - offset < header.size) {
+      // A recorded stream that was cut off.
+      fprintf(stderr, "Warning: trace ends in a record, ignoring the rest.\n");
+      break;
+    }
+    if (!decode_record(header.type, data.data() + offset, header.size, error))
+      return false;
+    offset += header.size;
+  }
+  if (!_has_info) {
+    *error = "trace has no info record";
+    return false;
+  }
+  return true;
+}
+
+bool TraceDecoder::decode_record(uint8_t type, const char* payload, size_t size, std::string* error) {
+  switch (type) {
+    case MABUTRACE_RECORD_INFO: {
+      if (size < sizeof(_info)) {
+        *error = "info record too short";
+        return false;
+      }
+      memcpy(&_info, payload, sizeof(_info));
+      if (_info.version != MABUTRACE_FORMAT_VERSION) {
+        *error = "unsupported format version " + std::to_string(_info.version);
+        return false;
+      }
+      if (_info.num_cpus > MABUTRACE_NUM_CPUS || _info.clock_frequency == 0) {
+        *error = "unsupported number of CPUs or clock frequency";
+        return false;
+      }
+      for (int i = 1; i < 32; i++) {
+        size_t expected = expected_type_size(i);
+        if (expected && _info.type_sizes[i] != expected) {
+          *error = "trace was written with a different entry layout";
+          return false;
+        }
+      }
+      _has_info = true;
+      return true;
+    }
+    case MABUTRACE_RECORD_TRACEPOINT: {
+      mabutrace_tracepoint_record_t record;
+      if (size < sizeof(record))
+        break;
+      memcpy(&record, payload, sizeof(record));
+      std::string name(payload + sizeof(record), size - sizeof(record));
+      uint16_t id = map_tracepoint_id(record.id);
+      auto known = _tracepoints.find(id);
+      // Events decoded so far keep the old name.
+      if (known != _tracepoints.end() && known->second.name != name && _next_tracepoint_id < LOST_TRACEPOINT_ID) {
+        id = _next_tracepoint_id++;
+        _tracepoint_ids[record.id] = id;
+      }
+      Tracepoint& tracepoint = _tracepoints[id];
+      tracepoint.name = name;
+      // The exporter looks colors up in a table.
+      uint8_t color = record.color <= COLOR_LIGHT_GRAY ? record.color : COLOR_UNDEFINED;
+      tracepoint.tracepoint = MABUTRACE_TRACEPOINT_INIT(tracepoint.name.c_str(), color, record.category);
+      tracepoint.tracepoint.id = id;
+      return true;
+    }
+    case MABUTRACE_RECORD_TASK: {
+      mabutrace_task_record_t record;
+      if (size < sizeof(record))
+        break;
+      memcpy(&record, payload, sizeof(record));
+      std::string name(payload + sizeof(record), size - sizeof(record));
+      auto known = _task_ids.find(record.task_id);
+      if (known == _task_ids.end() || _task_names[known->second] != name) {
+        _task_ids[record.task_id] = _task_names.size();
+        _task_names.push_back(name);
+      }
+      return true;
+    }
+    case MABUTRACE_RECORD_LOST: {
+      mabutrace_lost_record_t record;
+      if (size < sizeof(record))
+        break;
+      memcpy(&record, payload, sizeof(record));
+      if (record.cpu_id >= MABUTRACE_NUM_CPUS)
+        break;
+      _lost[record.cpu_id] = true;
+      _lost_bytes += record.lost_bytes;
+      return true;
+    }
+    case MABUTRACE_RECORD_RING: {
+      mabutrace_ring_record_t record;
+      if (size < sizeof(record))
+        break;
+      memcpy(&record, payload, sizeof(record));
+      if (!_has_info || record.cpu_id >= _info.num_cpus)
+        break;
+      return decode_ring(record, payload + sizeof(record), size - sizeof(record), error);
+    }
+    default:
+      // Unknown records are skipped, newer writers may add some.
+      return true;
+  }
+  *error = "malformed record of type " + std::to_string(type);
+  return false;
+}
+
+uint16_t TraceDecoder::map_task_id(uint16_t task_id) {
+  if (task_id == MABUTRACE_TASK_ID_ISR || task_id == MABUTRACE_TASK_ID_UNREGISTERED)
+    return task_id;
+  auto known = _task_ids.find(task_id);
+  if (known != _task_ids.end())
+    return known->second;
+  // No task record, which a complete trace doesn't have.
+  uint16_t mapped = _task_names.size();
+  _task_ids[task_id] = mapped;
+  _task_names.push_back("Unknown Task");
+  return mapped;
+}
+
+uint16_t TraceDecoder::map_tracepoint_id(uint16_t id) {
+  auto known = _tracepoint_ids.find(id);
+  return known != _tracepoint_ids.end() ? known->second : id;
+}
+
+bool TraceDecoder::decode_ring(const mabutrace_ring_record_t& record, const char* entries, size_t size, std::string* error) {
+  // Check every entry before taking any, the exporter trusts the types and lengths of the entries it reads. Also
+  // finds the time before the first entry from the first time anchor, like the exporter does for a ring.
+  uint64_t delta_sum = 0;
+  bool has_anchor = false;
+  uint64_t base_time = 0;
+  for (size_t offset = 0; offset < size;) {
+    const entry_header_t* header = reinterpret_cast<const entry_header_t*>(entries + offset);
+    size_t type_size = expected_type_size(header->type);
+    if (type_size != 0 && header->type == EVENT_TYPE_ARGS && offset + type_size <= size)
+      type_size += reinterpret_cast<const args_entry_t*>(header)->length;
+    if (type_size == 0 || offset + type_size + header->delta_length > size) {
+      *error = "malformed ring record";
+      return false;
+    }
+    if (!has_anchor) {
+      uint64_t delta = 0;
+      for (int i = header->delta_length - 1; i >= 0; i--) {
+        delta = (delta << 8) | static_cast<uint8_t>(entries[offset + type_size + i]);
+      }
+      delta_sum += delta;
+      if (header->type == EVENT_TYPE_TIME_ANCHOR) {
+        time_anchor_entry_t anchor;
+        memcpy(&anchor, header, sizeof(anchor));
+        base_time = anchor.time_stamp_ticks - delta_sum;
+        has_anchor = true;
+      }
+    }
+    offset += type_size + header->delta_length;
+  }
+  if (!has_anchor) {
+    fprintf(stderr, "Warning: ring record of CPU %d without time anchor, skipping it.\n", record.cpu_id);
+    return true;
+  }
+
+  uint8_t cpu_id = record.cpu_id;
+  time_anchor_entry_t anchor = {};
+  anchor.header.type = EVENT_TYPE_TIME_ANCHOR;
+  anchor.time_stamp_ticks = base_time;
+  append(cpu_id, anchor);
+  task_context_entry_t context = {};
+  context.header.type = EVENT_TYPE_TASK_CONTEXT;
+  context.task_id = map_task_id(record.start_task_id);
+  append(cpu_id, context);
+  if (_lost[cpu_id]) {
+    instant_entry_t lost = {};
+    lost.header.type = EVENT_TYPE_INSTANT;
+    lost.tracepoint_id = LOST_TRACEPOINT_ID;
+    append(cpu_id, lost);
+    _lost[cpu_id] = false;
+  }
+
+  std::vector<char>& buffer = _entries[cpu_id];
+  size_t start = buffer.size();
+  buffer.insert(buffer.end(), entries, entries + size);
+  for (size_t offset = start; offset < buffer.size();) {
+    entry_header_t* header = reinterpret_cast<entry_header_t*>(buffer.data() + offset);
+    if (header->type == EVENT_TYPE_TASK_CONTEXT) {
+      task_context_entry_t* task_context = reinterpret_cast<task_context_entry_t*>(header);
+      task_context->task_id = map_task_id(task_context->task_id);
+    } else if (header->type == EVENT_TYPE_TASK_READY) {
+      task_ready_entry_t* task_ready = reinterpret_cast<task_ready_entry_t*>(header);
+      task_ready->task_id = map_task_id(task_ready->task_id);
+    }
+    size_t id_offset = tracepoint_id_offset(header->type);
+    if (id_offset && !_tracepoint_ids.empty()) {
+      uint16_t id;
+      memcpy(&id, buffer.data() + offset + id_offset, sizeof(id));
+      id = map_tracepoint_id(id);
+      memcpy(buffer.data() + offset + id_offset, &id, sizeof(id));
+    }
+    offset += expected_type_size(header->type) + header->delta_length;
+    if (header->type == EVENT_TYPE_ARGS)
+      offset += reinterpret_cast<args_entry_t*>(header)->length;
+  }
+  return true;
+}
+
+const mabutrace_tracepoint_t* TraceDecoder::get_tracepoint(void* ctx, uint16_t id) {
+  TraceDecoder* decoder = static_cast<TraceDecoder*>(ctx);
+  auto tracepoint = decoder->_tracepoints.find(id);
+  return tracepoint != decoder->_tracepoints.end() ? &tracepoint->second.tracepoint : nullptr;
+}
+
+const char* TraceDecoder::get_task_name(void* ctx, uint16_t task_id) {
+  TraceDecoder* decoder = static_cast<TraceDecoder*>(ctx);
+  if (task_id == MABUTRACE_TASK_ID_UNREGISTERED)
+    return "Unregistered Tasks";
+  if (task_id >= decoder->_task_names.size())
+    return "Unknown Task";
+  return decoder->_task_names[task_id].c_str();
+}
+
+mabutrace_trace_t TraceDecoder::trace() {
+  for (int i = 0; i < _info.num_cpus; i++) {
+    _rings[i].entries = _entries[i].data();
+    _rings[i].size = _entries[i].size();
+    _rings[i].start_idx = 0;
+    _rings[i].length = _entries[i].size();
+    _rings[i].start_task_id = MABUTRACE_TASK_ID_ISR;
+    _rings[i].end_offset = 0;
+  }
+  mabutrace_trace_t trace = {};
+  trace.rings = _rings;
+  trace.num_rings = _info.num_cpus;
+  trace.num_task_ids = _task_names.size();
+  trace.num_tracepoint_ids = LOST_TRACEPOINT_ID + 1;
+  trace.clock_frequency = _info.clock_frequency;
+  trace.get_tracepoint = get_tracepoint;
+  trace.get_task_name = get_task_name;
+  trace.ctx = this;
+  trace.yield_interval_us = 0;
+  return trace;
+}
+
+bool read_file(const char* path, std::vector<char>* data) {
+  FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (!file)
+    return false;
+  char buffer[65536];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data->insert(data->end(), buffer, buffer + length);
+  }
+  bool ok = !ferror(file);
+  if (file != stdin)
+    fclose(file);
+  return ok;
+}
+
+bool ends_with(const char* text, const char* suffix) {
+  size_t text_length = strlen(text);
+  size_t suffix_length = strlen(suffix);
+  return text_length >= suffix_length && strcmp(text + text_length - suffix_length, suffix) == 0;
+}
+
+void write_chunk(void* ctx, const char* chunk, size_t size) {
+  fwrite(chunk, 1, size, static_cast<FILE*>(ctx));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <trace.bin> [<trace.json>|<trace.pftrace>[.gz]]\n", argv[0]);
+    return 2;
+  }
+  std::vector<char> data;
+  if (!read_file(argv[1], &data)) {
+    fprintf(stderr, "Failed to read %s.\n", argv[1]);
+    return 1;
+  }
+  TraceDecoder decoder;
+  std::string error;
+  if (!decoder.decode(data, &error)) {
+    fprintf(stderr, "Failed to decode %s: %s.\n", argv[1], error.c_str());
+    return 1;
+  }
+  if (decoder.lost_bytes())
+    fprintf(stderr, "Warning: %u bytes of events were lost while streaming.\n", (unsigned int)decoder.lost_bytes());
+
+  const char* output_path = argc > 2 ? argv[2] : "-";
+  FILE* output = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "wb");
+  if (!output) {
+    fprintf(stderr, "Failed to open %s.\n", output_path);
+    return 1;
+  }
+  std::string format_path = output_path;
+  void* ctx = output;
+  void (*process_chunk)(void*, const char*, size_t) = write_chunk;
+  mabutrace_gzip_stream_t* gzip = nullptr;
+  if (ends_with(output_path, ".gz")) {
+    format_path.resize(format_path.size() - 3);
+    gzip = mabutrace_gzip_begin(output, write_chunk);
+    if (!gzip) {
+      fprintf(stderr, "gzip compression is not available.\n");
+      return 1;
+    }
+    ctx = gzip;
+    process_chunk = mabutrace_gzip_chunk;
+  }
+  mabutrace_trace_t trace = decoder.trace();
+  esp_err_t res = ends_with(format_path.c_str(), ".pftrace") ? mabutrace_write_perfetto(&trace, ctx, process_chunk)
+                                                             : mabutrace_write_json(&trace, ctx, process_chunk);
+  if (gzip) {
+    esp_err_t gzip_res = mabutrace_gzip_end(gzip);
+    if (res == ESP_OK)
+      res = gzip_res;
+  }
+  if (output != stdout)
+    fclose(output);
+  if (res != ESP_OK) {
+    fprintf(stderr, "Failed to write %s.\n", output_path);
+    return 1;
+  }
+  return 0;
+}